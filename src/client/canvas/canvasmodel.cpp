@@ -29,6 +29,7 @@
 #include "core/layerstack.h"
 #include "core/annotationmodel.h"
 #include "core/layer.h"
+#include "core/tilecache.h"
 #include "ora/orawriter.h"
 #include "utils/identicon.h"
 #include "net/internalmsg.h"
@@ -40,6 +41,7 @@
 #include <QSettings>
 #include <QDebug>
 #include <QPainter>
+#include <QTimer>
 
 namespace canvas {
 
@@ -77,7 +79,15 @@ CanvasModel::CanvasModel(uint8_t localUserId, QObject *parent)
 
 	connect(m_layerstack, &paintcore::LayerStack::resized, this, &CanvasModel::onCanvasResize);
 
+	// Compress tiles that haven't been used in a while (if a tile cache budget is set.)
+	// This is done here, between events, because the main thread isn't accessing tiles then.
+	// Sweeps are skipped while the canvas thread or a saver is running.
+	QTimer *tileCacheTimer = new QTimer(this);
+	connect(tileCacheTimer, &QTimer::timeout, this, &paintcore::TileCache::sweep);
+	tileCacheTimer->start(5000);
+
 	updateLayerViewOptions();
+	updateHistoryOptions();
 }
 
 uint8_t CanvasModel::localUserId() const
@@ -330,6 +340,15 @@ void CanvasModel::updateLayerViewOptions()
 	);
 }
 
+void CanvasModel::updateHistoryOptions()
+{
+	QSettings cfg;
+	cfg.beginGroup("settings");
+
+	// Memory budget (in megabytes) for undo savepoints. Zero means unlimited.
+	m_statetracker->setSavepointBudget(cfg.value("savepointbudget", 0).toInt());
+}
+
 /**
  * @brief Find an unused annotation ID
  *
@@ -128,6 +128,7 @@ public slots:
 
 	void setLayerViewMode(int mode);
 	void updateLayerViewOptions();
+	void updateHistoryOptions();
 
 signals:
 	void layerAutoselectRequest(int id);
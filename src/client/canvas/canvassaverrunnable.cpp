@@ -19,6 +19,7 @@
 #include "canvassaverrunnable.h"
 #include "canvasmodel.h"
 #include "ora/orawriter.h"
+#include "core/tilecache.h"
 
 #include <QImageWriter>
 
@@ -33,6 +34,8 @@ CanvasSaverRunnable::CanvasSaverRunnable(const CanvasModel *canvas, const QStrin
 
 void CanvasSaverRunnable::run()
 {
+	paintcore::TileCache::Guard tileGuard;
+
 	bool ok;
 	QString errorMessage;
 
@@ -67,6 +67,12 @@ struct LayerListItem {
 
 	//! Get the LayerAttributes flags as a bitfield
 	uint8_t attributeFlags() const;
+
+	bool operator==(const LayerListItem &other) const {
+		return id == other.id && title == other.title && opacity == other.opacity && blend == other.blend &&
+			hidden == other.hidden && censored == other.censored && fixed == other.fixed;
+	}
+	bool operator!=(const LayerListItem &other) const { return !(*this == other); }
 };
 
 }
@@ -18,11 +18,61 @@
 */
 
 #include "retcon.h"
+#include "core/tile.h"
 
 using protocol::MessagePtr;
 
 namespace canvas {
 
+// Tile coordinate of a pixel coordinate (rounding towards negative infinity)
+static int tileCoordinate(int c)
+{
+	return c >= 0 ? c / paintcore::Tile::SIZE : (c + 1) / paintcore::Tile::SIZE - 1;
+}
+
+AffectedArea::AffectedArea(int layer, const QVector<QRect> &rects)
+	: m_domain(PIXELS), m_layer(layer), m_tileColumns(0)
+{
+	for(const QRect &r : rects)
+		m_bounds |= r;
+
+	// A single rectangle is described exactly by the bounds
+	if(rects.size() < 2 || m_bounds.isEmpty())
+		return;
+
+	const int x0 = tileCoordinate(m_bounds.left());
+	const int y0 = tileCoordinate(m_bounds.top());
+	m_tileColumns = tileCoordinate(m_bounds.right()) - x0 + 1;
+	const int rows = tileCoordinate(m_bounds.bottom()) - y0 + 1;
+
+	m_tiles.resize(m_tileColumns * rows);
+
+	for(const QRect &r : rects) {
+		if(r.isEmpty())
+			continue;
+		const int tx1 = tileCoordinate(r.right()) - x0;
+		const int ty1 = tileCoordinate(r.bottom()) - y0;
+		for(int ty=tileCoordinate(r.top())-y0;ty<=ty1;++ty) {
+			for(int tx=tileCoordinate(r.left())-x0;tx<=tx1;++tx)
+				m_tiles.setBit(ty * m_tileColumns + tx);
+		}
+	}
+}
+
+bool AffectedArea::touchesTile(int x, int y) const
+{
+	if(m_tiles.isEmpty())
+		return true;
+
+	x -= tileCoordinate(m_bounds.left());
+	y -= tileCoordinate(m_bounds.top());
+	if(x < 0 || y < 0 || x >= m_tileColumns)
+		return false;
+
+	const int i = y * m_tileColumns + x;
+	return i < m_tiles.size() && m_tiles.testBit(i);
+}
+
 bool AffectedArea::isConcurrentWith(const AffectedArea &other) const
 {
 	if(m_domain == EVERYTHING || other.m_domain == EVERYTHING)
@@ -31,9 +81,26 @@ bool AffectedArea::isConcurrentWith(const AffectedArea &other) const
 	if(m_domain == USERATTRS || m_domain != other.m_domain || m_layer != other.m_layer)
 		return true;
 
-	// for pixel changes, the effect bounding rectangles must not intersect
-	if(m_domain == PIXELS && !m_bounds.intersects(other.m_bounds))
+	if(m_domain == PIXELS) {
+		// for pixel changes, the effect bounding rectangles must not intersect...
+		const QRect overlap = m_bounds & other.m_bounds;
+		if(overlap.isEmpty())
+			return true;
+
+		// ...or if they do, they must not touch any of the same tiles
+		if(m_tiles.isEmpty() && other.m_tiles.isEmpty())
+			return false;
+
+		const int tx1 = tileCoordinate(overlap.right());
+		const int ty1 = tileCoordinate(overlap.bottom());
+		for(int ty=tileCoordinate(overlap.top());ty<=ty1;++ty) {
+			for(int tx=tileCoordinate(overlap.left());tx<=tx1;++tx) {
+				if(touchesTile(tx, ty) && other.touchesTile(tx, ty))
+					return false;
+			}
+		}
 		return true;
+	}
 
 	return false;
 }
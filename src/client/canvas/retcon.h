@@ -24,6 +24,8 @@
 
 #include <QRect>
 #include <QList>
+#include <QVector>
+#include <QBitArray>
 
 namespace canvas {
 
@@ -32,6 +34,10 @@ namespace canvas {
  *
  * This is used to check whether received operations are causally dependent or concurrent with
  * the ones in the local fork.
+ *
+ * Pixel changes made up of several small pieces (such as brush strokes) can also carry
+ * a bitmap of the tiles they touch. Two such changes conflict only if they touch
+ * the same tile, even if their bounding rectangles intersect.
  */
 class AffectedArea
 {
@@ -47,14 +53,29 @@ public:
 	AffectedArea() : m_domain(EVERYTHING), m_layer(0), m_bounds(QRect()) { }
 
 	AffectedArea(Domain domain, int layer, const QRect &bounds=QRect())
-		: m_domain(domain), m_layer(layer), m_bounds(bounds) { }
+		: m_domain(domain), m_layer(layer), m_bounds(bounds), m_tileColumns(0) { }
+
+	/**
+	 * @brief Construct a pixel change area made up of the given rectangles
+	 *
+	 * @param layer the layer ID
+	 * @param rects bounding rectangles of the pieces of the change
+	 */
+	AffectedArea(int layer, const QVector<QRect> &rects);
 
 	bool isConcurrentWith(const AffectedArea &other) const;
 
 private:
+	bool touchesTile(int x, int y) const;
+
 	Domain m_domain;
 	int m_layer;
 	QRect m_bounds;
+
+	// Tiles touched, relative to the tile containing the top-left corner of the bounds.
+	// If empty, every tile in the bounding rectangle is touched.
+	QBitArray m_tiles;
+	int m_tileColumns;
 };
 
 }
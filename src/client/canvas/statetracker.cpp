@@ -24,6 +24,7 @@
 
 #include "core/layerstack.h"
 #include "core/layer.h"
+#include "core/tilecache.h"
 #include "brushes/brushpainter.h"
 #include "net/commands.h"
 #include "net/internalmsg.h"
@@ -41,11 +42,129 @@
 #include <QElapsedTimer>
 #include <QSettings>
 #include <QPainter>
+#include <QThread>
+#include <QThreadPool>
+#include <QRunnable>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
 
 namespace canvas {
 
+// How many queued messages to look ahead when decompressing image payloads
+static const int INFLATE_LOOKAHEAD = 64;
+
+// A new savepoint is made once replaying the commands since the previous one would take this long (ns)
+static const qint64 SAVEPOINT_REPLAY_COST = 50 * 1000000;
+
+// Queued commands are applied in the canvas thread when at least this many are waiting
+static const int CANVAS_THREAD_MIN_QUEUE = 100;
+
+// How long (ms) the canvas thread may work before its results are shown
+static const int CANVAS_THREAD_SLICE = 50;
+
+namespace {
+
+class InflateRunnable : public QRunnable {
+public:
+	explicit InflateRunnable(const protocol::MessagePtr &msg) : m_msg(msg) { }
+	void run() override { protocol::preInflate(*m_msg); }
+
+private:
+	protocol::MessagePtr m_msg;
+};
+
+class CanvasThreadRunnable : public QRunnable {
+public:
+	explicit CanvasThreadRunnable(const std::function<void()> &fn) : m_fn(fn) { }
+	void run() override { m_fn(); }
+
+private:
+	std::function<void()> m_fn;
+};
+
+// Tiles touched by commands, identified by layer ID and tile index
+typedef QVector<quint64> TileList;
+
+inline quint64 tileKey(int layer, int index)
+{
+	return (quint64(layer) << 32) | quint32(index);
+}
+
+void addTiles(TileList &tiles, int layer, const QRect &rect, int xtiles)
+{
+	if(rect.isEmpty())
+		return;
+
+	const int x0 = rect.left() / paintcore::Tile::SIZE;
+	const int x1 = rect.right() / paintcore::Tile::SIZE;
+	const int y0 = rect.top() / paintcore::Tile::SIZE;
+	const int y1 = rect.bottom() / paintcore::Tile::SIZE;
+
+	for(int y=y0;y<=y1;++y) {
+		for(int x=x0;x<=x1;++x)
+			tiles << tileKey(layer, y * xtiles + x);
+	}
+}
+
+/**
+ * Groups of tiles that must be reverted together (a union-find structure)
+ *
+ * The tiles touched by the same command are joined into one group.
+ */
+class TileGroups {
+public:
+	//! Join the tiles into one group and return its representative (-1 if there are no tiles)
+	int join(const TileList &tiles)
+	{
+		int group = -1;
+		for(const quint64 key : tiles) {
+			const int t = find(id(key));
+			if(group < 0)
+				group = t;
+			else if(t != group)
+				m_parent[t] = group;
+		}
+		return group;
+	}
+
+	//! Find the representative of the group the tile belongs to
+	int find(int tile)
+	{
+		while(m_parent.at(tile) != tile) {
+			m_parent[tile] = m_parent.at(m_parent.at(tile));
+			tile = m_parent.at(tile);
+		}
+		return tile;
+	}
+
+	int count() const { return m_parent.size(); }
+
+	//! All the tile keys seen so far, mapped to their tile numbers
+	const QHash<quint64, int> &tiles() const { return m_tiles; }
+
+private:
+	int id(quint64 key)
+	{
+		const auto i = m_tiles.constFind(key);
+		if(i != m_tiles.constEnd())
+			return i.value();
+
+		const int t = m_parent.size();
+		m_parent << t;
+		m_tiles.insert(key, t);
+		return t;
+	}
+
+	QHash<quint64, int> m_tiles;
+	QVector<int> m_parent;
+};
+
+}
+
 struct StateSavepoint::Data {
-	Data() : timestamp(0), canvas(nullptr), streampointer(-1), m_refcount(1) {}
+	Data() : timestamp(0), canvas(nullptr), streampointer(-1), replayCost(0), unsharedTiles(0), m_refcount(1) {}
 	Data(const Data &) = delete;
 	Data &operator=(const Data&) = delete;
 	~Data() { delete canvas; }
@@ -54,6 +173,8 @@ struct StateSavepoint::Data {
 	paintcore::Savepoint *canvas;
 	QVector<LayerListItem> layermodel;
 	int streampointer;
+	qint64 replayCost; // time (ns) to replay the commands since the previous savepoint
+	int unsharedTiles; // tiles not shared with the next newer savepoint
 
 private:
 	int m_refcount;
@@ -132,6 +253,28 @@ protocol::MessageList StateSavepoint::initCommands(uint8_t contextId, const Canv
 	return loader.loadInitCommands();
 }
 
+/**
+ * @brief A run of queued commands being applied in the canvas thread
+ *
+ * While a batch is running, the state tracker applies commands to copies
+ * of the canvas and the layer list. The GUI keeps using the originals,
+ * which are updated when the batch is finished.
+ */
+struct StateTracker::CanvasBatch {
+	paintcore::LayerStack *image; // the canvas shown in the GUI
+	LayerListModel *layerlist;    // the layer list shown in the GUI
+
+	protocol::MessageList queue;      // commands to apply
+	protocol::MessageList localQueue; // local commands made while the batch was running
+
+	// Signals that refer to the canvas content are emitted after the results are published
+	QList<int> autoselectLayers;
+	QList<int> createdAnnotations;
+
+	// How far the content has moved due to canvas resizes
+	QPoint resizeOffset;
+};
+
 /**
  * @brief Construct a state tracker instance
  *
@@ -146,11 +289,15 @@ StateTracker::StateTracker(paintcore::LayerStack *image, LayerListModel *layerli
 		m_layerlist(layerlist),
 		m_myId(myId),
 		m_myLastLayer(-1),
+		m_replayCost(0),
+		m_savepointBudget(0),
 		m_fullhistory(true),
 		_showallmarkers(false),
 		m_hasParticipated(false),
 		m_localPenDown(false),
-		m_isQueued(false)
+		m_isQueued(false),
+		m_inflateAhead(0),
+		m_batch(nullptr)
 {
 	connect(m_layerlist, &LayerListModel::layerOpacityPreview, this, &StateTracker::previewLayerOpacity);
 
@@ -158,24 +305,54 @@ StateTracker::StateTracker(paintcore::LayerStack *image, LayerListModel *layerli
 	m_localfork.setFallbehind(10000);
 
 	// Timer for processing drawing commands in short chunks to avoid entirely locking up the UI.
-	// In the future, canvas rendering should be done in a separate thread.
+	// Long runs of commands (e.g. the session catch-up) are applied in the canvas thread instead.
 	m_queuetimer = new QTimer(this);
 	m_queuetimer->setSingleShot(true);
 	connect(m_queuetimer, &QTimer::timeout, this, &StateTracker::processQueuedCommands);
+
+	// Image payloads of queued commands are decompressed in advance in these threads.
+	// A pool of our own is used, since the paint engine blocks on the global pool.
+	m_inflatePool = new QThreadPool(this);
+	m_inflatePool->setMaxThreadCount(qMax(1, QThread::idealThreadCount() - 1));
+
+	// The canvas thread applies queued commands to a copy of the canvas
+	// while the GUI keeps showing (and reading) the original.
+	m_canvasThread = new QThreadPool(this);
+	m_canvasThread->setMaxThreadCount(1);
 }
 
 StateTracker::~StateTracker()
 {
+	m_canvasThread->waitForDone();
+	if(m_batch) {
+		// Discard the unpublished copies
+		delete m_layerstack;
+		delete m_layerlist;
+		delete m_batch;
+	}
+
+	m_inflatePool->clear();
+	m_inflatePool->waitForDone();
+}
+
+paintcore::LayerStack *StateTracker::image() const
+{
+	return m_batch ? m_batch->image : m_layerstack;
 }
 
 void StateTracker::reset()
 {
+	waitForCanvasThread();
+
 	m_savepoints.clear();
+	m_replayCost = 0;
 	m_history.resetTo(m_history.end());
 	m_fullhistory = true;
 	m_hasParticipated = false;
-	m_localPenDown = false;
+	m_localPenDown.store(false);
 	m_msgqueue.clear();
+	m_inflateAhead = 0;
+	m_inflatePool->clear();
 	m_localfork.clear();
 	m_layerlist->clear();
 
@@ -185,6 +362,13 @@ void StateTracker::reset()
 
 void StateTracker::localCommand(protocol::MessagePtr msg)
 {
+	if(m_batch) {
+		// Local commands are applied to the real canvas once the
+		// canvas thread is done with the current batch.
+		m_batch->localQueue << msg;
+		return;
+	}
+
 	// A fork is created at the end of the mainline history
 	if(m_localfork.isEmpty()) {
 		m_localfork.setOffset(m_history.end()-1);
@@ -215,7 +399,10 @@ void StateTracker::localCommand(protocol::MessagePtr msg)
 	// for the future: handle undo messages in the local fork too
 	if(msg->type() != protocol::MSG_UNDO && msg->type() != protocol::MSG_UNDOPOINT) {
 		int pos = m_history.end() - 1;
+		QElapsedTimer timer;
+		timer.start();
 		handleCommand(msg, false, pos);
+		m_replayCost += timer.nsecsElapsed();
 	}
 }
 
@@ -226,19 +413,35 @@ void StateTracker::receiveQueuedCommand(protocol::MessagePtr msg)
 	if(!m_isQueued) {
 		// This introduces a tiny bit of lag, but allows sequential
 		// messages to queue up even when the system is not under very heavy
-		// load. Won't be needed anymore when the paint engine runs in its own
-		// thread.
+		// load, so a long run of them can be handed to the canvas thread.
 		m_isQueued = true;
 		m_queuetimer->start(1);
 	}
 }
 
+void StateTracker::scheduleInflation(const protocol::MessageList &queue)
+{
+	const int end = qMin(queue.size(), INFLATE_LOOKAHEAD);
+	for(;m_inflateAhead<end;++m_inflateAhead) {
+		const protocol::MessagePtr &msg = queue.at(m_inflateAhead);
+		if(protocol::canPreInflate(*msg))
+			m_inflatePool->start(new InflateRunnable(msg));
+	}
+}
+
 void StateTracker::processQueuedCommands()
 {
+	if(m_msgqueue.size() >= CANVAS_THREAD_MIN_QUEUE) {
+		startBatch();
+		return;
+	}
+
 	QElapsedTimer elapsed;
 	elapsed.start();
 
 	while(!m_msgqueue.isEmpty() && elapsed.elapsed() < 100) {
+		scheduleInflation(m_msgqueue);
+		--m_inflateAhead;
 		receiveCommand(m_msgqueue.takeFirst());
 	}
 
@@ -251,6 +454,94 @@ void StateTracker::processQueuedCommands()
 	}
 }
 
+void StateTracker::startBatch()
+{
+	Q_ASSERT(!m_batch);
+
+	m_batch = new CanvasBatch;
+	m_batch->image = m_layerstack;
+	m_batch->layerlist = m_layerlist;
+	m_batch->queue.swap(m_msgqueue);
+
+	// Tiles are implicitly shared, so copying the canvas is cheap
+	m_layerstack = m_batch->image->clone();
+	m_layerlist = new LayerListModel;
+	m_layerlist->setLayers(m_batch->layerlist->getLayers());
+	m_layerlist->setDefaultLayer(m_batch->layerlist->defaultLayer());
+	m_layerlist->setMyId(m_batch->layerlist->myId());
+
+	m_isQueued = true;
+	m_canvasThread->start(new CanvasThreadRunnable([this]() {
+		{
+			paintcore::TileCache::Guard tileGuard;
+			applyBatch();
+		}
+		QMetaObject::invokeMethod(this, "finishBatch", Qt::QueuedConnection);
+	}));
+}
+
+void StateTracker::applyBatch()
+{
+	// Note: this is run in the canvas thread
+	QElapsedTimer elapsed;
+	elapsed.start();
+
+	while(!m_batch->queue.isEmpty() && elapsed.elapsed() < CANVAS_THREAD_SLICE) {
+		scheduleInflation(m_batch->queue);
+		--m_inflateAhead;
+		receiveCommand(m_batch->queue.takeFirst());
+	}
+}
+
+void StateTracker::finishBatch()
+{
+	// The batch may have been finished early by waitForCanvasThread()
+	if(!m_batch)
+		return;
+
+	CanvasBatch *batch = m_batch;
+	m_batch = nullptr;
+
+	// Publish the results
+	batch->image->editor(0).replaceContent(m_layerstack, batch->resizeOffset.x(), batch->resizeOffset.y());
+	if(batch->layerlist->getLayers() != m_layerlist->getLayers())
+		batch->layerlist->setLayers(m_layerlist->getLayers());
+
+	delete m_layerstack;
+	delete m_layerlist;
+	m_layerstack = batch->image;
+	m_layerlist = batch->layerlist;
+
+	// Commands that didn't fit in this batch go back to the head of the queue
+	batch->queue.append(m_msgqueue);
+	m_msgqueue.swap(batch->queue);
+
+	for(int id : batch->autoselectLayers)
+		emit layerAutoselectRequest(id);
+	for(int id : batch->createdAnnotations)
+		emit myAnnotationCreated(id);
+
+	for(const protocol::MessagePtr &msg : batch->localQueue)
+		localCommand(msg);
+
+	delete batch;
+
+	if(!m_msgqueue.isEmpty()) {
+		m_isQueued = true;
+		m_queuetimer->start(0);
+	} else {
+		m_isQueued = false;
+	}
+}
+
+void StateTracker::waitForCanvasThread()
+{
+	if(m_batch) {
+		m_canvasThread->waitForDone();
+		finishBatch();
+	}
+}
+
 void StateTracker::receiveCommand(protocol::MessagePtr msg)
 {
 	static const uint HISTORY_SIZE_LIMIT = 60 * 1024*1024;
@@ -306,6 +597,8 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
 			qDebug() << "removing" << savepoint << "redundant save points out of" << m_savepoints.count();
 			while(savepoint-- > 0)
 				m_savepoints.removeFirst();
+
+			updateSavepointStats();
 		}
 	}
 
@@ -340,7 +633,7 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
 			// Avoid rollback churn by clearing the local fork, but not if
 			// local drawing is in progress. If we clear the fork then,
 			// we trigger a self-conflict feedback loop until the stroke finishes.
-			if(!m_localPenDown)
+			if(!m_localPenDown.load())
 				m_localfork.clear();
 
 			revertSavepointAndReplay(sp);
@@ -349,8 +642,16 @@ void StateTracker::receiveCommand(protocol::MessagePtr msg)
 	} else if(lfa==LocalFork::CONCURRENT) {
 		// Concurrent operation: safe to execute
 		int pos = m_history.end() - 1;
+		QElapsedTimer timer;
+		timer.start();
 		handleCommand(msg, false, pos);
+		m_replayCost += timer.nsecsElapsed();
 	} // else ALREADYDONE
+
+	// The payload may have been decompressed ahead of time. If the message
+	// wasn't applied (already done locally, unknown layer, etc.) the copy
+	// would otherwise stay in the history with it.
+	protocol::releaseInflated(*msg);
 }
 
 void StateTracker::handleCommand(protocol::MessagePtr msg, bool replay, int pos)
@@ -430,6 +731,8 @@ void StateTracker::handleCommand(protocol::MessagePtr msg, bool replay, int pos)
  */
 void StateTracker::endRemoteContexts()
 {
+	waitForCanvasThread();
+
 	// Add local fork to the mainline history
 	auto localfork = m_localfork.messages();
 	m_localfork.clear();
@@ -451,6 +754,7 @@ void StateTracker::endRemoteContexts()
  */
 void StateTracker::endPlayback()
 {
+	waitForCanvasThread();
 	auto layers = m_layerstack->editor(0);
 	layers.mergeAllSublayers();
 }
@@ -464,6 +768,9 @@ void StateTracker::handleCanvasResize(const protocol::CanvasResize &cmd, int pos
 		layers.resize(cmd.top(), cmd.right(), cmd.bottom(), cmd.left());
 	}
 
+	if(m_batch)
+		m_batch->resizeOffset += QPoint(cmd.left(), cmd.top());
+
 	// Generate the initial savepoint, just in case
 	makeSavepoint(pos);
 }
@@ -475,7 +782,7 @@ void StateTracker::handleCanvasBackground(const protocol::CanvasBackground &cmd)
 		t = paintcore::Tile(QColor::fromRgba(cmd.color()));
 
 	} else {
-		QByteArray data = qUncompress(cmd.image());
+		QByteArray data = cmd.inflatedImage();
 		if(data.length() != paintcore::Tile::BYTES) {
 			qWarning() << "Invalid canvas background: Expected" << paintcore::Tile::BYTES << "bytes, but got" << data.length();
 			return;
@@ -532,7 +839,10 @@ void StateTracker::handleLayerCreate(const protocol::LayerCreate &cmd)
 			))
 	   )
 	{
-		emit layerAutoselectRequest(layer->id());
+		if(m_batch)
+			m_batch->autoselectLayers << layer->id();
+		else
+			emit layerAutoselectRequest(layer->id());
 	}
 }
 
@@ -582,6 +892,7 @@ void StateTracker::handleLayerVisibility(const protocol::LayerVisibility &cmd)
 
 void StateTracker::previewLayerOpacity(int id, float opacity)
 {
+	waitForCanvasThread();
 	auto layers = m_layerstack->editor(0);
 	auto layer = layers.getEditableLayer(id);
 
@@ -664,7 +975,7 @@ void StateTracker::handlePutImage(const protocol::PutImage &cmd)
 	}
 
 	const int expectedLen = cmd.width() * cmd.height() * 4;
-	QByteArray data = qUncompress(cmd.image());
+	QByteArray data = cmd.inflatedImage();
 	if(data.length() != expectedLen) {
 		qWarning() << "Invalid putImage: Expected" << expectedLen << "bytes, but got" << data.length();
 		return;
@@ -690,7 +1001,7 @@ void StateTracker::handlePutTile(const protocol::PutTile &cmd)
 		t = paintcore::Tile(QColor::fromRgba(cmd.color()), cmd.contextId());
 
 	} else {
-		QByteArray data = qUncompress(cmd.image());
+		QByteArray data = cmd.inflatedImage();
 		if(data.length() != paintcore::Tile::BYTES) {
 			qWarning() << "Invalid putTile: Expected" << paintcore::Tile::BYTES << "bytes, but got" << data.length();
 			return;
@@ -753,7 +1064,7 @@ void StateTracker::handleMoveRegion(const protocol::MoveRegion &cmd)
 	QImage mask;
 	if(!cmd.mask().isEmpty()) {
 		const int expectedLen = (cmd.bw()+31)/32 * 4 * cmd.bh(); // 1bpp lines padded to 32bit boundaries
-		QByteArray maskData = qUncompress(cmd.mask());
+		QByteArray maskData = cmd.inflatedMask();
 		if(maskData.length() != expectedLen) {
 			qWarning("Invalid moveRegion mask: Expected %d bytes, but got %d", expectedLen, maskData.length());
 			return;
@@ -944,6 +1255,7 @@ void StateTracker::handleUndo(protocol::Undo &cmd)
 	}
 
 	// Step 3. (Un)mark all actions by the user as undone
+	QSet<int> toggled;
 	if(cmd.isRedo()) {
 		int i=pos;
 		int sequence=2;
@@ -956,8 +1268,10 @@ void StateTracker::handleUndo(protocol::Undo &cmd)
 						break;
 
 				// GONE messages cannot be redone
-				if(msg->undoState() == protocol::UNDONE)
+				if(msg->undoState() == protocol::UNDONE) {
 					msg->setUndoState(protocol::DONE);
+					toggled << i;
+				}
 			}
 			++i;
 		}
@@ -966,13 +1280,19 @@ void StateTracker::handleUndo(protocol::Undo &cmd)
 		// Mark all messages from undo point to the end as undone.
 		for(int i=pos;i<m_history.end();++i) {
 			protocol::MessagePtr msg = m_history.at(i);
-			if(msg->contextId() == ctxid)
+			if(msg->contextId() == ctxid) {
+				if(msg->undoState() == protocol::DONE)
+					toggled << i;
 				msg->setUndoState(protocol::MessageUndoState(protocol::UNDONE | msg->undoState()));
+			}
 		}
 	}
 
-	// Step 4. Revert to the savepoint and replay with undone commands removed (or added back)
-	revertSavepointAndReplay(savepoint);
+	// Step 4. Revert the tiles touched by the undone commands and replay just the
+	// commands affecting those tiles. If that is not possible, revert the whole canvas
+	// to the savepoint and replay everything with undone commands removed (or added back)
+	if(!replayAffectedTiles(savepoint, toggled))
+		revertSavepointAndReplay(savepoint);
 }
 
 StateSavepoint StateTracker::createSavepoint(int pos)
@@ -994,21 +1314,132 @@ void StateTracker::makeSavepoint(int pos)
 	if(!m_localfork.isEmpty())
 		return;
 
-	// Check if sufficient time and actions has elapsed from previous savepoint
-	if(!m_savepoints.isEmpty()) {
-		const StateSavepoint sp = m_savepoints.last();
-		quint64 now = QDateTime::currentMSecsSinceEpoch();
-		if(now - sp->timestamp < 1000 && m_history.end() - sp->streampointer < 100)
-			return;
-	}
+	// Check if replaying the commands since the previous savepoint
+	// would take long enough to make a new one worthwhile
+	if(!m_savepoints.isEmpty() && m_replayCost < SAVEPOINT_REPLAY_COST)
+		return;
 
 	// Looks like a good spot for a savepoint
-	m_savepoints.append(createSavepoint(pos));
+	StateSavepoint savepoint = createSavepoint(pos);
+	savepoint->replayCost = m_replayCost;
+	m_replayCost = 0;
+
+	// Shared tiles are only counted when there is a budget to keep
+	if(!m_savepoints.isEmpty() && m_savepointBudget > 0) {
+		StateSavepoint &previous = m_savepoints.last();
+		previous->unsharedTiles = previous->canvas->countUnsharedTiles(savepoint->canvas);
+	}
+
+	m_savepoints.append(savepoint);
+
+	thinSavepoints();
+	updateSavepointStats();
+}
+
+void StateTracker::setSavepointBudget(int megabytes)
+{
+	waitForCanvasThread();
+	const bool wasCounting = m_savepointBudget > 0;
+	m_savepointBudget = qMax(0, megabytes);
+
+	// Tiles aren't counted while there is no budget
+	if((m_savepointBudget > 0) != wasCounting) {
+		for(int i=0;i<m_savepoints.size()-1;++i) {
+			StateSavepoint previous = m_savepoints.at(i);
+			previous->unsharedTiles = m_savepointBudget > 0
+				? previous->canvas->countUnsharedTiles(m_savepoints.at(i+1)->canvas)
+				: 0;
+		}
+	}
+
+	thinSavepoints();
+	updateSavepointStats();
+}
+
+/**
+ * @brief Remove savepoints until they fit in the memory budget
+ *
+ * The oldest savepoint is always kept, since it is needed to reach the
+ * end of the undo history. So is the newest, which is the one used most often.
+ *
+ * Removing a savepoint makes undoing past it more expensive, so the one to remove
+ * is chosen by the replay cost of the gap its removal leaves behind. The allowed gap
+ * doubles with each step back in age, so the remaining savepoints end up spaced
+ * logarithmically.
+ */
+void StateTracker::thinSavepoints()
+{
+	if(m_savepointBudget <= 0)
+		return;
+
+	const qint64 budget = qint64(m_savepointBudget) * 1024 * 1024;
+
+	qint64 tiles = 0;
+	for(const StateSavepoint &sp : m_savepoints)
+		tiles += sp->unsharedTiles;
+
+	while(m_savepoints.size() > 2 && tiles * paintcore::Tile::BYTES > budget) {
+		const int last = m_savepoints.size() - 1;
+
+		int victim = 1;
+		qreal bestScore = 0;
+		for(int i=1;i<last;++i) {
+			const qreal gap = m_savepoints.at(i)->replayCost + m_savepoints.at(i+1)->replayCost;
+			const qreal score = std::ldexp(gap, -qMin(last - i, 60));
+			if(i == 1 || score < bestScore) {
+				victim = i;
+				bestScore = score;
+			}
+		}
+
+		StateSavepoint next = m_savepoints.at(victim+1);
+		StateSavepoint previous = m_savepoints.at(victim-1);
+
+		tiles -= m_savepoints.at(victim)->unsharedTiles + previous->unsharedTiles;
+
+		next->replayCost += m_savepoints.at(victim)->replayCost;
+		m_savepoints.removeAt(victim);
+
+		previous->unsharedTiles = previous->canvas->countUnsharedTiles(next->canvas);
+		tiles += previous->unsharedTiles;
+	}
+}
+
+/**
+ * @brief Remove all savepoints newer than the given one
+ *
+ * This is done when the canvas is reverted to the savepoint,
+ * since the newer ones may contain undone commands.
+ */
+void StateTracker::dropSavepointsAfter(const StateSavepoint &savepoint)
+{
+	while(m_savepoints.last() != savepoint) {
+		m_replayCost += m_savepoints.last()->replayCost;
+		m_savepoints.removeLast();
+	}
+	m_savepoints.last()->unsharedTiles = 0;
+
+	updateSavepointStats();
+}
+
+void StateTracker::updateSavepointStats()
+{
+	qint64 tiles = 0;
+	qint64 replayCost = m_replayCost;
+	for(int i=0;i<m_savepoints.size();++i) {
+		tiles += m_savepoints.at(i)->unsharedTiles;
+		if(i>0)
+			replayCost += m_savepoints.at(i)->replayCost;
+	}
+
+	emit savepointStatsChanged(m_savepoints.size(), tiles * paintcore::Tile::BYTES, int(replayCost / 1000000));
 }
 
 
 void StateTracker::resetToSavepoint(const StateSavepoint savepoint)
 {
+	waitForCanvasThread();
+
 	// This function is called when jumping to a recorded savepoint
 	if(!savepoint) {
 		qWarning("resetToSavepoint() was called with a null savepoint!");
@@ -1017,6 +1448,7 @@ void StateTracker::resetToSavepoint(const StateSavepoint savepoint)
 
 	m_history.resetTo(savepoint->streampointer);
 	m_savepoints.clear();
+	m_replayCost = 0;
 
 	m_layerstack->editor(0).restoreSavepoint(savepoint->canvas);
 	m_layerlist->setLayers(savepoint->layermodel);
@@ -1041,8 +1473,7 @@ void StateTracker::revertSavepointAndReplay(const StateSavepoint savepoint)
 	m_layerlist->setLayers(savepoint->layermodel);
 
 	// Reverting a savepoint destroys all newer savepoints
-	while(m_savepoints.last() != savepoint)
-		m_savepoints.removeLast();
+	dropSavepointsAfter(savepoint);
 
 	// Replay all not-undo actions (and local fork)
 	int pos = savepoint->streampointer + 1;
@@ -1065,6 +1496,215 @@ void StateTracker::revertSavepointAndReplay(const StateSavepoint savepoint)
 	}
 }
 
+/**
+ * @brief Undo or redo by reverting only the affected tiles
+ *
+ * The tiles touched by the toggled commands are restored from the savepoint.
+ * Every command after the savepoint that touches any of those tiles must then
+ * be replayed, which in turn adds the rest of the tiles it touches to the set.
+ * In other words, commands that share tiles form groups, and the groups
+ * containing a toggled command are reverted. The commands left out don't touch
+ * any restored tile, so their results on the canvas remain valid.
+ *
+ * Since savepoints share unchanged tiles with the canvas, they serve as the
+ * store of old tile versions.
+ *
+ * @param savepoint the savepoint preceding the undo point
+ * @param toggled history positions of the commands whose undo state was changed
+ * @return false if the canvas must be reverted and replayed in full
+ */
+bool StateTracker::replayAffectedTiles(const StateSavepoint &savepoint, const QSet<int> &toggled)
+{
+	using namespace protocol;
+
+	// A sequence of commands that must be replayed together
+	struct ReplayUnit {
+		QVector<int> messages; // indices to the message list below
+		TileList tiles;
+		bool toggled;
+		bool isStroke;
+	};
+
+	// Commands after the savepoint. Position -1 means the message is in the local fork.
+	QList<QPair<MessagePtr, int>> messages;
+	for(int pos=savepoint->streampointer+1;pos<m_history.end();++pos)
+		messages << qMakePair(m_history.at(pos), pos);
+
+	for(const MessagePtr &msg : m_localfork.messages()) {
+		if(msg->type() != MSG_UNDO && msg->type() != MSG_UNDOPOINT)
+			messages << qMakePair(msg, -1);
+	}
+
+	// Find out which tiles each command touches
+	const QRect canvasRect(0, 0, m_layerstack->width(), m_layerstack->height());
+	const int xtiles = paintcore::Tile::roundTiles(canvasRect.width());
+
+	QList<ReplayUnit> units;
+	QHash<int, ReplayUnit> strokes; // indirect strokes in progress
+
+	for(int i=0;i<messages.size();++i) {
+		const MessagePtr &msg = messages.at(i).first;
+		const bool isToggled = toggled.contains(messages.at(i).second);
+
+		// Commands that were undone before and still are have no effect
+		if(!isToggled && msg->undoState() != DONE)
+			continue;
+
+		ReplayUnit unit { { i }, TileList(), isToggled, false };
+
+		switch(msg->type()) {
+		case MSG_UNDOPOINT:
+		case MSG_UNDO:
+			continue;
+
+		case MSG_LAYER_ATTR:
+			if(msg.cast<LayerAttributes>().sublayer() != 0)
+				return false;
+			// fall through
+		case MSG_LAYER_RETITLE:
+		case MSG_LAYER_VISIBILITY:
+		case MSG_LAYER_ORDER:
+		case MSG_ANNOTATION_CREATE:
+		case MSG_ANNOTATION_RESHAPE:
+		case MSG_ANNOTATION_EDIT:
+		case MSG_ANNOTATION_DELETE:
+			// These don't change pixels, but they can't be undone tile by tile either
+			if(isToggled)
+				return false;
+			continue;
+
+		case MSG_DRAWDABS_CLASSIC:
+		case MSG_DRAWDABS_PIXEL:
+		case MSG_DRAWDABS_PIXEL_SQUARE: {
+			const DrawDabs &dd = msg.cast<DrawDabs>();
+			if(dd.isIndirect()) {
+				// Indirect strokes are drawn on a sublayer that is merged
+				// at PenUp, so the whole stroke is replayed as a unit.
+				ReplayUnit &stroke = strokes[msg->contextId()];
+				if(stroke.messages.isEmpty()) {
+					stroke.toggled = isToggled;
+					stroke.isStroke = true;
+				} else if(stroke.toggled != isToggled) {
+					return false;
+				}
+				stroke.messages << i;
+				addTiles(stroke.tiles, dd.layer(), dd.bounds() & canvasRect, xtiles);
+				continue;
+			}
+			addTiles(unit.tiles, dd.layer(), dd.bounds() & canvasRect, xtiles);
+			break;
+		}
+
+		case MSG_PEN_UP:
+			// Without an indirect stroke, PenUp does nothing
+			if(!strokes.contains(msg->contextId()))
+				continue;
+			unit = strokes.take(msg->contextId());
+			if(unit.toggled != isToggled)
+				return false;
+			unit.messages << i;
+			break;
+
+		case MSG_PUTIMAGE: {
+			const PutImage &pi = msg.cast<PutImage>();
+			addTiles(unit.tiles, pi.layer(), QRect(pi.x(), pi.y(), pi.width(), pi.height()) & canvasRect, xtiles);
+			break;
+		}
+
+		case MSG_PUTTILE: {
+			const PutTile &pt = msg.cast<PutTile>();
+			if(pt.sublayer() != 0)
+				return false;
+			const int total = xtiles * paintcore::Tile::roundTiles(canvasRect.height());
+			const int first = pt.row() * xtiles + pt.column();
+			const int last = qMin(first + pt.repeat(), total - 1);
+			for(int t=first;t<=last;++t)
+				unit.tiles << tileKey(pt.layer(), t);
+			break;
+		}
+
+		case MSG_FILLRECT: {
+			const FillRect &fr = msg.cast<FillRect>();
+			addTiles(unit.tiles, fr.layer(), QRect(fr.x(), fr.y(), fr.width(), fr.height()) & canvasRect, xtiles);
+			break;
+		}
+
+		case MSG_REGION_MOVE: {
+			const MoveRegion &mr = msg.cast<MoveRegion>();
+			addTiles(unit.tiles, mr.layer(), mr.sourceBounds() & canvasRect, xtiles);
+			addTiles(unit.tiles, mr.layer(), mr.targetBounds() & canvasRect, xtiles);
+			break;
+		}
+
+		default:
+			// Layer creation and deletion, canvas resize, etc.
+			return false;
+		}
+
+		units << unit;
+	}
+
+	// The sublayer of an unfinished stroke is left as is, so it can't be undone
+	for(const ReplayUnit &stroke : strokes) {
+		if(stroke.toggled)
+			return false;
+	}
+
+	// Group the tiles. Since the restored tiles lose the effects of every command,
+	// commands both before and after the toggled ones may have to be replayed.
+	TileGroups groups;
+	QVector<int> unitGroups;
+	unitGroups.reserve(units.size());
+	for(const ReplayUnit &unit : units)
+		unitGroups << groups.join(unit.tiles);
+
+	QVector<bool> affected(groups.count(), false);
+	for(int u=0;u<units.size();++u) {
+		if(units.at(u).toggled && unitGroups.at(u) >= 0)
+			affected[groups.find(unitGroups.at(u))] = true;
+	}
+
+	// Find all the commands touching the affected tiles
+	QVector<int> replay;
+	for(int u=0;u<units.size();++u) {
+		const ReplayUnit &unit = units.at(u);
+		if(unitGroups.at(u) < 0 || !affected.at(groups.find(unitGroups.at(u))))
+			continue;
+
+		// Replaying a finished stroke would draw into the sublayer of
+		// the same user's stroke that is currently in progress
+		if(unit.isStroke && strokes.contains(messages.at(unit.messages.first()).first->contextId()))
+			return false;
+		replay << unit.messages;
+	}
+	std::sort(replay.begin(), replay.end());
+
+	// Revert the affected tiles
+	QHash<int, QVector<int>> restore;
+	for(auto t=groups.tiles().constBegin();t!=groups.tiles().constEnd();++t) {
+		if(affected.at(groups.find(t.value())))
+			restore[int(t.key() >> 32)] << int(t.key() & 0xffffffff);
+	}
+
+	if(!m_layerstack->editor(0).restoreTiles(savepoint->canvas, restore))
+		return false;
+
+	// Replay the commands touching them (undone ones are skipped)
+	for(const int i : replay) {
+		const MessagePtr &msg = messages.at(i).first;
+		if(msg->undoState() == DONE)
+			handleCommand(msg, true, messages.at(i).second < 0 ? m_history.end() : messages.at(i).second);
+	}
+
+	// Newer savepoints include the undone commands
+	dropSavepointsAfter(savepoint);
+
+	if(!m_localfork.isEmpty())
+		m_localfork.setOffset(m_history.end()-1);
+
+	return true;
+}
+
 void StateTracker::handleTruncateHistory()
 {
 	int pos = m_history.end()-1;
@@ -1087,8 +1727,12 @@ void StateTracker::handleTruncateHistory()
 void StateTracker::handleAnnotationCreate(const protocol::AnnotationCreate &cmd)
 {
 	m_layerstack->annotations()->addAnnotation(cmd.id(), QRect(cmd.x(), cmd.y(), cmd.w(), cmd.h()));
-	if(cmd.contextId() == localId())
-		emit myAnnotationCreated(cmd.id());
+	if(cmd.contextId() == localId()) {
+		if(m_batch)
+			m_batch->createdAnnotations << cmd.id();
+		else
+			emit myAnnotationCreated(cmd.id());
+	}
 }
 
 void StateTracker::handleAnnotationReshape(const protocol::AnnotationReshape &cmd)
@@ -1238,7 +1882,9 @@ AffectedArea StateTracker::affectedArea(protocol::MessagePtr msg) const
 		if(dd.isIndirect())
 			return AffectedArea(AffectedArea::USERATTRS, 0);
 
-		return AffectedArea(AffectedArea::PIXELS, dd.layer(), dd.bounds());
+		// A stroke's bounding box can be much bigger than the area it touches,
+		// so the individual dabs are used
+		return AffectedArea(dd.layer(), dd.dabBounds());
 	}
 	case MSG_PEN_UP: {
 		QPair<int,QRect> bounds = m_layerstack->findChangeBounds(msg->contextId());
@@ -24,6 +24,10 @@
 #include "core/point.h"
 
 #include <QObject>
+#include <QSet>
+#include <QAtomicInt>
+
+class QThreadPool;
 
 namespace protocol {
 	class CanvasResize;
@@ -126,6 +130,10 @@ class LayerListModel;
  * 
  * The state tracker object keeps track of each drawing context and performs
  * the drawing using the paint engine.
+ *
+ * Long runs of queued commands (such as the session catch-up) are applied
+ * in a separate canvas thread to a copy of the canvas. The GUI keeps showing
+ * the previous state until the copy is published at the end of each batch.
  */
 class StateTracker : public QObject {
 	Q_OBJECT
@@ -144,14 +152,14 @@ public:
 	//! Reset the entire history
 	void reset();
 
-	bool hasFullHistory() const { return m_fullhistory; }
-	const History &getHistory() const { return m_history; }
+	bool hasFullHistory() { waitForCanvasThread(); return m_fullhistory; }
+	const History &getHistory() { waitForCanvasThread(); return m_history; }
 
 	/**
 	 * @brief Set if all user markers (own included) should be shown
 	 * @param showall
 	 */
-	void setShowAllUserMarkers(bool showall) { _showallmarkers = showall; }
+	void setShowAllUserMarkers(bool showall) { waitForCanvasThread(); _showallmarkers = showall; }
 
 	/**
 	 * @brief Get the local user's ID
@@ -162,16 +170,18 @@ public:
 	/**
 	 * @brief Set the local user's ID
 	 */
-	void setLocalId(uint8_t id) { m_myId = id; }
+	void setLocalId(uint8_t id) { waitForCanvasThread(); m_myId = id; }
 
 	/**
 	 * @brief Get the paint canvas
-	 * @return
+	 *
+	 * This is always the canvas shown in the GUI, even when commands
+	 * are being applied to a copy of it in the canvas thread.
 	 */
-	paintcore::LayerStack *image() const { return m_layerstack; }
+	paintcore::LayerStack *image() const;
 
 	//! Has the local user participated in the session yet?
-	bool hasParticipated() const { return m_hasParticipated; }
+	bool hasParticipated() { waitForCanvasThread(); return m_hasParticipated; }
 
 	StateTracker &operator=(const StateTracker&) = delete;
 
@@ -194,7 +204,17 @@ public:
 	void resetToSavepoint(StateSavepoint sp);
 
 	//! Get all existing savepoints (can be used for selecting a reset point)
-	QList<StateSavepoint> getSavepoints() const { return m_savepoints; }
+	QList<StateSavepoint> getSavepoints() { waitForCanvasThread(); return m_savepoints; }
+
+	/**
+	 * @brief Set the memory budget for savepoints
+	 *
+	 * When the tiles held only by savepoints take more memory than this,
+	 * savepoints are thinned out so that older ones are spaced further apart.
+	 *
+	 * @param megabytes the budget or zero for no limit
+	 */
+	void setSavepointBudget(int megabytes);
 
 signals:
 	void myAnnotationCreated(int id);
@@ -206,6 +226,14 @@ signals:
 	void catchupProgress(int percent);
 	void sequencePoint(int);
 
+	/**
+	 * @brief Savepoint statistics have changed
+	 * @param count number of savepoints
+	 * @param bytes estimated memory held by savepoints (zero if no budget is set)
+	 * @param replayMsecs estimated time to replay the history from the oldest savepoint
+	 */
+	void savepointStatsChanged(int count, qint64 bytes, int replayMsecs);
+
 public slots:
 	void previewLayerOpacity(int id, float opacity);
 
@@ -219,12 +247,19 @@ public slots:
 	 * Not setting this flag doesn't break anything, but may cause
 	 * unnecessary rollbacks if a conflict occurs during local drawing.
 	 */
-	void setLocalDrawingInProgress(bool pendown) { m_localPenDown = pendown; }
+	void setLocalDrawingInProgress(bool pendown) { m_localPenDown.store(pendown); }
 
 private slots:
 	void processQueuedCommands();
+	void finishBatch();
 
 private:
+	struct CanvasBatch;
+
+	void scheduleInflation(const protocol::MessageList &queue);
+	void startBatch();
+	void applyBatch();
+	void waitForCanvasThread();
 	void handleCommand(protocol::MessagePtr msg, bool replay, int pos);
 
 	AffectedArea affectedArea(const protocol::MessagePtr msg) const;
@@ -252,7 +287,11 @@ private:
 	void handleUndoPoint(const protocol::UndoPoint &cmd, bool replay, int pos);
 	void handleUndo(protocol::Undo &cmd);
 	void makeSavepoint(int pos);
+	void thinSavepoints();
+	void dropSavepointsAfter(const StateSavepoint &savepoint);
+	void updateSavepointStats();
 	void revertSavepointAndReplay(const StateSavepoint savepoint);
+	bool replayAffectedTiles(const StateSavepoint &savepoint, const QSet<int> &toggled);
 	void handleTruncateHistory();
 
 	// Annotation related commands
@@ -270,17 +309,25 @@ private:
 
 	History m_history;
 	QList<StateSavepoint> m_savepoints;
+	qint64 m_replayCost; // time (ns) spent executing commands since the last savepoint
+	int m_savepointBudget; // in megabytes
 
 	LocalFork m_localfork;
 
 	bool m_fullhistory;
 	bool _showallmarkers;
 	bool m_hasParticipated;
-	bool m_localPenDown;
+	QAtomicInt m_localPenDown; // set from the GUI thread while the canvas thread may be running
 
 	protocol::MessageList m_msgqueue;
 	QTimer *m_queuetimer;
 	bool m_isQueued;
+
+	QThreadPool *m_inflatePool;
+	int m_inflateAhead; // number of messages at the head of the queue already handed to m_inflatePool
+
+	QThreadPool *m_canvasThread;
+	CanvasBatch *m_batch; // commands currently being applied in the canvas thread
 };
 
 }
@@ -43,6 +43,12 @@ struct Annotation {
 	// TODO this needs to be HTML aware
 	bool isEmpty() const { return text.isEmpty(); }
 
+	bool operator==(const Annotation &other) const {
+		return id == other.id && text == other.text && rect == other.rect &&
+			background == other.background && protect == other.protect && valign == other.valign;
+	}
+	bool operator!=(const Annotation &other) const { return !(*this == other); }
+
 	void paint(QPainter *painter) const;
 	void paint(QPainter *painter, const QRectF &paintrect) const;
 	QImage toImage() const;
@@ -22,10 +22,22 @@
 
 #include <QThreadPool>
 #include <QSemaphore>
+#include <QAtomicInt>
 #include <functional>
 
 namespace paintcore {
 
+/**
+ * @brief Call the function for each item in the list using the global thread pool
+ *
+ * The calling thread takes part in the work and the function returns once
+ * all the items have been processed. Items are handed out one at a time,
+ * which keeps the threads busy even when some items take longer than others.
+ *
+ * Helpers that have not started by the time the calling thread runs out
+ * of work are taken back from the pool, so this can also be called from
+ * a thread pool thread (e.g. a background saver) without deadlocking.
+ */
 template<typename T>
 void concurrentForEach(QList<T> &list, std::function<void(T)> func)
 {
@@ -40,35 +52,48 @@ void concurrentForEach(QList<T> &list, std::function<void(T)> func)
 
 	class ConcurrentForEachRunnable : public QRunnable {
 	public:
-		T value;
-		std::function<void(T)> func;
+		std::function<void()> work;
 		QSemaphore *semaphore;
 
 		void run() override
 		{
-			func(value);
+			work();
 			semaphore->release();
 		}
 	};
 
+	const QList<T> &items = list;
+	QAtomicInt next;
+	std::function<void()> work = [&items, &next, &func]() {
+		int i;
+		while((i = next.fetchAndAddRelaxed(1)) < items.size())
+			func(items.at(i));
+	};
+
 	QSemaphore s;
 	QThreadPool *tp = QThreadPool::globalInstance();
 
-	// Run functions in the thread pool
-	ConcurrentForEachRunnable *runnables = new ConcurrentForEachRunnable[list.size()];
-	for(int i=0;i<list.size();++i) {
+	// Start helpers in the thread pool
+	const int helperCount = qMin(list.size() - 1, qMax(1, tp->maxThreadCount()));
+	ConcurrentForEachRunnable *runnables = new ConcurrentForEachRunnable[helperCount];
+	for(int i=0;i<helperCount;++i) {
 		runnables[i].setAutoDelete(false);
-		runnables[i].value = list[i];
-		runnables[i].func = func;
+		runnables[i].work = work;
 		runnables[i].semaphore = &s;
 		tp->start(&runnables[i]);
 	}
 
-	// Wait for all functions to finish
-	s.acquire(list.size());
+	work();
+
+	// Wait for the helpers that got to run to finish
+	int started = helperCount;
+	for(int i=0;i<helperCount;++i) {
+		if(tp->tryTake(&runnables[i]))
+			--started;
+	}
+	s.acquire(started);
 	delete [] runnables;
 }
-
 }
 
 #endif
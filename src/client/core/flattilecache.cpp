@@ -0,0 +1,80 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "flattilecache.h"
+#include "layerstack.h"
+
+namespace paintcore {
+
+Tile FlatTileCache::tile(int index)
+{
+	QMutexLocker lock(&m_mutex);
+	Q_ASSERT(index>=0 && index<m_tiles.size());
+
+	if(!isDirty(index))
+		return m_tiles.at(index);
+
+	lock.unlock();
+
+	// The tile is flattened outside the lock so other threads can
+	// fetch their tiles meanwhile. If two threads happen to flatten
+	// the same tile, they both get the same result.
+	const LayerStack *layers = layerStack();
+	Tile t = layers->m_backgroundTile;
+	layers->flattenTile(t.data(), index % layers->m_xtiles, index / layers->m_xtiles);
+	t.optimize();
+
+	lock.relock();
+	m_tiles[index] = t;
+	clearDirty(index);
+
+	return t;
+}
+
+void FlatTileCache::copyFrom(FlatTileCache &other)
+{
+	QMutexLocker lock(&other.m_mutex);
+	Q_ASSERT(other.m_tiles.size() == m_tiles.size());
+
+	for(int i=0;i<m_tiles.size();++i) {
+		if(!other.isDirty(i)) {
+			m_tiles[i] = other.m_tiles.at(i);
+			clearDirty(i);
+		}
+	}
+}
+
+void FlatTileCache::canvasBackgroundChanged(const Tile&)
+{
+	markDirty();
+}
+
+void FlatTileCache::areaChanged(const QRect&)
+{
+	// Nothing to do here: changed tiles are flattened when they're needed
+}
+
+void FlatTileCache::resized(int, int, const QSize&)
+{
+	// All tiles are marked dirty on resize, so there is nothing to keep
+	const LayerStack *layers = layerStack();
+	m_tiles = QVector<Tile>(layers->m_xtiles * layers->m_ytiles);
+}
+
+}
@@ -0,0 +1,77 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_FLATTILECACHE_H
+#define PAINTCORE_FLATTILECACHE_H
+
+#include "layerstackobserver.h"
+
+#include <QVector>
+#include <QMutex>
+
+namespace paintcore {
+
+/**
+ * @brief Flattened tiles of a layer stack
+ *
+ * Each layer stack owns one of these, so the views, the color picker,
+ * the merged flood fill and the exporters don't all have to flatten
+ * the same tiles again. The cache observes its layer stack just like
+ * the views do: whenever anything under a tile changes, the tile is
+ * marked dirty and it is flattened again the next time it is needed.
+ *
+ * Tiles are flattened onto the canvas background the way the view
+ * shows them (view mode, highlighting and censoring are applied.)
+ * Views showing a transparent background flatten their tiles onto the
+ * checker pattern instead, so those don't use the cache.
+ *
+ * At most, the cache holds as much pixel data as one more layer would.
+ * Solid tiles take no space, a cloned layer stack shares the tiles it
+ * takes over, and like all tiles, the cached ones count towards the
+ * TileCache budget and may be compressed when they haven't been used
+ * in a while.
+ *
+ * Tiles can be requested from several threads at once, but not while
+ * the layer stack is being modified.
+ */
+class FlatTileCache : public LayerStackObserver
+{
+public:
+	//! Get the flattened tile at the given index, flattening it first if needed
+	Tile tile(int index);
+
+	//! Take the still valid tiles from the cache of the layer stack this one's is a copy of
+	void copyFrom(FlatTileCache &other);
+
+	//! The background is flattened into the tiles, so no checker pattern is needed here
+	void canvasBackgroundChanged(const Tile &tile) override;
+
+protected:
+	void areaChanged(const QRect &area) override;
+	void resized(int xoffset, int yoffset, const QSize &oldSize) override;
+
+private:
+	QVector<Tile> m_tiles;
+
+	// Guards the tiles and the dirty flags while the cache is being read
+	QMutex m_mutex;
+};
+
+}
+
+#endif
@@ -35,6 +35,7 @@ public:
 		source(image),
 		scratch(0, QString(), Qt::transparent, image->size()),
 		fill(0, QString(), Qt::transparent, image->size()),
+		scratchFetched(Tile::roundTiles(image->width()) * Tile::roundTiles(image->height()), false),
 		layer(sourceLayer),
 		merge(merge),
 		fillColor(color.rgba()),
@@ -46,17 +47,18 @@ public:
 	Tile &scratchTile(int x, int y)
 	{
 		Tile &t = EditableLayer(&scratch, nullptr, 0).rtile(x, y);
-		if(t.isNull()) {
+
+		// Blank source tiles stay null in the scratch layer, so whether a tile
+		// was already fetched must be tracked separately
+		bool &fetched = scratchFetched[y * Tile::roundTiles(scratch.width()) + x];
+		if(!fetched) {
+			fetched = true;
 			if(merge) {
 				t = source->getFlatTile(x, y);
 			} else {
 				const Layer *sl = source->getLayer(layer);
 				Q_ASSERT(sl);
-				const Tile &st = sl->tile(x, y);
-				if(st.isNull())
-					t = Tile(Qt::transparent);
-				else
-					t = st;
+				t = sl->tile(x, y);
 			}
 		}
 
@@ -80,7 +82,7 @@ public:
 
 		const Tile &t = scratchTile(tx, ty);
 
-		return t.constData()[y*Tile::SIZE + x];
+		return t.pixel(x, y);
 	}
 
 	void setPixel(int x, int y) {
@@ -199,6 +201,9 @@ private:
 	// The fill layer, containing just the filled pixels
 	Layer fill;
 
+	// Which scratch tiles have been fetched from the image
+	QVector<bool> scratchFetched;
+
 	// Target layer
 	int layer;
 
@@ -112,8 +112,8 @@ Layer::Layer(int id, const QString& title, const QColor& color, const QSize& siz
 	  m_xtiles(Tile::roundTiles(size.width())),
 	  m_ytiles(Tile::roundTiles(size.height()))
 {
-	m_tiles = QVector<Tile>(
-		m_xtiles * m_ytiles,
+	m_tiles = TileMap(
+		m_xtiles, m_ytiles,
 		color.alpha() > 0 ? Tile(color) : Tile()
 	);
 }
@@ -147,11 +147,28 @@ Layer::~Layer() {
 
 QImage Layer::toImage() const {
 	QImage image(m_width, m_height, QImage::Format_ARGB32_Premultiplied);
-	int i=0;
-	for(int y=0;y<m_ytiles;++y) {
-		for(int x=0;x<m_xtiles;++x,++i)
-			m_tiles[i].copyToImage(image, x*Tile::SIZE, y*Tile::SIZE);
-	}
+	if(image.isNull())
+		return image;
+
+	// Rows of tiles are copied in parallel straight into the image
+	quint32 *pixels = reinterpret_cast<quint32*>(image.bits());
+	const int stride = image.bytesPerLine() / 4;
+
+	QList<int> rows;
+	for(int ty=0;ty<m_ytiles;++ty)
+		rows << ty;
+
+	concurrentForEach<int>(rows, [this, pixels, stride](int ty) {
+		const int y = ty * Tile::SIZE;
+		const int h = m_height - y < Tile::SIZE ? m_height - y : Tile::SIZE;
+
+		for(int tx=0;tx<m_xtiles;++tx) {
+			const int x = tx * Tile::SIZE;
+			const int w = m_width - x < Tile::SIZE ? m_width - x : Tile::SIZE;
+			m_tiles.at(ty*m_xtiles + tx).copyTo(pixels + y * stride + x, stride, w, h);
+		}
+	});
+
 	return image;
 }
 
@@ -385,15 +402,13 @@ QColor Layer::getDabColor(const BrushStamp &stamp) const
 }
 
 /**
- * Free all tiles that are completely transparent
+ * Free all tiles that are completely transparent and turn
+ * uniformly colored tiles into solid tiles.
  */
 void Layer::optimize()
 {
 	// Optimize tile memory usage
-	for(int i=0;i<m_tiles.size();++i) {
-		if(!m_tiles[i].isNull() && m_tiles[i].isBlank())
-			m_tiles[i] = Tile();
-	}
+	m_tiles.optimize();
 
 	// Delete unused sublayers
 	QMutableListIterator<Layer*> li(m_sublayers);
@@ -406,6 +421,16 @@ void Layer::optimize()
 	}
 }
 
+int Layer::countUnsharedTiles(const Layer *other) const
+{
+	return m_tiles.countUnshared(other ? other->m_tiles : TileMap());
+}
+
+QVector<int> Layer::changedTiles(const Layer *other) const
+{
+	return m_tiles.changedIndices(other ? other->m_tiles : TileMap(m_xtiles, m_ytiles));
+}
+
 Layer *Layer::getSubLayer(int id, BlendMode::Mode blendmode, uchar opacity)
 {
 	Q_ASSERT(id != 0);
@@ -457,8 +482,8 @@ void Layer::toDatastream(QDataStream &out) const
 	out << m_info.hidden;
 
 	// Write layer content
-	for(const Tile &t : m_tiles)
-		out << t;
+	for(int i=0;i<m_tiles.size();++i)
+		out << m_tiles.at(i);
 
 	// Write sublayers
 	out << quint8(m_sublayers.size());
@@ -487,8 +512,11 @@ Layer *Layer::fromDatastream(QDataStream &in)
 	// Read tiles
 	Layer *layer = new Layer(id, title, Qt::transparent, QSize(lw, lh));
 
-	for(Tile &t : layer->m_tiles)
+	for(int i=0;i<layer->m_tiles.size();++i) {
+		Tile t;
 		in >> t;
+		layer->m_tiles.set(i, t);
+	}
 
 	layer->m_info.opacity = opacity;
 	layer->m_info.blend = BlendMode::Mode(blend);
@@ -526,22 +554,13 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 
 	int xtiles = Tile::roundTiles(width);
 	int ytiles = Tile::roundTiles(height);
-	QVector<Tile> tiles(xtiles * ytiles);
-
 	// if there is no old content, resizing is simple
-	bool hascontent = false;
-	for(int i=0;i<d->m_tiles.size();++i) {
-		if(!d->m_tiles.at(i).isBlank()) {
-			hascontent = true;
-			break;
-		}
-	}
-	if(!hascontent) {
+	if(!d->m_tiles.hasContent()) {
 		d->m_width = width;
 		d->m_height = height;
 		d->m_xtiles = xtiles;
 		d->m_ytiles = ytiles;
-		d->m_tiles = tiles;
+		d->m_tiles = TileMap(xtiles, ytiles);
 		return;
 	}
 
@@ -564,7 +583,7 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 		d->m_height = height;
 		d->m_xtiles = xtiles;
 		d->m_ytiles = ytiles;
-		d->m_tiles = tiles;
+		d->m_tiles = TileMap(xtiles, ytiles, bgtile);
 		if(left<0 || top<0) {
 			int cropx = 0;
 			if(left<0) {
@@ -579,8 +598,6 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 			oldcontent = oldcontent.copy(cropx, cropy, oldcontent.width()-cropx, oldcontent.height()-cropy);
 		}
 
-		d->m_tiles.fill(bgtile);
-
 		// temporarily set the hidden flag, because markDirty must not
 		// be called during a resize operation.
 		const bool hidden = d->m_info.hidden;
@@ -590,34 +607,17 @@ void EditableLayer::resize(int top, int right, int bottom, int left)
 
 	} else {
 		// top/left offset is aligned at tile boundary:
-		// existing tile content can be reused
+		// existing tile content can be reused. Only the
+		// painted tiles need to be moved.
 
 		const int firstrow = Tile::roundTiles(-top);
 		const int firstcol = Tile::roundTiles(-left);
 
-		int oldy = firstrow;
-		for(int y=0;y<ytiles;++y,++oldy) {
-			int oldx = firstcol;
-			const int oldyy = d->m_xtiles * oldy;
-			const int yy = xtiles * y;
-			for(int x=0;x<xtiles;++x,++oldx) {
-				const int i = yy + x;
-
-				if(oldy<0 || oldy>=d->m_ytiles || oldx<0 || oldx>=d->m_xtiles) {
-					tiles[i] = bgtile;
-
-				} else {
-					const int oldi = oldyy + oldx;
-					tiles[i] = d->m_tiles.at(oldi);
-				}
-			}
-		}
-
+		d->m_tiles = d->m_tiles.resized(xtiles, ytiles, firstcol, firstrow, bgtile);
 		d->m_width = width;
 		d->m_height = height;
 		d->m_xtiles = xtiles;
 		d->m_ytiles = ytiles;
-		d->m_tiles = tiles;
 	}
 }
 
@@ -734,8 +734,17 @@ void EditableLayer::putTile(int col, int row, int repeat, const Tile &tile, int
 
 	int i=row*d->m_xtiles+col;
 	const int end = qMin(i+repeat, d->m_tiles.size()-1);
+
+	if(i==0 && end==d->m_tiles.size()-1) {
+		// Special case: the whole layer is filled with the same tile
+		d->m_tiles.fill(tile);
+		if(owner && d->isVisible())
+			OBSERVERS(markDirty());
+		return;
+	}
+
 	for(;i<=end;++i) {
-		d->m_tiles[i] = tile;
+		d->m_tiles.set(i, tile);
 		if(owner && d->isVisible())
 			OBSERVERS(markDirty(i));
 	}
@@ -824,7 +833,8 @@ void EditableLayer::putBrushStamp(const BrushStamp &bs, const QColor &color, Ble
 			const int xt = x - xindex * Tile::SIZE;
 			const int wb = xt+dia-xb < Tile::SIZE ? dia-xb : Tile::SIZE-xt;
 			const int i = d->m_xtiles * yindex + xindex;
-			d->m_tiles[i].composite(
+			Tile &t = d->m_tiles[i];
+			t.composite(
 					blendmode,
 					values + yb * dia + xb,
 					color,
@@ -832,7 +842,7 @@ void EditableLayer::putBrushStamp(const BrushStamp &bs, const QColor &color, Ble
 					wb, hb,
 					dia-wb
 					);
-			d->m_tiles[i].setLastEditedBy(contextId);
+			t.setLastEditedBy(contextId);
 
 			x = (xindex+1) * Tile::SIZE;
 			xb = xb + wb;
@@ -859,20 +869,17 @@ void EditableLayer::merge(const Layer *layer)
 	Q_ASSERT(layer->m_xtiles == d->m_xtiles);
 	Q_ASSERT(layer->m_ytiles == d->m_ytiles);
 
-	// Gather a list of non-null source tiles to merge
-	QList<int> mergeidx;
-	for(int i=0;i<d->m_tiles.size();++i) {
-		if(!layer->m_tiles.at(i).isNull())
-			mergeidx.append(i);
-	}
-
-	// Detach tile vector explicitly to make sure concurrent modifications
-	// are all done to the same vector
-	d->m_tiles.detach();
+	// Gather a list of non-null source tiles to merge.
+	// The target tiles are materialized here, since the map must not be
+	// modified during the concurrent part.
+	typedef QPair<Tile*, const Tile*> MergePair;
+	QList<MergePair> merges;
+	for(int i : layer->m_tiles.nonNullIndices())
+		merges << MergePair(&d->m_tiles[i], &layer->m_tiles.at(i));
 
 	// Merge tiles
-	concurrentForEach<int>(mergeidx, [this, layer](int idx) {
-		d->m_tiles[idx].merge(layer->m_tiles.at(idx), layer->opacity(), layer->blendmode());
+	concurrentForEach<MergePair>(merges, [layer](MergePair m) {
+		m.first->merge(*m.second, layer->opacity(), layer->blendmode());
 	});
 
 	// Merging a layer does not cause an immediate visual change, so we don't
@@ -952,15 +959,27 @@ void EditableLayer::removePreviews()
 	}
 }
 
+void EditableLayer::takePreviews(Layer *layer)
+{
+	Q_ASSERT(d);
+	Q_ASSERT(layer);
+	int i=0;
+	while(i<layer->m_sublayers.size()) {
+		const Layer *sl = layer->m_sublayers.at(i);
+		if(sl->id() < 0 && !sl->isHidden())
+			d->m_sublayers.append(layer->m_sublayers.takeAt(i));
+		else
+			++i;
+	}
+}
+
 void EditableLayer::markOpaqueDirty(bool forceVisible)
 {
 	if(!owner || !(forceVisible || d->isVisible()))
 		return;
 
-	for(int i=0;i<d->m_tiles.size();++i) {
-		if(!d->m_tiles.at(i).isNull())
-			OBSERVERS(markDirty(i));
-	}
+	for(int i : d->m_tiles.nonNullIndices())
+		OBSERVERS(markDirty(i));
 }
 
 }
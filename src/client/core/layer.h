@@ -19,7 +19,7 @@
 #ifndef PAINTCORE_LAYER_H
 #define PAINTCORE_LAYER_H
 
-#include "tile.h"
+#include "tilemap.h"
 
 #include <QVector>
 #include <QColor>
@@ -183,8 +183,8 @@ public:
 	void toDatastream(QDataStream &out) const;
 	static Layer *fromDatastream(QDataStream &in);
 
-	//! Get this layer's tile vector
-	const QVector<Tile> tiles() const { return m_tiles; }
+	//! Get this layer's tiles as a dense vector
+	QVector<Tile> tiles() const { return m_tiles.toVector(); }
 
 	/**
 	 * @brief Get the layer's change bounds
@@ -206,6 +206,18 @@ public:
 	//! Optimize layer memory usage
 	void optimize();
 
+	/**
+	 * @brief Count the tiles whose pixel data is not shared with another version of this layer
+	 * @param other the other layer (if null, all tiles with pixel data are counted)
+	 */
+	int countUnsharedTiles(const Layer *other) const;
+
+	/**
+	 * @brief Get the indices of the tiles that are not the same as in another version of this layer
+	 * @param other the other layer (if null, all non-null tiles are listed)
+	 */
+	QVector<int> changedTiles(const Layer *other) const;
+
 private:
 	//! Construct a sublayer
 	Layer(int id, const QSize& size);
@@ -222,7 +234,7 @@ private:
 	LayerInfo m_info;
 	QRect m_changeBounds;
 
-	QVector<Tile> m_tiles;
+	TileMap m_tiles;
 	QList<Layer*> m_sublayers;
 
 	int m_width;
@@ -302,6 +314,9 @@ public:
 	//! Remove all preview (ephemeral) sublayers
 	void removePreviews();
 
+	//! Move the visible preview sublayers of another layer to this one
+	void takePreviews(Layer *layer);
+
 	//! Merge a layer
 	void merge(const Layer *layer);
 
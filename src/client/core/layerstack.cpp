@@ -28,6 +28,8 @@
 #include <QMimeData>
 #include <QDataStream>
 
+#include <algorithm>
+
 namespace paintcore {
 
 static const Tile CENSORED_TILE = Tile::ZebraBlock(QColor("#232629"), QColor("#eff0f1"));
@@ -39,6 +41,7 @@ LayerStack::LayerStack(QObject *parent)
 	m_onionskinsBelow(4), m_onionskinsAbove(4), m_openEditors(0), m_onionskinTint(true), m_censorLayers(false)
 {
 	m_annotations = new AnnotationModel(this);
+	m_flatTiles.attachToLayerStack(this);
 }
 
 LayerStack::LayerStack(const LayerStack *orig, QObject *parent)
@@ -61,12 +64,17 @@ LayerStack::LayerStack(const LayerStack *orig, QObject *parent)
 	m_backgroundTile = orig->m_backgroundTile;
 	for(const Layer *l : orig->m_layers)
 		m_layers << new Layer(*l);
+
+	// The copy looks exactly the same, so the flattened tiles can be shared
+	m_flatTiles.attachToLayerStack(this);
+	m_flatTiles.copyFrom(orig->m_flatTiles);
 }
 
 LayerStack::~LayerStack()
 {
-	for(LayerStackObserver *observer : m_observers)
-		observer->detachFromLayerStack();
+	// Detaching removes the observer from the list
+	while(!m_observers.isEmpty())
+		m_observers.first()->detachFromLayerStack();
 
 	for(Layer *l : m_layers)
 		delete l;
@@ -112,9 +120,9 @@ int LayerStack::indexOf(int id) const
 
 Tile LayerStack::getFlatTile(int x, int y) const
 {
-	Tile t = m_backgroundTile;
-	flattenTile(t.data(), x, y);
-	return t;
+	Q_ASSERT(x>=0 && x<m_xtiles);
+	Q_ASSERT(y>=0 && y<m_ytiles);
+	return m_flatTiles.tile(y*m_xtiles + x);
 }
 
 const Layer *LayerStack::layerAt(int x, int y) const
@@ -144,17 +152,15 @@ QColor LayerStack::colorAt(int x, int y, int dia) const
 		return QColor();
 
 	if(dia<=1) {
-		// TODO some more efficient way of doing this
-		Tile tile = getFlatTile(x/Tile::SIZE, y/Tile::SIZE);
-		quint32 c = tile.data()[(y-Tile::roundDown(y)) * Tile::SIZE + (x-Tile::roundDown(x))];
-		return QColor(c);
+		const Tile tile = getFlatTile(x/Tile::SIZE, y/Tile::SIZE);
+		return QColor(tile.pixel(x-Tile::roundDown(x), y-Tile::roundDown(y)));
 
 	} else {
 		const int r = dia/2+1;
-		const int x1 = (x-r) / Tile::SIZE;
-		const int x2 = (x+r) / Tile::SIZE;
-		const int y1 = (y-r) / Tile::SIZE;
-		const int y2 = (y+r) / Tile::SIZE;
+		const int x1 = qMax(0, (x-r) / Tile::SIZE);
+		const int x2 = qMin(m_xtiles-1, (x+r) / Tile::SIZE);
+		const int y1 = qMax(0, (y-r) / Tile::SIZE);
+		const int y2 = qMin(m_ytiles-1, (y+r) / Tile::SIZE);
 
 		Layer flat(0, QString(), Qt::transparent, size());
 		EditableLayer ef(&flat, nullptr, 0);
@@ -187,24 +193,60 @@ int LayerStack::tileLastEditedBy(int tx, int ty) const
 	return 0;
 }
 
+// Paint a new image one tile at a time, straight into its scanlines.
+// Each row of tiles is painted in its own thread.
+template<typename PaintFunc>
+static QImage paintTileRows(int width, int height, const PaintFunc &paintTile)
+{
+	QImage image(width, height, QImage::Format_ARGB32_Premultiplied);
+	if(image.isNull())
+		return image;
+
+	// Note: bits() must not be called concurrently, since it may detach the image
+	quint32 *pixels = reinterpret_cast<quint32*>(image.bits());
+	const int stride = image.bytesPerLine() / 4;
+	const int xtiles = Tile::roundTiles(width);
+
+	QList<int> rows;
+	for(int ty=0;ty<Tile::roundTiles(height);++ty)
+		rows << ty;
+
+	concurrentForEach<int>(rows, [&paintTile, pixels, stride, xtiles, width, height](int ty) {
+		const int y = ty * Tile::SIZE;
+		const int h = height - y < Tile::SIZE ? height - y : Tile::SIZE;
+
+		for(int tx=0;tx<xtiles;++tx) {
+			const int x = tx * Tile::SIZE;
+			const int w = width - x < Tile::SIZE ? width - x : Tile::SIZE;
+			paintTile(tx, ty, pixels + y * stride + x, stride, w, h);
+		}
+	});
+
+	return image;
+}
+
 QImage LayerStack::toFlatImage(bool includeAnnotations, bool includeBackground) const
 {
 	if(m_layers.isEmpty())
 		return QImage();
 
-	Layer flat(0, QString(), Qt::transparent, size());
-	EditableLayer ef(&flat, nullptr, 0);
+	QImage image;
+	if(includeBackground && isFlatTileExportable()) {
+		// The cached flat tiles are just what is needed here
+		image = paintTileRows(m_width, m_height, [this](int tx, int ty, quint32 *base, int stride, int w, int h) {
+			getFlatTile(tx, ty).copyTo(base, stride, w, h);
+		});
 
-	if(includeBackground)
-		ef.putTile(0, 0, 9999*9999, m_backgroundTile);
+	} else {
+		QList<const Layer*> layers;
+		for(const Layer *l : m_layers) {
+			if(l->isVisible() && (includeBackground || !l->isFixed()))
+				layers << l;
+		}
 
-	for(int i=0;i<m_layers.size();++i) {
-		if(m_layers.at(i)->isVisible() && (includeBackground || !m_layers.at(i)->isFixed()))
-			ef.merge(m_layers.at(i));
+		image = flattenLayers(layers, includeBackground ? m_backgroundTile : Tile());
 	}
 
-	QImage image = ef->toImage();
-
 	if(includeAnnotations) {
 		QPainter painter(&image);
 		for(const Annotation &a : m_annotations->getAnnotations())
@@ -222,17 +264,13 @@ QImage LayerStack::flatLayerImage(int layerIdx) const
 {
 	Q_ASSERT(layerIdx>=0 && layerIdx < m_layers.size());
 
-	Layer flat(0, QString(), Qt::transparent, size());
-	EditableLayer ef(&flat, nullptr, 0);
-
-	ef.putTile(0, 0, 9999*9999, m_backgroundTile);
-
+	QList<const Layer*> layers;
 	for(int i=0;i<m_layers.size();++i) {
 		if(i == layerIdx || m_layers.at(i)->isFixed())
-			ef.merge(m_layers.at(i));
+			layers << m_layers.at(i);
 	}
 
-	QImage image = ef->toImage();
+	QImage image = flattenLayers(layers, m_backgroundTile);
 	if(m_dpix > 0 && m_dpiy > 0) {
 		image.setDotsPerMeterX(int(m_dpix / 0.0254));
 		image.setDotsPerMeterY(int(m_dpiy / 0.0254));
@@ -241,6 +279,38 @@ QImage LayerStack::flatLayerImage(int layerIdx) const
 	return image;
 }
 
+// Composite the given layers onto the background straight into a new image
+QImage LayerStack::flattenLayers(const QList<const Layer*> &layers, const Tile &background) const
+{
+	return paintTileRows(m_width, m_height, [&layers, &background](int tx, int ty, quint32 *base, int stride, int w, int h) {
+		background.copyTo(base, stride, w, h);
+		for(const Layer *l : layers)
+			l->tile(tx, ty).compositeOnto(base, stride, w, h, l->opacity(), l->blendmode());
+	});
+}
+
+// Are the tiles flattened for the view identical to the ones a plain export would produce?
+bool LayerStack::isFlatTileExportable() const
+{
+	if(m_viewmode != NORMAL || m_highlightId > 0)
+		return false;
+
+	for(const Layer *l : m_layers) {
+		if(!l->isVisible())
+			continue;
+
+		if(m_censorLayers && l->isCensored())
+			return false;
+
+		for(const Layer *sl : l->sublayers()) {
+			if(sl->isVisible())
+				return false;
+		}
+	}
+
+	return true;
+}
+
 // Flatten a single tile
 void LayerStack::flattenTile(quint32 *data, int xindex, int yindex) const
 {
@@ -264,11 +334,7 @@ void LayerStack::flattenTile(quint32 *data, int xindex, int yindex) const
 
 				for(const Layer *sl : l->sublayers()) {
 					if(sl->isVisible()) {
-						const Tile &subtile = sl->tile(xindex, yindex);
-						if(!subtile.isNull()) {
-							compositePixels(sl->blendmode(), ldata, subtile.constData(),
-									Tile::LENGTH, sl->opacity());
-						}
+						sl->tile(xindex, yindex).compositeOnto(ldata, sl->opacity(), sl->blendmode());
 					}
 				}
 
@@ -287,10 +353,9 @@ void LayerStack::flattenTile(quint32 *data, int xindex, int yindex) const
 				compositePixels(l->blendmode(), data, ldata,
 						Tile::SIZE*Tile::SIZE, layerOpacity(layeridx));
 
-			} else if(!tile.isNull()) {
+			} else {
 				// No sublayers or tint, just this tile as it is
-				compositePixels(l->blendmode(), data, tile.constData(),
-						Tile::LENGTH, layerOpacity(layeridx));
+				tile.compositeOnto(data, layerOpacity(layeridx), l->blendmode());
 			}
 		}
 
@@ -444,6 +509,168 @@ void EditableLayerStack::restoreSavepoint(const Savepoint *savepoint)
 	d->m_annotations->setAnnotations(savepoint->annotations);
 }
 
+bool EditableLayerStack::restoreTiles(const Savepoint *savepoint, const QHash<int, QVector<int>> &tiles)
+{
+	if(d->m_width != savepoint->width || d->m_height != savepoint->height)
+		return false;
+
+	// Sublayer content can't be restored tile by tile
+	for(const Layer *l : savepoint->layers) {
+		if(!l->sublayers().isEmpty())
+			return false;
+	}
+
+	// Check that all the layers exist before changing anything
+	QHash<int, const Layer*> sources;
+	for(auto i=tiles.constBegin();i!=tiles.constEnd();++i) {
+		const Layer *source = nullptr;
+		for(const Layer *l : savepoint->layers) {
+			if(l->id() == i.key()) {
+				source = l;
+				break;
+			}
+		}
+		if(!source || !d->getLayer(i.key()))
+			return false;
+		sources[i.key()] = source;
+	}
+
+	for(auto i=tiles.constBegin();i!=tiles.constEnd();++i) {
+		const Layer *source = sources[i.key()];
+		EditableLayer layer = getEditableLayer(i.key());
+		for(int idx : i.value())
+			layer.putTile(idx % d->m_xtiles, idx / d->m_xtiles, 0, source->tile(idx));
+	}
+
+	return true;
+}
+
+// Would the two versions of the layer be composited the same way (given identical tiles)
+static bool sameLayerRendering(const Layer *a, const Layer *b)
+{
+	return a->id() == b->id() &&
+		a->effectiveOpacity() == b->effectiveOpacity() &&
+		a->blendmode() == b->blendmode() &&
+		a->isCensored() == b->isCensored();
+}
+
+// Find a visible indirect drawing sublayer
+static const Layer *visibleSublayer(const Layer *layer, int id)
+{
+	for(const Layer *sl : layer->sublayers()) {
+		if(sl->id() == id && sl->isVisible())
+			return sl;
+	}
+	return nullptr;
+}
+
+void EditableLayerStack::replaceContent(const LayerStack *source, int xoffset, int yoffset)
+{
+	Q_ASSERT(source);
+	Q_ASSERT(source != d);
+
+	const QSize oldsize(d->m_width, d->m_height);
+	if(d->m_width != source->m_width || d->m_height != source->m_height || xoffset || yoffset) {
+		d->m_width = source->m_width;
+		d->m_height = source->m_height;
+		d->m_xtiles = source->m_xtiles;
+		d->m_ytiles = source->m_ytiles;
+		for(auto observer : d->m_observers)
+			observer->canvasResized(xoffset, yoffset, oldsize);
+		emit d->resized(xoffset, yoffset, oldsize);
+
+	} else if(!d->m_observers.isEmpty()) {
+		bool refreshAll = source->m_layers.size() != d->m_layers.size();
+		for(int l=0;!refreshAll && l<source->m_layers.size();++l)
+			refreshAll = !sameLayerRendering(d->m_layers.at(l), source->m_layers.at(l));
+
+		if(refreshAll) {
+			for(auto observer : d->m_observers)
+				observer->markDirty();
+
+		} else {
+			// Only the stored tiles are compared: unchanged tiles share their data
+			// and unmodified layers share their whole tile maps
+			QVector<int> changed;
+
+			for(int l=0;l<source->m_layers.size();++l) {
+				const Layer *l0 = d->m_layers.at(l);
+				const Layer *l1 = source->m_layers.at(l);
+
+				changed << l0->changedTiles(l1);
+
+				// Indirect strokes in progress
+				QList<int> sublayerIds;
+				for(const Layer *sl : l0->sublayers() + l1->sublayers()) {
+					if(sl->id() > 0 && sl->isVisible() && !sublayerIds.contains(sl->id()))
+						sublayerIds << sl->id();
+				}
+
+				for(const int id : sublayerIds) {
+					const Layer *s0 = visibleSublayer(l0, id);
+					const Layer *s1 = visibleSublayer(l1, id);
+					const bool sameProps = s0 && s1 && s0->opacity() == s1->opacity() && s0->blendmode() == s1->blendmode();
+
+					if(s0)
+						changed << s0->changedTiles(sameProps ? s1 : nullptr);
+					if(s1 && !sameProps)
+						changed << s1->changedTiles(nullptr);
+				}
+			}
+
+			std::sort(changed.begin(), changed.end());
+			changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+			for(const int i : changed) {
+				for(auto observer : d->m_observers)
+					observer->markDirty(i);
+			}
+		}
+	}
+
+	// Replace layers, keeping the local previews
+	QList<Layer*> layers;
+	layers.reserve(source->m_layers.size());
+	for(const Layer *sl : source->m_layers) {
+		Layer *l = new Layer(*sl);
+		for(Layer *old : d->m_layers) {
+			if(old->id() == l->id()) {
+				EditableLayer(l, d, contextId).takePreviews(old);
+				break;
+			}
+		}
+		layers << l;
+	}
+
+	while(!d->m_layers.isEmpty())
+		delete d->m_layers.takeLast();
+	d->m_layers = layers;
+
+	setBackground(source->m_backgroundTile);
+
+	d->m_dpix = source->m_dpix;
+	d->m_dpiy = source->m_dpiy;
+
+	const QList<Annotation> annotations = source->m_annotations->getAnnotations();
+	if(annotations != d->m_annotations->getAnnotations())
+		d->m_annotations->setAnnotations(annotations);
+}
+
+int Savepoint::countUnsharedTiles(const Savepoint *newer) const
+{
+	int count = 0;
+	for(const Layer *l : layers) {
+		const Layer *other = nullptr;
+		for(const Layer *nl : newer->layers) {
+			if(nl->id() == l->id()) {
+				other = nl;
+				break;
+			}
+		}
+		count += l->countUnsharedTiles(other);
+	}
+	return count;
+}
+
 void Savepoint::toDatastream(QDataStream &out) const
 {
 	// Write size
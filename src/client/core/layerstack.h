@@ -20,12 +20,15 @@
 #define LAYERSTACK_H
 
 #include "annotationmodel.h"
+#include "flattilecache.h"
 #include "tile.h"
 
 #include <cstdint>
 
 #include <QObject>
 #include <QList>
+#include <QHash>
+#include <QVector>
 #include <QImage>
 
 class QDataStream;
@@ -48,6 +51,7 @@ class LayerStack : public QObject {
 	Q_OBJECT
 	friend class EditableLayerStack;
 	friend class LayerStackObserver;
+	friend class FlatTileCache;
 public:
 	enum ViewMode {
 		NORMAL,   // show all layers normally
@@ -120,7 +124,13 @@ public:
 	 */
 	QImage flatLayerImage(int layerIdx) const;
 
-	//! Get a merged tile
+	/**
+	 * @brief Get a merged tile
+	 *
+	 * Merged tiles are cached until something under them changes, so the
+	 * same tile can be fetched repeatedly (and from several threads at once)
+	 * without flattening it again.
+	 */
 	Tile getFlatTile(int x, int y) const;
 
 	//! Create a new savepoint
@@ -173,6 +183,8 @@ private:
 	void endWriteSequence();
 
 	void flattenTile(quint32 *data, int xindex, int yindex) const;
+	QImage flattenLayers(const QList<const Layer*> &layers, const Tile &background) const;
+	bool isFlatTileExportable() const;
 
 	bool isVisible(int idx) const;
 	int layerOpacity(int idx) const;
@@ -197,6 +209,8 @@ private:
 
 	bool m_onionskinTint;
 	bool m_censorLayers;
+
+	mutable FlatTileCache m_flatTiles;
 };
 
 /// Layer stack savepoint for undo use
@@ -209,6 +223,14 @@ public:
 	void toDatastream(QDataStream &out) const;
 	static Savepoint *fromDatastream(QDataStream &in);
 
+	/**
+	 * @brief Count the tiles in this savepoint that are not shared with a newer one
+	 *
+	 * This is an estimate of the memory this savepoint is holding on to
+	 * on its own.
+	 */
+	int countUnsharedTiles(const Savepoint *newer) const;
+
 private:
 	Savepoint() {}
 	QList<Layer*> layers;
@@ -297,6 +319,36 @@ public:
 	//! Restore layer stack to a previous savepoint
 	void restoreSavepoint(const Savepoint *savepoint);
 
+	/**
+	 * @brief Restore individual tiles from a savepoint
+	 *
+	 * This is used for incremental undo: only the tiles affected by the
+	 * undone actions are reverted, and the actions touching them replayed.
+	 *
+	 * Nothing is changed if the savepoint is not compatible with the
+	 * current layer stack (the canvas size is different, a layer is missing,
+	 * or the savepoint contains unmerged sublayers.)
+	 *
+	 * @param savepoint the savepoint to restore tiles from
+	 * @param tiles layer ID -> indices of the tiles to restore
+	 * @return false if tiles could not be restored
+	 */
+	bool restoreTiles(const Savepoint *savepoint, const QHash<int, QVector<int>> &tiles);
+
+	/**
+	 * @brief Replace the content of this layer stack with that of another one
+	 *
+	 * This is used to publish the results of commands applied to a copy
+	 * of the layer stack in another thread. Only tiles that look different
+	 * are marked as dirty. The view settings and local preview sublayers
+	 * of this layer stack are kept.
+	 *
+	 * @param source the layer stack to copy the layers, background and annotations from
+	 * @param xoffset how far the content moved horizontally if the source was resized
+	 * @param yoffset how far the content moved vertically if the source was resized
+	 */
+	void replaceContent(const LayerStack *source, int xoffset=0, int yoffset=0);
+
 	const LayerStack *layerStack() const { return d; }
 
 	const LayerStack *operator ->() const { return d; }
@@ -128,7 +128,9 @@ void LayerStackObserver::canvasBackgroundChanged(const Tile &tile)
 {
 	// Check if background tile has any transparent pixels
 	bool isTransparent = tile.isNull();
-	if(!tile.isNull()) {
+	if(tile.isSolid()) {
+		isTransparent = qAlpha(tile.solidPixel()) < 255;
+	} else if(!tile.isNull()) {
 		const quint32 *ptr = tile.constData();
 		for(int i=0;i<Tile::LENGTH;++i,++ptr) {
 			if(qAlpha(*ptr) < 255) {
@@ -145,7 +147,7 @@ void LayerStackObserver::canvasBackgroundChanged(const Tile &tile)
 		m_paintBackgroundTile.merge(tile, 255, BlendMode::MODE_NORMAL);
 
 	} else {
-		m_paintBackgroundTile = tile;
+		m_paintBackgroundTile = Tile();
 	}
 
 	markDirty();
@@ -187,10 +189,18 @@ void LayerStackObserver::paintChangedTiles(const QRect &rect, QPaintDevice *targ
 	}
 
 	if(!updates.isEmpty()) {
-		// Flatten tiles
+		// Fetch the flattened tiles. The ones not in the layer stack's cache
+		// are flattened in parallel here.
+		// With a transparent background, the layers are flattened onto the
+		// checkerboard itself, as the blending modes would otherwise have
+		// nothing to blend with. Those tiles can't come from the cache.
 		concurrentForEach<UpdateTile*>(updates, [this](UpdateTile *t) {
-			m_paintBackgroundTile.copyTo(t->data);
-			m_layerstack->flattenTile(t->data, t->x, t->y);
+			if(m_paintBackgroundTile.isNull()) {
+				m_layerstack->getFlatTile(t->x, t->y).copyTo(t->data);
+			} else {
+				m_paintBackgroundTile.copyTo(t->data);
+				m_layerstack->flattenTile(t->data, t->x, t->y);
+			}
 		});
 
 		// Paint flattened tiles
@@ -51,7 +51,7 @@ public:
 	const LayerStack *layerStack() const { return m_layerstack; }
 
 	//! Canvas background tile change
-	void canvasBackgroundChanged(const Tile &tile);
+	virtual void canvasBackgroundChanged(const Tile &tile);
 
 	//! Mark the tiles under the area dirty
 	void markDirty(const QRect &area);
@@ -97,8 +97,16 @@ protected:
 	 */
 	void paintChangedTiles(const QRect &rect, QPaintDevice *target);
 
+	//! Is the tile at the given index marked dirty
+	bool isDirty(int index) const { return m_dirtytiles.testBit(index); }
+
+	//! Clear the dirty flag of the tile at the given index
+	void clearDirty(int index) { m_dirtytiles.clearBit(index); }
+
 private:
 	LayerStack *m_layerstack;
+
+	// Transparent canvas background composited onto a checker pattern (null if the background is opaque)
 	Tile m_paintBackgroundTile;
 
 	QBitArray m_dirtytiles;
@@ -21,6 +21,8 @@
 
 #include <QRgb>
 
+#include <algorithm>
+
 namespace paintcore {
 
 // This is borrowed from Pigment of koffice libs:
@@ -498,4 +500,27 @@ void compositePixels(BlendMode::Mode mode, quint32 *base, const quint32 *over, i
 	}
 }
 
+void compositeSolid(BlendMode::Mode mode, quint32 *base, quint32 color, int len, uchar opacity)
+{
+	Q_ASSERT(len>=0);
+
+	if(mode == BlendMode::MODE_NORMAL && opacity == 255 && qAlpha(color) == 255) {
+		// Special case: an opaque color simply replaces the base pixels
+		std::fill(base, base+len, color);
+		return;
+	}
+
+	// The usual case: use the normal pixel compositing functions in chunks
+	static const int CHUNK = 256;
+	quint32 over[CHUNK];
+	std::fill(over, over+qMin(len, CHUNK), color);
+
+	while(len>0) {
+		const int n = qMin(len, CHUNK);
+		compositePixels(mode, base, over, n, opacity);
+		base += n;
+		len -= n;
+	}
+}
+
 }
@@ -49,6 +49,19 @@ void compositeMask(BlendMode::Mode mode, quint32 *base, quint32 color, const uch
  */
 void compositePixels(BlendMode::Mode mode, quint32 *base, const quint32 *over, int len, uchar opacity);
 
+/**
+ * Composite a single color over an image tile.
+ *
+ * This gives the same result as compositePixels with a buffer
+ * filled with the color.
+ * @param mode composition mode
+ * @param base pixels onto which the color is composited
+ * @param color premultiplied ARGB color value
+ * @param len number of pixels to blend
+ * @param opacity blend opacity (0..255)
+ */
+void compositeSolid(BlendMode::Mode mode, quint32 *base, quint32 color, int len, uchar opacity);
+
 /**
  * Get a weighted average of the pixel data using the mask as the weights
  *
@@ -23,23 +23,20 @@
 #include <QImage>
 #include <QPainter>
 
+#include <algorithm>
+
 namespace paintcore {
 
 Tile::Tile(const QColor& color, int lastEditedBy)
-	: m_data(new TileData)
+	: m_data(nullptr), m_color(qPremultiply(color.rgba())), m_lastEditedBy(lastEditedBy)
 {
-	quint32 *ptr = m_data->pixels;
-	quint32 col = qPremultiply(color.rgba());
-	for(int i=0;i<LENGTH;++i)
-		*(ptr++) = col;
-	m_data->lastEditedBy = lastEditedBy;
 }
 
 Tile::Tile(const QByteArray &data, int lastEditedBy)
-	: m_data(new TileData)
+	: m_data(new TileData), m_color(0), m_lastEditedBy(0)
 {
 	Q_ASSERT(data.length() == BYTES);
-	memcpy(m_data->pixels, data.constData(), BYTES);
+	memcpy(m_data->pixels(), data.constData(), BYTES);
 	m_data->lastEditedBy = lastEditedBy;
 }
 
@@ -52,7 +49,7 @@ Tile::Tile(const QByteArray &data, int lastEditedBy)
  * @param yoff source image offset
  */
 Tile::Tile(const QImage& image, int xoff, int yoff, int lastEditedBy)
-	: m_data(new TileData)
+	: m_data(new TileData), m_color(0), m_lastEditedBy(0)
 {
 	Q_ASSERT(xoff>=0 && xoff < image.width());
 	Q_ASSERT(yoff>=0 && yoff < image.height());
@@ -61,7 +58,7 @@ Tile::Tile(const QImage& image, int xoff, int yoff, int lastEditedBy)
 	const int w = xoff + SIZE > image.width() ? image.width() - xoff : SIZE;
 	const int h = yoff + SIZE > image.height() ? image.height() - yoff : SIZE;
 
-	uchar *ptr = reinterpret_cast<uchar*>(m_data->pixels);
+	uchar *ptr = reinterpret_cast<uchar*>(m_data->pixels());
 	if(w < SIZE || h < SIZE)
 		memset(ptr, 0, BYTES);
 
@@ -111,32 +108,40 @@ Tile Tile::ZebraBlock(const QColor &dark, const QColor &light, const int stripe)
 
 void Tile::copyTo(quint32 *data) const
 {
-	if(isNull())
-		memset(data, 0, BYTES);
-	else
+	if(m_data)
 		memcpy(data, constData(), BYTES);
+	else
+		std::fill(data, data+LENGTH, m_color);
 }
 
-void Tile::copyToImage(QImage& image, int x, int y) const {
-	int w = 4*(image.width()-x<SIZE ? image.width()-x : SIZE);
-	int h = image.height()-y<SIZE ? image.height()-y : SIZE;
-	uchar *targ = image.bits() + y * image.bytesPerLine() + x * 4;
+void Tile::copyTo(quint32 *base, int stride, int w, int h) const
+{
+	Q_ASSERT(w>=0 && w<=SIZE);
+	Q_ASSERT(h>=0 && h<=SIZE);
 
-	if(isNull()) {
+	if(m_data) {
+		const quint32 *ptr = constData();
 		for(int y=0;y<h;++y) {
-			memset(targ, 0, w);
-			targ += image.bytesPerLine();
+			memcpy(base, ptr, w * sizeof(quint32));
+			base += stride;
+			ptr += SIZE;
 		}
 	} else {
-		const quint32 *ptr = constData();
 		for(int y=0;y<h;++y) {
-			memcpy(targ, ptr, w);
-			targ += image.bytesPerLine();
-			ptr += SIZE;
+			std::fill(base, base+w, m_color);
+			base += stride;
 		}
 	}
 }
 
+void Tile::copyToImage(QImage& image, int x, int y) const {
+	const int w = image.width()-x<SIZE ? image.width()-x : SIZE;
+	const int h = image.height()-y<SIZE ? image.height()-y : SIZE;
+	const int stride = image.bytesPerLine() / 4;
+
+	copyTo(reinterpret_cast<quint32*>(image.bits()) + y * stride + x, stride, w, h);
+}
+
 /**
  * @param values array of alpha values
  * @param color composite color
@@ -150,6 +155,27 @@ void Tile::composite(BlendMode::Mode mode, const uchar *values, const QColor& co
 {
 	Q_ASSERT(x>=0 && x<SIZE && y>=0 && y<SIZE);
 	Q_ASSERT((x+w)<=SIZE && (y+h)<=SIZE);
+
+	if(!m_data && w==SIZE && h==SIZE) {
+		// A uniform mask covering the whole tile keeps a solid tile solid
+		const uchar value = *values;
+		const uchar *v = values;
+		bool uniform = true;
+		for(int i=0;i<SIZE && uniform;++i, v+=skip) {
+			for(int j=0;j<SIZE;++j,++v) {
+				if(*v != value) {
+					uniform = false;
+					break;
+				}
+			}
+		}
+
+		if(uniform) {
+			compositeMask(mode, &m_color, color.rgba(), &value, 1, 1, 0, 0);
+			return;
+		}
+	}
+
 	compositeMask(mode, data() + y * SIZE + x,
 			color.rgba(), values, w, h, skip, SIZE-w);
 }
@@ -179,6 +205,12 @@ std::array<quint32, 5> Tile::weightedAverage(const uchar *weights, int x, int y,
 
 		return {{weightsum, 0, 0, 0, 0}};
 
+	} else if(isSolid()) {
+		quint32 pixels[LENGTH];
+		copyTo(pixels);
+		return sampleMask(pixels + y * SIZE + x, weights,
+			w, h, skip, SIZE-w);
+
 	} else {
 		return sampleMask(constData() + y * SIZE + x, weights,
 			w, h, skip, SIZE-w);
@@ -192,19 +224,60 @@ std::array<quint32, 5> Tile::weightedAverage(const uchar *weights, int x, int y,
  */
 void Tile::merge(const Tile &tile, uchar opacity, BlendMode::Mode blend)
 {
-	if(!tile.isNull()) {
-		compositePixels(blend, data(), tile.constData(), SIZE*SIZE, opacity);
+	if(tile.isNull())
+		return;
+
+	if(tile.isSolid() && !m_data) {
+		// Solid over solid (or null) is still solid
+		compositePixels(blend, &m_color, &tile.m_color, 1, opacity);
+		m_lastEditedBy = tile.lastEditedBy();
+
+	} else {
+		tile.compositeOnto(data(), opacity, blend);
 		m_data->lastEditedBy = tile.lastEditedBy();
 	}
 }
 
+/**
+ * @param base the pixels onto which this tile is composited
+ * @param opacity opacity modifier of this tile
+ * @param mode blending mode
+ */
+void Tile::compositeOnto(quint32 *base, uchar opacity, BlendMode::Mode mode) const
+{
+	if(m_data)
+		compositePixels(mode, base, m_data->constPixels(), LENGTH, opacity);
+	else if(m_color)
+		compositeSolid(mode, base, m_color, LENGTH, opacity);
+}
+
+void Tile::compositeOnto(quint32 *base, int stride, int w, int h, uchar opacity, BlendMode::Mode mode) const
+{
+	Q_ASSERT(w>=0 && w<=SIZE);
+	Q_ASSERT(h>=0 && h<=SIZE);
+
+	if(m_data) {
+		const quint32 *ptr = m_data->constPixels();
+		for(int y=0;y<h;++y) {
+			compositePixels(mode, base, ptr, w, opacity);
+			base += stride;
+			ptr += SIZE;
+		}
+	} else if(m_color) {
+		for(int y=0;y<h;++y) {
+			compositeSolid(mode, base, m_color, w, opacity);
+			base += stride;
+		}
+	}
+}
+
 /**
  * @return true if every pixel of this tile has an alpha value of zero
  */
 bool Tile::isBlank() const
 {
-	if(isNull())
-		return true;
+	if(!m_data)
+		return m_color == 0;
 
 	const quint32 *pixel = constData();
 	const quint32 *end = pixel + LENGTH;
@@ -221,6 +294,8 @@ QColor Tile::solidColor() const
 {
 	if(isNull())
 		return Qt::transparent;
+	if(isSolid())
+		return QColor::fromRgba(qUnpremultiply(m_color));
 
 	const quint32 *pixel = constData();
 	const quint32 *end = pixel + LENGTH;
@@ -236,35 +311,71 @@ QColor Tile::solidColor() const
 
 void Tile::setLastEditedBy(int id)
 {
-	if(!m_data) {
-		m_data = new TileData;
-		memset(m_data->pixels, 0, BYTES);
-	}
-	m_data->lastEditedBy = id;
+	if(m_data)
+		m_data->lastEditedBy = id;
+	else
+		m_lastEditedBy = id;
 }
 
 quint32 *Tile::data() {
 	if(!m_data) {
 		m_data = new TileData;
-		memset(m_data->pixels, 0, BYTES);
-		m_data->lastEditedBy = 0;
+		quint32 *pixels = m_data->pixels();
+		std::fill(pixels, pixels+LENGTH, m_color);
+		m_data->lastEditedBy = m_lastEditedBy;
+		m_color = 0;
+		m_lastEditedBy = 0;
+	}
+	return m_data->pixels();
+}
+
+void Tile::optimize()
+{
+	if(!m_data)
+		return;
+
+	// Note: const access, so shared data won't be detached
+	const TileData *td = m_data.constData();
+
+	const quint32 *pixel = td->constPixels();
+	const quint32 *end = pixel + LENGTH;
+	const quint32 first = *(pixel++);
+	while(pixel<end) {
+		if(*pixel != first)
+			return;
+		++pixel;
 	}
-	return m_data->pixels;
+
+	// Blank tiles become null tiles
+	const int lastEdit = first ? td->lastEditedBy : 0;
+	m_data = nullptr;
+	m_color = first;
+	m_lastEditedBy = lastEdit;
 }
 
 bool Tile::equals(const Tile &other) const
 {
-	// Check if the tiles are both the same or both blank
-	if(*this == other || (isNull() && other.isBlank()) || (other.isNull() && isBlank()))
+	if(*this == other)
 		return true;
 
-	// If both are not blank, either being null means they can't be the same
-	if(isNull() || other.isNull())
-		return false;
+	// Neither has pixel data: compare colors (null tiles are transparent)
+	if(!m_data && !other.m_data)
+		return m_color == other.m_color;
+
+	// Only one has pixel data: check if it is all the other tile's color
+	if(!m_data || !other.m_data) {
+		const quint32 color = m_data ? other.m_color : m_color;
+		const quint32 *d = m_data ? m_data->constPixels() : other.m_data->constPixels();
+		for(int i=0;i<LENGTH;++i) {
+			if(*(d++) != color)
+				return false;
+		}
+		return true;
+	}
 
-	// Both are not null: check content
-	const quint32 *d1 = m_data->pixels;
-	const quint32 *d2 = other.m_data->pixels;
+	// Both have pixel data: check content
+	const quint32 *d1 = m_data->constPixels();
+	const quint32 *d2 = other.m_data->constPixels();
 	for(int i=0;i<LENGTH;++i) {
 		if(*(d1++) != *(d2++))
 			return false;
@@ -302,11 +413,27 @@ QDataStream &operator>>(QDataStream &ds, Tile &t)
 	return ds;
 }
 
-#ifndef NDEBUG
-QAtomicInt TileData::_count;
-TileData::TileData() { _count.fetchAndAddOrdered(1); }
-TileData::TileData(const TileData &td) : QSharedData() { memcpy(pixels, td.pixels, sizeof pixels); _count.fetchAndAddOrdered(1); }
-TileData::~TileData() { _count.fetchAndAddOrdered(-1); }
-#endif
+TileData::TileData()
+	: lastEditedBy(0), m_pixels(static_cast<quint32*>(TilePool::allocate())),
+	  m_lastUsed(TileCache::epoch()), m_prev(nullptr), m_next(nullptr)
+{
+	TileCache::add(this);
+}
+
+TileData::TileData(const TileData &td)
+	: QSharedData(), lastEditedBy(td.lastEditedBy),
+	  m_pixels(static_cast<quint32*>(TilePool::allocate())),
+	  m_lastUsed(TileCache::epoch()), m_prev(nullptr), m_next(nullptr)
+{
+	memcpy(m_pixels.load(), td.constPixels(), Tile::BYTES);
+	TileCache::add(this);
+}
+
+TileData::~TileData()
+{
+	// Must be done first: the cache may be compressing this tile right now
+	TileCache::remove(this);
+	TilePool::release(m_pixels.load());
+}
 
 }
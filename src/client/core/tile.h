@@ -20,12 +20,12 @@
 #define TILE_H
 
 #include "blendmodes.h"
+#include "tilepool.h"
+#include "tilecache.h"
 
 #include <QSharedDataPointer>
-
-#ifndef NDEBUG
-#include <QAtomicInt>
-#endif
+#include <QByteArray>
+#include <QMutex>
 
 #include <array>
 
@@ -35,27 +35,62 @@ class QDataStream;
 
 namespace paintcore {
 
-/// Shared tile data
-struct TileData : public QSharedData {
-	quint32 pixels[64*64]; // the pixel data
-	int lastEditedBy;     // ID of the user who last edited this tile
-
-#ifndef NDEBUG // Debug tool for measuring memory usage
+/**
+ * @brief Shared tile data
+ *
+ * The pixel buffer is allocated from the TilePool. The TileCache may
+ * compress it while the tile is not in use, in which case it is
+ * decompressed again on the next access.
+ */
+class TileData : public QSharedData {
+public:
 	TileData();
 	TileData(const TileData &td);
 	~TileData();
+	TileData &operator=(const TileData&) = delete;
+
+	//! Get read access to the pixel data
+	const quint32 *constPixels() const { return access(); }
+
+	//! Get read/write access to the pixel data
+	quint32 *pixels() { return access(); }
+
+	int lastEditedBy;     // ID of the user who last edited this tile
 
-	static int globalCount() { return _count.load() ; }
-	static float megabytesUsed() { return globalCount() * sizeof(pixels) / float(1024*1024); }
 private:
-	static QAtomicInt _count;
-#endif
+	friend class TileCache;
+
+	quint32 *access() const {
+		m_lastUsed.store(TileCache::epoch());
+		quint32 *p = m_pixels.loadAcquire();
+		if(Q_UNLIKELY(!p)) {
+			TileCache::decompress(this);
+			p = m_pixels.loadAcquire();
+		}
+		return p;
+	}
+
+	mutable QAtomicPointer<quint32> m_pixels; // null while compressed
+	mutable QByteArray m_compressed;
+	mutable QAtomicInt m_lastUsed;
+	mutable QBasicMutex m_mutex;
+
+	// TileCache's list of all tile data
+	TileData *m_prev;
+	TileData *m_next;
 };
 
 /**
  * @brief A piece of an image
  * Each tile is a square of size SIZE*SIZE. The pixel format is 32-bit ARGB.
  *
+ * A tile can be in one of three states:
+ *  - null: fully transparent, no pixel data
+ *  - solid: filled with a single color, no pixel data
+ *  - full: a shared TileData block
+ *
+ * A solid tile is expanded to full pixel data only when it is painted on
+ * in a way that makes it non-uniform.
  */
 class Tile {
 	public:
@@ -99,9 +134,9 @@ class Tile {
 		}
 
 		//! Construct a null tile
-		Tile() : m_data(nullptr) { }
+		Tile() : m_data(nullptr), m_color(0), m_lastEditedBy(0) { }
 
-		//! Construct a tile filled with the given color
+		//! Construct a solid tile filled with the given color (a null tile if the color is transparent)
 		explicit Tile(const QColor& color, int lastEditedBy=0);
 
 		//! Construct a tile from raw data
@@ -115,12 +150,12 @@ class Tile {
 			Q_ASSERT(x>=0 && x<SIZE);
 			Q_ASSERT(y>=0 && y<SIZE);
 			if(m_data)
-				return m_data->pixels[y * SIZE + x];
-			return 0;
+				return m_data->constPixels()[y * SIZE + x];
+			return m_color;
 		}
 
 		//! Get the ID of the user who last edited this tile
-		int lastEditedBy() const { return m_data ? m_data->lastEditedBy : 0; }
+		int lastEditedBy() const { return m_data ? m_data->lastEditedBy : m_lastEditedBy; }
 
 		//! Set the last edited by tag
 		void setLastEditedBy(int id);
@@ -134,26 +169,59 @@ class Tile {
 		//! Composite another tile with this tile
 		void merge(const Tile &tile, uchar opacity, BlendMode::Mode mode);
 
+		//! Composite this tile onto a tile sized pixel buffer
+		void compositeOnto(quint32 *base, uchar opacity, BlendMode::Mode mode) const;
+
+		/**
+		 * @brief Composite this tile onto a part of a bigger pixel buffer
+		 *
+		 * Only the top-left w*h pixels of the tile are used. This is used to
+		 * flatten layers straight into an image.
+		 *
+		 * @param base the buffer pixel under the top-left corner of the tile
+		 * @param stride buffer row length in pixels
+		 */
+		void compositeOnto(quint32 *base, int stride, int w, int h, uchar opacity, BlendMode::Mode mode) const;
+
 		//! Copy the contents of this tile onto the given spot on an image
 		void copyToImage(QImage& image, int x, int y) const;
 
-		//! Get read access to the raw pixel data (tile must not be a null tile)
-		const quint32 *constData() const { Q_ASSERT(m_data); return m_data->pixels; }
+		//! Get read access to the raw pixel data (tile must not be a null or a solid tile)
+		const quint32 *constData() const { Q_ASSERT(m_data); return m_data->constPixels(); }
 
-		//! Get read/write access to the raw pixel data
+		//! Get read/write access to the raw pixel data (expands null and solid tiles)
 		quint32 *data();
 
 		//! Copy the contents of this tile
 		void copyTo(quint32 *data) const;
 
+		//! Copy the top-left w*h pixels of this tile to a part of a bigger pixel buffer
+		void copyTo(quint32 *base, int stride, int w, int h) const;
+
 		/**
 		 * @brief is this a null tile?
 		 *
 		 * Aside from constData(), null tiles behave exactly like
 		 * blank tiles.
-		 * @return true if there is no pixel data
+		 * @return true if there is no pixel data and no solid color
+		 */
+		bool isNull() const { return !m_data && !m_color; }
+
+		//! Is this a compact solid color tile (with no pixel data)?
+		bool isSolid() const { return !m_data && m_color; }
+
+		//! Does this tile have pixel data that is not shared with the other tile?
+		bool hasUnsharedData(const Tile &other) const { return m_data && m_data != other.m_data; }
+
+		//! Get the (premultiplied) color of a solid tile
+		quint32 solidPixel() const { Q_ASSERT(!m_data); return m_color; }
+
+		/**
+		 * @brief Convert the tile to its most compact form
+		 *
+		 * Tiles with uniform pixel data are turned into solid (or null) tiles.
 		 */
-		bool isNull() const { return !m_data; }
+		void optimize();
 
 		//! Check if this tile is completely transparent
 		bool isBlank() const;
@@ -161,6 +229,8 @@ class Tile {
 		/**
 		 * @brief Is this tile filled with a single solid color?
 		 *
+		 * Unlike isSolid(), this checks the content of full tiles too.
+		 *
 		 * @return tile color or an invalid color if not solid
 		 */
 		QColor solidColor() const;
@@ -181,15 +251,22 @@ class Tile {
 		 *
 		 * This is an identity comparison. This will return false even
 		 * if the tiles have identical contents but have different data pointers.
+		 * Solid tiles are the same if their colors and last editors are.
 		 * @param other
 		 * @return true if tiles share data pointers
 		 */
-		bool operator==(const Tile &other) const { return m_data == other.m_data; }
-		bool operator!=(const Tile &other) const { return m_data != other.m_data; }
+		bool operator==(const Tile &other) const {
+			return m_data == other.m_data && m_color == other.m_color && m_lastEditedBy == other.m_lastEditedBy;
+		}
+		bool operator!=(const Tile &other) const { return !(*this == other); }
 		friend QDataStream &operator>>(QDataStream&, Tile&);
 
 	private:
 		QSharedDataPointer<TileData> m_data;
+
+		// Used only when m_data is null (and zero otherwise)
+		quint32 m_color;
+		int m_lastEditedBy;
 };
 
 QDataStream &operator<<(QDataStream&, const Tile&);
@@ -0,0 +1,201 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tilecache.h"
+#include "tile.h"
+
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QVector>
+#include <QPair>
+#include <QDebug>
+
+#include <algorithm>
+
+namespace paintcore {
+
+// A tile must go this many sweeps without being accessed before it is compressed
+static const int COLD_EPOCHS = 6;
+
+// Upper limit for compression work done in a single sweep
+static const int MAX_COMPRESS_PER_SWEEP = 256;
+
+// Compressed data must be at most this big to be worth keeping
+static const int MAX_COMPRESSED_SIZE = Tile::BYTES * 3 / 4;
+
+QAtomicInt TileCache::s_epoch;
+
+namespace {
+
+// As with the TilePool, these are safe to use during static destruction
+QBasicMutex listMutex;
+TileData *listHead = nullptr;
+
+// Held for reading by Guards and for writing by sweep()
+QReadWriteLock sweepLock;
+
+QAtomicInt budgetMb;
+QAtomicInt uncompressedCount;
+QAtomicInt compressedCount;
+QAtomicInt compressedBytes;
+
+}
+
+TileCache::Guard::Guard()
+{
+	sweepLock.lockForRead();
+}
+
+TileCache::Guard::~Guard()
+{
+	sweepLock.unlock();
+}
+
+void TileCache::setBudget(int megabytes)
+{
+	budgetMb.store(qMax(0, megabytes));
+}
+
+int TileCache::budget()
+{
+	return budgetMb.load();
+}
+
+TileCache::Stats TileCache::stats()
+{
+	return Stats {
+		compressedCount.load(),
+		compressedBytes.load()
+	};
+}
+
+void TileCache::add(TileData *td)
+{
+	QMutexLocker lock(&listMutex);
+	td->m_prev = nullptr;
+	td->m_next = listHead;
+	if(listHead)
+		listHead->m_prev = td;
+	listHead = td;
+	uncompressedCount.fetchAndAddRelaxed(1);
+}
+
+void TileCache::remove(TileData *td)
+{
+	QMutexLocker lock(&listMutex);
+	if(td->m_prev)
+		td->m_prev->m_next = td->m_next;
+	else
+		listHead = td->m_next;
+	if(td->m_next)
+		td->m_next->m_prev = td->m_prev;
+
+	if(td->m_pixels.load()) {
+		uncompressedCount.fetchAndAddRelaxed(-1);
+	} else {
+		compressedCount.fetchAndAddRelaxed(-1);
+		compressedBytes.fetchAndAddRelaxed(-td->m_compressed.length());
+	}
+}
+
+void TileCache::decompress(const TileData *td)
+{
+	QMutexLocker lock(&td->m_mutex);
+
+	// Another thread may have gotten here first
+	if(td->m_pixels.load())
+		return;
+
+	quint32 *pixels = static_cast<quint32*>(TilePool::allocate());
+	const QByteArray data = qUncompress(td->m_compressed);
+	if(data.length() == Tile::BYTES) {
+		memcpy(pixels, data.constData(), Tile::BYTES);
+	} else {
+		// Shouldn't happen
+		qWarning("Couldn't decompress tile data!");
+		memset(pixels, 0, Tile::BYTES);
+	}
+
+	compressedCount.fetchAndAddRelaxed(-1);
+	compressedBytes.fetchAndAddRelaxed(-td->m_compressed.length());
+	td->m_compressed = QByteArray();
+
+	uncompressedCount.fetchAndAddRelaxed(1);
+
+	td->m_pixels.storeRelease(pixels);
+}
+
+void TileCache::sweep()
+{
+	const int epoch = s_epoch.fetchAndAddRelaxed(1);
+
+	const int budgetTiles = budgetMb.load() * (1024 * 1024 / Tile::BYTES);
+	if(budgetTiles <= 0)
+		return;
+
+	// Tile data is being accessed in another thread: try again next time
+	if(!sweepLock.tryLockForWrite())
+		return;
+
+	struct Unlocker { ~Unlocker() { sweepLock.unlock(); } } unlocker;
+
+	QMutexLocker lock(&listMutex);
+	const int excess = qMin(uncompressedCount.load() - budgetTiles, MAX_COMPRESS_PER_SWEEP);
+	if(excess <= 0)
+		return;
+
+	// Find the least recently used tiles
+	QVector<QPair<int, TileData*>> candidates;
+	for(TileData *td = listHead; td; td = td->m_next) {
+		const int lastUsed = td->m_lastUsed.load();
+		if(epoch - lastUsed >= COLD_EPOCHS && td->m_pixels.load())
+			candidates << qMakePair(lastUsed, td);
+	}
+
+	if(candidates.size() > excess) {
+		std::partial_sort(candidates.begin(), candidates.begin() + excess, candidates.end(),
+			[](const QPair<int, TileData*> &a, const QPair<int, TileData*> &b) { return a.first < b.first; }
+		);
+		candidates.resize(excess);
+	}
+
+	// Compress them
+	for(const auto &c : candidates) {
+		TileData *td = c.second;
+		QMutexLocker tileLock(&td->m_mutex);
+
+		quint32 *pixels = td->m_pixels.load();
+		const QByteArray compressed = qCompress(reinterpret_cast<const uchar*>(pixels), Tile::BYTES, 1);
+		if(compressed.length() > MAX_COMPRESSED_SIZE) {
+			// Not worth it. Mark as used so this isn't retried for a while.
+			td->m_lastUsed.store(epoch);
+			continue;
+		}
+
+		td->m_compressed = compressed;
+		td->m_pixels.store(nullptr);
+		TilePool::release(pixels);
+
+		uncompressedCount.fetchAndAddRelaxed(-1);
+		compressedCount.fetchAndAddRelaxed(1);
+		compressedBytes.fetchAndAddRelaxed(compressed.length());
+	}
+}
+
+}
@@ -0,0 +1,98 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_TILECACHE_H
+#define PAINTCORE_TILECACHE_H
+
+#include <QAtomicInt>
+
+namespace paintcore {
+
+class TileData;
+
+/**
+ * @brief Compression of tiles that haven't been used in a while
+ *
+ * When a memory budget is set, sweep() compresses the least recently used
+ * tile data in place until the uncompressed tiles fit in the budget.
+ * Only tiles that have not been accessed for several sweeps are compressed,
+ * so whatever is being drawn on or viewed stays as it is.
+ * Compressed tiles are decompressed transparently when their pixels are
+ * accessed again.
+ *
+ * This covers all tile data, including old tile versions held by savepoints.
+ *
+ * By default, the budget is zero and nothing is compressed.
+ */
+class TileCache {
+public:
+	struct Stats {
+		int compressedTiles;
+		int compressedBytes;
+	};
+
+	/**
+	 * @brief Keeps sweep() from running while tiles are used in another thread
+	 *
+	 * Tile pixels are read without locking, so background jobs (the canvas
+	 * thread, the canvas saver) hold one of these for as long as they
+	 * access tiles. A sweep attempted meanwhile is skipped.
+	 */
+	class Guard {
+	public:
+		Guard();
+		~Guard();
+
+	private:
+		Q_DISABLE_COPY(Guard)
+	};
+
+	/**
+	 * @brief Set the budget for uncompressed tile data
+	 * @param megabytes the budget or zero to disable compression
+	 */
+	static void setBudget(int megabytes);
+	static int budget();
+
+	/**
+	 * @brief Compress cold tiles if over budget
+	 *
+	 * This should be called periodically (every few seconds) from the main
+	 * thread, at a point where it isn't accessing tile pixel data itself.
+	 * Nothing is done if another thread holds a Guard.
+	 */
+	static void sweep();
+
+	static Stats stats();
+
+	//! The current access tick (used by TileData)
+	static int epoch() { return s_epoch.load(); }
+
+private:
+	friend class TileData;
+
+	static void add(TileData *td);
+	static void remove(TileData *td);
+	static void decompress(const TileData *td);
+
+	static QAtomicInt s_epoch;
+};
+
+}
+
+#endif
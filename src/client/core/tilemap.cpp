@@ -0,0 +1,166 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tilemap.h"
+
+#include <algorithm>
+
+namespace paintcore {
+
+void TileMap::set(int index, const Tile &tile)
+{
+	Q_ASSERT(index>=0 && index<size());
+	if(tile == m_fill)
+		m_tiles.remove(index);
+	else
+		m_tiles[index] = tile;
+}
+
+QList<int> TileMap::nonNullIndices() const
+{
+	QList<int> indices;
+	if(!m_fill.isNull()) {
+		for(int i=0;i<size();++i) {
+			if(!at(i).isNull())
+				indices << i;
+		}
+
+	} else {
+		for(auto i=m_tiles.constBegin();i!=m_tiles.constEnd();++i) {
+			if(!i.value().isNull())
+				indices << i.key();
+		}
+		std::sort(indices.begin(), indices.end());
+	}
+
+	return indices;
+}
+
+bool TileMap::hasContent() const
+{
+	if(size() > m_tiles.size() && !m_fill.isBlank())
+		return true;
+
+	for(const Tile &t : m_tiles) {
+		if(!t.isBlank())
+			return true;
+	}
+	return false;
+}
+
+void TileMap::optimize()
+{
+	m_fill.optimize();
+
+	auto i = m_tiles.begin();
+	while(i != m_tiles.end()) {
+		i.value().optimize();
+		if(i.value() == m_fill)
+			i = m_tiles.erase(i);
+		else
+			++i;
+	}
+}
+
+TileMap TileMap::resized(int columns, int rows, int xoffset, int yoffset, const Tile &outside) const
+{
+	TileMap map(columns, rows, outside);
+
+	if(outside == m_fill) {
+		// Only the stored tiles need to be moved
+		for(auto i=m_tiles.constBegin();i!=m_tiles.constEnd();++i) {
+			const int x = i.key() % m_columns - xoffset;
+			const int y = i.key() / m_columns - yoffset;
+			if(x>=0 && x<columns && y>=0 && y<rows)
+				map.m_tiles.insert(y*columns+x, i.value());
+		}
+
+	} else {
+		// The old fill tile must be materialized in the overlapping region
+		const int x0 = qMax(0, -xoffset);
+		const int x1 = qMin(columns, m_columns - xoffset);
+		const int y0 = qMax(0, -yoffset);
+		const int y1 = qMin(rows, m_rows - yoffset);
+
+		for(int y=y0;y<y1;++y) {
+			for(int x=x0;x<x1;++x)
+				map.set(y*columns+x, at((y+yoffset)*m_columns + x+xoffset));
+		}
+	}
+
+	return map;
+}
+
+int TileMap::countUnshared(const TileMap &other) const
+{
+	const bool sameSize = m_columns == other.m_columns && m_rows == other.m_rows;
+
+	int count = 0;
+	for(auto i=m_tiles.constBegin();i!=m_tiles.constEnd();++i) {
+		if(!sameSize || i.value().hasUnsharedData(other.at(i.key())))
+			++count;
+	}
+
+	// The fill tile's data is shared by all positions, so it is counted just once
+	if(m_fill.hasUnsharedData(other.m_fill))
+		++count;
+
+	return count;
+}
+
+QVector<int> TileMap::changedIndices(const TileMap &other) const
+{
+	Q_ASSERT(m_columns == other.m_columns && m_rows == other.m_rows);
+
+	QVector<int> changed;
+
+	if(m_fill != other.m_fill) {
+		for(int i=0;i<size();++i) {
+			if(at(i) != other.at(i))
+				changed << i;
+		}
+		return changed;
+	}
+
+	// An unmodified copy still shares the stored tiles
+	if(m_tiles.isSharedWith(other.m_tiles))
+		return changed;
+
+	for(auto i=m_tiles.constBegin();i!=m_tiles.constEnd();++i) {
+		if(i.value() != other.at(i.key()))
+			changed << i.key();
+	}
+
+	for(auto i=other.m_tiles.constBegin();i!=other.m_tiles.constEnd();++i) {
+		if(!m_tiles.contains(i.key()) && i.value() != m_fill)
+			changed << i.key();
+	}
+
+	return changed;
+}
+
+QVector<Tile> TileMap::toVector() const
+{
+	QVector<Tile> tiles(size(), m_fill);
+	for(auto i=m_tiles.constBegin();i!=m_tiles.constEnd();++i)
+		tiles[i.key()] = i.value();
+	return tiles;
+}
+
+}
@@ -0,0 +1,150 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_TILEMAP_H
+#define PAINTCORE_TILEMAP_H
+
+#include "tile.h"
+
+#include <QHash>
+#include <QVector>
+
+namespace paintcore {
+
+/**
+ * @brief A sparse grid of tiles
+ *
+ * Only tiles that differ from the grid's fill tile are stored. Reading
+ * a position that has no stored tile returns the fill tile, while
+ * the non-const accessors insert a copy of the fill tile first.
+ *
+ * Like the QVector it replaces, the map is implicitly shared, so
+ * copying a layer (e.g. for a savepoint) is cheap. Concurrent reads
+ * through the const functions are safe.
+ */
+class TileMap {
+public:
+	typedef QHash<int, Tile>::const_iterator const_iterator;
+
+	TileMap() : m_columns(0), m_rows(0) { }
+	TileMap(int columns, int rows, const Tile &fill=Tile())
+		: m_fill(fill), m_columns(columns), m_rows(rows) { }
+
+	int columns() const { return m_columns; }
+	int rows() const { return m_rows; }
+
+	//! Total number of grid positions
+	int size() const { return m_columns * m_rows; }
+
+	//! Get the tile at the given index
+	const Tile &at(int index) const {
+		Q_ASSERT(index>=0 && index<size());
+		const auto i = m_tiles.constFind(index);
+		return i != m_tiles.constEnd() ? i.value() : m_fill;
+	}
+
+	const Tile &operator[](int index) const { return at(index); }
+
+	/**
+	 * @brief Get a modifiable reference to the tile at the given index
+	 *
+	 * If the position has no tile yet, a copy of the fill tile is stored.
+	 * The reference stays valid until the tile is removed or the map is
+	 * modified via a copy (which causes a detach).
+	 */
+	Tile &operator[](int index) {
+		Q_ASSERT(index>=0 && index<size());
+		auto i = m_tiles.find(index);
+		if(i == m_tiles.end())
+			i = m_tiles.insert(index, m_fill);
+		return i.value();
+	}
+
+	//! Set the tile at the given index. Tiles equal to the fill tile are not stored.
+	void set(int index, const Tile &tile);
+
+	//! Replace all the tiles in the grid with the given one
+	void fill(const Tile &tile) { m_tiles.clear(); m_fill = tile; }
+
+	//! The tile returned for positions that have nothing stored
+	const Tile &fillTile() const { return m_fill; }
+
+	//! Number of stored tiles
+	int storedCount() const { return m_tiles.size(); }
+
+	//! Iterate over the stored tiles. The key is the tile index.
+	const_iterator begin() const { return m_tiles.constBegin(); }
+	const_iterator end() const { return m_tiles.constEnd(); }
+
+	//! Get the indices of the non-null tiles in index order
+	QList<int> nonNullIndices() const;
+
+	//! Is there anything but blank tiles in the grid
+	bool hasContent() const;
+
+	/**
+	 * @brief Optimize all tiles and drop the ones identical to the fill tile
+	 *
+	 * See Tile::optimize()
+	 */
+	void optimize();
+
+	/**
+	 * @brief Get a resized copy of this grid
+	 *
+	 * The content is moved so that position (xoffset, yoffset) in this grid
+	 * becomes position (0, 0) in the new one. Positions outside this
+	 * grid get the outside tile.
+	 *
+	 * When the outside tile is the same as the current fill tile, only
+	 * the stored tiles need to be moved.
+	 */
+	TileMap resized(int columns, int rows, int xoffset, int yoffset, const Tile &outside) const;
+
+	/**
+	 * @brief Count the tiles whose pixel data is not shared with the other grid
+	 *
+	 * Tiles are compared position by position. This is used to estimate
+	 * how much memory an older version of the grid is holding on to.
+	 */
+	int countUnshared(const TileMap &other) const;
+
+	/**
+	 * @brief Get the positions where the tile is not the same as in the other grid
+	 *
+	 * Tiles are compared by identity (see Tile::operator==). Both grids must
+	 * be the same size. Unless the fill tiles differ, only the stored tiles
+	 * need to be looked at.
+	 */
+	QVector<int> changedIndices(const TileMap &other) const;
+
+	//! Get a dense vector of all the tiles in index order
+	QVector<Tile> toVector() const;
+
+	void detach() { m_tiles.detach(); }
+
+private:
+	QHash<int, Tile> m_tiles;
+	Tile m_fill;
+	int m_columns;
+	int m_rows;
+};
+
+}
+
+#endif
@@ -0,0 +1,134 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "tilepool.h"
+#include "tile.h"
+
+#include <QMutex>
+#include <QAtomicInt>
+
+#include <new>
+
+namespace paintcore {
+
+// Maximum number of released blocks to keep around (16 MB)
+static const int MAX_POOLED = 1024;
+
+namespace {
+
+struct FreeBlock {
+	FreeBlock *next;
+};
+
+// These are all constant-initialized and have trivial destructors, so
+// tiles can still be safely released during static destruction.
+QBasicMutex freeListMutex;
+FreeBlock *freeList = nullptr;
+QAtomicInt liveCount;
+QAtomicInt pooledCount;
+QAtomicInt peakCount;
+
+float toMegabytes(int tiles)
+{
+	return tiles * float(Tile::BYTES) / (1024 * 1024);
+}
+
+}
+
+void *TilePool::allocate()
+{
+	void *ptr = nullptr;
+	{
+		QMutexLocker lock(&freeListMutex);
+		if(freeList) {
+			ptr = freeList;
+			freeList = freeList->next;
+			pooledCount.fetchAndAddRelaxed(-1);
+		}
+	}
+
+	if(!ptr)
+		ptr = ::operator new(Tile::BYTES);
+
+	const int live = liveCount.fetchAndAddRelaxed(1) + 1;
+	int peak = peakCount.load();
+	while(live > peak && !peakCount.testAndSetRelaxed(peak, live))
+		peak = peakCount.load();
+
+	return ptr;
+}
+
+void TilePool::release(void *ptr)
+{
+	if(!ptr)
+		return;
+
+	liveCount.fetchAndAddRelaxed(-1);
+
+	{
+		QMutexLocker lock(&freeListMutex);
+		if(pooledCount.load() < MAX_POOLED) {
+			FreeBlock *block = static_cast<FreeBlock*>(ptr);
+			block->next = freeList;
+			freeList = block;
+			pooledCount.fetchAndAddRelaxed(1);
+			return;
+		}
+	}
+
+	::operator delete(ptr);
+}
+
+TilePool::Stats TilePool::stats()
+{
+	return Stats {
+		liveCount.load(),
+		pooledCount.load(),
+		peakCount.load()
+	};
+}
+
+void TilePool::trim()
+{
+	FreeBlock *blocks;
+	{
+		QMutexLocker lock(&freeListMutex);
+		blocks = freeList;
+		freeList = nullptr;
+		pooledCount.store(0);
+	}
+
+	while(blocks) {
+		FreeBlock *next = blocks->next;
+		::operator delete(blocks);
+		blocks = next;
+	}
+}
+
+float TilePool::Stats::megabytes() const
+{
+	return toMegabytes(liveTiles + pooledTiles);
+}
+
+float TilePool::Stats::peakMegabytes() const
+{
+	return toMegabytes(peakTiles);
+}
+
+}
@@ -0,0 +1,64 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef PAINTCORE_TILEPOOL_H
+#define PAINTCORE_TILEPOOL_H
+
+namespace paintcore {
+
+/**
+ * @brief Memory pool for tile pixel data
+ *
+ * The pixel buffers of all TileData are allocated from here. Released
+ * blocks are kept on a free list (up to a limit) and handed out again on
+ * the next allocation, so the copy-on-write detaches of busy drawing don't
+ * have to go through the general purpose allocator every time.
+ *
+ * The functions are thread safe. The usage counters are always
+ * enabled and can be read at any time.
+ */
+class TilePool {
+public:
+	struct Stats {
+		int liveTiles;   // blocks in use
+		int pooledTiles; // released blocks kept for reuse
+		int peakTiles;   // highest number of blocks in use at once
+
+		//! Memory reserved for live and pooled tiles in megabytes
+		float megabytes() const;
+
+		//! Memory used by the peak number of tiles in megabytes
+		float peakMegabytes() const;
+	};
+
+	//! Allocate a block for Tile::BYTES of pixel data
+	static void *allocate();
+
+	//! Return a block to the pool
+	static void release(void *ptr);
+
+	//! Get the current usage counters
+	static Stats stats();
+
+	//! Free all pooled blocks (done when a canvas is closed or a session is left)
+	static void trim();
+};
+
+}
+
+#endif
@@ -32,6 +32,7 @@
 #include "canvas/canvassaverrunnable.h"
 #include "canvas/loader.h"
 #include "tools/toolcontroller.h"
+#include "core/tilepool.h"
 #include "utils/settings.h"
 #include "utils/images.h"
 
@@ -108,6 +109,10 @@ Document::~Document()
 void Document::initCanvas()
 {
 	delete m_canvas;
+
+	// The old canvas's tiles went to the pool: return the memory
+	paintcore::TilePool::trim();
+
 	m_canvas = new canvas::CanvasModel(m_client->myId(), this);
 
 	m_toolctrl->setModel(m_canvas);
@@ -118,6 +123,7 @@ void Document::initCanvas()
 	connect(m_canvas->layerlist(), &canvas::LayerListModel::layerCommand, m_client, &net::Client::sendMessage);
 	connect(m_canvas, &canvas::CanvasModel::titleChanged, this, &Document::sessionTitleChanged);
 	connect(qApp, SIGNAL(settingsChanged()), m_canvas, SLOT(updateLayerViewOptions()));
+	connect(qApp, SIGNAL(settingsChanged()), m_canvas, SLOT(updateHistoryOptions()));
 
 	connect(m_canvas->stateTracker(), &canvas::StateTracker::catchupProgress, this, &Document::catchupProgress);
 
@@ -196,6 +202,10 @@ void Document::onServerDisconnect()
 		m_canvas->disconnectedFromServer();
 		m_canvas->setTitle(QString());
 	}
+
+	// Free the tiles pooled while the session history was being replayed
+	paintcore::TilePool::trim();
+
 	m_banlist->clear();
 	m_announcementlist->clear();
 	setSessionOpword(false);
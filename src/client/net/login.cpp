@@ -25,6 +25,7 @@
 
 #include "../shared/net/protover.h"
 #include "../shared/net/control.h"
+#include "../shared/net/messagequeue.h"
 #include "../shared/util/networkaccess.h"
 
 #include <QDebug>
@@ -75,6 +76,7 @@ LoginHandler::LoginHandler(Mode mode, const QUrl &url, QObject *parent)
 	  m_needUserPassword(false),
 	  m_supportsCustomAvatars(false),
 	  m_supportsExtAuthAvatars(false),
+	  m_canCompress(false),
 	  m_isGuest(true)
 {
 	m_sessions = new LoginSessionModel(this);
@@ -180,6 +182,7 @@ void LoginHandler::expectHello(const protocol::ServerReply &msg)
 	m_needUserPassword = false;
 	m_canPersist = false;
 	m_canReport = false;
+	m_canCompress = false;
 
 	for(const QJsonValue &flag : flags) {
 		if(flag == "MULTI") {
@@ -196,6 +199,8 @@ void LoginHandler::expectHello(const protocol::ServerReply &msg)
 			m_canReport = true;
 		} else if(flag == "AVATAR") {
 			m_supportsCustomAvatars = true;
+		} else if(flag == "COMPRESS") {
+			m_canCompress = true;
 		} else {
 			qWarning() << "Unknown server capability:" << flag;
 		}
@@ -303,6 +308,12 @@ void LoginHandler::sendIdentity()
 		m_avatar = QByteArray();
 	}
 
+	if(m_canCompress) {
+		cmd.kwargs["compress"] = true;
+		// The server's compressed output may arrive right behind its login reply
+		m_server->m_msgqueue->setAcceptCompressed(true);
+	}
+
 	m_state = EXPECT_IDENTIFIED;
 	send(cmd);
 }
@@ -550,6 +561,11 @@ void LoginHandler::expectLoginOk(const protocol::ServerReply &msg)
 		m_userid = uint8_t(userid);
 		m_server->loginSuccess();
 
+		// Both sides start compressing only after the login, so the
+		// passwords sent during it never share a compression context
+		if(m_canCompress)
+			m_server->m_msgqueue->setCompression(true);
+
 		// If in host mode, send initial session settings
 		if(m_mode==HOST) {
 			protocol::ServerCommand conf;
@@ -406,6 +406,7 @@ private:
 	bool m_needUserPassword;
 	bool m_supportsCustomAvatars;
 	bool m_supportsExtAuthAvatars;
+	bool m_canCompress;
 
 	// User flags
 	QStringList m_userFlags;
@@ -0,0 +1,196 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "networkworker.h"
+
+#include "../shared/net/messagequeue.h"
+#include "../shared/net/control.h"
+
+#include <QDebug>
+#include <QSslSocket>
+
+namespace net {
+
+// Stop reading from the socket if the GUI thread has this many messages waiting
+static const int MAX_INBOX = 1024;
+
+NetworkWorker::NetworkWorker(QSslSocket *socket, protocol::MessageQueue *msgqueue)
+	: QObject(), m_socket(socket), m_msgqueue(msgqueue),
+	  m_outboxBytes(0), m_queuedBytes(0),
+	  m_flushPending(false), m_disconnect(false), m_abort(false),
+	  m_readPaused(false)
+{
+	Q_ASSERT(!socket->parent());
+	Q_ASSERT(!msgqueue->parent());
+
+	m_socket->setParent(this);
+	m_msgqueue->setParent(this);
+
+	m_queuedBytes = m_msgqueue->uploadQueueBytes();
+
+	connect(m_socket, QOverload<QAbstractSocket::SocketError>::of(&QSslSocket::error), this, &NetworkWorker::onSocketError);
+	connect(m_msgqueue, &protocol::MessageQueue::messageAvailable, this, &NetworkWorker::receiveMessages);
+	connect(m_msgqueue, &protocol::MessageQueue::bytesSent, this, &NetworkWorker::updateUploadQueue);
+
+	// Messages that arrived before the move are picked up once the thread starts
+	if(m_msgqueue->isPending())
+		QMetaObject::invokeMethod(this, "receiveMessages", Qt::QueuedConnection);
+}
+
+void NetworkWorker::send(const protocol::MessageList &msgs)
+{
+	QMutexLocker lock(&m_mutex);
+	for(const protocol::MessagePtr &msg : msgs)
+		m_outboxBytes += msg->length();
+	m_outbox << msgs;
+	scheduleFlush();
+}
+
+void NetworkWorker::sendDisconnect()
+{
+	QMutexLocker lock(&m_mutex);
+	m_disconnect = true;
+	scheduleFlush();
+}
+
+void NetworkWorker::abort()
+{
+	QMutexLocker lock(&m_mutex);
+	m_abort = true;
+	scheduleFlush();
+}
+
+protocol::MessageList NetworkWorker::takeReceived()
+{
+	protocol::MessageList msgs;
+
+	QMutexLocker lock(&m_mutex);
+	msgs.swap(m_inbox);
+
+	// Let the network thread resume reading if it had to stop
+	if(msgs.size() >= MAX_INBOX)
+		scheduleFlush();
+
+	return msgs;
+}
+
+int NetworkWorker::uploadQueueBytes() const
+{
+	QMutexLocker lock(&m_mutex);
+	return m_outboxBytes + m_queuedBytes;
+}
+
+void NetworkWorker::scheduleFlush()
+{
+	// Caller must hold the mutex
+	if(!m_flushPending) {
+		m_flushPending = true;
+		QMetaObject::invokeMethod(this, "flush", Qt::QueuedConnection);
+	}
+}
+
+void NetworkWorker::flush()
+{
+	protocol::MessageList outbox;
+	bool disconnect, abort, inboxFull;
+	{
+		QMutexLocker lock(&m_mutex);
+		outbox.swap(m_outbox);
+		disconnect = m_disconnect;
+		abort = m_abort;
+		inboxFull = m_inbox.size() >= MAX_INBOX;
+		m_disconnect = false;
+		m_flushPending = false;
+	}
+
+	if(abort) {
+		m_socket->abort();
+		return;
+	}
+
+	if(!outbox.isEmpty()) {
+		int bytes = 0;
+		for(const protocol::MessagePtr &msg : outbox)
+			bytes += msg->length();
+
+		m_msgqueue->send(outbox);
+
+		QMutexLocker lock(&m_mutex);
+		m_outboxBytes -= bytes;
+		m_queuedBytes = m_msgqueue->uploadQueueBytes();
+	}
+
+	if(disconnect)
+		m_msgqueue->sendDisconnect(protocol::Disconnect::SHUTDOWN, QString());
+
+	if(m_readPaused && !inboxFull) {
+		m_readPaused = false;
+		m_msgqueue->setReadPaused(false);
+	}
+}
+
+void NetworkWorker::receiveMessages()
+{
+	if(!m_msgqueue->isPending())
+		return;
+
+	protocol::MessageList received;
+	while(m_msgqueue->isPending()) {
+		received << m_msgqueue->getPending();
+	}
+
+	bool wasEmpty;
+	{
+		QMutexLocker lock(&m_mutex);
+		wasEmpty = m_inbox.isEmpty();
+		m_inbox << received;
+
+		if(m_inbox.size() >= MAX_INBOX && !m_readPaused) {
+			m_readPaused = true;
+			m_msgqueue->setReadPaused(true);
+		}
+	}
+
+	// If the inbox wasn't empty, the GUI thread hasn't yet reacted to the previous signal
+	if(wasEmpty)
+		emit messageAvailable();
+}
+
+void NetworkWorker::updateUploadQueue()
+{
+	const int queued = m_msgqueue->uploadQueueBytes();
+	QMutexLocker lock(&m_mutex);
+	m_queuedBytes = queued;
+}
+
+void NetworkWorker::onSocketError(QAbstractSocket::SocketError error)
+{
+	qWarning() << "Socket error:" << m_socket->errorString();
+
+	if(error == QAbstractSocket::RemoteHostClosedError)
+		return;
+
+	const bool connected = m_socket->state() != QAbstractSocket::UnconnectedState;
+	emit socketError(m_socket->errorString(), connected);
+
+	if(connected)
+		m_socket->disconnectFromHost();
+}
+
+}
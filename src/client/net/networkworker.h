@@ -0,0 +1,101 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_NET_NETWORKWORKER_H
+#define DP_NET_NETWORKWORKER_H
+
+#include "../shared/net/message.h"
+
+#include <QObject>
+#include <QMutex>
+#include <QAbstractSocket>
+
+class QSslSocket;
+
+namespace protocol {
+	class MessageQueue;
+}
+
+namespace net {
+
+/**
+ * @brief The part of a TcpServer connection that runs in the network thread
+ *
+ * Once logged in, the TcpServer moves its socket and message queue to a
+ * thread of their own. Incoming messages are decoded there, so the GUI thread
+ * only needs to apply them. (Image payloads are decompressed later by the
+ * StateTracker, a bounded number of messages ahead of the one being applied.)
+ *
+ * The public functions are safe to call from the GUI thread.
+ */
+class NetworkWorker : public QObject
+{
+	Q_OBJECT
+public:
+	//! Construct a worker that takes over the (parentless) socket and message queue
+	NetworkWorker(QSslSocket *socket, protocol::MessageQueue *msgqueue);
+
+	void send(const protocol::MessageList &msgs);
+
+	//! Send a disconnect notification after the queued messages
+	void sendDisconnect();
+
+	//! Close the connection immediately
+	void abort();
+
+	//! Get the messages received so far
+	protocol::MessageList takeReceived();
+
+	//! Number of bytes not yet sent (including those still on their way to the network thread)
+	int uploadQueueBytes() const;
+
+signals:
+	//! New messages can be taken with takeReceived()
+	void messageAvailable();
+
+	//! A socket error occurred. If still connected, the socket is being closed
+	void socketError(const QString &errorString, bool connected);
+
+private slots:
+	void flush();
+	void receiveMessages();
+	void updateUploadQueue();
+	void onSocketError(QAbstractSocket::SocketError error);
+
+private:
+	void scheduleFlush();
+
+	QSslSocket *m_socket;
+	protocol::MessageQueue *m_msgqueue;
+
+	// These are shared with the GUI thread
+	mutable QMutex m_mutex;
+	protocol::MessageList m_outbox;
+	protocol::MessageList m_inbox;
+	int m_outboxBytes;
+	int m_queuedBytes;
+	bool m_flushPending;
+	bool m_disconnect;
+	bool m_abort;
+
+	bool m_readPaused;
+};
+
+}
+
+#endif
@@ -20,6 +20,7 @@
 #include "config.h"
 #include "tcpserver.h"
 #include "login.h"
+#include "networkworker.h"
 
 #include "../shared/net/messagequeue.h"
 #include "../shared/net/control.h"
@@ -28,11 +29,13 @@
 #include <QSslSocket>
 #include <QSslConfiguration>
 #include <QSettings>
+#include <QThread>
 
 namespace net {
 
 TcpServer::TcpServer(QObject *parent) :
-	Server(false, parent), m_loginstate(nullptr), m_securityLevel(NO_SECURITY),
+	Server(false, parent), m_networkThread(nullptr), m_worker(nullptr),
+	m_loginstate(nullptr), m_securityLevel(NO_SECURITY),
 	m_localDisconnect(false), m_supportsPersistence(false)
 {
 	m_socket = new QSslSocket(this);
@@ -61,6 +64,16 @@ TcpServer::TcpServer(QObject *parent) :
 	connect(m_msgqueue, &protocol::MessageQueue::pingPong, this, &TcpServer::lagMeasured);
 }
 
+TcpServer::~TcpServer()
+{
+	if(m_networkThread) {
+		// The worker (along with the socket) is deleted when the thread finishes
+		m_worker->deleteLater();
+		m_networkThread->quit();
+		m_networkThread->wait();
+	}
+}
+
 void TcpServer::login(LoginHandler *login)
 {
 	m_url = login->url();
@@ -73,22 +86,33 @@ void TcpServer::login(LoginHandler *login)
 void TcpServer::logout()
 {
 	m_localDisconnect = true;
-	m_msgqueue->sendDisconnect(protocol::Disconnect::SHUTDOWN, QString());
+	if(m_worker)
+		m_worker->sendDisconnect();
+	else
+		m_msgqueue->sendDisconnect(protocol::Disconnect::SHUTDOWN, QString());
 }
 
 int TcpServer::uploadQueueBytes() const
 {
+	if(m_worker)
+		return m_worker->uploadQueueBytes();
 	return m_msgqueue->uploadQueueBytes();
 }
 
 void TcpServer::sendMessage(const protocol::MessagePtr &msg)
 {
-	m_msgqueue->send(msg);
+	if(m_worker)
+		m_worker->send(protocol::MessageList() << msg);
+	else
+		m_msgqueue->send(msg);
 }
 
 void TcpServer::sendMessages(const protocol::MessageList &msgs)
 {
-	m_msgqueue->send(msgs);
+	if(m_worker)
+		m_worker->send(msgs);
+	else
+		m_msgqueue->send(msgs);
 }
 
 void TcpServer::handleMessage()
@@ -100,6 +124,17 @@ void TcpServer::handleMessage()
 		else
 			emit messageReceived(msg);
 	}
+
+	// The login sequence is done: the rest happens in the network thread
+	if(!m_loginstate && !m_worker)
+		startNetworkThread();
+}
+
+void TcpServer::handleReceivedMessages()
+{
+	const protocol::MessageList msgs = m_worker->takeReceived();
+	for(const protocol::MessagePtr &msg : msgs)
+		emit messageReceived(msg);
 }
 
 void TcpServer::handleBadData(int len, int type, int contextId)
@@ -108,7 +143,10 @@ void TcpServer::handleBadData(int len, int type, int contextId)
 	if(type < 64 || contextId == 0) {
 		// If message type is Transparent, the bad data came from the server. Something is wrong for sure.
 		m_error = tr("Received invalid data");
-		m_socket->abort();
+		if(m_worker)
+			m_worker->abort();
+		else
+			m_socket->abort();
 	} else {
 		// Opaque messages are merely passed along by the server.
 		// TODO autokick misbehaving clients?
@@ -117,6 +155,10 @@ void TcpServer::handleBadData(int len, int type, int contextId)
 
 void TcpServer::handleDisconnect()
 {
+	// Don't lose any messages received just before the disconnect
+	if(m_worker)
+		handleReceivedMessages();
+
 	emit serverDisconnected(m_error, m_errorcode, m_localDisconnect);
 }
 
@@ -135,6 +177,15 @@ void TcpServer::handleSocketError()
 		handleDisconnect();
 }
 
+void TcpServer::handleNetworkError(const QString &errorString, bool connected)
+{
+	// The worker has already started closing the socket if it was still connected
+	if(m_error.isEmpty())
+		m_error = errorString;
+	if(!connected)
+		handleDisconnect();
+}
+
 void TcpServer::loginFailure(const QString &message, const QString &errorcode)
 {
 	qWarning() << "Login failed:" << message;
@@ -163,8 +214,32 @@ void TcpServer::loginSuccess()
 	m_loginstate = nullptr;
 }
 
+void TcpServer::startNetworkThread()
+{
+	// The login sequence stays in the GUI thread, since the user may need
+	// to be asked about the server's certificate while the handshake is paused.
+	m_peerCertificate = m_socket->peerCertificate();
+
+	disconnect(m_msgqueue, &protocol::MessageQueue::messageAvailable, this, &TcpServer::handleMessage);
+	disconnect(m_socket, QOverload<QAbstractSocket::SocketError>::of(&QTcpSocket::error), this, &TcpServer::handleSocketError);
+
+	m_socket->setParent(nullptr);
+	m_msgqueue->setParent(nullptr);
+	m_worker = new NetworkWorker(m_socket, m_msgqueue);
+
+	connect(m_worker, &NetworkWorker::messageAvailable, this, &TcpServer::handleReceivedMessages);
+	connect(m_worker, &NetworkWorker::socketError, this, &TcpServer::handleNetworkError);
+
+	m_networkThread = new QThread(this);
+	m_networkThread->setObjectName("network");
+	m_worker->moveToThread(m_networkThread);
+	m_networkThread->start();
+}
+
 QSslCertificate TcpServer::hostCertificate() const
 {
+	if(m_worker)
+		return m_peerCertificate;
 	return m_socket->peerCertificate();
 }
 
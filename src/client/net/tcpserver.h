@@ -22,8 +22,10 @@
 #include "server.h"
 
 #include <QUrl>
+#include <QSslCertificate>
 
 class QSslSocket;
+class QThread;
 
 namespace protocol {
     class MessageQueue;
@@ -32,13 +34,21 @@ namespace protocol {
 namespace net {
 
 class LoginHandler;
-
+class NetworkWorker;
+
+/**
+ * @brief A connection to a remote server
+ *
+ * The login sequence runs in the GUI thread. After that, the socket
+ * is moved to a network thread (see NetworkWorker.)
+ */
 class TcpServer : public Server
 {
 	Q_OBJECT
 	friend class LoginHandler;
 public:
 	explicit TcpServer(QObject *parent=nullptr);
+	~TcpServer();
 
 	void login(LoginHandler *login);
 	void logout() override;
@@ -76,14 +86,21 @@ protected:
 
 private slots:
 	void handleMessage();
+	void handleReceivedMessages();
 	void handleBadData(int len, int type, int contextId);
 	void handleDisconnect();
 	void handleSocketError();
+	void handleNetworkError(const QString &errorString, bool connected);
 
 private:
+	void startNetworkThread();
+
 	QUrl m_url;
 	QSslSocket *m_socket;
 	protocol::MessageQueue *m_msgqueue;
+	QThread *m_networkThread;
+	NetworkWorker *m_worker;
+	QSslCertificate m_peerCertificate;
 	LoginHandler *m_loginstate;
 	QString m_error, m_errorcode;
 	Security m_securityLevel;
@@ -0,0 +1,110 @@
+#include "../core/layerstack.h"
+#include "../core/layer.h"
+#include "../core/tile.h"
+
+#include <QtTest/QtTest>
+
+using namespace paintcore;
+
+class TestFlatTileCache : public QObject
+{
+	Q_OBJECT
+private slots:
+	void init()
+	{
+		m_stack = new LayerStack;
+
+		// A patterned layer, so each flattened tile is a full tile of its own
+		Tile pattern;
+		Tile::fillChecker(pattern.data(), Qt::gray, Qt::white);
+
+		auto editor = m_stack->editor(0);
+		editor.resize(0, Tile::SIZE*2, Tile::SIZE*2, 0);
+		editor.createLayer(1, 0, Qt::transparent, false, false, "Layer").putTile(0, 0, 3, pattern);
+	}
+
+	void cleanup()
+	{
+		delete m_stack;
+	}
+
+	void testCached()
+	{
+		const QVector<Tile> before = flatTiles();
+		QCOMPARE(flatTiles(), before);
+	}
+
+	void testEdit()
+	{
+		const QVector<Tile> before = flatTiles();
+
+		m_stack->editor(0).getEditableLayer(1).fillRect(QRect(0, Tile::SIZE, 10, 10), Qt::red, BlendMode::MODE_NORMAL);
+
+		const QVector<Tile> after = flatTiles();
+		QCOMPARE(after.at(0), before.at(0));
+		QCOMPARE(after.at(1), before.at(1));
+		QVERIFY(after.at(2) != before.at(2));
+		QCOMPARE(after.at(3), before.at(3));
+	}
+
+	void testViewOptions()
+	{
+		QVector<Tile> before = flatTiles();
+		m_stack->editor(0).setViewMode(LayerStack::SOLO);
+		verifyAllChanged(before);
+
+		before = flatTiles();
+		m_stack->editor(0).setInspectorHighlight(1);
+		verifyAllChanged(before);
+
+		before = flatTiles();
+		m_stack->editor(0).setCensorship(true);
+		verifyAllChanged(before);
+	}
+
+	void testBackground()
+	{
+		const QVector<Tile> before = flatTiles();
+		m_stack->editor(0).setBackground(Tile(QColor(Qt::white)));
+		verifyAllChanged(before);
+	}
+
+	void testResize()
+	{
+		const QVector<Tile> before = flatTiles();
+		m_stack->editor(0).resize(0, Tile::SIZE, 0, 0);
+
+		const QVector<Tile> after = flatTiles();
+		QCOMPARE(after.size(), 6);
+		QVERIFY(after.at(0) != before.at(0));
+		QVERIFY(after.at(1) != before.at(1));
+		QVERIFY(after.at(3) != before.at(2));
+		QVERIFY(after.at(4) != before.at(3));
+	}
+
+private:
+	QVector<Tile> flatTiles() const
+	{
+		QVector<Tile> tiles;
+		const int xt = Tile::roundTiles(m_stack->width());
+		const int yt = Tile::roundTiles(m_stack->height());
+		for(int y=0;y<yt;++y)
+			for(int x=0;x<xt;++x)
+				tiles << m_stack->getFlatTile(x, y);
+		return tiles;
+	}
+
+	void verifyAllChanged(const QVector<Tile> &before)
+	{
+		const QVector<Tile> after = flatTiles();
+		QCOMPARE(after.size(), before.size());
+		for(int i=0;i<after.size();++i)
+			QVERIFY(after.at(i) != before.at(i));
+	}
+
+	LayerStack *m_stack;
+};
+
+
+QTEST_MAIN(TestFlatTileCache)
+#include "flattilecache.moc"
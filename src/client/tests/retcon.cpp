@@ -39,6 +39,28 @@ private slots:
 			<< AffectedArea(AffectedArea::PIXELS, 1, QRect(100,1,10,10))
 			<< false;
 
+		// Pixel changes made of several pieces are concurrent when they don't touch the same tiles
+		QTest::newRow("diagonal-strokes")
+			<< AffectedArea(1, { QRect(0,0,10,10), QRect(200,200,10,10) })
+			<< AffectedArea(1, { QRect(200,0,10,10), QRect(0,200,10,10) })
+			<< true;
+		QTest::newRow("diagonal-strokes2")
+			<< AffectedArea(1, { QRect(0,0,10,10), QRect(200,200,10,10) })
+			<< AffectedArea(1, { QRect(200,0,10,10), QRect(50,50,10,10) })
+			<< false;
+		QTest::newRow("stroke-and-rect")
+			<< AffectedArea(1, { QRect(0,0,10,10), QRect(200,200,10,10) })
+			<< AffectedArea(AffectedArea::PIXELS, 1, QRect(100,100,20,20))
+			<< true;
+		QTest::newRow("stroke-and-rect2")
+			<< AffectedArea(1, { QRect(0,0,10,10), QRect(200,200,10,10) })
+			<< AffectedArea(AffectedArea::PIXELS, 1, QRect(20,20,10,10))
+			<< false;
+		QTest::newRow("negative-coordinates")
+			<< AffectedArea(1, { QRect(-10,-10,5,5), QRect(200,200,10,10) })
+			<< AffectedArea(1, { QRect(-70,100,5,5), QRect(100,-70,10,10) })
+			<< true;
+
 		// Pixels changes on different layers are always concurrent
 		QTest::newRow("different-layer")
 			<< AffectedArea(AffectedArea::PIXELS, 1, QRect(1,1,110,10))
@@ -0,0 +1,266 @@
+#include "../canvas/statetracker.h"
+#include "../canvas/layerlist.h"
+#include "../core/layerstack.h"
+#include "../core/layer.h"
+#include "../../shared/net/layer.h"
+#include "../../shared/net/image.h"
+#include "../../shared/net/brushes.h"
+#include "../../shared/net/undo.h"
+
+#include <QtTest/QtTest>
+
+using namespace protocol;
+using namespace canvas;
+
+static const uint32_t RED = 0xffff0000;
+static const uint32_t GREEN = 0xff00ff00;
+static const uint32_t BLUE = 0xff0000ff;
+
+static const uint16_t LAYER = 0x0201;
+static const uint16_t LAYER2 = 0x0202;
+static const uint16_t EXTRA_LAYER = 0x0901;
+
+// Commands applied before and after the savepoint an undo reverts to
+struct UndoScenario {
+	MessageList beforeSavepoint;
+	MessageList afterSavepoint;
+};
+
+static MessageList canvasSetup()
+{
+	return MessageList()
+		<< MessagePtr(new CanvasResize(2, 0, 256, 128, 0))
+		<< MessagePtr(new LayerCreate(2, LAYER, 0, 0, 0, "Layer"));
+}
+
+// Dabs across two tiles, without the pen up
+static MessagePtr dabs(uint8_t user, uint16_t layer, int x, int y, uint32_t color, bool indirect)
+{
+	PixelBrushDabVector dabVector;
+	for(int i=0;i<10;++i)
+		dabVector << PixelBrushDab { int8_t(i ? 8 : 0), 0, 10, 128 };
+
+	return MessagePtr(new DrawDabsPixel(DabShape::Round, user, layer, x, y, indirect ? color : color & 0x00ffffff, 1, dabVector));
+}
+
+static MessageList stroke(uint8_t user, uint16_t layer, int x, int y, uint32_t color, bool indirect)
+{
+	return MessageList()
+		<< MessagePtr(new UndoPoint(user))
+		<< dabs(user, layer, x, y, color, indirect)
+		<< MessagePtr(new PenUp(user));
+}
+
+class TestStateTracker : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testCanvasThread()
+	{
+		paintcore::LayerStack image;
+		LayerListModel layerlist;
+		StateTracker tracker(&image, &layerlist, 1);
+
+		// Set up the canvas the regular way
+		tracker.receiveQueuedCommand(MessagePtr(new CanvasResize(2, 0, 64, 64, 0)));
+		tracker.receiveQueuedCommand(MessagePtr(new LayerCreate(2, 0x0201, 0, 0, 0, "Layer")));
+		QTRY_VERIFY(image.getLayer(0x0201));
+		QCOMPARE(image.width(), 64);
+
+		QList<QPoint> offsets;
+		connect(&image, &paintcore::LayerStack::resized, [&offsets](int x, int y, const QSize&) {
+			offsets << QPoint(x, y);
+		});
+
+		// A local fill, waiting for the server to echo it back
+		tracker.localCommand(MessagePtr(new FillRect(1, 0x0201, 1, 0, 0, 8, 8, RED)));
+
+		// A long queue is applied in the canvas thread
+		int expectedHistory = tracker.getHistory().end();
+		for(int i=0;i<150;++i)
+			tracker.receiveQueuedCommand(MessagePtr(new FillRect(2, 0x0201, 1, 32 + i % 32, 32, 1, 1, GREEN)));
+
+		tracker.receiveQueuedCommand(MessagePtr(new FillRect(1, 0x0201, 1, 0, 0, 8, 8, RED)));
+		tracker.receiveQueuedCommand(MessagePtr(new CanvasResize(2, 5, 0, 0, 10)));
+
+		for(int i=0;i<150;++i)
+			tracker.receiveQueuedCommand(MessagePtr(new FillRect(2, 0x0201, 1, 42 + i % 32, 50, 1, 1, GREEN)));
+
+		expectedHistory += 302;
+		QTRY_COMPARE(tracker.getHistory().end(), expectedHistory);
+
+		// The resize was published with its real offset
+		QCOMPARE(image.width(), 74);
+		QCOMPARE(image.height(), 69);
+		QVERIFY(offsets.contains(QPoint(10, 5)));
+
+		// The echoed local fill was not applied again, and everything ended up in place
+		const paintcore::Layer *layer = image.getLayer(0x0201);
+		QCOMPARE(layer->pixelAt(10, 5), RED);
+		QCOMPARE(layer->pixelAt(17, 12), RED);
+		QCOMPARE(layer->pixelAt(18, 13), 0u);
+		QCOMPARE(layer->pixelAt(42, 37), GREEN);
+		QCOMPARE(layer->pixelAt(73, 37), GREEN);
+		QCOMPARE(layer->pixelAt(42, 50), GREEN);
+		QCOMPARE(layer->pixelAt(73, 50), GREEN);
+		QCOMPARE(layer->pixelAt(42, 51), 0u);
+	}
+
+	void testUndoOverlappingStrokes_data()
+	{
+		QTest::addColumn<bool>("indirect");
+		QTest::newRow("direct") << false;
+		QTest::newRow("indirect") << true;
+	}
+
+	void testUndoOverlappingStrokes()
+	{
+		QFETCH(bool, indirect);
+
+		const auto scenario = [indirect]() {
+			UndoScenario s { canvasSetup(), MessageList() };
+			s.afterSavepoint
+				<< stroke(3, LAYER, 100, 20, BLUE, indirect) // shares a tile with the undone stroke, but comes before it
+				<< stroke(1, LAYER, 40, 30, RED, indirect) // the stroke to undo
+				<< stroke(2, LAYER, 60, 34, GREEN, indirect) // drawn over the undone stroke
+				<< stroke(2, LAYER, 20, 100, GREEN, indirect) // unaffected tiles
+				<< MessagePtr(new FillRect(2, LAYER, 1, 200, 90, 20, 20, GREEN));
+			return s;
+		};
+
+		paintcore::LayerStack perTile, fullReplay;
+		undo(perTile, scenario(), 1, false);
+		undo(fullReplay, scenario(), 1, true);
+		verifySameLayers(perTile, fullReplay);
+
+		// Only the undone stroke covered this pixel
+		QCOMPARE(perTile.getLayer(LAYER)->pixelAt(45, 30), 0u);
+		QVERIFY(perTile.getLayer(LAYER)->pixelAt(65, 34) != 0u);
+	}
+
+	void testUndoWithLayerCommands()
+	{
+		// Layer commands in the replay window can't be undone tile by tile
+		const auto scenario = []() {
+			UndoScenario s { canvasSetup(), MessageList() };
+			s.afterSavepoint
+				<< stroke(1, LAYER, 40, 30, RED, false)
+				<< MessagePtr(new LayerCreate(2, LAYER2, 0, 0, 0, "Layer 2"))
+				<< stroke(2, LAYER2, 60, 34, GREEN, false)
+				<< MessagePtr(new LayerAttributes(2, LAYER, 0, 0, 128, 1))
+				<< MessagePtr(new LayerOrder(2, QList<uint16_t>() << LAYER2 << LAYER))
+				<< stroke(2, LAYER, 60, 30, GREEN, false);
+			return s;
+		};
+
+		paintcore::LayerStack perTile, fullReplay;
+		undo(perTile, scenario(), 1, false);
+		undo(fullReplay, scenario(), 1, true);
+		verifySameLayers(perTile, fullReplay);
+		QCOMPARE(perTile.getLayer(LAYER)->pixelAt(45, 30), 0u);
+	}
+
+	void testUndoMidStroke_data()
+	{
+		QTest::addColumn<bool>("savepointMidStroke");
+		QTest::newRow("savepoint mid-stroke") << true;
+		QTest::newRow("undo mid-stroke") << false;
+	}
+
+	void testUndoMidStroke()
+	{
+		QFETCH(bool, savepointMidStroke);
+
+		const auto scenario = [savepointMidStroke]() {
+			UndoScenario s { canvasSetup(), MessageList() };
+			if(savepointMidStroke) {
+				// The savepoint has an unmerged sublayer
+				s.beforeSavepoint << dabs(3, LAYER, 50, 40, BLUE, true);
+				s.afterSavepoint
+					<< stroke(1, LAYER, 40, 30, RED, true)
+					<< dabs(3, LAYER, 130, 40, BLUE, true)
+					<< MessagePtr(new PenUp(3))
+					<< stroke(2, LAYER, 60, 34, GREEN, true);
+			} else {
+				// The stroke in progress is left on its sublayer
+				s.afterSavepoint
+					<< stroke(1, LAYER, 40, 30, RED, true)
+					<< stroke(2, LAYER, 60, 34, GREEN, true)
+					<< dabs(3, LAYER, 50, 40, BLUE, true);
+			}
+			return s;
+		};
+
+		paintcore::LayerStack perTile, fullReplay;
+		undo(perTile, scenario(), 1, false);
+		undo(fullReplay, scenario(), 1, true);
+		verifySameLayers(perTile, fullReplay);
+		QCOMPARE(perTile.getLayer(LAYER)->pixelAt(45, 30), 0u);
+	}
+
+private:
+	/**
+	 * Apply the scenario's commands and undo the user's last action
+	 *
+	 * Normally the undo reverts just the affected tiles when it can. A layer
+	 * created in the replay window makes it revert the whole savepoint instead.
+	 */
+	void undo(paintcore::LayerStack &image, const UndoScenario &scenario, uint8_t user, bool fullReplay)
+	{
+		LayerListModel layerlist;
+		StateTracker tracker(&image, &layerlist, 10);
+
+		for(const MessagePtr &msg : scenario.beforeSavepoint)
+			tracker.receiveCommand(msg);
+
+		// Start the history here, so the savepoint made by the canvas setup isn't used.
+		// (The replay window starts after the message the savepoint was made at.)
+		tracker.resetToSavepoint(tracker.createSavepoint(tracker.getHistory().end()-1));
+
+		for(const MessagePtr &msg : scenario.afterSavepoint)
+			tracker.receiveCommand(msg);
+		QCOMPARE(tracker.getSavepoints().size(), 1);
+
+		if(fullReplay)
+			tracker.receiveCommand(MessagePtr(new LayerCreate(9, EXTRA_LAYER, 0, 0, 0, "Extra")));
+
+		tracker.receiveCommand(MessagePtr(new Undo(user, 0, false)));
+	}
+
+	void verifySameLayers(const paintcore::LayerStack &a, const paintcore::LayerStack &b)
+	{
+		int compared = 0;
+		for(int i=0;i<b.layerCount();++i) {
+			const paintcore::Layer *lb = b.getLayerByIndex(i);
+			if(lb->id() == EXTRA_LAYER)
+				continue;
+
+			const paintcore::Layer *la = a.getLayerByIndex(compared++);
+			QCOMPARE(la->id(), lb->id());
+			verifySameTiles(la, lb);
+
+			QCOMPARE(la->sublayers().size(), lb->sublayers().size());
+			for(int j=0;j<lb->sublayers().size();++j) {
+				QCOMPARE(la->sublayers().at(j)->id(), lb->sublayers().at(j)->id());
+				verifySameTiles(la->sublayers().at(j), lb->sublayers().at(j));
+			}
+		}
+		QCOMPARE(a.layerCount(), compared);
+	}
+
+	void verifySameTiles(const paintcore::Layer *a, const paintcore::Layer *b)
+	{
+		QCOMPARE(a->width(), b->width());
+		QCOMPARE(a->height(), b->height());
+
+		const int count = paintcore::Tile::roundTiles(a->width()) * paintcore::Tile::roundTiles(a->height());
+		for(int i=0;i<count;++i) {
+			if(!a->tile(i).equals(b->tile(i)))
+				QFAIL(qPrintable(QStringLiteral("Layer %1 tile %2 differs").arg(a->id(), 0, 16).arg(i)));
+		}
+	}
+};
+
+
+QTEST_MAIN(TestStateTracker)
+#include "statetracker.moc"
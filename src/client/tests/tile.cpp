@@ -0,0 +1,171 @@
+#include "../core/tile.h"
+
+#include <QtTest/QtTest>
+
+using namespace paintcore;
+
+Q_DECLARE_METATYPE(paintcore::Tile)
+
+// A copy of the tile with the same content as full pixel data
+static Tile expanded(Tile tile)
+{
+	tile.data();
+	return tile;
+}
+
+static Tile checker()
+{
+	Tile t;
+	Tile::fillChecker(t.data(), QColor(255, 0, 0, 128), Qt::white);
+	return t;
+}
+
+class TestTile : public QObject
+{
+	Q_OBJECT
+private slots:
+	void testSolid()
+	{
+		QVERIFY(Tile().isNull());
+		QVERIFY(Tile(QColor(Qt::transparent)).isNull());
+
+		const QColor color(255, 0, 0, 128);
+		const Tile solid(color, 1);
+		QVERIFY(solid.isSolid());
+		QVERIFY(!solid.isNull());
+		QCOMPARE(solid.pixel(10, 20), qPremultiply(color.rgba()));
+		QCOMPARE(solid.solidColor(), QColor::fromRgba(qUnpremultiply(qPremultiply(color.rgba()))));
+		QCOMPARE(solid.lastEditedBy(), 1);
+
+		// Painting expands the tile
+		const Tile full = expanded(solid);
+		QVERIFY(!full.isSolid());
+		QVERIFY(!full.isNull());
+		QCOMPARE(full.constData()[Tile::LENGTH-1], qPremultiply(color.rgba()));
+		QCOMPARE(full.lastEditedBy(), 1);
+	}
+
+	void testOptimize()
+	{
+		Tile uniform = expanded(Tile(QColor(Qt::red), 2));
+		uniform.optimize();
+		QVERIFY(uniform.isSolid());
+		QCOMPARE(uniform.pixel(0, 0), qPremultiply(QColor(Qt::red).rgba()));
+		QCOMPARE(uniform.lastEditedBy(), 2);
+
+		Tile blank;
+		blank.data();
+		blank.setLastEditedBy(2);
+		blank.optimize();
+		QVERIFY(blank.isNull());
+		QCOMPARE(blank, Tile());
+
+		Tile pattern = checker();
+		const Tile before = pattern;
+		pattern.optimize();
+		QVERIFY(!pattern.isSolid());
+		QVERIFY(!pattern.isNull());
+		QCOMPARE(pattern, before);
+	}
+
+	void testMerge_data()
+	{
+		QTest::addColumn<Tile>("dest");
+		QTest::addColumn<Tile>("src");
+		QTest::addColumn<bool>("staysSolid");
+
+		const Tile null;
+		const Tile solid(QColor(0, 0, 255, 200));
+		const Tile solid2(QColor(255, 0, 0, 100));
+		const Tile full = checker();
+
+		QTest::newRow("null over null") << null << null << true;
+		QTest::newRow("solid over null") << null << solid << true;
+		QTest::newRow("null over solid") << solid << null << true;
+		QTest::newRow("solid over solid") << solid << solid2 << true;
+		QTest::newRow("full over null") << null << full << false;
+		QTest::newRow("full over solid") << solid << full << false;
+		QTest::newRow("null over full") << full << null << false;
+		QTest::newRow("solid over full") << full << solid << false;
+		QTest::newRow("full over full") << full << expanded(solid2) << false;
+	}
+
+	void testMerge()
+	{
+		QFETCH(Tile, dest);
+		QFETCH(Tile, src);
+		QFETCH(bool, staysSolid);
+
+		// The same merge done with full pixel data is the reference
+		Tile reference = expanded(dest);
+		reference.merge(expanded(src), 200, BlendMode::MODE_NORMAL);
+
+		Tile result = dest;
+		result.merge(src, 200, BlendMode::MODE_NORMAL);
+
+		QCOMPARE(!result.isSolid() && !result.isNull(), !staysSolid);
+		QVERIFY(result.equals(reference));
+	}
+
+	void testCopyTo_data()
+	{
+		QTest::addColumn<Tile>("tile");
+
+		QTest::newRow("null") << Tile();
+		QTest::newRow("solid") << Tile(QColor(Qt::green));
+		QTest::newRow("full") << checker();
+	}
+
+	void testCopyTo()
+	{
+		QFETCH(Tile, tile);
+		const Tile reference = expanded(tile);
+
+		QVector<quint32> buffer(Tile::LENGTH, 0x12345678);
+		tile.copyTo(buffer.data());
+		QVERIFY(std::equal(buffer.constBegin(), buffer.constEnd(), reference.constData()));
+
+		// Copy the top-left corner into a wider buffer
+		const int stride = Tile::SIZE + 10;
+		const int w = 20, h = 30;
+		QVector<quint32> wide(stride * Tile::SIZE, 0x12345678);
+		tile.copyTo(wide.data(), stride, w, h);
+		for(int y=0;y<Tile::SIZE;++y) {
+			for(int x=0;x<stride;++x) {
+				const quint32 expected = x < w && y < h ? reference.pixel(x, y) : 0x12345678;
+				QCOMPARE(wide.at(y * stride + x), expected);
+			}
+		}
+	}
+
+	void testEquals()
+	{
+		const Tile null;
+		const Tile red(QColor(Qt::red));
+		const Tile green(QColor(Qt::green));
+		const Tile pattern = checker();
+
+		QVERIFY(null.equals(Tile(QColor(Qt::transparent))));
+		QVERIFY(null.equals(expanded(null)));
+		QVERIFY(expanded(null).equals(null));
+		QVERIFY(!null.equals(red));
+		QVERIFY(!red.equals(null));
+
+		QVERIFY(red.equals(Tile(QColor(Qt::red), 5)));
+		QVERIFY(red.equals(expanded(red)));
+		QVERIFY(expanded(red).equals(red));
+		QVERIFY(expanded(red).equals(expanded(red)));
+		QVERIFY(!red.equals(green));
+		QVERIFY(!red.equals(expanded(green)));
+		QVERIFY(!expanded(green).equals(red));
+
+		QVERIFY(pattern.equals(expanded(pattern)));
+		QVERIFY(!pattern.equals(null));
+		QVERIFY(!pattern.equals(red));
+		QVERIFY(!red.equals(pattern));
+	}
+};
+
+
+QTEST_MAIN(TestTile)
+#include "tile.moc"
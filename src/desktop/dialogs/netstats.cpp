@@ -20,6 +20,11 @@
 #include "netstats.h"
 #include "ui_netstats.h"
 
+#include "core/tilepool.h"
+#include "core/tilecache.h"
+
+#include <QTimer>
+
 namespace dialogs {
 
 static QString formatKb(int bytes)
@@ -37,6 +42,11 @@ NetStats::NetStats(QWidget *parent) :
 {
 	_ui->setupUi(this);
 	setDisconnected();
+
+	QTimer *tileMemTimer = new QTimer(this);
+	connect(tileMemTimer, &QTimer::timeout, this, &NetStats::updateTileMemory);
+	tileMemTimer->start(1000);
+	updateTileMemory();
 }
 
 void NetStats::setRecvBytes(int bytes)
@@ -59,4 +69,26 @@ void NetStats::setDisconnected()
 	_ui->lagLabel->setText(tr("not connected"));
 }
 
+void NetStats::setSavepointStats(int count, qint64 bytes, int replayMsecs)
+{
+	_ui->savepointLabel->setText(tr("%1 (%2 Mb)")
+		.arg(count)
+		.arg(bytes / float(1024*1024), 0, 'f', 1));
+	_ui->replayLabel->setText(tr("~%1 ms").arg(replayMsecs));
+}
+
+void NetStats::updateTileMemory()
+{
+	const paintcore::TilePool::Stats stats = paintcore::TilePool::stats();
+	_ui->tileMemLabel->setText(tr("%1 Mb (peak %2 Mb)")
+		.arg(stats.megabytes(), 0, 'f', 1)
+		.arg(stats.peakMegabytes(), 0, 'f', 1));
+	const paintcore::TileCache::Stats cache = paintcore::TileCache::stats();
+	_ui->tileMemLabel->setToolTip(tr("%1 tiles in use, %2 kept for reuse, %3 compressed (%4)")
+		.arg(stats.liveTiles)
+		.arg(stats.pooledTiles)
+		.arg(cache.compressedTiles)
+		.arg(formatKb(cache.compressedBytes)));
+}
+
 }
@@ -37,6 +37,10 @@ public slots:
 	void setRecvBytes(int bytes);
 	void setCurrentLag(int lag);
 	void setDisconnected();
+	void setSavepointStats(int count, qint64 bytes, int replayMsecs);
+
+private slots:
+	void updateTileMemory();
 
 private:
 	Ui_NetStats *_ui;
@@ -119,7 +119,7 @@ struct ResetDialog::Private
 	}
 };
 
-ResetDialog::ResetDialog(const canvas::StateTracker *state, QWidget *parent)
+ResetDialog::ResetDialog(canvas::StateTracker *state, QWidget *parent)
 	: QDialog(parent), d(new Private(state->getSavepoints()))
 {
 	d->ui->setupUi(this);
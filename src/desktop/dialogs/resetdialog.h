@@ -34,7 +34,7 @@ class ResetDialog : public QDialog
 {
 	Q_OBJECT
 public:
-	explicit ResetDialog(const canvas::StateTracker *state, QWidget *parent=nullptr);
+	explicit ResetDialog(canvas::StateTracker *state, QWidget *parent=nullptr);
 	~ResetDialog();
 
 	protocol::MessageList resetImage(int myId, const canvas::CanvasModel *canvas);
@@ -46,7 +46,8 @@
 #include <ColorDialog>
 
 #ifndef NDEBUG
-#include "core/tile.h"
+#include "core/tilepool.h"
+#include "core/tilecache.h"
 #endif
 
 #ifdef Q_OS_OSX
@@ -227,7 +228,7 @@ MainWindow::MainWindow(bool restoreWindowPosition)
 		QLabel *tilemem = new QLabel(this);
 		QTimer *tilememtimer = new QTimer(this);
 		connect(tilememtimer, &QTimer::timeout, [tilemem]() {
-			tilemem->setText(QStringLiteral("Tiles: %1 Mb").arg(paintcore::TileData::megabytesUsed(), 0, 'f', 2));
+			tilemem->setText(QStringLiteral("Tiles: %1 Mb").arg(paintcore::TilePool::stats().megabytes(), 0, 'f', 2));
 		});
 		tilememtimer->setInterval(1000);
 		tilememtimer->start(1000);
@@ -489,6 +490,7 @@ void MainWindow::onCanvasChanged(canvas::CanvasModel *canvas)
 	connect(canvas, &canvas::CanvasModel::selectionRemoved, this, &MainWindow::selectionRemoved);
 
 	connect(canvas, &canvas::CanvasModel::userJoined, m_netstatus, &widgets::NetStatus::join);
+	connect(canvas->stateTracker(), &canvas::StateTracker::savepointStatsChanged, m_netstatus, &widgets::NetStatus::setSavepointStats);
 	connect(canvas, &canvas::CanvasModel::userLeft, m_netstatus, &widgets::NetStatus::leave);
 	connect(canvas, &canvas::CanvasModel::userJoined, m_chatbox, &widgets::ChatBox::userJoined);
 	connect(canvas, &canvas::CanvasModel::userLeft, m_chatbox, &widgets::ChatBox::userParted);
@@ -740,6 +742,10 @@ void MainWindow::updateSettings()
 
 	cfg.beginGroup("settings");
 	m_view->setBrushCursorStyle(cfg.value("brushcursor").toInt());
+
+	// Memory budget (in megabytes) for uncompressed tiles. Zero means unlimited.
+	paintcore::TileCache::setBudget(cfg.value("tilecachebudget", 0).toInt());
+
 	static_cast<tools::BrushSettings*>(m_dockToolSettings->getToolSettingsPage(tools::Tool::FREEHAND))->setShareBrushSlotColor(cfg.value("sharebrushslotcolor", false).toBool());
 }
 
@@ -43,7 +43,8 @@
 namespace widgets {
 
 NetStatus::NetStatus(QWidget *parent)
-	: QWidget(parent), m_state(NotConnected), _sentbytes(0), _recvbytes(0), _lag(0)
+	: QWidget(parent), m_state(NotConnected), _sentbytes(0), _recvbytes(0), _lag(0),
+	  m_savepointCount(0), m_savepointReplay(0), m_savepointBytes(0)
 {
 	setMinimumHeight(16+2);
 
@@ -293,6 +294,15 @@ void NetStatus::lagMeasured(qint64 lag)
 		_netstats->setCurrentLag(lag);
 }
 
+void NetStatus::setSavepointStats(int count, qint64 bytes, int replayMsecs)
+{
+	m_savepointCount = count;
+	m_savepointBytes = bytes;
+	m_savepointReplay = replayMsecs;
+	if(_netstats)
+		_netstats->setSavepointStats(count, bytes, replayMsecs);
+}
+
 /**
  * Copy the current address to clipboard.
  * Should not be called if disconnected.
@@ -422,6 +432,7 @@ void NetStatus::showNetStats()
 
 		_netstats->setRecvBytes(_recvbytes);
 		_netstats->setSentBytes(_sentbytes);
+		_netstats->setSavepointStats(m_savepointCount, m_savepointBytes, m_savepointReplay);
 		if(!m_address.isEmpty())
 			_netstats->setCurrentLag(_lag);
 	}
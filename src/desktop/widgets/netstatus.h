@@ -64,6 +64,9 @@ public slots:
 
 	void lagMeasured(qint64 lag);
 
+	//! Update undo savepoint statistics
+	void setSavepointStats(int count, qint64 bytes, int replayMsecs);
+
 	//! Show the message in the balloon popup if alert is true
 	void alertMessage(const QString &msg, bool alert);
 
@@ -122,6 +125,9 @@ private:
 
 	quint64 _sentbytes, _recvbytes, _lag;
 
+	int m_savepointCount, m_savepointReplay;
+	qint64 m_savepointBytes;
+
 	QSslCertificate m_certificate;
 };
 
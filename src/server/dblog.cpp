@@ -22,26 +22,235 @@
 #include <QSqlQuery>
 #include <QMetaEnum>
 #include <QSqlError>
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QElapsedTimer>
 
 namespace server {
 
+// How long to collect log entries before writing them
+static const int WRITE_BATCH_DELAY = 1000;
+
+static bool insertEntries(QSqlDatabase db, const QList<Log> &entries)
+{
+	if(entries.isEmpty())
+		return true;
+
+	db.transaction();
+
+	QSqlQuery q(db);
+	q.prepare("INSERT INTO serverlog (timestamp, level, topic, user, session, message) VALUES (?, ?, ?, ?, ?, ?)");
+	for(const Log &entry : entries) {
+		q.bindValue(0, entry.timestamp().toString(Qt::ISODate));
+		q.bindValue(1, int(entry.level()));
+		q.bindValue(2, QMetaEnum::fromType<Log::Topic>().valueToKey(int(entry.topic())));
+		q.bindValue(3, entry.user());
+		q.bindValue(4, entry.session().toString());
+		q.bindValue(5, entry.message());
+		if(!q.exec())
+			qWarning("Couldn't write log entry: %s", qPrintable(q.lastError().databaseText()));
+	}
+
+	if(!db.commit()) {
+		qWarning("Couldn't commit log entries: %s", qPrintable(db.lastError().databaseText()));
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Background thread for writing log entries
+ */
+class DbLogWriter : public QThread
+{
+public:
+	DbLogWriter(const QString &databaseName, const QString &connectionName)
+		: m_databaseName(databaseName), m_connectionName(connectionName),
+		  m_queued(0), m_written(0), m_flush(false), m_stop(false)
+	{
+	}
+
+	void enqueue(const Log &entry)
+	{
+		QMutexLocker lock(&m_mutex);
+		m_queue << entry;
+		++m_queued;
+		m_wakeup.wakeOne();
+	}
+
+	void flush()
+	{
+		QMutexLocker lock(&m_mutex);
+		const quint64 target = m_queued;
+		if(m_written >= target)
+			return;
+
+		m_flush = true;
+		m_wakeup.wakeOne();
+		while(m_written < target && isRunning())
+			m_flushed.wait(&m_mutex, 100);
+	}
+
+	void stop()
+	{
+		{
+			QMutexLocker lock(&m_mutex);
+			m_stop = true;
+			m_wakeup.wakeOne();
+		}
+		wait();
+	}
+
+protected:
+	void run() override
+	{
+		{
+			QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", m_connectionName);
+			db.setDatabaseName(m_databaseName);
+			if(!db.open()) {
+				qWarning("Log writer couldn't open database: %s", qPrintable(db.lastError().text()));
+			} else {
+				writeLoop(db);
+				db.close();
+			}
+		}
+		QSqlDatabase::removeDatabase(m_connectionName);
+	}
+
+private:
+	void writeLoop(QSqlDatabase db)
+	{
+		QMutexLocker lock(&m_mutex);
+		for(;;) {
+			while(m_queue.isEmpty() && !m_stop)
+				m_wakeup.wait(&m_mutex);
+
+			if(m_queue.isEmpty())
+				break;
+
+			// Let more entries accumulate so they can be written in a single transaction
+			QElapsedTimer t;
+			t.start();
+			while(!m_stop && !m_flush && t.elapsed() < WRITE_BATCH_DELAY)
+				m_wakeup.wait(&m_mutex, WRITE_BATCH_DELAY - t.elapsed());
+
+			const QList<Log> batch = m_queue;
+			m_queue.clear();
+			m_flush = false;
+
+			lock.unlock();
+			insertEntries(db, batch);
+			lock.relock();
+
+			m_written += batch.size();
+			m_flushed.wakeAll();
+		}
+	}
+
+	const QString m_databaseName;
+	const QString m_connectionName;
+
+	QMutex m_mutex;
+	QWaitCondition m_wakeup;
+	QWaitCondition m_flushed;
+
+	QList<Log> m_queue;
+	quint64 m_queued;
+	quint64 m_written;
+	bool m_flush;
+	bool m_stop;
+};
+
 DbLog::DbLog(const QSqlDatabase &db)
-	: m_db(db)
+	: m_db(db), m_dbThread(QThread::currentThread()), m_writer(nullptr)
+{
+}
+
+DbLog::~DbLog()
 {
+	if(m_writer) {
+		m_writer->stop();
+		delete m_writer;
+	}
+
+	// Not all query threads are QThreads that could clean up after
+	// themselves (e.g. the HTTP server's worker threads are just adopted by Qt)
+	for(const QString &name : m_connections)
+		QSqlDatabase::removeDatabase(name);
 }
 
 bool DbLog::initDb()
 {
 	QSqlQuery q(m_db);
-	return q.exec(
+	if(!q.exec(
 		"CREATE TABLE IF NOT EXISTS serverlog ("
 			"timestamp, level, topic, user, session, message"
 		");"
-	);
+	))
+		return false;
+
+	// Indexes for log queries and purging.
+	// (Databases created by older versions don't have these yet.)
+	if(!q.exec("CREATE INDEX IF NOT EXISTS serverlog_timestamp ON serverlog (timestamp)"))
+		return false;
+
+	if(!q.exec("CREATE INDEX IF NOT EXISTS serverlog_session ON serverlog (session, timestamp)"))
+		return false;
+
+	if(!q.exec("CREATE INDEX IF NOT EXISTS serverlog_level ON serverlog (level, timestamp)"))
+		return false;
+
+	// In-memory databases can't be shared with another connection
+	const QString dbName = m_db.databaseName();
+	if(!m_writer && !dbName.isEmpty() && !dbName.startsWith(":memory:") && !dbName.contains("mode=memory")) {
+		m_writer = new DbLogWriter(dbName, QStringLiteral("dblog-writer-%1").arg(quintptr(this)));
+		m_writer->start();
+	}
+
+	return true;
+}
+
+QSqlDatabase DbLog::connection() const
+{
+	if(QThread::currentThread() == m_dbThread || !m_writer)
+		return m_db;
+
+	// Database connections can only be used in the thread that created them
+	const QString name = QStringLiteral("dblog-reader-%1-%2").arg(quintptr(this)).arg(quintptr(QThread::currentThread()));
+
+	QMutexLocker lock(&m_connectionMutex);
+	if(m_connections.contains(name)) {
+		// The ID may belong to a new thread if the old one has exited
+		QSqlDatabase db = QSqlDatabase::database(name);
+		if(db.isOpen())
+			return db;
+		db = QSqlDatabase();
+		QSqlDatabase::removeDatabase(name);
+		m_connections.removeOne(name);
+	}
+
+	QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", name);
+	db.setDatabaseName(m_db.databaseName());
+	if(!db.open())
+		qWarning("Couldn't open log database connection: %s", qPrintable(db.lastError().text()));
+
+	// The connection is removed when the log is destroyed
+	m_connections << name;
+
+	return db;
+}
+
+void DbLog::flush() const
+{
+	if(m_writer)
+		m_writer->flush();
 }
 
 QList<Log> DbLog::getLogEntries(const QUuid &session, const QDateTime &after, Log::Level atleast, int offset, int limit) const
 {
+	flush();
+
 	QString sql = "SELECT timestamp, session, user, level, topic, message FROM serverlog WHERE 1=1";
 	QVariantList params;
 	if(!session.isNull()) {
@@ -69,7 +278,7 @@ QList<Log> DbLog::getLogEntries(const QUuid &session, const QDateTime &after, Lo
 		params << offset;
 	}
 
-	QSqlQuery q(m_db);
+	QSqlQuery q(connection());
 	q.prepare(sql);
 	for(int i=0;i<params.size();++i)
 		q.bindValue(i, params.at(i));
@@ -95,15 +304,10 @@ QList<Log> DbLog::getLogEntries(const QUuid &session, const QDateTime &after, Lo
 
 void DbLog::storeMessage(const Log &entry)
 {
-	QSqlQuery q(m_db);
-	q.prepare("INSERT INTO serverlog (timestamp, level, topic, user, session, message) VALUES (?, ?, ?, ?, ?, ?)");
-	q.bindValue(0, entry.timestamp().toString(Qt::ISODate));
-	q.bindValue(1, int(entry.level()));
-	q.bindValue(2, QMetaEnum::fromType<Log::Topic>().valueToKey(int(entry.topic())));
-	q.bindValue(3, entry.user());
-	q.bindValue(4, entry.session().toString());
-	q.bindValue(5, entry.message());
-	q.exec();
+	if(m_writer)
+		m_writer->enqueue(entry);
+	else
+		insertEntries(m_db, QList<Log>() << entry);
 }
 
 int DbLog::purgeLogs(int olderThanDays)
@@ -111,6 +315,8 @@ int DbLog::purgeLogs(int olderThanDays)
 	if(olderThanDays<=0)
 		return 0;
 
+	flush();
+
 	QSqlQuery q(m_db);
 	q.prepare("DELETE FROM serverlog WHERE timestamp < DATE('now', ?)");
 	q.bindValue(0, QStringLiteral("-%1 days").arg(olderThanDays));
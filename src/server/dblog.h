@@ -23,18 +23,41 @@
 #include "../shared/server/serverlog.h"
 
 #include <QSqlDatabase>
+#include <QMutex>
+#include <QStringList>
+
+class QThread;
 
 namespace server {
 
+class DbLogWriter;
+
+/**
+ * @brief A server log that stores the entries in a database
+ *
+ * When the database is a file, log entries are written in a background thread.
+ * Entries are collected into batches, and each batch is written in a single
+ * transaction. Log queries can then also be made from other threads, each
+ * using its own database connection.
+ *
+ * In-memory databases cannot be shared between connections, so in that case
+ * entries are written immediately in the calling thread.
+ */
 class DbLog : public ServerLog
 {
 public:
 	explicit DbLog(const QSqlDatabase &db);
+	~DbLog();
 
+	/**
+	 * @brief Create or update the log table and start the background writer
+	 */
 	bool initDb();
 
 	QList<Log> getLogEntries(const QUuid &session, const QDateTime &after, Log::Level atleast, int offset, int limit) const override;
 
+	bool hasThreadSafeQueries() const override { return m_writer != nullptr; }
+
 	/**
 	 * @brief Delete all log entries older than the given number of days
 	 * @param olderThanDays
@@ -42,11 +65,24 @@ public:
 	 */
 	int purgeLogs(int olderThanDays);
 
+	/**
+	 * @brief Wait until all pending log entries have been written
+	 */
+	void flush() const;
+
 protected:
 	void storeMessage(const Log &entry) override;
 
 private:
+	QSqlDatabase connection() const;
+
 	QSqlDatabase m_db;
+	QThread *m_dbThread;
+	DbLogWriter *m_writer;
+
+	// Connections made for queries from other threads
+	mutable QMutex m_connectionMutex;
+	mutable QStringList m_connections;
 };
 
 }
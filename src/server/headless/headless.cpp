@@ -104,6 +104,10 @@ bool start() {
 	QCommandLineOption recordOption("record", "Record sessions", "path");
 	parser.addOption(recordOption);
 
+	// --io-threads <count>
+	QCommandLineOption ioThreadsOption("io-threads", "Number of threads for network I/O and TLS (0 = use the main thread)", "count", "2");
+	parser.addOption(ioThreadsOption);
+
 #ifndef NDEBUG
 	QCommandLineOption lagOption("random-lag", "Randomly sleep to simulate lag", "msecs", "0");
 	parser.addOption(lagOption);
@@ -237,6 +241,16 @@ bool start() {
 		}
 	}
 
+	{
+		bool ok;
+		const int ioThreads = parser.value(ioThreadsOption).toInt(&ok);
+		if(!ok || ioThreads<0) {
+			qCritical("Invalid thread count %s", qPrintable(parser.value(ioThreadsOption)));
+			return false;
+		}
+		server->setNetworkThreads(ioThreads);
+	}
+
 	{
 		QString recordingPath = parser.value(recordOption);
 		if(!recordingPath.isEmpty()) {
@@ -26,8 +26,10 @@
 #include "../shared/server/session.h"
 #include "../shared/server/sessionserver.h"
 #include "../shared/server/client.h"
+#include "../shared/server/networkthreadpool.h"
 #include "../shared/server/serverconfig.h"
 #include "../shared/server/serverlog.h"
+#include "../shared/server/metrics.h"
 
 #include <QTcpSocket>
 #include <QFileInfo>
@@ -35,13 +37,18 @@
 #include <QDir>
 #include <QJsonObject>
 #include <QJsonArray>
+#include <QTimer>
 
 namespace server {
 
+// Interval of the event loop lag measurement timer
+static const int LAG_TIMER_INTERVAL = 1000;
+
 MultiServer::MultiServer(ServerConfig *config, QObject *parent)
 	: QObject(parent),
 	m_config(config),
 	m_server(nullptr),
+	m_netThreads(nullptr),
 	m_state(STOPPED),
 	m_autoStop(false),
 	m_port(0)
@@ -49,6 +56,13 @@ MultiServer::MultiServer(ServerConfig *config, QObject *parent)
 	m_sessions = new SessionServer(config, this);
 	m_started = QDateTime::currentDateTimeUtc();
 
+	m_lagTimer = new QTimer(this);
+	m_lagTimer->setInterval(LAG_TIMER_INTERVAL);
+	m_lagTimer->setTimerType(Qt::PreciseTimer); // coarse timer slop would show up as lag
+	connect(m_lagTimer, &QTimer::timeout, this, &MultiServer::measureEventLoopLag);
+	m_lagClock.start();
+	m_lagTimer->start();
+
 	connect(m_sessions, &SessionServer::sessionCreated, this, &MultiServer::assignRecording);
 	connect(m_sessions, &SessionServer::sessionEnded, this, &MultiServer::tryAutoStop);
 	connect(m_sessions, &SessionServer::userLoggedIn, this, &MultiServer::printStatusUpdate);
@@ -69,6 +83,13 @@ void MultiServer::setMustSecure(bool secure)
 	m_sessions->setMustSecure(secure);
 }
 
+void MultiServer::setNetworkThreads(int count)
+{
+	Q_ASSERT(m_state == STOPPED);
+	delete m_netThreads;
+	m_netThreads = count > 0 ? new NetworkThreadPool(count, this) : nullptr;
+}
+
 #ifndef NDEBUG
 void MultiServer::setRandomLag(uint lag)
 {
@@ -254,7 +275,7 @@ void MultiServer::newClient()
 		.user(0, socket->peerAddress(), QString())
 		.message(QStringLiteral("New client connected")));
 
-	auto *client = new Client(socket, m_sessions->config()->logger());
+	auto *client = new Client(socket, m_sessions->config()->logger(), m_netThreads ? m_netThreads->nextThread() : nullptr);
 
 	if(m_config->isAddressBanned(socket->peerAddress())) {
 		client->log(Log().about(Log::Level::Warn, Log::Topic::Kick)
@@ -278,6 +299,27 @@ void MultiServer::printStatusUpdate()
 	);
 }
 
+void MultiServer::measureEventLoopLag()
+{
+	// A busy event loop will fire the timer late
+	const qint64 elapsed = m_lagClock.restart();
+	ServerMetrics::instance().eventLoopLag.observe(qMax(Q_INT64_C(0), elapsed - LAG_TIMER_INTERVAL) / 1000.0);
+}
+
+QByteArray MultiServer::metrics() const
+{
+	const ServerMetrics &sm = ServerMetrics::instance();
+	MetricsWriter writer;
+
+	writer.gauge("drawpile_uptime_seconds", "Time since the server was started", m_started.secsTo(QDateTime::currentDateTimeUtc()));
+	m_sessions->writeMetrics(writer);
+	writer.histogram("drawpile_history_block_load_seconds", "Time taken to load a block of session history from disk", sm.historyBlockLoadTime);
+	writer.histogram("drawpile_login_duration_seconds", "Time from connection to joining a session", sm.loginDuration);
+	writer.histogram("drawpile_event_loop_lag_seconds", "Event loop timer delay", sm.eventLoopLag);
+
+	return writer.data();
+}
+
 /**
  * @brief Stop the server if vacant (and autostop is enabled)
  */
@@ -372,10 +414,17 @@ JsonApiResult MultiServer::serverJsonApi(JsonApiMethod method, const QStringList
 		config::ClientTimeout,
 		config::SessionSizeLimit,
 		config::AutoresetThreshold,
+		config::AutoCompact,
+		config::ClientMessageRate,
+		config::ClientByteRate,
+		config::SessionMessageRate,
+		config::SessionByteRate,
+		config::Compression,
 		config::SessionCountLimit,
 		config::EnablePersistence,
 		config::ArchiveMode,
 		config::IdleTimeLimit,
+		config::HibernationTime,
 		config::ServerTitle,
 		config::WelcomeMessage,
 		config::AnnounceWhiteList,
@@ -23,10 +23,12 @@
 #include <QObject>
 #include <QHostAddress>
 #include <QDateTime>
+#include <QElapsedTimer>
 #include "../shared/server/jsonapi.h"
 
 class QTcpServer;
 class QDir;
+class QTimer;
 
 namespace server {
 
@@ -34,6 +36,7 @@ class Client;
 class Session;
 class SessionServer;
 class ServerConfig;
+class NetworkThreadPool;
 
 /**
  * The drawpile server.
@@ -50,6 +53,14 @@ public:
 	void setSessionDirectory(const QDir &dir);
 	void setTemplateDirectory(const QDir &dir);
 
+	/**
+	 * @brief Set the number of threads used for client socket I/O
+	 *
+	 * If zero, all I/O happens in the main thread.
+	 * This should be called before the server is started.
+	 */
+	void setNetworkThreads(int count);
+
 #ifndef NDEBUG
 	void setRandomLag(uint lag);
 #endif
@@ -93,11 +104,26 @@ public slots:
 	 */
 	void callJsonApiAsync(const QString &requestId, JsonApiMethod method, const QStringList &path, const QJsonObject &request);
 
+	/**
+	 * @brief Call the server log query API
+	 *
+	 * If the log has thread-safe queries, this can be called from any thread.
+	 */
+	JsonApiResult logJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request);
+
+	/**
+	 * @brief Get server metrics in the Prometheus text format
+	 *
+	 * This is used by the HTTP admin API.
+	 */
+	QByteArray metrics() const;
+
 private slots:
 	void newClient();
 	void printStatusUpdate();
 	void tryAutoStop();
 	void assignRecording(Session *session);
+	void measureEventLoopLag();
 
 signals:
 	void serverStartError(const QString &message);
@@ -113,13 +139,13 @@ private:
 	JsonApiResult statusJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request);
 	JsonApiResult banlistJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request);
 	JsonApiResult accountsJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request);
-	JsonApiResult logJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request);
 
 	enum State {RUNNING, STOPPING, STOPPED};
 
 	ServerConfig *m_config;
 	QTcpServer *m_server;
 	SessionServer *m_sessions;
+	NetworkThreadPool *m_netThreads;
 
 	State m_state;
 
@@ -131,6 +157,9 @@ private:
 	QString m_recordingPath;
 
 	QDateTime m_started;
+
+	QTimer *m_lagTimer;
+	QElapsedTimer m_lagClock;
 };
 
 }
@@ -24,6 +24,7 @@
 
 #include <QJsonArray>
 #include <QFileSystemWatcher>
+#include <QFileInfo>
 
 namespace server {
 
@@ -110,49 +111,27 @@ bool TemplateFiles::exists(const QString &alias) const
 	return m_templates.contains(alias) && !m_templates[alias].description.isEmpty();
 }
 
-bool TemplateFiles::init(SessionHistory *session) const
+TemplateFiles::TemplateContentPtr TemplateFiles::loadContent(const QString &path, const QDateTime &lastmod)
 {
-	if(!m_templates.contains(session->idAlias()))
-		return false;
-
-	recording::Reader reader(m_templates[session->idAlias()].filename);
+	recording::Reader reader(path);
 	if(reader.open() != recording::COMPATIBLE) {
-		qWarning("%s: template not compatible", qPrintable(m_templates[session->idAlias()].filename));
-		return false;
-	}
-
-	// Set session metadata
-	Q_ASSERT(protocol::ProtocolVersion::fromString(reader.metadata().value("version").toString()) == session->protocolVersion());
-	session->setMaxUsers(reader.metadata().value("maxUserCount").toInt(25));
-	session->setPasswordHash(reader.metadata().value("password").toString().toUtf8());
-	session->setOpwordHash(reader.metadata().value("opword").toString().toUtf8());
-	session->setTitle(reader.metadata().value("title").toString());
-
-	if(reader.metadata().contains("announce")) {
-		session->addAnnouncement(reader.metadata()["announce"].toString());
+		qWarning("%s: template not compatible", qPrintable(path));
+		return TemplateContentPtr();
 	}
 
-	SessionHistory::Flags flags;
-	if(reader.metadata().value("nsfm").toBool())
-		flags |= SessionHistory::Nsfm;
-	if(reader.metadata().value("persistent").toBool())
-		flags |= SessionHistory::Persistent;
-	if(reader.metadata().value("preserveChat").toBool())
-		flags |= SessionHistory::PreserveChat;
-	if(reader.metadata().value("deputies").toBool())
-		flags |= SessionHistory::Deputies;
-	session->setFlags(flags);
+	QSharedPointer<TemplateContent> content(new TemplateContent);
+	content->metadata = reader.metadata();
+	content->lastmod = lastmod;
 
-	// Set initial history
 	bool keepReading=true;
 	do {
 		recording::MessageRecord r = reader.readNext();
 		switch(r.status) {
 		case recording::MessageRecord::OK:
-			session->addMessage(protocol::MessagePtr::fromNullable(r.message));
+			content->messages << protocol::MessagePtr::fromNullable(r.message);
 			break;
 		case recording::MessageRecord::INVALID:
-			qWarning("%s: Invalid message (type %d, len %d) in template!", qPrintable(session->idAlias()), r.invalid_type, r.invalid_len);
+			qWarning("%s: Invalid message (type %d, len %d) in template!", qPrintable(path), r.invalid_type, r.invalid_len);
 			break;
 		case recording::MessageRecord::END_OF_RECORDING:
 			keepReading = false;
@@ -160,8 +139,54 @@ bool TemplateFiles::init(SessionHistory *session) const
 		}
 	} while(keepReading);
 
-	return true;
+	return content;
 }
 
+bool TemplateFiles::init(SessionHistory *session) const
+{
+	if(!m_templates.contains(session->idAlias()))
+		return false;
+
+	const Template &t = m_templates[session->idAlias()];
+
+	// The file may have been rewritten in place without triggering
+	// a directory change notification, so check the timestamp here too.
+	const QDateTime lastmod = QFileInfo(t.filename).lastModified();
+	if(t.content.isNull() || t.content->lastmod != lastmod)
+		t.content = loadContent(t.filename, lastmod);
+
+	if(t.content.isNull())
+		return false;
+
+	const QJsonObject &metadata = t.content->metadata;
+
+	// Set session metadata
+	Q_ASSERT(protocol::ProtocolVersion::fromString(metadata.value("version").toString()) == session->protocolVersion());
+	session->setMaxUsers(metadata.value("maxUserCount").toInt(25));
+	session->setPasswordHash(metadata.value("password").toString().toUtf8());
+	session->setOpwordHash(metadata.value("opword").toString().toUtf8());
+	session->setTitle(metadata.value("title").toString());
+
+	if(metadata.contains("announce")) {
+		session->addAnnouncement(metadata["announce"].toString());
+	}
+
+	SessionHistory::Flags flags;
+	if(metadata.value("nsfm").toBool())
+		flags |= SessionHistory::Nsfm;
+	if(metadata.value("persistent").toBool())
+		flags |= SessionHistory::Persistent;
+	if(metadata.value("preserveChat").toBool())
+		flags |= SessionHistory::PreserveChat;
+	if(metadata.value("deputies").toBool())
+		flags |= SessionHistory::Deputies;
+	session->setFlags(flags);
+
+	// Set initial history. The messages are shared with the template cache.
+	for(const protocol::MessagePtr &msg : t.content->messages)
+		session->addSharedMessage(msg);
+
+	return true;
 }
 
+}
@@ -21,12 +21,14 @@
 #define DP_SERVER_TEMPLATEFILES_H
 
 #include "../shared/server/templateloader.h"
+#include "../shared/net/message.h"
 
 #include <QObject>
 #include <QDir>
 #include <QJsonObject>
 #include <QDateTime>
 #include <QHash>
+#include <QSharedPointer>
 
 class QFileSystemWatcher;
 
@@ -48,10 +50,28 @@ private slots:
 private:
 	QJsonObject templateFileDescription(const QString &path, const QString &alias) const;
 
+	/**
+	 * @brief Parsed template file content
+	 *
+	 * The content is immutable once loaded, so the messages can be shared
+	 * by all sessions instantiated from the same template.
+	 */
+	struct TemplateContent {
+		QJsonObject metadata;
+		protocol::MessageList messages;
+		QDateTime lastmod;
+	};
+	typedef QSharedPointer<const TemplateContent> TemplateContentPtr;
+
+	static TemplateContentPtr loadContent(const QString &path, const QDateTime &lastmod);
+
 	struct Template {
 		QJsonObject description;
 		QString filename;
 		QDateTime lastmod;
+
+		// Loaded on first use and reused until the file changes
+		mutable TemplateContentPtr content;
 	};
 
 	QHash<QString,Template> m_templates;
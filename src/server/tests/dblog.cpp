@@ -2,6 +2,7 @@
 #include "../dblog.h"
 
 #include <QtTest/QtTest>
+#include <QThread>
 
 using server::Database;
 using server::DbLog;
@@ -45,7 +46,68 @@ private slots:
 		QCOMPARE(logEntryCount(), 1);
 	}
 
+	void testBackgroundWriter()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+
+		// File databases use a background writer thread
+		m_db.reset(new Database);
+		QVERIFY(m_db->openFile(dir.filePath("test.db")));
+
+		logger = dynamic_cast<DbLog*>(m_db->logger());
+		QVERIFY(logger);
+		QVERIFY(logger->hasThreadSafeQueries());
+		logger->setSilent(true);
+
+		const QDateTime now = QDateTime::currentDateTimeUtc();
+		for(int i=0;i<10;++i)
+			logger->logMessage(Log(now, QUuid(), "test", Log::Level::Info, Log::Topic::Status, QString::number(i)));
+
+		// Pending entries are written before querying
+		QCOMPARE(logEntryCount(), 10);
+
+		m_db.reset();
+	}
+
+	void testQueryThreadConnection()
+	{
+		QTemporaryDir dir;
+		QVERIFY(dir.isValid());
+
+		m_db.reset(new Database);
+		QVERIFY(m_db->openFile(dir.filePath("test.db")));
+
+		logger = dynamic_cast<DbLog*>(m_db->logger());
+		QVERIFY(logger);
+		logger->setSilent(true);
+		logger->logMessage(Log(QDateTime::currentDateTimeUtc(), QUuid(), "test", Log::Level::Info, Log::Topic::Status, "test"));
+
+		const int connections = QSqlDatabase::connectionNames().size();
+
+		// Queries made in another thread use a connection of their own,
+		// which is removed with the log.
+		QueryThread thread(logger);
+		thread.start();
+		QVERIFY(thread.wait(5000));
+		QCOMPARE(thread.count, 1);
+		QCOMPARE(QSqlDatabase::connectionNames().size(), connections + 1);
+
+		m_db.reset();
+		for(const QString &name : QSqlDatabase::connectionNames())
+			QVERIFY(!name.startsWith("dblog-"));
+	}
+
 private:
+	struct QueryThread : public QThread {
+		QueryThread(DbLog *logger) : logger(logger), count(-1) { }
+		void run() override {
+			count = logger->getLogEntries(QUuid(), QDateTime(), Log::Level::Debug, 0, 0).size();
+		}
+		DbLog *logger;
+		int count;
+	};
+
 	int logEntryCount()
 	{
 		return logger->getLogEntries(QUuid(), QDateTime(), Log::Level::Debug, 0, 0).size();
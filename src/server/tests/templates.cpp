@@ -69,6 +69,22 @@ private slots:
 
 		QCOMPARE(msgs.at(0)->type(), protocol::MSG_CANVAS_RESIZE);
 		QCOMPARE(msgs.at(1)->type(), protocol::MSG_LAYER_CREATE);
+
+		// A second session from the same template shares the parsed messages
+		InMemoryHistory history2(
+			QUuid::createUuid(),
+			"test",
+			protocol::ProtocolVersion::fromString(desc.value("protocol").toString()),
+			desc.value("founder").toString()
+			);
+
+		QVERIFY(templates.init(&history2));
+
+		protocol::MessageList msgs2;
+		std::tie(msgs2, last) = history2.getBatch(-1);
+		QCOMPARE(msgs2.size(), 2);
+		QCOMPARE(&(*msgs2.at(0)), &(*msgs.at(0)));
+		QCOMPARE(history2.title(), QString("Test"));
 	}
 
 private:
@@ -22,6 +22,8 @@
 #include "multiserver.h"
 
 #include "../shared/server/jsonapi.h"
+#include "../shared/server/serverconfig.h"
+#include "../shared/server/serverlog.h"
 
 #include <QJsonObject>
 #include <QMetaObject>
@@ -47,6 +49,21 @@ void Webadmin::setBasicAuth(const QString &userpass)
 
 void Webadmin::setSessions(MultiServer *server)
 {
+	m_server->addRequestHandler("^/metrics/?$", [server](const HttpRequest &req) {
+		if(req.method() != HttpRequest::GET && req.method() != HttpRequest::HEAD)
+			return HttpResponse::MethodNotAllowed(QStringList() << "GET" << "HEAD");
+
+		QByteArray metrics;
+		QMetaObject::invokeMethod(
+			server, "metrics", Qt::BlockingQueuedConnection,
+			Q_RETURN_ARG(QByteArray, metrics)
+			);
+
+		HttpResponse response(200, metrics);
+		response.setHeader("Content-Type", "text/plain; version=0.0.4");
+		return response;
+	});
+
 	m_server->addRequestHandler(".*", [server](const HttpRequest &req) {
 		JsonApiMethod m;
 		switch(req.method()) {
@@ -91,15 +108,22 @@ void Webadmin::setSessions(MultiServer *server)
 
 		JsonApiResult result;
 
-		// The HTTP server runs in another thread, so we can't
-		// call the main server directly
-		QMetaObject::invokeMethod(
-			server, "callJsonApi", Qt::BlockingQueuedConnection,
-			Q_RETURN_ARG(JsonApiResult, result),
-			Q_ARG(JsonApiMethod, m),
-			Q_ARG(QStringList, path),
-			Q_ARG(QJsonObject, reqBodyDoc.object())
-			);
+		if(m == JsonApiMethod::Get && path.value(0) == "log" && server->config()->logger()->hasThreadSafeQueries()) {
+			// Log queries can be slow, so don't block the main thread with them
+			// when the log can be queried from here.
+			result = server->logJsonApi(m, path.mid(1), reqBodyDoc.object());
+
+		} else {
+			// The HTTP server runs in another thread, so we can't
+			// call the main server directly
+			QMetaObject::invokeMethod(
+				server, "callJsonApi", Qt::BlockingQueuedConnection,
+				Q_RETURN_ARG(JsonApiResult, result),
+				Q_ARG(JsonApiMethod, m),
+				Q_ARG(QStringList, path),
+				Q_ARG(QJsonObject, reqBodyDoc.object())
+				);
+		}
 
 		return HttpResponse::JsonResponse(result.body, result.status);
 	});
@@ -197,6 +197,21 @@ QRect DrawDabsClassic::bounds() const
 	return QRect(minX/4, minY/4, (maxX-minX)/4, (maxY-minY)/4);
 }
 
+QVector<QRect> DrawDabsClassic::dabBounds() const
+{
+	QVector<QRect> rects;
+	rects.reserve(m_dabs.size());
+
+	int x = m_x, y = m_y;
+	for(const auto dab : m_dabs) {
+		const int r = dab.size/(256*2)*4+1;
+		x += dab.x;
+		y += dab.y;
+		rects << QRect(QPoint((x-r)/4, (y-r)/4), QPoint((x+r)/4, (y+r)/4));
+	}
+	return rects;
+}
+
 bool DrawDabsClassic::extend(const DrawDabs &dabs)
 {
 	if(dabs.type() != type())
@@ -409,6 +424,21 @@ QRect DrawDabsPixel::bounds() const
 	return QRect(minX, minY, maxX-minX, maxY-minY);
 }
 
+QVector<QRect> DrawDabsPixel::dabBounds() const
+{
+	QVector<QRect> rects;
+	rects.reserve(m_dabs.size());
+
+	int x = m_x, y = m_y;
+	for(const auto dab : m_dabs) {
+		const int r = dab.size/2+1;
+		x += dab.x;
+		y += dab.y;
+		rects << QRect(QPoint(x-r, y-r), QPoint(x+r, y+r));
+	}
+	return rects;
+}
+
 bool DrawDabsPixel::extend(const DrawDabs &dabs)
 {
 	if(dabs.type() != type())
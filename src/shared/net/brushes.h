@@ -90,6 +90,9 @@ public:
 	//! Get the bounding rectangle of the dab vector
 	virtual QRect bounds() const = 0;
 
+	//! Get the bounding rectangles of the individual dabs
+	virtual QVector<QRect> dabBounds() const = 0;
+
 	/**
 	 * @brief Append the given dab message's dabs to this message's dab vector.
 	 *
@@ -152,6 +155,7 @@ public:
 
 	QPoint lastPoint() const override;
 	QRect bounds() const override;
+	QVector<QRect> dabBounds() const override;
 	bool extend(const DrawDabs &dab) override;
 
 protected:
@@ -218,6 +222,7 @@ public:
 
 	QPoint lastPoint() const override;
 	QRect bounds() const override;
+	QVector<QRect> dabBounds() const override;
 	bool extend(const DrawDabs &dab) override;
 
 protected:
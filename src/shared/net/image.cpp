@@ -455,4 +455,123 @@ MoveRegion *MoveRegion::fromText(uint8_t ctx, const Kwargs &kwargs)
 		);
 }
 
+void InflateCache::prepare(const QByteArray &compressed) const
+{
+	{
+		QMutexLocker lock(&m_mutex);
+		if(m_ready || m_busy || m_done)
+			return;
+		m_busy = true;
+	}
+
+	// Decompress without holding the lock
+	const QByteArray data = qUncompress(compressed);
+
+	QMutexLocker lock(&m_mutex);
+	if(!m_done) {
+		m_data = data;
+		m_ready = true;
+	}
+	m_busy = false;
+}
+
+QByteArray InflateCache::take(const QByteArray &compressed) const
+{
+	{
+		QMutexLocker lock(&m_mutex);
+		// Don't keep the result of a prepare() that is still running, and
+		// don't let a lookahead job still waiting in the thread pool
+		// prepare the data again after the message has been applied
+		m_done = true;
+
+		if(m_ready) {
+			QByteArray data;
+			data.swap(m_data);
+			m_ready = false;
+			return data;
+		}
+	}
+
+	return qUncompress(compressed);
+}
+
+void InflateCache::release() const
+{
+	QMutexLocker lock(&m_mutex);
+	m_data = QByteArray();
+	m_ready = false;
+	m_done = true;
+}
+
+// Bigger images are decompressed only when used, so that a long queue
+// of prepared messages doesn't take up too much memory.
+static const quint64 MAX_PREINFLATE_SIZE = 4 * 1024 * 1024;
+
+bool canPreInflate(const Message &msg)
+{
+	switch(msg.type()) {
+	case MSG_PUTIMAGE: {
+		const PutImage &m = static_cast<const PutImage&>(msg);
+		return quint64(m.width()) * m.height() * 4 <= MAX_PREINFLATE_SIZE;
+	}
+	case MSG_PUTTILE:
+		return !static_cast<const PutTile&>(msg).isSolidColor();
+	case MSG_CANVAS_BACKGROUND:
+		return !static_cast<const CanvasBackground&>(msg).isSolidColor();
+	case MSG_REGION_MOVE:
+		return !static_cast<const MoveRegion&>(msg).mask().isEmpty();
+	default:
+		return false;
+	}
+}
+
+void preInflate(const Message &msg)
+{
+	if(!canPreInflate(msg))
+		return;
+
+	switch(msg.type()) {
+	case MSG_PUTIMAGE: {
+		const PutImage &m = static_cast<const PutImage&>(msg);
+		m.m_inflated.prepare(m.m_image);
+		break;
+	}
+	case MSG_PUTTILE: {
+		const PutTile &m = static_cast<const PutTile&>(msg);
+		m.m_inflated.prepare(m.m_image);
+		break;
+	}
+	case MSG_CANVAS_BACKGROUND: {
+		const CanvasBackground &m = static_cast<const CanvasBackground&>(msg);
+		m.m_inflated.prepare(m.m_image);
+		break;
+	}
+	case MSG_REGION_MOVE: {
+		const MoveRegion &m = static_cast<const MoveRegion&>(msg);
+		m.m_inflated.prepare(m.m_mask);
+		break;
+	}
+	default: break;
+	}
+}
+
+void releaseInflated(const Message &msg)
+{
+	switch(msg.type()) {
+	case MSG_PUTIMAGE:
+		static_cast<const PutImage&>(msg).m_inflated.release();
+		break;
+	case MSG_PUTTILE:
+		static_cast<const PutTile&>(msg).m_inflated.release();
+		break;
+	case MSG_CANVAS_BACKGROUND:
+		static_cast<const CanvasBackground&>(msg).m_inflated.release();
+		break;
+	case MSG_REGION_MOVE:
+		static_cast<const MoveRegion&>(msg).m_inflated.release();
+		break;
+	default: break;
+	}
+}
+
 }
@@ -24,9 +24,43 @@
 #include <QByteArray>
 #include <QList>
 #include <QRect>
+#include <QMutex>
 
 namespace protocol {
 
+/**
+ * @brief A decompressed copy of a DEFLATEd payload
+ *
+ * Decompression can be done ahead of time in another thread. The result is
+ * kept only until it is taken, since messages stay in the session history
+ * long after they have been applied.
+ *
+ * If the data is taken while it is still being prepared, take() decompresses
+ * it by itself and the prepared copy is discarded when done. Once taken or
+ * released, the data is not prepared again.
+ */
+class InflateCache {
+public:
+	InflateCache() : m_ready(false), m_busy(false), m_done(false) { }
+	InflateCache(const InflateCache &) : m_ready(false), m_busy(false), m_done(false) { }
+
+	//! Decompress the data now so take() won't have to
+	void prepare(const QByteArray &compressed) const;
+
+	//! Get the prepared data (releasing it) or decompress it on the spot
+	QByteArray take(const QByteArray &compressed) const;
+
+	//! Drop the prepared data, if any
+	void release() const;
+
+private:
+	mutable QMutex m_mutex;
+	mutable QByteArray m_data;
+	mutable bool m_ready;
+	mutable bool m_busy;
+	mutable bool m_done;
+};
+
 /**
  * @brief Draw a bitmap onto a layer
  *
@@ -63,6 +97,9 @@ public:
 	uint32_t height() const { return m_h; }
 	const QByteArray &image() const { return m_image; }
 
+	//! Get the decompressed image data (see preInflate())
+	QByteArray inflatedImage() const { return m_inflated.take(m_image); }
+
 	QString messageName() const override { return QStringLiteral("putimage"); }
 
 protected:
@@ -79,6 +116,10 @@ private:
 	uint32_t m_w;
 	uint32_t m_h;
 	QByteArray m_image;
+	InflateCache m_inflated;
+
+	friend void preInflate(const Message &msg);
+	friend void releaseInflated(const Message &msg);
 };
 
 /**
@@ -136,6 +177,9 @@ public:
 
 	bool isSolidColor() const { return m_image.length() == 4; }
 
+	//! Get the decompressed tile data (see preInflate())
+	QByteArray inflatedImage() const { return m_inflated.take(m_image); }
+
 	QString messageName() const override { return QStringLiteral("puttile"); }
 
 protected:
@@ -151,6 +195,10 @@ private:
 	uint16_t m_repeat;
 	uint8_t m_sublayer;
 	QByteArray m_image;
+	InflateCache m_inflated;
+
+	friend void preInflate(const Message &msg);
+	friend void releaseInflated(const Message &msg);
 };
 
 /**
@@ -188,6 +236,9 @@ public:
 
 	bool isSolidColor() const { return m_image.length() == 4; }
 
+	//! Get the decompressed tile data (see preInflate())
+	QByteArray inflatedImage() const { return m_inflated.take(m_image); }
+
 	QString messageName() const override { return QStringLiteral("background"); }
 
 protected:
@@ -198,6 +249,10 @@ protected:
 
 private:
 	QByteArray m_image;
+	InflateCache m_inflated;
+
+	friend void preInflate(const Message &msg);
+	friend void releaseInflated(const Message &msg);
 };
 
 
@@ -313,6 +368,9 @@ public:
 
 	QByteArray mask() const { return m_mask; }
 
+	//! Get the decompressed mask bitmap (see preInflate())
+	QByteArray inflatedMask() const { return m_inflated.take(m_mask); }
+
 	QString messageName() const override { return QStringLiteral("moveregion"); }
 
 	QRect sourceBounds() const { return QRect(bx(), by(), bw(), bh()); }
@@ -334,8 +392,33 @@ private:
 	int32_t m_bx, m_by, m_bw, m_bh;
 	int32_t m_x1, m_y1, m_x2, m_y2, m_x3, m_y3, m_x4, m_y4;
 	QByteArray m_mask;
+	InflateCache m_inflated;
+
+	friend void preInflate(const Message &msg);
+	friend void releaseInflated(const Message &msg);
 };
 
+/**
+ * @brief Does the message have a payload preInflate() would decompress?
+ */
+bool canPreInflate(const Message &msg);
+
+/**
+ * @brief Decompress the image payload of a message ahead of time
+ *
+ * This is safe to call from any thread. Messages without a compressed
+ * payload (including solid color tiles) and very large images are ignored.
+ */
+void preInflate(const Message &msg);
+
+/**
+ * @brief Drop the payload decompressed by preInflate()
+ *
+ * This should be called for messages that were prepared but will not be
+ * applied, since messages stay in the session history.
+ */
+void releaseInflated(const Message &msg);
+
 }
 
 #endif
@@ -23,6 +23,7 @@
 #include <QMap>
 #include <QString>
 #include <QList>
+#include <QAtomicInt>
 
 namespace protocol {
 
@@ -34,6 +35,7 @@ enum MessageType {
 	MSG_COMMAND=0,
 	MSG_DISCONNECT,
 	MSG_PING,
+	MSG_COMPRESSED, // compressed stream frame (handled by MessageQueue)
 
 	// Reserved ID for internal use (not serializable)
 	MSG_INTERNAL=31,
@@ -316,7 +318,7 @@ protected:
 private:
 	const MessageType m_type;
 	MessageUndoState _undone;
-	int m_refcount;
+	QAtomicInt m_refcount;
 	uint8_t m_contextid;
 };
 
@@ -353,7 +355,8 @@ protected:
 * This object is the length of a normal pointer so it can be used
 * efficiently with QList.
 *
-* @todo use QAtomicInt if thread safety is needed
+* The reference count is atomic, so the same message can be queued
+* for sending in several network threads at once.
 */
 class MessagePtr {
 public:
@@ -368,29 +371,29 @@ public:
 		: d(msg)
 	{
 		Q_ASSERT(d);
-		Q_ASSERT(d->m_refcount==0);
-		++d->m_refcount;
+		Q_ASSERT(d->m_refcount.load()==0);
+		d->m_refcount.ref();
 	}
 
-	MessagePtr(const MessagePtr &ptr) : d(ptr.d) { ++d->m_refcount; }
+	MessagePtr(const MessagePtr &ptr) : d(ptr.d) { d->m_refcount.ref(); }
 
 	static MessagePtr fromNullable(const NullableMessageRef &ref) { return MessagePtr(ref); }
 
 	~MessagePtr()
 	{
-		Q_ASSERT(d->m_refcount>0);
-		if(--d->m_refcount == 0)
+		Q_ASSERT(d->m_refcount.load()>0);
+		if(!d->m_refcount.deref())
 			delete d;
 	}
 
 	MessagePtr &operator=(const MessagePtr &msg)
 	{
 		if(msg.d != d) {
-			Q_ASSERT(d->m_refcount>0);
-			if(--d->m_refcount == 0)
+			Q_ASSERT(d->m_refcount.load()>0);
+			if(!d->m_refcount.deref())
 				delete d;
 			d = msg.d;
-			++d->m_refcount;
+			d->m_refcount.ref();
 		}
 		return *this;
 	}
@@ -432,19 +435,19 @@ public:
 		: d(msg)
 	{
 		if(d) {
-			Q_ASSERT(d->m_refcount==0);
-			++d->m_refcount;
+			Q_ASSERT(d->m_refcount.load()==0);
+			d->m_refcount.ref();
 		}
 	}
 
-	NullableMessageRef(const MessagePtr &ptr) : d(&(*ptr)) { ++d->m_refcount; }
-	NullableMessageRef(const NullableMessageRef &ptr) : d(ptr.d) { if(d) ++d->m_refcount; }
+	NullableMessageRef(const MessagePtr &ptr) : d(&(*ptr)) { d->m_refcount.ref(); }
+	NullableMessageRef(const NullableMessageRef &ptr) : d(ptr.d) { if(d) d->m_refcount.ref(); }
 
 	~NullableMessageRef()
 	{
 		if(d) {
-			Q_ASSERT(d->m_refcount>0);
-			if(--d->m_refcount == 0)
+			Q_ASSERT(d->m_refcount.load()>0);
+			if(!d->m_refcount.deref())
 				delete d;
 		}
 	}
@@ -453,13 +456,13 @@ public:
 	{
 		if(msg.d != d) {
 			if(d) {
-				Q_ASSERT(d->m_refcount>0);
-				if(--d->m_refcount == 0)
+				Q_ASSERT(d->m_refcount.load()>0);
+				if(!d->m_refcount.deref())
 					delete d;
 			}
 			d = msg.d;
 			if(d)
-				++d->m_refcount;
+				d->m_refcount.ref();
 		}
 		return *this;
 	}
@@ -468,12 +471,12 @@ public:
 	{
 		if(&(*msg) != d) {
 			if(d) {
-				Q_ASSERT(d->m_refcount>0);
-				if(--d->m_refcount == 0)
+				Q_ASSERT(d->m_refcount.load()>0);
+				if(!d->m_refcount.deref())
 					delete d;
 			}
 			d = &(*msg);
-			++d->m_refcount;
+			d->m_refcount.ref();
 		}
 		return *this;
 	}
@@ -497,7 +500,7 @@ MessagePtr::MessagePtr(const NullableMessageRef &ref)
 {
 	if(!d)
 		qFatal("MessagePtr::fromNullable(nullptr) called!");
-	++d->m_refcount;
+	d->m_refcount.ref();
 }
 
 bool MessagePtr::equals(const NullableMessageRef &m) const { return !m.isNull() && d->equals(*m); }
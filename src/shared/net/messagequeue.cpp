@@ -23,8 +23,11 @@
 #include <QTcpSocket>
 #include <QDateTime>
 #include <QTimer>
+#include <QtEndian>
 #include <cstring>
 
+#include <zlib.h>
+
 #ifndef NDEBUG
 #include <QThread>
 #endif
@@ -34,14 +37,64 @@ namespace protocol {
 // Reserve enough buffer space for one complete message
 static const int MAX_BUF_LEN = 1024*64 + protocol::Message::HEADER_LEN;
 
+// The send buffer must also fit a batch of compressed frames
+static const int SEND_BUF_LEN = MAX_BUF_LEN * 2;
+
+// Compressed output is flushed after about this much input
+static const int COMPRESS_BATCH = 1024 * 16;
+
+// Speed matters more than compression ratio on a busy server
+static const int COMPRESSION_LEVEL = 4;
+
+// Maximum payload length of a compressed frame
+static const int MAX_FRAME_PAYLOAD = 0xffff;
+
+// Output buffer growth step when compressing or decompressing
+static const int ZLIB_CHUNK = 1024 * 64;
+
+// A compressed frame holds (part of) one flushed batch, so it can't legitimately
+// inflate to more than this. Anything bigger is a compression bomb.
+static const int MAX_INFLATED_FRAME = COMPRESS_BATCH + MAX_BUF_LEN * 2;
+
+struct MessageQueue::Compression {
+	z_stream deflater;
+	z_stream inflater;
+	bool deflaterReady;
+	bool inflaterReady;
+
+	QByteArray staging;  // uncompressed outgoing batch
+	QByteArray deflated; // compressed outgoing batch (not yet framed)
+	QByteArray inflated; // decompressed incoming data not yet parsed
+
+	Compression() : deflaterReady(false), inflaterReady(false)
+	{
+		memset(&deflater, 0, sizeof(deflater));
+		memset(&inflater, 0, sizeof(inflater));
+	}
+
+	~Compression()
+	{
+		if(deflaterReady)
+			deflateEnd(&deflater);
+		if(inflaterReady)
+			inflateEnd(&inflater);
+	}
+};
+
 MessageQueue::MessageQueue(QTcpSocket *socket, QObject *parent)
 	: QObject(parent), m_socket(socket),
 	  m_pingTimer(nullptr),
 	  m_lastRecvTime(0),
 	  m_idleTimeout(0), m_pingSent(0), m_closeWhenReady(false),
-	  m_ignoreIncoming(false),
-	  m_decodeOpaque(false)
+	  m_ignoreIncoming(false), m_readPaused(false),
+	  m_decodeOpaque(false),
+	  m_compression(nullptr), m_compressOutgoing(false), m_acceptCompressed(false),
+	  m_rawBytesSent(0), m_wireBytesSent(0),
+	  m_rawBytesReceived(0), m_wireBytesReceived(0)
 {
+	for(int i=0;i<PRIORITY_COUNT;++i)
+		m_outboxBytes[i] = 0;
+
 	connect(socket, SIGNAL(readyRead()), this, SLOT(readData()));
 	connect(socket, SIGNAL(bytesWritten(qint64)), this, SLOT(dataWritten(qint64)));
 
@@ -50,7 +103,7 @@ MessageQueue::MessageQueue(QTcpSocket *socket, QObject *parent)
 	}
 
 	m_recvbuffer = new char[MAX_BUF_LEN];
-	m_sendbuffer = new char[MAX_BUF_LEN];
+	m_sendbuffer = new char[SEND_BUF_LEN];
 	m_recvbytes = 0;
 	m_sentbytes = 0;
 	m_sendbuflen = 0;
@@ -104,6 +157,31 @@ MessageQueue::~MessageQueue()
 {
 	delete [] m_recvbuffer;
 	delete [] m_sendbuffer;
+	delete m_compression;
+}
+
+void MessageQueue::setCompression(bool compress)
+{
+	if(compress) {
+		if(!m_compression)
+			m_compression = new Compression;
+
+		if(!m_compression->deflaterReady) {
+			if(deflateInit(&m_compression->deflater, COMPRESSION_LEVEL) != Z_OK) {
+				qWarning("Couldn't initialize deflate stream");
+				return;
+			}
+			m_compression->deflaterReady = true;
+		}
+	}
+
+	// Each compressed batch is flushed, so switching is possible at any point
+	m_compressOutgoing = compress;
+
+	// Compression is negotiated for both directions at once. Frames may
+	// still be in flight when it is switched off, so they stay accepted.
+	if(compress)
+		m_acceptCompressed = true;
 }
 
 bool MessageQueue::isPending() const
@@ -116,19 +194,22 @@ MessagePtr MessageQueue::getPending()
 	return m_inbox.dequeue();
 }
 
-void MessageQueue::send(const MessagePtr &message)
+void MessageQueue::send(const MessagePtr &message, Priority priority)
 {
 	if(!m_closeWhenReady) {
-		m_outbox.enqueue(message);
+		m_outbox[priority].enqueue(message);
+		m_outboxBytes[priority] += message->length();
 		if(m_sendbuflen==0)
 			writeData();
 	}
 }
 
-void MessageQueue::send(const MessageList &messages)
+void MessageQueue::send(const MessageList &messages, Priority priority)
 {
 	if(!m_closeWhenReady) {
-		m_outbox << messages;
+		m_outbox[priority] << messages;
+		for(const MessagePtr &msg : messages)
+			m_outboxBytes[priority] += msg->length();
 		if(m_sendbuflen==0)
 			writeData();
 	}
@@ -137,12 +218,44 @@ void MessageQueue::send(const MessageList &messages)
 void MessageQueue::sendNow(MessagePtr msg)
 {
 	if(!m_closeWhenReady) {
-		m_outbox.prepend(msg);
+		m_outbox[Control].prepend(msg);
+		m_outboxBytes[Control] += msg->length();
 		if(m_sendbuflen==0)
 			writeData();
 	}
 }
 
+void MessageQueue::clearQueue(Priority priority)
+{
+	m_outbox[priority].clear();
+	m_outboxBytes[priority] = 0;
+}
+
+bool MessageQueue::isOutboxEmpty() const
+{
+	for(int i=0;i<PRIORITY_COUNT;++i) {
+		if(!m_outbox[i].isEmpty())
+			return false;
+	}
+	return true;
+}
+
+MessagePtr MessageQueue::takeNextOutgoing()
+{
+	Q_ASSERT(!isOutboxEmpty());
+
+	// Control messages are small and time sensitive, so they always go first.
+	// Live traffic goes before catch-up, which keeps history in order when
+	// a client falls behind and its next batch is queued as catch-up.
+	int priority = Control;
+	while(m_outbox[priority].isEmpty())
+		++priority;
+
+	MessagePtr msg = m_outbox[priority].dequeue();
+	m_outboxBytes[priority] -= msg->length();
+	return msg;
+}
+
 void MessageQueue::sendDisconnect(int reason, const QString &message)
 {
 	send(MessagePtr(new protocol::Disconnect(0, protocol::Disconnect::Reason(reason), message)));
@@ -162,11 +275,28 @@ void MessageQueue::sendPing()
 	sendNow(MessagePtr(new Ping(0, false)));
 }
 
+void MessageQueue::setReadPaused(bool pause)
+{
+	if(m_readPaused == pause)
+		return;
+
+	m_readPaused = pause;
+	if(pause) {
+		// Limit the socket's own buffer too, so the data stays in the kernel's buffers
+		m_socket->setReadBufferSize(MAX_BUF_LEN);
+	} else {
+		m_socket->setReadBufferSize(0);
+
+		// We won't get another readyRead signal for data that arrived while paused
+		QTimer::singleShot(0, this, &MessageQueue::readData);
+	}
+}
+
 int MessageQueue::uploadQueueBytes() const
 {
 	int total = m_socket->bytesToWrite() + m_sendbuflen - m_sentbytes;
-	for(const MessagePtr msg : m_outbox)
-		total += msg->length();
+	for(int i=0;i<PRIORITY_COUNT;++i)
+		total += m_outboxBytes[i];
 	return total;
 }
 
@@ -181,6 +311,9 @@ qint64 MessageQueue::idleTime() const
 }
 
 void MessageQueue::readData() {
+	if(m_readPaused)
+		return;
+
 	bool gotmessage = false;
 	int read, totalread=0;
 	do {
@@ -201,37 +334,25 @@ void MessageQueue::readData() {
 		}
 
 		m_recvbytes += read;
+		m_wireBytesReceived += read;
 
 		// Extract all complete messages
 		int len;
 		while(m_recvbytes >= Message::HEADER_LEN && m_recvbytes >= (len=Message::sniffLength(m_recvbuffer))) {
 			// Whole message received!
-			NullableMessageRef msg = Message::deserialize((const uchar*)m_recvbuffer, m_recvbytes, m_decodeOpaque);
-			if(msg.isNull()) {
-				emit badData(len, (unsigned char)m_recvbuffer[2], (unsigned char)m_recvbuffer[3]);
+			if((unsigned char)m_recvbuffer[2] == MSG_COMPRESSED) {
+				if(!m_acceptCompressed) {
+					qWarning("Received a compressed frame, but compression was not negotiated");
+					emit badData(len, MSG_COMPRESSED, 0);
 
-			} else {
-				 if(msg->type() == MSG_PING) {
-					// Special handling for Ping messages
-					bool isPong = msg.cast<Ping>().isPong();
-
-					if(isPong) {
-						if(m_pingSent==0) {
-							qWarning("Received Pong, but no Ping was sent!");
-
-						} else {
-							qint64 roundtrip = QDateTime::currentMSecsSinceEpoch() - m_pingSent;
-							m_pingSent = 0;
-							emit pingPong(roundtrip);
-						}
-					} else {
-						sendNow(MessagePtr(new Ping(0, true)));
-					}
-
-				} else {
-					m_inbox.enqueue(MessagePtr::fromNullable(msg));
+				} else if(inflateFrame(m_recvbuffer + Message::HEADER_LEN, len - Message::HEADER_LEN)) {
 					gotmessage = true;
 				}
+
+			} else {
+				m_rawBytesReceived += len;
+				if(handleMessage(m_recvbuffer, len))
+					gotmessage = true;
 			}
 
 			if(len < m_recvbytes) {
@@ -255,39 +376,198 @@ void MessageQueue::readData() {
 		emit messageAvailable();
 }
 
+bool MessageQueue::handleMessage(const char *data, int len)
+{
+	NullableMessageRef msg = Message::deserialize((const uchar*)data, len, m_decodeOpaque);
+	if(msg.isNull()) {
+		emit badData(len, (unsigned char)data[2], (unsigned char)data[3]);
+		return false;
+	}
+
+	if(msg->type() == MSG_PING) {
+		// Special handling for Ping messages
+		bool isPong = msg.cast<Ping>().isPong();
+
+		if(isPong) {
+			if(m_pingSent==0) {
+				qWarning("Received Pong, but no Ping was sent!");
+
+			} else {
+				qint64 roundtrip = QDateTime::currentMSecsSinceEpoch() - m_pingSent;
+				m_pingSent = 0;
+				emit pingPong(roundtrip);
+			}
+		} else {
+			sendNow(MessagePtr(new Ping(0, true)));
+		}
+		return false;
+	}
+
+	m_inbox.enqueue(MessagePtr::fromNullable(msg));
+	return true;
+}
+
+bool MessageQueue::inflateFrame(const char *data, int len)
+{
+	if(!m_compression)
+		m_compression = new Compression;
+
+	Compression &c = *m_compression;
+	if(!c.inflaterReady) {
+		if(inflateInit(&c.inflater) != Z_OK) {
+			qWarning("Couldn't initialize inflate stream");
+			emit badData(len, MSG_COMPRESSED, 0);
+			return false;
+		}
+		c.inflaterReady = true;
+	}
+
+	c.inflater.next_in = (Bytef*)data;
+	c.inflater.avail_in = len;
+
+	// Decompress a chunk at a time and extract messages as we go, so the
+	// buffer stays small even if the frame is very compressible.
+	bool gotmessage = false;
+	int inflatedTotal = 0;
+	do {
+		if(inflatedTotal > MAX_INFLATED_FRAME) {
+			qWarning("Compressed frame inflates to more than %d bytes", MAX_INFLATED_FRAME);
+			c.inflated.clear();
+			emit badData(len, MSG_COMPRESSED, 0);
+			return gotmessage;
+		}
+
+		const int pos = c.inflated.size();
+		c.inflated.resize(pos + ZLIB_CHUNK);
+		c.inflater.next_out = (Bytef*)c.inflated.data() + pos;
+		c.inflater.avail_out = ZLIB_CHUNK;
+
+		const int ret = inflate(&c.inflater, Z_SYNC_FLUSH);
+		c.inflated.resize(pos + ZLIB_CHUNK - c.inflater.avail_out);
+		inflatedTotal += ZLIB_CHUNK - c.inflater.avail_out;
+
+		if(ret != Z_OK && ret != Z_BUF_ERROR) {
+			qWarning("Invalid compressed data (%d)", ret);
+			c.inflated.clear();
+			emit badData(len, MSG_COMPRESSED, 0);
+			return gotmessage;
+		}
+
+		int consumed = 0, msglen;
+		while(c.inflated.size() - consumed >= Message::HEADER_LEN &&
+			c.inflated.size() - consumed >= (msglen=Message::sniffLength(c.inflated.constData() + consumed)))
+		{
+			m_rawBytesReceived += msglen;
+			if(handleMessage(c.inflated.constData() + consumed, msglen))
+				gotmessage = true;
+			consumed += msglen;
+		}
+		c.inflated.remove(0, consumed);
+
+	} while(c.inflater.avail_in > 0 || c.inflater.avail_out == 0);
+
+	return gotmessage;
+}
+
 void MessageQueue::dataWritten(qint64 bytes)
 {
 	emit bytesSent(bytes);
 
 	// Write more once the buffer is empty
 	if(m_socket->bytesToWrite()==0) {
-		if(m_sendbuflen==0 && m_outbox.isEmpty())
+		if(m_sendbuflen==0 && isOutboxEmpty())
 			emit allSent();
 		else
 			writeData();
 	}
 }
 
+int MessageQueue::fillSendBuffer()
+{
+	MessagePtr msg = takeNextOutgoing();
+	const int len = msg->serialize(m_sendbuffer);
+	Q_ASSERT(len <= MAX_BUF_LEN);
+	m_rawBytesSent += len;
+
+	if(msg->type() == protocol::MSG_DISCONNECT) {
+		// Automatically disconnect after Disconnect notification is sent
+		m_closeWhenReady = true;
+		for(int i=0;i<PRIORITY_COUNT;++i)
+			clearQueue(Priority(i));
+	}
+
+	return len;
+}
+
+int MessageQueue::fillCompressedSendBuffer()
+{
+	Q_ASSERT(m_compression && m_compression->deflaterReady);
+	Compression &c = *m_compression;
+
+	// Collect a batch of messages
+	int rawlen = 0;
+	while(rawlen < COMPRESS_BATCH && !isOutboxEmpty()) {
+		MessagePtr msg = takeNextOutgoing();
+		if(c.staging.size() < rawlen + msg->length())
+			c.staging.resize(rawlen + msg->length());
+		rawlen += msg->serialize(c.staging.data() + rawlen);
+
+		if(msg->type() == protocol::MSG_DISCONNECT) {
+			m_closeWhenReady = true;
+			for(int i=0;i<PRIORITY_COUNT;++i)
+				clearQueue(Priority(i));
+		}
+	}
+	m_rawBytesSent += rawlen;
+
+	// Compress and flush, so the receiver can decode everything right away
+	c.deflater.next_in = (Bytef*)c.staging.data();
+	c.deflater.avail_in = rawlen;
+
+	int outlen = 0;
+	do {
+		if(c.deflated.size() < outlen + ZLIB_CHUNK)
+			c.deflated.resize(outlen + ZLIB_CHUNK);
+		c.deflater.next_out = (Bytef*)c.deflated.data() + outlen;
+		c.deflater.avail_out = ZLIB_CHUNK;
+
+		const int ret = deflate(&c.deflater, Z_SYNC_FLUSH);
+		Q_ASSERT(ret != Z_STREAM_ERROR);
+		Q_UNUSED(ret);
+
+		outlen += ZLIB_CHUNK - c.deflater.avail_out;
+	} while(c.deflater.avail_out == 0);
+
+	// Split the output into frames
+	int pos = 0;
+	for(int framePos=0;framePos<outlen;) {
+		const int payload = qMin(MAX_FRAME_PAYLOAD, outlen - framePos);
+		Q_ASSERT(pos + Message::HEADER_LEN + payload <= SEND_BUF_LEN);
+
+		qToBigEndian(quint16(payload), (uchar*)m_sendbuffer + pos);
+		m_sendbuffer[pos+2] = MSG_COMPRESSED;
+		m_sendbuffer[pos+3] = 0;
+		memcpy(m_sendbuffer + pos + Message::HEADER_LEN, c.deflated.constData() + framePos, payload);
+
+		pos += Message::HEADER_LEN + payload;
+		framePos += payload;
+	}
+
+	return pos;
+}
+
 void MessageQueue::writeData() {
 	int sentBatch = 0;
 	bool sendMore = true;
 
 	while(sendMore && sentBatch < 1024*64) {
 		sendMore = false;
-		if(m_sendbuflen==0 && !m_outbox.isEmpty()) {
+		if(m_sendbuflen==0 && !isOutboxEmpty()) {
 			// Upload buffer is empty, but there are messages in the outbox
 			Q_ASSERT(m_sentbytes == 0);
-
-			MessagePtr msg = m_outbox.dequeue();
-			m_sendbuflen = msg->serialize(m_sendbuffer);
+			m_sendbuflen = m_compressOutgoing ? fillCompressedSendBuffer() : fillSendBuffer();
 			Q_ASSERT(m_sendbuflen>0);
-			Q_ASSERT(m_sendbuflen <= MAX_BUF_LEN);
-
-			if(msg->type() == protocol::MSG_DISCONNECT) {
-				// Automatically disconnect after Disconnect notification is sent
-				m_closeWhenReady = true;
-				m_outbox.clear();
-			}
+			Q_ASSERT(m_sendbuflen <= SEND_BUF_LEN);
 		}
 
 		if(m_sentbytes < m_sendbuflen) {
@@ -305,6 +585,7 @@ void MessageQueue::writeData() {
 				return;
 			}
 			m_sentbytes += sent;
+			m_wireBytesSent += sent;
 			sentBatch += sent;
 
 			Q_ASSERT(m_sentbytes <= m_sendbuflen);
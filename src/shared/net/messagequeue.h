@@ -45,6 +45,21 @@ public:
 	MessageQueue(const MessageQueue&) = delete;
 	~MessageQueue();
 
+	/**
+	 * @brief Upload queue priority classes
+	 *
+	 * The classes have strict priority: a message is sent only when
+	 * the queues of all the higher priority classes are empty.
+	 *
+	 * Messages within a single class are always sent in order.
+	 */
+	enum Priority {
+		Control, // pings, server replies, chat and other small messages
+		Live,    // regular traffic (default)
+		CatchUp  // bulk transfers such as session history
+	};
+	static const int PRIORITY_COUNT = CatchUp + 1;
+
 	/**
 	 * @brief Automatically decode opaque messages?
 	 *
@@ -53,6 +68,39 @@ public:
 	 */
 	void setDecodeOpaque(bool d) { m_decodeOpaque = d; }
 
+	/**
+	 * @brief Compress outgoing data
+	 *
+	 * When enabled, outgoing messages are fed through a deflate stream
+	 * and sent in MSG_COMPRESSED frames. The stream is flushed at the end of
+	 * each batch, so the receiver never has to wait for more data to decode
+	 * what has already been sent.
+	 *
+	 * Enable this only if the other end has announced support for it.
+	 * Incoming compressed frames are accepted once compression has been
+	 * enabled (or setAcceptCompressed() called.) Until then, they are
+	 * treated as bad data.
+	 */
+	void setCompression(bool compress);
+
+	//! Accept incoming compressed frames before compressing outgoing data
+	void setAcceptCompressed(bool accept) { m_acceptCompressed = accept; }
+
+	//! Is outgoing data being compressed?
+	bool isCompressing() const { return m_compressOutgoing; }
+
+	//! Total length of the messages sent (before compression)
+	qint64 rawBytesSent() const { return m_rawBytesSent; }
+
+	//! Total number of bytes written to the socket
+	qint64 wireBytesSent() const { return m_wireBytesSent; }
+
+	//! Total length of the messages received (after decompression)
+	qint64 rawBytesReceived() const { return m_rawBytesReceived; }
+
+	//! Total number of bytes read from the socket
+	qint64 wireBytesReceived() const { return m_wireBytesReceived; }
+
 	/**
 	 * @brief Check if there are new messages available
 	 * @return true if getPending will return a message
@@ -68,8 +116,25 @@ public:
 	/**
 	 * Enqueue a message for sending.
 	 */
-	void send(const MessagePtr &message);
-	void send(const MessageList &messages);
+	void send(const MessagePtr &message, Priority priority=Live);
+	void send(const MessageList &messages, Priority priority=Live);
+
+	/**
+	 * @brief Get the number of messages waiting in the given upload queue
+	 */
+	int queuedMessages(Priority priority) const { return m_outbox[priority].size(); }
+
+	/**
+	 * @brief Get the total length of the messages waiting in the given upload queue
+	 */
+	int queuedBytes(Priority priority) const { return m_outboxBytes[priority]; }
+
+	/**
+	 * @brief Discard all messages waiting in the given upload queue
+	 *
+	 * The message currently being uploaded (if any) is not affected.
+	 */
+	void clearQueue(Priority priority);
 
 	/**
 	 * @brief Gracefully disconnect
@@ -83,6 +148,18 @@ public:
 	 */
 	void sendDisconnect(int reason, const QString &message);
 
+	/**
+	 * @brief Stop reading from the socket
+	 *
+	 * While paused, incoming data is left in the socket buffer. Once it fills up,
+	 * TCP flow control will slow down the sender.
+	 * Messages already in the reception queue can still be taken with getPending().
+	 */
+	void setReadPaused(bool pause);
+
+	//! Is reading paused?
+	bool isReadPaused() const { return m_readPaused; }
+
 	/**
 	 * @brief Get the number of bytes in the upload queue
 	 * @return
@@ -181,7 +258,16 @@ private slots:
 	void checkIdleTimeout();
 
 private:
+	struct Compression;
+
 	void sendNow(MessagePtr msg);
+	bool isOutboxEmpty() const;
+	MessagePtr takeNextOutgoing();
+
+	bool handleMessage(const char *data, int len);
+	bool inflateFrame(const char *data, int len);
+	int fillSendBuffer();
+	int fillCompressedSendBuffer();
 
 	void writeData();
 
@@ -194,7 +280,8 @@ private:
 	int m_sendbuflen;   // length of the data in the upload buffer
 
 	QQueue<MessagePtr> m_inbox;  // pending messages
-	QQueue<MessagePtr> m_outbox; // messages to be sent
+	QQueue<MessagePtr> m_outbox[PRIORITY_COUNT]; // messages to be sent
+	int m_outboxBytes[PRIORITY_COUNT];           // total length of the queued messages
 
 	QTimer *m_idleTimer;
 	QTimer *m_pingTimer;
@@ -204,9 +291,18 @@ private:
 
 	bool m_closeWhenReady;
 	bool m_ignoreIncoming;
+	bool m_readPaused;
 
 	bool m_decodeOpaque;
 
+	Compression *m_compression;
+	bool m_compressOutgoing;
+	bool m_acceptCompressed;
+	qint64 m_rawBytesSent;
+	qint64 m_wireBytesSent;
+	qint64 m_rawBytesReceived;
+	qint64 m_wireBytesReceived;
+
 #ifndef NDEBUG
 	uint m_randomlag;
 #endif
@@ -23,27 +23,79 @@
 #include "opcommands.h"
 #include "serverlog.h"
 #include "serverconfig.h"
+#include "ratelimiter.h"
+#include "clientconnection.h"
 
-#include "../net/messagequeue.h"
 #include "../net/control.h"
 #include "../net/meta.h"
 
-#include <QSslSocket>
 #include <QStringList>
 #include <QPointer>
+#include <QSet>
+#include <QVarLengthArray>
+#include <QDateTime>
+#include <QTimer>
 
 namespace server {
 
 using protocol::MessagePtr;
 
+// History batches larger than this are sent with catch-up priority
+static const int LIVE_BATCH_MAX = 100;
+
+// When the upload backlog exceeds these limits, superseded pointer movements
+// are coalesced, or all of them dropped.
+static const int EPHEMERAL_COALESCE_BACKLOG = 1024 * 32;
+static const int EPHEMERAL_DROP_BACKLOG = 1024 * 256;
+
+static inline bool isEphemeral(const protocol::MessagePtr &msg)
+{
+	return msg->type() == protocol::MSG_MOVEPOINTER || msg->type() == protocol::MSG_LASERTRAIL;
+}
+
+bool Client::coalesceEphemeral(protocol::MessageList &batch, int from, bool dropAll)
+{
+	QVarLengthArray<bool, 256> keep(batch.size());
+	QSet<int> seen;
+	bool found = false;
+
+	for(int i=batch.size()-1;i>=0;--i) {
+		const protocol::MessagePtr &msg = batch.at(i);
+		keep[i] = true;
+		if(i >= from && isEphemeral(msg)) {
+			const int key = (msg->type() << 8) | msg->contextId();
+			if(dropAll || seen.contains(key)) {
+				keep[i] = false;
+				found = true;
+			} else {
+				seen.insert(key);
+			}
+		}
+	}
+
+	if(found) {
+		protocol::MessageList coalesced;
+		coalesced.reserve(batch.size());
+		for(int i=0;i<batch.size();++i) {
+			if(keep[i])
+				coalesced << batch.at(i);
+		}
+		batch = coalesced;
+	}
+
+	return found;
+}
+
 struct Client::Private {
 	QPointer<Session> session;
-	QTcpSocket *socket;
 	ServerLog *logger;
 
-	protocol::MessageQueue *msgqueue;
+	ClientConnection *connection;
 	protocol::MessageList holdqueue;
 	int historyPosition;
+	int catchupEnd;
+
+	RateLimiter rateLimiter;
 
 	int id;
 	QString username;
@@ -56,26 +108,25 @@ struct Client::Private {
 	bool isAuthenticated;
 	bool isMuted;
 
-	Private(QTcpSocket *socket, ServerLog *logger)
-		: socket(socket), logger(logger), msgqueue(nullptr),
-		historyPosition(-1), id(0),
+	Private(ServerLog *logger)
+		: logger(logger), connection(nullptr),
+		historyPosition(-1), catchupEnd(-1), id(0),
 		isOperator(false), isModerator(false), isTrusted(false), isAuthenticated(false), isMuted(false)
 	{
-		Q_ASSERT(socket);
 		Q_ASSERT(logger);
 	}
 };
 
-Client::Client(QTcpSocket *socket, ServerLog *logger, QObject *parent)
-	: QObject(parent), d(new Private(socket, logger))
+Client::Client(QTcpSocket *socket, ServerLog *logger, QThread *ioThread, QObject *parent)
+	: QObject(parent), d(new Private(logger))
 {
-	d->msgqueue = new protocol::MessageQueue(socket, this);
-	d->socket->setParent(this);
+	Q_ASSERT(socket);
+	d->connection = new ClientConnection(socket, ioThread, this);
 
-	connect(d->socket, &QAbstractSocket::disconnected, this, &Client::socketDisconnect);
-	connect(d->socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(socketError(QAbstractSocket::SocketError)));
-	connect(d->msgqueue, &protocol::MessageQueue::messageAvailable, this, &Client::receiveMessages);
-	connect(d->msgqueue, &protocol::MessageQueue::badData, this, &Client::gotBadData);
+	connect(d->connection, &ClientConnection::disconnected, this, &Client::socketDisconnect);
+	connect(d->connection, &ClientConnection::socketError, this, &Client::socketError);
+	connect(d->connection, &ClientConnection::messageAvailable, this, &Client::receiveMessages);
+	connect(d->connection, &ClientConnection::badData, this, &Client::gotBadData);
 }
 
 Client::~Client()
@@ -106,6 +157,28 @@ QJsonObject Client::description(bool includeSession) const
 	u["tls"] = isSecure();
 	if(includeSession && d->session)
 		u["session"] = d->session->idString();
+
+	static const char *queueNames[] = { "control", "live", "catchup" };
+	QJsonObject queues;
+	for(int i=0;i<protocol::MessageQueue::PRIORITY_COUNT;++i) {
+		const auto p = protocol::MessageQueue::Priority(i);
+		QJsonObject q;
+		q["messages"] = d->connection->queuedMessages(p);
+		q["bytes"] = d->connection->queuedBytes(p);
+		queues[queueNames[i]] = q;
+	}
+	u["queues"] = queues;
+
+	QJsonObject traffic;
+	const ClientConnection::Traffic t = d->connection->traffic();
+	traffic["compressed"] = d->connection->isCompressing();
+	traffic["rawIn"] = t.rawIn;
+	traffic["wireIn"] = t.wireIn;
+	traffic["rawOut"] = t.rawOut;
+	traffic["wireOut"] = t.wireOut;
+	u["traffic"] = traffic;
+
+	u["rateLimit"] = d->rateLimiter.description();
 	return u;
 }
 
@@ -146,11 +219,14 @@ void Client::setSession(Session *session)
 	d->session = session;
 	d->historyPosition = -1;
 
+	// The client is told how many messages to expect during the initial catch-up
+	d->catchupEnd = session ? session->history()->lastIndex() : -1;
+
 	// Enqueue the next batch (if available) when upload queue is empty
 	if(session)
-		connect(d->msgqueue, &protocol::MessageQueue::allSent, this, &Client::sendNextHistoryBatch);
+		connect(d->connection, &ClientConnection::allSent, this, &Client::sendNextHistoryBatch);
 	else
-		disconnect(d->msgqueue, &protocol::MessageQueue::allSent, this, &Client::sendNextHistoryBatch);
+		disconnect(d->connection, &ClientConnection::allSent, this, &Client::sendNextHistoryBatch);
 }
 
 Session *Client::session()
@@ -266,41 +342,92 @@ void Client::setHistoryPosition(int newpos)
 
 void Client::setConnectionTimeout(int timeout)
 {
-	d->msgqueue->setIdleTimeout(timeout);
+	d->connection->setIdleTimeout(timeout);
 }
 
 #ifndef NDEBUG
 void Client::setRandomLag(uint lag)
 {
-	d->msgqueue->setRandomLag(lag);
+	d->connection->setRandomLag(lag);
 }
 #endif
 
 QHostAddress Client::peerAddress() const
 {
-	return d->socket->peerAddress();
+	return d->connection->peerAddress();
 }
 
 void Client::sendNextHistoryBatch()
 {
-	// Only enqueue messages for uploading when upload queue is empty
-	// and session is in a normal running state.
+	// Only enqueue messages for uploading when the previous catch-up batch has
+	// left the upload queue and session is in a normal running state.
 	// (We'll get another messagesAvailable signal when ready)
-	if(d->session == nullptr || d->msgqueue->isUploading() || d->session->state() != Session::Running)
+	if(d->session == nullptr || hasQueuedCatchUp() || d->session->state() != Session::Running)
 		return;
 
 	d->session->historyCacheCleanup();
 
+	const SessionHistory *history = d->session->history();
 	protocol::MessageList batch;
 	int batchLast;
-	std::tie(batch, batchLast) = d->session->history()->getBatch(d->historyPosition);
+	std::tie(batch, batchLast) = history->getBatch(d->historyPosition);
 	d->historyPosition = batchLast;
-	d->msgqueue->send(batch);
+	if(batch.isEmpty())
+		return;
+
+	int batchBytes = 0;
+	for(const MessagePtr &msg : batch)
+		batchBytes += msg->length();
+
+	// Don't let pointer movements pile up when the client can't keep up.
+	// (Messages the client counts towards its catch-up progress are left alone.)
+	const int batchFirst = batchLast - batch.size() + 1;
+	if(batchLast > d->catchupEnd) {
+		const int backlog = d->connection->uploadQueueBytes() + batchBytes;
+		if(backlog > EPHEMERAL_COALESCE_BACKLOG && coalesceEphemeral(batch, qMax(0, d->catchupEnd - batchFirst + 1), backlog > EPHEMERAL_DROP_BACKLOG)) {
+			batchBytes = 0;
+			for(const MessagePtr &msg : batch)
+				batchBytes += msg->length();
+		}
+	}
+
+	d->session->countOutgoing(batch.size(), batchBytes);
+
+	// A client that is catching up (or hasn't yet sent the previous live batch)
+	// shouldn't hog the connection. Live batches are sent before catch-up ones
+	// and only one catch-up batch is queued at a time, so message order is
+	// preserved even though the batches are placed in different priority classes.
+	const bool catchingUp = batchLast < history->lastIndex()
+		|| batch.size() > LIVE_BATCH_MAX
+		|| d->connection->queuedMessages(protocol::MessageQueue::Live) > 0;
+	d->connection->send(batch, catchingUp ? protocol::MessageQueue::CatchUp : protocol::MessageQueue::Live);
+}
+
+bool Client::hasQueuedCatchUp() const
+{
+	return d->connection->queuedMessages(protocol::MessageQueue::CatchUp) > 0;
+}
+
+void Client::discardQueuedHistory()
+{
+	d->connection->clearQueue(protocol::MessageQueue::Live);
+	d->connection->clearQueue(protocol::MessageQueue::CatchUp);
+
+	// The whole new history counts towards the catch-up progress
+	if(d->session)
+		d->catchupEnd = d->session->history()->lastIndex();
 }
 
 void Client::sendDirectMessage(protocol::MessagePtr msg)
 {
-	d->msgqueue->send(msg);
+	if(d->session)
+		d->session->countOutgoing(1, msg->length());
+	d->connection->send(msg, protocol::MessageQueue::Control);
+}
+
+int Client::uploadQueueBytes() const
+{
+	return d->connection->uploadQueueBytes();
 }
 
 void Client::sendSystemChat(const QString &message)
@@ -311,13 +438,13 @@ void Client::sendSystemChat(const QString &message)
 		QJsonObject()
 	};
 
-	d->msgqueue->send(MessagePtr(new protocol::Command(0, msg.toJson())));
+	sendDirectMessage(MessagePtr(new protocol::Command(0, msg.toJson())));
 }
 
 void Client::receiveMessages()
 {
-	while(d->msgqueue->isPending()) {
-		MessagePtr msg = d->msgqueue->getPending();
+	while(d->connection->isPending()) {
+		MessagePtr msg = d->connection->getPending();
 
 		if(d->session == nullptr) {
 			// No session? We must be in the login phase
@@ -330,24 +457,55 @@ void Client::receiveMessages()
 
 		} else {
 			handleSessionMessage(msg);
+
+			// Rest of the messages will be handled when the client is no longer throttled
+			if(d->connection->isReadPaused())
+				break;
 		}
 	}
 }
 
+void Client::setRateLimits(int messagesPerSecond, int bytesPerSecond)
+{
+	d->rateLimiter.setLimits(messagesPerSecond, bytesPerSecond);
+}
+
+void Client::applyRateLimits(const protocol::MessagePtr &msg)
+{
+	const qint64 now = QDateTime::currentMSecsSinceEpoch();
+	const int wait = qMax(
+		d->rateLimiter.take(msg->length(), now),
+		d->session->rateLimiter().take(msg->length(), now)
+	);
+
+	if(wait > 0 && !d->connection->isReadPaused()) {
+		d->connection->setReadPaused(true);
+		QTimer::singleShot(wait, this, &Client::resumeReading);
+	}
+}
+
+void Client::resumeReading()
+{
+	if(!d->connection->isReadPaused())
+		return;
+
+	// Unpause first, so that receiveMessages can pause again if needed
+	d->connection->setReadPaused(false);
+	receiveMessages();
+}
+
 void Client::gotBadData(int len, int type)
 {
 	log(Log().about(Log::Level::Warn, Log::Topic::RuleBreak).message(
 		QString("Received unknown message type %1 of length %2").arg(type).arg(len)
 		));
-	d->socket->abort();
+	d->connection->abort();
 }
 
-void Client::socketError(QAbstractSocket::SocketError error)
+void Client::socketError(const QString &errorString)
 {
-	if(error != QAbstractSocket::RemoteHostClosedError) {
-		log(Log().about(Log::Level::Warn, Log::Topic::Status).message("Socket error: " + d->socket->errorString()));
-		d->socket->abort();
-	}
+	// The connection has already been aborted at this point
+	log(Log().about(Log::Level::Warn, Log::Topic::Status).message("Socket error: " + errorString));
 }
 
 void Client::socketDisconnect()
@@ -368,6 +526,11 @@ void Client::handleSessionMessage(MessagePtr msg)
 {
 	Q_ASSERT(d->session);
 
+	// The snapshot uploaded during initialization or reset is not throttled,
+	// since everyone is waiting for it
+	if(d->session->initUserId() != d->id)
+		applyRateLimits(msg);
+
 	// Filter away server-to-client-only messages
 	switch(msg->type()) {
 	using namespace protocol;
@@ -454,20 +617,20 @@ void Client::disconnectKick(const QString &kickedBy)
 {
 	log(Log().about(Log::Level::Info, Log::Topic::Kick).message("Kicked by " + kickedBy));
 	emit loggedOff(this);
-	d->msgqueue->sendDisconnect(protocol::Disconnect::KICK, kickedBy);
+	d->connection->sendDisconnect(protocol::Disconnect::KICK, kickedBy);
 }
 
 void Client::disconnectError(const QString &message)
 {
 	emit loggedOff(this);
 	log(Log().about(Log::Level::Warn, Log::Topic::Leave).message("Disconnected due to error: " + message));
-	d->msgqueue->sendDisconnect(protocol::Disconnect::ERROR, message);
+	d->connection->sendDisconnect(protocol::Disconnect::ERROR, message);
 }
 
 void Client::disconnectShutdown()
 {
 	emit loggedOff(this);
-	d->msgqueue->sendDisconnect(protocol::Disconnect::SHUTDOWN, QString());
+	d->connection->sendDisconnect(protocol::Disconnect::SHUTDOWN, QString());
 }
 
 bool Client::isHoldLocked() const
@@ -489,25 +652,27 @@ void Client::enqueueHeldCommands()
 
 bool Client::hasSslSupport() const
 {
-	return d->socket->inherits("QSslSocket");
+	return d->connection->hasSslSupport();
 }
 
 bool Client::isSecure() const
 {
-	QSslSocket *socket = qobject_cast<QSslSocket*>(d->socket);
-	return socket && socket->isEncrypted();
+	return d->connection->isSecure();
+}
+
+void Client::setCompression(bool compress)
+{
+	d->connection->setCompression(compress);
 }
 
 void Client::startTls()
 {
-	QSslSocket *socket = qobject_cast<QSslSocket*>(d->socket);
-	Q_ASSERT(socket);
-	socket->startServerEncryption();
+	d->connection->startTls();
 }
 
 void Client::log(Log entry) const
 {
-	entry.user(d->id, d->socket->peerAddress(), d->username);
+	entry.user(d->id, d->connection->peerAddress(), d->username);
 	if(d->session)
 		d->session->log(entry);
 	else
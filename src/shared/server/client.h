@@ -26,6 +26,7 @@
 #include <QTcpSocket>
 
 class QHostAddress;
+class QThread;
 
 namespace server {
 
@@ -45,7 +46,14 @@ class Client : public QObject
     Q_OBJECT
 
 public:
-	Client(QTcpSocket *socket, ServerLog *logger, QObject *parent=nullptr);
+	/**
+	 * @brief Construct a client
+	 *
+	 * @param socket the client's socket. The client takes ownership
+	 * @param logger server logger
+	 * @param ioThread the network thread for the socket (null to stay in the current thread)
+	 */
+	Client(QTcpSocket *socket, ServerLog *logger, QThread *ioThread=nullptr, QObject *parent=nullptr);
 	~Client();
 
 	//! Get the user's IP address
@@ -144,6 +152,22 @@ public:
 	 */
 	void setConnectionTimeout(int timeout);
 
+	/**
+	 * @brief Set the incoming message rate limits
+	 *
+	 * When the client exceeds either its own or its session's limits,
+	 * reading from the socket is paused until enough time has passed.
+	 *
+	 * @param messagesPerSecond maximum number of messages per second (0 for unlimited)
+	 * @param bytesPerSecond maximum number of bytes per second (0 for unlimited)
+	 */
+	void setRateLimits(int messagesPerSecond, int bytesPerSecond);
+
+	/**
+	 * @brief Get the number of bytes waiting in the upload queue
+	 */
+	int uploadQueueBytes() const;
+
 #ifndef NDEBUG
 	void setRandomLag(uint lag);
 #endif
@@ -170,10 +194,21 @@ public:
 	 *
 	 * Note. Typically messages are sent via the shared session history. Direct
 	 * messages are used during the login phase and for client specific notifications.
+	 *
+	 * Direct messages are sent with control priority, meaning they will
+	 * not wait behind the session history in the upload queue.
 	 * @param msg
 	 */
 	void sendDirectMessage(protocol::MessagePtr msg);
 
+	/**
+	 * @brief Discard session history that is still waiting in the upload queue
+	 *
+	 * This is done when the session is reset, since the new history
+	 * replaces everything that has not been sent yet.
+	 */
+	void discardQueuedHistory();
+
 	/**
 	 * @brief Send a message from the server directly to this user
 	 * @param message
@@ -210,6 +245,14 @@ public:
 	 */
 	bool isSecure() const;
 
+	/**
+	 * @brief Start compressing outgoing messages
+	 *
+	 * This should only be called if the client announced it can
+	 * decompress the stream.
+	 */
+	void setCompression(bool compress);
+
 	/**
 	 * @brief Start SSL handshake
 	 */
@@ -252,6 +295,22 @@ public:
 	 */
 	void log(Log entry) const;
 
+	/**
+	 * @brief Remove superseded pointer movements from an outgoing history batch
+	 *
+	 * Pointer movements and laser trail updates that are followed by a later
+	 * message of the same type from the same user are removed. If dropAll is
+	 * set, all such messages are removed. The order of the remaining
+	 * messages is not changed.
+	 *
+	 * Only messages starting from the given offset are touched. Messages of
+	 * earlier batches have already been handed to the network thread, so
+	 * coalescing only happens within the batch.
+	 *
+	 * @return true if any messages were removed
+	 */
+	static bool coalesceEphemeral(protocol::MessageList &batch, int from, bool dropAll);
+
 signals:
 	/**
 	 * @brief Message received while not part of a session
@@ -273,11 +332,14 @@ public slots:
 private slots:
 	void gotBadData(int len, int type);
 	void receiveMessages();
-	void socketError(QAbstractSocket::SocketError error);
+	void socketError(const QString &errorString);
 	void socketDisconnect();
+	void resumeReading();
 
 private:
 	void handleSessionMessage(protocol::MessagePtr msg);
+	bool hasQueuedCatchUp() const;
+	void applyRateLimits(const protocol::MessagePtr &msg);
 	bool isHoldLocked() const;
 
 	struct Private;
@@ -0,0 +1,433 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "clientconnection.h"
+
+#include <QSslSocket>
+#include <QThread>
+#include <QMutex>
+#include <QVector>
+
+namespace server {
+
+using protocol::MessageQueue;
+using protocol::MessagePtr;
+using protocol::MessageList;
+
+// Stop reading from the socket when this many received messages are
+// waiting for the session logic
+static const int MAX_INBOX = 256;
+
+struct ConnectionOp {
+	enum Type {
+		Send,
+		Clear,
+		Disconnect,
+		ReadPause,
+		ResumeInbox,
+		IdleTimeout,
+		Compression,
+		StartTls,
+		Abort,
+		RandomLag
+	};
+
+	Type type;
+	int priority;
+	qint64 value;
+	MessageList messages;
+	QString message;
+
+	ConnectionOp(Type t, qint64 v=0, int p=0) : type(t), priority(p), value(v) { }
+};
+
+/**
+ * State shared between the two ends of the connection.
+ *
+ * The lock is only ever held long enough to swap a queue or copy
+ * a handful of numbers.
+ */
+struct ConnectionState {
+	QMutex mutex;
+
+	// Session logic -> network thread
+	QVector<ConnectionOp> ops;
+	bool wakePending = false;
+
+	// Network thread -> session logic
+	QQueue<MessagePtr> inbox;
+	bool inboxFull = false;
+
+	// Published by the network thread
+	qint64 done[MessageQueue::PRIORITY_COUNT] = {};
+	qint64 doneBytes[MessageQueue::PRIORITY_COUNT] = {};
+	int inFlightBytes = 0;
+	bool encrypted = false;
+	ClientConnection::Traffic traffic;
+};
+
+ClientConnection::ClientConnection(QTcpSocket *socket, QThread *thread, QObject *parent)
+	: QObject(parent), m_state(new ConnectionState),
+	  m_peerAddress(socket->peerAddress()),
+	  m_sslSupport(socket->inherits("QSslSocket")),
+	  m_readPaused(false), m_compress(false)
+{
+	for(int i=0;i<MessageQueue::PRIORITY_COUNT;++i) {
+		m_submitted[i] = 0;
+		m_submittedBytes[i] = 0;
+		m_cleared[i] = 0;
+		m_clearedBytes[i] = 0;
+	}
+
+	socket->setParent(nullptr);
+	m_worker = new ClientConnectionWorker(socket, m_state);
+	if(thread)
+		m_worker->moveToThread(thread);
+
+	connect(m_worker, &ClientConnectionWorker::messageAvailable, this, &ClientConnection::messageAvailable);
+	connect(m_worker, &ClientConnectionWorker::allSent, this, &ClientConnection::allSent);
+	connect(m_worker, &ClientConnectionWorker::badData, this, &ClientConnection::badData);
+	connect(m_worker, &ClientConnectionWorker::socketError, this, &ClientConnection::socketError);
+	connect(m_worker, &ClientConnectionWorker::disconnected, this, &ClientConnection::disconnected);
+}
+
+ClientConnection::~ClientConnection()
+{
+	// The socket must be closed in its own thread
+	m_worker->deleteLater();
+}
+
+void ClientConnection::pushOp(ConnectionOp &&op)
+{
+	bool wake = false;
+	{
+		QMutexLocker lock(&m_state->mutex);
+
+		// Consecutive messages of the same priority are passed along as one batch
+		if(op.type == ConnectionOp::Send && !m_state->ops.isEmpty()) {
+			ConnectionOp &last = m_state->ops.last();
+			if(last.type == ConnectionOp::Send && last.priority == op.priority) {
+				last.messages << op.messages;
+				return;
+			}
+		}
+
+		m_state->ops.append(std::move(op));
+		if(!m_state->wakePending) {
+			m_state->wakePending = true;
+			wake = true;
+		}
+	}
+
+	if(wake)
+		QMetaObject::invokeMethod(m_worker, "processOps", Qt::QueuedConnection);
+}
+
+bool ClientConnection::isSecure() const
+{
+	QMutexLocker lock(&m_state->mutex);
+	return m_state->encrypted;
+}
+
+void ClientConnection::send(const MessagePtr &message, Priority priority)
+{
+	ConnectionOp op(ConnectionOp::Send, 0, priority);
+	op.messages << message;
+
+	++m_submitted[priority];
+	m_submittedBytes[priority] += message->length();
+
+	pushOp(std::move(op));
+}
+
+void ClientConnection::send(const MessageList &messages, Priority priority)
+{
+	if(messages.isEmpty())
+		return;
+
+	ConnectionOp op(ConnectionOp::Send, 0, priority);
+	op.messages = messages;
+
+	m_submitted[priority] += messages.size();
+	for(const MessagePtr &msg : messages)
+		m_submittedBytes[priority] += msg->length();
+
+	pushOp(std::move(op));
+}
+
+void ClientConnection::clearQueue(Priority priority)
+{
+	// Everything submitted so far is either sent or dropped by the time
+	// the network thread gets to this. Until it has published its stats,
+	// this is where the queue counts start from.
+	m_cleared[priority] = m_submitted[priority];
+	m_clearedBytes[priority] = m_submittedBytes[priority];
+
+	pushOp(ConnectionOp(ConnectionOp::Clear, 0, priority));
+}
+
+void ClientConnection::sendDisconnect(int reason, const QString &message)
+{
+	ConnectionOp op(ConnectionOp::Disconnect, reason);
+	op.message = message;
+	pushOp(std::move(op));
+}
+
+int ClientConnection::queuedMessages(Priority priority) const
+{
+	QMutexLocker lock(&m_state->mutex);
+	return int(m_submitted[priority] - qMax(m_state->done[priority], m_cleared[priority]));
+}
+
+int ClientConnection::queuedBytes(Priority priority) const
+{
+	QMutexLocker lock(&m_state->mutex);
+	return int(m_submittedBytes[priority] - qMax(m_state->doneBytes[priority], m_clearedBytes[priority]));
+}
+
+int ClientConnection::uploadQueueBytes() const
+{
+	QMutexLocker lock(&m_state->mutex);
+	qint64 total = m_state->inFlightBytes;
+	for(int i=0;i<MessageQueue::PRIORITY_COUNT;++i)
+		total += m_submittedBytes[i] - qMax(m_state->doneBytes[i], m_clearedBytes[i]);
+	return int(total);
+}
+
+bool ClientConnection::isPending()
+{
+	if(m_inbox.isEmpty()) {
+		bool resume = false;
+		{
+			QMutexLocker lock(&m_state->mutex);
+			m_inbox.swap(m_state->inbox);
+			if(m_state->inboxFull) {
+				m_state->inboxFull = false;
+				resume = true;
+			}
+		}
+
+		// The network thread stopped reading when the inbox filled up
+		if(resume)
+			pushOp(ConnectionOp(ConnectionOp::ResumeInbox));
+	}
+
+	return !m_inbox.isEmpty();
+}
+
+MessagePtr ClientConnection::getPending()
+{
+	Q_ASSERT(!m_inbox.isEmpty());
+	return m_inbox.dequeue();
+}
+
+void ClientConnection::setReadPaused(bool pause)
+{
+	if(m_readPaused != pause) {
+		m_readPaused = pause;
+		pushOp(ConnectionOp(ConnectionOp::ReadPause, pause));
+	}
+}
+
+void ClientConnection::setIdleTimeout(qint64 timeout)
+{
+	pushOp(ConnectionOp(ConnectionOp::IdleTimeout, timeout));
+}
+
+void ClientConnection::setCompression(bool compress)
+{
+	m_compress = compress;
+	pushOp(ConnectionOp(ConnectionOp::Compression, compress));
+}
+
+ClientConnection::Traffic ClientConnection::traffic() const
+{
+	QMutexLocker lock(&m_state->mutex);
+	return m_state->traffic;
+}
+
+void ClientConnection::startTls()
+{
+	Q_ASSERT(m_sslSupport);
+	pushOp(ConnectionOp(ConnectionOp::StartTls));
+}
+
+void ClientConnection::abort()
+{
+	pushOp(ConnectionOp(ConnectionOp::Abort));
+}
+
+#ifndef NDEBUG
+void ClientConnection::setRandomLag(uint lag)
+{
+	pushOp(ConnectionOp(ConnectionOp::RandomLag, lag));
+}
+#endif
+
+ClientConnectionWorker::ClientConnectionWorker(QTcpSocket *socket, const QSharedPointer<ConnectionState> &state)
+	: QObject(), m_state(state), m_socket(socket),
+	  m_readPaused(false), m_inboxFull(false)
+{
+	for(int i=0;i<MessageQueue::PRIORITY_COUNT;++i) {
+		m_received[i] = 0;
+		m_receivedBytes[i] = 0;
+	}
+
+	m_socket->setParent(this);
+	m_msgqueue = new MessageQueue(socket, this);
+
+	connect(m_socket, &QAbstractSocket::disconnected, this, &ClientConnectionWorker::disconnected);
+	connect(m_socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(onSocketError(QAbstractSocket::SocketError)));
+	if(socket->inherits("QSslSocket"))
+		connect(m_socket, SIGNAL(encrypted()), this, SLOT(onEncrypted()));
+
+	connect(m_msgqueue, &MessageQueue::messageAvailable, this, &ClientConnectionWorker::receiveMessages);
+	connect(m_msgqueue, &MessageQueue::badData, this, &ClientConnectionWorker::badData);
+	connect(m_msgqueue, &MessageQueue::allSent, this, &ClientConnectionWorker::onAllSent);
+	connect(m_msgqueue, &MessageQueue::bytesSent, this, &ClientConnectionWorker::publishStats);
+}
+
+void ClientConnectionWorker::processOps()
+{
+	QVector<ConnectionOp> ops;
+	{
+		QMutexLocker lock(&m_state->mutex);
+		ops.swap(m_state->ops);
+		m_state->wakePending = false;
+	}
+
+	for(const ConnectionOp &op : ops) {
+		switch(op.type) {
+		case ConnectionOp::Send:
+			m_received[op.priority] += op.messages.size();
+			for(const MessagePtr &msg : op.messages)
+				m_receivedBytes[op.priority] += msg->length();
+			m_msgqueue->send(op.messages, MessageQueue::Priority(op.priority));
+			break;
+		case ConnectionOp::Clear:
+			m_msgqueue->clearQueue(MessageQueue::Priority(op.priority));
+			break;
+		case ConnectionOp::Disconnect:
+			m_msgqueue->sendDisconnect(op.value, op.message);
+			break;
+		case ConnectionOp::ReadPause:
+			m_readPaused = op.value;
+			updateReadPause();
+			break;
+		case ConnectionOp::ResumeInbox:
+			m_inboxFull = false;
+			updateReadPause();
+			break;
+		case ConnectionOp::IdleTimeout:
+			m_msgqueue->setIdleTimeout(op.value);
+			break;
+		case ConnectionOp::Compression:
+			m_msgqueue->setCompression(op.value);
+			break;
+		case ConnectionOp::StartTls: {
+			QSslSocket *socket = qobject_cast<QSslSocket*>(m_socket);
+			Q_ASSERT(socket);
+			socket->startServerEncryption();
+			break;
+		}
+		case ConnectionOp::Abort:
+			m_socket->abort();
+			break;
+		case ConnectionOp::RandomLag:
+#ifndef NDEBUG
+			m_msgqueue->setRandomLag(op.value);
+#endif
+			break;
+		}
+	}
+
+	publishStats();
+}
+
+void ClientConnectionWorker::updateReadPause()
+{
+	m_msgqueue->setReadPaused(m_readPaused || m_inboxFull);
+}
+
+void ClientConnectionWorker::receiveMessages()
+{
+	bool notify;
+	bool full;
+	{
+		QMutexLocker lock(&m_state->mutex);
+		notify = m_state->inbox.isEmpty();
+		while(m_msgqueue->isPending())
+			m_state->inbox.enqueue(m_msgqueue->getPending());
+
+		full = m_state->inbox.size() >= MAX_INBOX;
+		if(full)
+			m_state->inboxFull = true;
+	}
+
+	if(full && !m_inboxFull) {
+		m_inboxFull = true;
+		updateReadPause();
+	}
+
+	if(notify)
+		emit messageAvailable();
+}
+
+void ClientConnectionWorker::onAllSent()
+{
+	// Make sure the queue lengths are up to date when the signal arrives
+	publishStats();
+	emit allSent();
+}
+
+void ClientConnectionWorker::onSocketError(QAbstractSocket::SocketError error)
+{
+	if(error != QAbstractSocket::RemoteHostClosedError) {
+		emit socketError(m_socket->errorString());
+		m_socket->abort();
+	}
+}
+
+void ClientConnectionWorker::onEncrypted()
+{
+	QMutexLocker lock(&m_state->mutex);
+	m_state->encrypted = true;
+}
+
+void ClientConnectionWorker::publishStats()
+{
+	int queued = 0;
+	for(int i=0;i<MessageQueue::PRIORITY_COUNT;++i)
+		queued += m_msgqueue->queuedBytes(MessageQueue::Priority(i));
+
+	QMutexLocker lock(&m_state->mutex);
+	for(int i=0;i<MessageQueue::PRIORITY_COUNT;++i) {
+		const auto p = MessageQueue::Priority(i);
+		m_state->done[i] = m_received[i] - m_msgqueue->queuedMessages(p);
+		m_state->doneBytes[i] = m_receivedBytes[i] - m_msgqueue->queuedBytes(p);
+	}
+	m_state->inFlightBytes = m_msgqueue->uploadQueueBytes() - queued;
+
+	m_state->traffic.rawIn = m_msgqueue->rawBytesReceived();
+	m_state->traffic.wireIn = m_msgqueue->wireBytesReceived();
+	m_state->traffic.rawOut = m_msgqueue->rawBytesSent();
+	m_state->traffic.wireOut = m_msgqueue->wireBytesSent();
+}
+
+}
@@ -0,0 +1,189 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_SERVER_CLIENTCONNECTION_H
+#define DP_SERVER_CLIENTCONNECTION_H
+
+#include "../net/message.h"
+#include "../net/messagequeue.h"
+
+#include <QObject>
+#include <QHostAddress>
+#include <QQueue>
+#include <QSharedPointer>
+#include <QAbstractSocket>
+
+class QTcpSocket;
+class QThread;
+
+namespace server {
+
+struct ConnectionState;
+struct ConnectionOp;
+class ClientConnectionWorker;
+
+/**
+ * @brief The session logic's end of a client's network connection
+ *
+ * The socket and its MessageQueue live in a network thread, where the
+ * TLS handshake, encryption and message framing take place. This class
+ * offers the parts of the MessageQueue API the Client needs.
+ *
+ * Outgoing messages and commands are handed to the network thread in the
+ * order they were given. Incoming messages are passed back in batches.
+ * If the session logic falls behind, the network thread stops reading from
+ * the socket until the received messages have been taken.
+ *
+ * If no thread is given, the socket stays in the current thread.
+ */
+class ClientConnection : public QObject
+{
+	Q_OBJECT
+public:
+	typedef protocol::MessageQueue::Priority Priority;
+
+	struct Traffic {
+		qint64 rawIn = 0;
+		qint64 wireIn = 0;
+		qint64 rawOut = 0;
+		qint64 wireOut = 0;
+	};
+
+	ClientConnection(QTcpSocket *socket, QThread *thread, QObject *parent=nullptr);
+	~ClientConnection();
+
+	QHostAddress peerAddress() const { return m_peerAddress; }
+
+	//! Does the socket support TLS? (Says nothing about the remote end)
+	bool hasSslSupport() const { return m_sslSupport; }
+
+	//! Has the TLS handshake been completed?
+	bool isSecure() const;
+
+	void send(const protocol::MessagePtr &message, Priority priority);
+	void send(const protocol::MessageList &messages, Priority priority);
+
+	//! See MessageQueue::clearQueue()
+	void clearQueue(Priority priority);
+
+	//! See MessageQueue::sendDisconnect()
+	void sendDisconnect(int reason, const QString &message);
+
+	/**
+	 * @brief Get the number of messages not yet taken out of the upload queue
+	 *
+	 * This includes the messages still on their way to the network thread.
+	 * The number may lag behind a little, but it is never too small.
+	 */
+	int queuedMessages(Priority priority) const;
+	int queuedBytes(Priority priority) const;
+	int uploadQueueBytes() const;
+
+	bool isPending();
+	protocol::MessagePtr getPending();
+
+	//! See MessageQueue::setReadPaused()
+	void setReadPaused(bool pause);
+	bool isReadPaused() const { return m_readPaused; }
+
+	void setIdleTimeout(qint64 timeout);
+	void setCompression(bool compress);
+	bool isCompressing() const { return m_compress; }
+
+	Traffic traffic() const;
+
+	//! Start the server side TLS handshake after the queued messages have been sent
+	void startTls();
+
+	//! Close the connection immediately
+	void abort();
+
+#ifndef NDEBUG
+	void setRandomLag(uint lag);
+#endif
+
+signals:
+	void messageAvailable();
+	void allSent();
+	void badData(int len, int type, int contextId);
+	void socketError(const QString &errorString);
+	void disconnected();
+
+private:
+	void pushOp(ConnectionOp &&op);
+
+	QSharedPointer<ConnectionState> m_state;
+	ClientConnectionWorker *m_worker;
+
+	QQueue<protocol::MessagePtr> m_inbox;
+	qint64 m_submitted[protocol::MessageQueue::PRIORITY_COUNT];
+	qint64 m_submittedBytes[protocol::MessageQueue::PRIORITY_COUNT];
+	qint64 m_cleared[protocol::MessageQueue::PRIORITY_COUNT];
+	qint64 m_clearedBytes[protocol::MessageQueue::PRIORITY_COUNT];
+
+	QHostAddress m_peerAddress;
+	bool m_sslSupport;
+	bool m_readPaused;
+	bool m_compress;
+};
+
+/**
+ * @brief The network thread's end of a client connection
+ *
+ * This is an internal class of ClientConnection.
+ */
+class ClientConnectionWorker : public QObject
+{
+	Q_OBJECT
+public:
+	ClientConnectionWorker(QTcpSocket *socket, const QSharedPointer<ConnectionState> &state);
+
+public slots:
+	void processOps();
+
+signals:
+	void messageAvailable();
+	void allSent();
+	void badData(int len, int type, int contextId);
+	void socketError(const QString &errorString);
+	void disconnected();
+
+private slots:
+	void receiveMessages();
+	void onAllSent();
+	void onSocketError(QAbstractSocket::SocketError error);
+	void onEncrypted();
+	void publishStats();
+
+private:
+	void updateReadPause();
+
+	QSharedPointer<ConnectionState> m_state;
+	QTcpSocket *m_socket;
+	protocol::MessageQueue *m_msgqueue;
+
+	qint64 m_received[protocol::MessageQueue::PRIORITY_COUNT];
+	qint64 m_receivedBytes[protocol::MessageQueue::PRIORITY_COUNT];
+
+	bool m_readPaused;
+	bool m_inboxFull;
+};
+
+}
+
+#endif
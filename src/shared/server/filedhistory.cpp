@@ -18,6 +18,7 @@
 */
 
 #include "filedhistory.h"
+#include "metrics.h"
 #include "../shared/util/passwordhash.h"
 #include "../shared/util/filename.h"
 #include "../shared/record/header.h"
@@ -28,11 +29,13 @@
 #include <QVarLengthArray>
 #include <QDebug>
 #include <QTimerEvent>
+#include <QElapsedTimer>
 
 namespace server {
 
 // A block is closed when its size goes above this limit
 static const qint64 MAX_BLOCK_SIZE = 0xffff * 10;
+static const int FLUSH_INTERVAL = 1000 * 30;
 
 FiledHistory::FiledHistory(const QDir &dir, QFile *journal, const QUuid &id, const QString &alias, const protocol::ProtocolVersion &version, const QString &founder, QObject *parent)
 	: SessionHistory(id, parent),
@@ -44,12 +47,13 @@ FiledHistory::FiledHistory(const QDir &dir, QFile *journal, const QUuid &id, con
 	  m_version(version),
 	  m_maxUsers(254),
 	  m_flags(0),
+	  m_flushTimer(0),
 	  m_archive(false)
 {
 	Q_ASSERT(journal);
 
 	// Flush the recording file periodically
-	startTimer(1000 * 30, Qt::VeryCoarseTimer);
+	m_flushTimer = startTimer(FLUSH_INTERVAL, Qt::VeryCoarseTimer);
 }
 
 FiledHistory::FiledHistory(const QDir &dir, QFile *journal, const QUuid &id, QObject *parent)
@@ -555,6 +559,8 @@ std::tuple<protocol::MessageList, int> FiledHistory::getBatch(int after) const
 
 	if(b.messages.isEmpty() && b.count>0) {
 		// Load the block worth of messages to memory if not already loaded
+		QElapsedTimer loadTime;
+		loadTime.start();
 		const qint64 prevPos = m_recording->pos();
 		qDebug() << m_recording->fileName() << "loading block" << i;
 		m_recording->seek(b.startOffset);
@@ -575,6 +581,7 @@ std::tuple<protocol::MessageList, int> FiledHistory::getBatch(int after) const
 		}
 
 		m_recording->seek(prevPos);
+		ServerMetrics::instance().historyBlockLoadTime.observe(loadTime.nsecsElapsed() / 1.0e9);
 	}
 	Q_ASSERT(b.messages.size() == b.count);
 	return std::make_tuple(b.messages.mid(idxOffset), b.startIndex+b.count-1);
@@ -582,6 +589,9 @@ std::tuple<protocol::MessageList, int> FiledHistory::getBatch(int after) const
 
 void FiledHistory::historyAdd(const protocol::MessagePtr &msg)
 {
+	if(!m_flushTimer)
+		m_flushTimer = startTimer(FLUSH_INTERVAL, Qt::VeryCoarseTimer);
+
 	QVarLengthArray<char> buf(msg->length());
 	const int len = msg->serialize(buf.data());
 	Q_ASSERT(len == buf.length());
@@ -632,6 +642,24 @@ void FiledHistory::cleanupBatches(int before)
 	}
 }
 
+void FiledHistory::hibernate()
+{
+	if(m_recording)
+		m_recording->flush();
+	m_journal->flush();
+
+	// Nothing will be written until the session wakes up again
+	if(m_flushTimer) {
+		killTimer(m_flushTimer);
+		m_flushTimer = 0;
+	}
+
+	// Blocks are reloaded from the recording when needed
+	for(Block &b : m_blocks)
+		b.messages = protocol::MessageList();
+	m_blocks.squeeze();
+}
+
 void FiledHistory::historyAddBan(int id, const QString &username, const QHostAddress &ip, const QString &extAuthId, const QString &bannedBy)
 {
 	const QByteArray include = " ";
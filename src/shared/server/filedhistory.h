@@ -94,6 +94,7 @@ public:
 
 	void terminate() override;
 	void cleanupBatches(int before) override;
+	void hibernate() override;
 	std::tuple<protocol::MessageList, int> getBatch(int after) const override;
 
 	void addAnnouncement(const QString &) override;
@@ -150,6 +151,7 @@ private:
 	QSet<QString> m_trusted;
 
 	QVector<Block> m_blocks;
+	int m_flushTimer;
 	bool m_archive;
 };
 
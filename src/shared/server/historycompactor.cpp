@@ -0,0 +1,353 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "historycompactor.h"
+
+#include "../net/undo.h"
+#include "../net/meta.h"
+#include "../net/layer.h"
+#include "../net/annotation.h"
+
+#include <QVector>
+#include <QHash>
+#include <QSet>
+
+namespace server {
+
+namespace {
+
+struct CompactionIndex {
+	// message type (protocol)
+	uchar type;
+
+	// message context ID
+	uchar ctxid;
+
+	// is this message undoable at all
+	bool undoable;
+
+	// undo state of this message
+	protocol::MessageUndoState undo;
+
+	// removed by compaction
+	bool removed;
+};
+
+struct State {
+	QVector<CompactionIndex> index;
+
+	// User join/leave message indices
+	QHash<int, QList<int>> userjoins;
+
+	// Users who have done something other than logging in and out
+	QSet<int> users_seen;
+
+	// Index of the latest pinned chat message
+	int lastPin = -1;
+};
+
+static inline bool isGone(const CompactionIndex &i)
+{
+	return i.removed || (i.undoable && i.undo != protocol::DONE);
+}
+
+// Branch the undo history. See StateTracker::handleUndoPoint
+static void handleUndoPoint(State &state, uchar ctxid)
+{
+	int i = state.index.size() - 2; // skip the one just added
+	int upCount = 1;
+
+	while(i>=0 && upCount < protocol::UNDO_DEPTH_LIMIT) {
+		CompactionIndex &u = state.index[i];
+		if(u.type == protocol::MSG_UNDOPOINT)
+			++upCount;
+		if(u.ctxid == ctxid) {
+			if(u.type != protocol::MSG_UNDO && u.undo == protocol::GONE)
+				break;
+			else if(u.undoable && u.undo == protocol::UNDONE)
+				u.undo = protocol::GONE;
+		}
+		--i;
+	}
+}
+
+// Perform an undo. See StateTracker::handleUndo
+static void handleUndo(State &state, const protocol::Undo &cmd)
+{
+	const uchar ctxid = cmd.overrideId() ? cmd.overrideId() : cmd.contextId();
+
+	// Step 1. Find undo or redo point
+	int pos = state.index.size() - 1; // skip the undo command itself
+	int upCount = 0;
+
+	if(cmd.isRedo()) {
+		int redostart = pos;
+		while(--pos>=0 && upCount <= protocol::UNDO_DEPTH_LIMIT) {
+			const CompactionIndex &u = state.index[pos];
+			if(u.type == protocol::MSG_UNDOPOINT) {
+				++upCount;
+				if(u.ctxid == ctxid) {
+					if(u.undo != protocol::DONE)
+						redostart = pos;
+					else
+						break;
+				}
+			}
+		}
+
+		if(redostart == state.index.size() - 1)
+			return;
+		pos = redostart;
+
+	} else {
+		while(--pos>=0 && upCount <= protocol::UNDO_DEPTH_LIMIT) {
+			const CompactionIndex &u = state.index[pos];
+			if(u.type == protocol::MSG_UNDOPOINT) {
+				++upCount;
+				if(u.ctxid == ctxid && u.undo == protocol::DONE)
+					break;
+			}
+		}
+	}
+
+	if(upCount > protocol::UNDO_DEPTH_LIMIT || pos < 0)
+		return;
+
+	// Step 2. (Un)mark all actions by the user as undone
+	if(cmd.isRedo()) {
+		int sequence=2;
+		for(int i=pos;i<state.index.size();++i) {
+			CompactionIndex &u = state.index[i];
+			if(u.ctxid == ctxid) {
+				if(u.type == protocol::MSG_UNDOPOINT && u.undo != protocol::GONE)
+					if(--sequence==0)
+						break;
+
+				// GONE messages cannot be redone
+				if(u.undo == protocol::UNDONE)
+					u.undo = protocol::DONE;
+			}
+		}
+	} else {
+		for(int i=pos;i<state.index.size();++i) {
+			CompactionIndex &u = state.index[i];
+			if(u.ctxid == ctxid && u.undoable)
+				u.undo = protocol::MessageUndoState(protocol::UNDONE | u.undo);
+		}
+	}
+}
+
+// Basic filtering (including Undo)
+static void filterMessage(State &state, const protocol::MessagePtr &msg)
+{
+	state.index.append(CompactionIndex {
+		uchar(msg->type()),
+		msg->contextId(),
+		msg->isUndoable(),
+		protocol::DONE,
+		false
+	});
+	CompactionIndex &entry = state.index.last();
+
+	switch(msg->type()) {
+	using namespace protocol;
+	case MSG_COMMAND:
+	case MSG_DISCONNECT:
+	case MSG_PING:
+	case MSG_SOFTRESET:
+	case MSG_INTERVAL:
+	case MSG_LASERTRAIL:
+	case MSG_MOVEPOINTER:
+	case MSG_MARKER:
+	case MSG_FILTERED:
+		entry.removed = true;
+		return;
+
+	// The session resets prepend fresh operator and trusted user lists.
+	// Old ones must not be replayed after them.
+	case MSG_SESSION_OWNER:
+	case MSG_TRUSTED_USERS:
+		entry.removed = true;
+		return;
+
+	case MSG_CHAT:
+		if(msg.cast<Chat>().isPin()) {
+			if(state.lastPin >= 0)
+				state.index[state.lastPin].removed = true;
+			state.lastPin = state.index.size() - 1;
+		} else {
+			entry.removed = true;
+			return;
+		}
+		break;
+
+	case MSG_USER_JOIN:
+	case MSG_USER_LEAVE:
+		state.userjoins[msg->contextId()].append(state.index.size()-1);
+		return;
+
+	case MSG_UNDOPOINT:
+		handleUndoPoint(state, msg->contextId());
+		break;
+
+	case MSG_UNDO:
+		// Undo commands are never replayed
+		entry.undo = protocol::GONE;
+		entry.removed = true;
+		handleUndo(state, msg.cast<Undo>());
+		break;
+
+	default: break;
+	}
+
+	if(msg->contextId()>0)
+		state.users_seen.insert(msg->contextId());
+}
+
+// Remove Join/Leave messages of those users who didn't do anything
+static void filterLookyloos(State &state)
+{
+	for(auto i=state.userjoins.constBegin();i!=state.userjoins.constEnd();++i) {
+		if(!state.users_seen.contains(i.key())) {
+			for(const int idx : i.value())
+				state.index[idx].removed = true;
+		}
+	}
+}
+
+// Remove content of layers and annotations that no longer exist.
+// The history is scanned from the end, so when a deletion is found,
+// everything targeting the same ID up to its creation can be removed.
+static void filterDeleted(State &state, const protocol::MessageList &history)
+{
+	QSet<uint16_t> deadLayers;
+	QSet<uint16_t> deadAnnotations;
+
+	for(int i=state.index.size()-1;i>=0;--i) {
+		CompactionIndex &fi = state.index[i];
+		if(isGone(fi))
+			continue;
+
+		const protocol::MessagePtr &msg = history.at(i);
+
+		switch(msg->type()) {
+		using namespace protocol;
+		case MSG_LAYER_DELETE:
+			// When merged, the content is not lost
+			if(!msg.cast<LayerDelete>().merge())
+				deadLayers.insert(msg->layer());
+			break;
+
+		case MSG_LAYER_CREATE: {
+			const LayerCreate &lc = msg.cast<LayerCreate>();
+			// A copy of a deleted layer needs the original's content
+			if((lc.flags() & LayerCreate::FLAG_COPY))
+				deadLayers.remove(lc.source());
+			deadLayers.remove(lc.layer());
+			break;
+		}
+
+		case MSG_PUTIMAGE:
+		case MSG_PUTTILE:
+		case MSG_FILLRECT:
+		case MSG_REGION_MOVE:
+		case MSG_DRAWDABS_CLASSIC:
+		case MSG_DRAWDABS_PIXEL:
+		case MSG_DRAWDABS_PIXEL_SQUARE:
+			if(deadLayers.contains(msg->layer()))
+				fi.removed = true;
+			break;
+
+		case MSG_ANNOTATION_DELETE:
+			deadAnnotations.insert(msg.cast<AnnotationDelete>().id());
+			fi.removed = true;
+			break;
+
+		case MSG_ANNOTATION_RESHAPE:
+			if(deadAnnotations.contains(msg.cast<AnnotationReshape>().id()))
+				fi.removed = true;
+			break;
+
+		case MSG_ANNOTATION_EDIT:
+			if(deadAnnotations.contains(msg.cast<AnnotationEdit>().id()))
+				fi.removed = true;
+			break;
+
+		case MSG_ANNOTATION_CREATE: {
+			const uint16_t id = msg.cast<AnnotationCreate>().id();
+			if(deadAnnotations.remove(id))
+				fi.removed = true;
+			break;
+		}
+
+		default: break;
+		}
+	}
+}
+
+}
+
+HistoryCompactor::HistoryCompactor(const QByteArray &history, QObject *parent)
+	: QObject(parent), m_history(history)
+{
+}
+
+void HistoryCompactor::run()
+{
+	protocol::MessageList history;
+
+	const uchar *data = reinterpret_cast<const uchar*>(m_history.constData());
+	int pos = 0;
+	while(pos < m_history.length()) {
+		const int len = protocol::Message::sniffLength(m_history.constData() + pos);
+		protocol::NullableMessageRef msg = protocol::Message::deserialize(data + pos, m_history.length() - pos, true);
+		if(msg.isNull()) {
+			qWarning("History compaction: could not decode message at offset %d", pos);
+			emit compacted(QBitArray());
+			return;
+		}
+		history << protocol::MessagePtr::fromNullable(msg);
+		pos += len;
+	}
+
+	emit compacted(compact(history));
+}
+
+QBitArray HistoryCompactor::compact(const protocol::MessageList &history)
+{
+	State state;
+	state.index.reserve(history.size());
+
+	for(const protocol::MessagePtr &msg : history)
+		filterMessage(state, msg);
+
+	filterLookyloos(state);
+	filterDeleted(state, history);
+
+	QBitArray keep(state.index.size());
+	for(int i=0;i<state.index.size();++i) {
+		const CompactionIndex &fi = state.index.at(i);
+		// A reset image does not contain any undo points
+		keep.setBit(i, !isGone(fi) && fi.type != protocol::MSG_UNDOPOINT);
+	}
+
+	return keep;
+}
+
+}
@@ -0,0 +1,90 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_SERVER_HISTORYCOMPACTOR_H
+#define DP_SERVER_HISTORYCOMPACTOR_H
+
+#include "../net/message.h"
+
+#include <QObject>
+#include <QRunnable>
+#include <QByteArray>
+#include <QBitArray>
+
+namespace server {
+
+/**
+ * @brief A runnable for compacting session history in a background thread
+ *
+ * This is the serverside alternative to a client generated reset image.
+ * The server cannot render the canvas, so instead of a snapshot, the compactor
+ * removes everything from the history that does not contribute to the
+ * current canvas content:
+ *
+ * - undone actions, undo/redo commands and undo points
+ * - chat (except the latest pinned message), laser trails, markers and other transient messages
+ * - server command messages (these are regenerated by the session)
+ * - Join/Leave messages of users who never did anything
+ * - content of layers and annotations that were later deleted
+ *
+ * Since messages are only removed, never merged, a history made mostly of
+ * plain drawing barely shrinks. The session gives up on automatic compaction
+ * when it doesn't free at least 10% and waits for an operator to reset.
+ *
+ * Like the recording filter, this uses a stripped down version of StateTracker's
+ * undo logic and does not evaluate access controls.
+ *
+ * Message reference counts are not thread safe, so the history is handed to
+ * the compactor in serialized form. The result is a bitmap of the messages to keep.
+ */
+class HistoryCompactor : public QObject, public QRunnable
+{
+	Q_OBJECT
+public:
+	/**
+	 * @brief Construct a compactor
+	 * @param history serialized session history
+	 */
+	explicit HistoryCompactor(const QByteArray &history, QObject *parent=nullptr);
+
+	void run() override;
+
+	/**
+	 * @brief Compact the given message list
+	 *
+	 * Opaque messages must have been decoded.
+	 *
+	 * @return a bitmap of the messages that must be kept
+	 */
+	static QBitArray compact(const protocol::MessageList &history);
+
+signals:
+	/**
+	 * @brief Compaction finished
+	 *
+	 * @param keep bitmap of messages to keep. A null array is emitted if the history could not be decoded.
+	 */
+	void compacted(const QBitArray &keep);
+
+private:
+	QByteArray m_history;
+};
+
+}
+
+#endif
@@ -34,26 +34,123 @@ InMemoryHistory::InMemoryHistory(const QUuid &id, const QString &alias, const pr
 {
 }
 
+// Number of most recent messages kept in deserialized form
+static const int TAIL_CACHE_SIZE = 256;
+
+// Maximum amount of serialized data to decode in a single batch
+static const int MAX_BATCH_BYTES = 512 * 1024;
+
 std::tuple<protocol::MessageList, int> InMemoryHistory::getBatch(int after) const
 {
 	if(after >= lastIndex())
 		return std::make_tuple(protocol::MessageList(), lastIndex());
 
 	const int offset = qMax(0, after - firstIndex() + 1);
-	Q_ASSERT(offset<m_history.size());
+	const int shared = m_shared.size();
+	const int count = shared + m_offsets.size();
+	Q_ASSERT(offset<count);
+
+	const int tailStart = count - m_tail.size();
+	if(offset >= tailStart)
+		return std::make_tuple(m_tail.mid(offset - tailStart), lastIndex());
+
+	protocol::MessageList batch;
+	int i = offset;
+
+	// Shared messages don't need decoding
+	if(i < shared) {
+		batch = m_shared.mid(i);
+		i = shared;
+	}
+
+	// Decode older messages from the arena
+	if(i < tailStart) {
+		const uchar *data = reinterpret_cast<const uchar*>(m_arena.constData());
+		const int startPos = m_offsets.at(i - shared);
+
+		for(;i<tailStart && m_offsets.at(i - shared) - startPos < MAX_BATCH_BYTES;++i) {
+			const int a = i - shared;
+			const int pos = m_offsets.at(a);
+			const int end = a+1 < m_offsets.size() ? m_offsets.at(a+1) : m_arena.length();
+			protocol::NullableMessageRef msg = protocol::Message::deserialize(data + pos, end - pos, false);
+			if(msg.isNull()) {
+				// Should not happen: everything in the arena was serialized by us.
+				// The batch ends here, so there won't be a gap in the history.
+				qCritical("%s: invalid message at history index %d", qPrintable(id().toString()), firstIndex() + i);
+				return std::make_tuple(batch, firstIndex() + i - 1);
+			}
+			batch << protocol::MessagePtr::fromNullable(msg);
+		}
+	}
 
-	return std::make_tuple(m_history.mid(offset), lastIndex());
+	if(i >= tailStart) {
+		batch << m_tail.mid(i - tailStart);
+		return std::make_tuple(batch, lastIndex());
+	}
+
+	return std::make_tuple(batch, firstIndex() + i - 1);
+}
+
+void InMemoryHistory::appendToArena(const protocol::MessagePtr &msg)
+{
+	const int pos = m_arena.length();
+	m_arena.resize(pos + msg->length());
+	const int len = msg->serialize(m_arena.data() + pos);
+	Q_ASSERT(len == msg->length());
+	Q_UNUSED(len);
+	m_offsets << pos;
+}
+
+void InMemoryHistory::trimTail()
+{
+	if(m_tail.size() > TAIL_CACHE_SIZE)
+		m_tail.erase(m_tail.begin(), m_tail.begin() + (m_tail.size() - TAIL_CACHE_SIZE));
+}
+
+void InMemoryHistory::hibernate()
+{
+	// Everything is still in the arena
+	m_tail = protocol::MessageList();
+	m_arena.squeeze();
+	m_offsets.squeeze();
 }
 
 void InMemoryHistory::historyAdd(const protocol::MessagePtr &msg)
 {
-	m_history << msg;
+	appendToArena(msg);
+	m_tail << msg;
+	trimTail();
 }
 
-void InMemoryHistory::historyReset(const protocol::MessageList &newHistory)
+void InMemoryHistory::historyAddShared(const protocol::MessagePtr &msg)
 {
-	m_history = newHistory;
+	// Only a shared prefix can be kept apart from the arena
+	if(!m_offsets.isEmpty()) {
+		historyAdd(msg);
+		return;
+	}
+
+	m_shared << msg;
+	m_tail << msg;
+	trimTail();
 }
 
+void InMemoryHistory::historyReset(const protocol::MessageList &newHistory)
+{
+	int size = 0;
+	for(const protocol::MessagePtr &msg : newHistory)
+		size += msg->length();
+
+	m_shared = protocol::MessageList();
+	m_arena.clear();
+	m_arena.reserve(size);
+	m_offsets.clear();
+	m_offsets.reserve(newHistory.size());
+
+	for(const protocol::MessagePtr &msg : newHistory)
+		appendToArena(msg);
+
+	m_tail = newHistory.mid(qMax(0, newHistory.size() - TAIL_CACHE_SIZE));
 }
 
+}
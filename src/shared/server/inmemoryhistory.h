@@ -24,11 +24,22 @@
 
 #include <QDateTime>
 #include <QSet>
+#include <QVector>
 
 namespace server {
 
 /**
  * @brief A session history backend that stores the session in memory
+ *
+ * To keep the memory footprint small, the history is stored in serialized
+ * form in a single append-only buffer with an index of message offsets.
+ * Messages are deserialized again when requested with getBatch. The most
+ * recent messages are also kept as MessagePtrs, so live updates are shared by
+ * all clients without being decoded separately for each of them.
+ *
+ * Shared messages (i.e. session template content) at the start of the
+ * history are not serialized. They are kept as MessagePtrs, since their
+ * content is already held by the template cache.
  */
 class InMemoryHistory : public SessionHistory {
 	Q_OBJECT
@@ -39,6 +50,7 @@ public:
 
 	void terminate() override { /* nothing to do */ }
 	void cleanupBatches(int) override { /* no caching, nothing to do */ }
+	void hibernate() override;
 
 	QString idAlias() const override { return m_alias; }
 	QString founderName() const override { return m_founder; }
@@ -74,12 +86,19 @@ public:
 
 protected:
 	void historyAdd(const protocol::MessagePtr &msg) override;
+	void historyAddShared(const protocol::MessagePtr &msg) override;
 	void historyReset(const protocol::MessageList &newHistory) override;
 	void historyAddBan(int, const QString &, const QHostAddress &, const QString &, const QString &) override { /* not persistent */ }
 	void historyRemoveBan(int) override { /* not persistent */ }
 
 private:
-	protocol::MessageList m_history;
+	void appendToArena(const protocol::MessagePtr &msg);
+	void trimTail();
+
+	protocol::MessageList m_shared;
+	QByteArray m_arena;
+	QVector<int> m_offsets;
+	protocol::MessageList m_tail;
 	QSet<QString> m_ops;
 	QSet<QString> m_trusted;
 	QSet<QString> m_announcements;
@@ -24,6 +24,7 @@
 #include "serverconfig.h"
 #include "serverlog.h"
 #include "templateloader.h"
+#include "metrics.h"
 
 #include "../net/control.h"
 #include "../util/authtoken.h"
@@ -39,11 +40,11 @@
 namespace server {
 
 LoginHandler::LoginHandler(Client *client, SessionServer *server) :
-	QObject(client), m_client(client), m_server(server), m_extauth_nonce(0), m_hostPrivilege(false), m_complete(false)
+	QObject(client), m_client(client), m_server(server), m_extauth_nonce(0), m_hostPrivilege(false), m_complete(false), m_compress(false)
 {
 	connect(client, &Client::loginMessage, this, &LoginHandler::handleLoginMessage);
-	connect(server, &SessionServer::sessionChanged, this, &LoginHandler::announceSession);
-	connect(server, &SessionServer::sessionEnded, this, &LoginHandler::announceSessionEnd);
+	connect(server, &SessionServer::sessionListUpdated, this, &LoginHandler::announceSessionList);
+	m_loginTime.start();
 }
 
 void LoginHandler::startLoginProcess()
@@ -73,6 +74,8 @@ void LoginHandler::startLoginProcess()
 		flags << "REPORT";
 	if(m_server->config()->getConfigBool(config::AllowCustomAvatars))
 		flags << "AVATAR";
+	if(m_server->config()->getConfigBool(config::Compression))
+		flags << "COMPRESS";
 
 	greeting.reply["flags"] = flags;
 
@@ -129,38 +132,14 @@ void LoginHandler::announceServerInfo()
 	}
 }
 
-void LoginHandler::announceSession(const QJsonObject &session)
+void LoginHandler::announceSessionList(const protocol::MessageList &messages)
 {
-	Q_ASSERT(session.contains("id"));
-
-	if(m_state != WAIT_FOR_LOGIN)
-		return;
-
-	protocol::ServerReply greeting;
-	greeting.type = protocol::ServerReply::LOGIN;
-	greeting.message = "New session";
-
-	QJsonArray s;
-	s << session;
-	greeting.reply["sessions"] = s;
-
-	send(greeting);
-}
-
-void LoginHandler::announceSessionEnd(const QString &id)
-{
-	if(m_state != WAIT_FOR_LOGIN)
+	if(m_state != WAIT_FOR_LOGIN || m_complete)
 		return;
 
-	protocol::ServerReply greeting;
-	greeting.type = protocol::ServerReply::LOGIN;
-	greeting.message = "Session ended";
-
-	QJsonArray s;
-	s << id;
-	greeting.reply["remove"] = s;
-
-	send(greeting);
+	// These messages are shared by all clients in the lobby
+	for(const protocol::MessagePtr &msg : messages)
+		m_client->sendDirectMessage(msg);
 }
 
 void LoginHandler::handleLoginMessage(protocol::MessagePtr msg)
@@ -234,6 +213,10 @@ void LoginHandler::handleIdentMessage(const protocol::ServerCommand &cmd)
 		m_client->setAvatar(QByteArray::fromBase64(cmd.kwargs["avatar"].toString().toUtf8()));
 	}
 
+	// Client can decompress the stream. Compression is not started until the login
+	// is complete, so passwords are never compressed together with other content.
+	m_compress = cmd.kwargs["compress"].toBool() && m_server->config()->getConfigBool(config::Compression);
+
 	switch(userAccount.status) {
 	case RegisteredUser::NotFound: {
 		// Account not found in internal user list. Allow guest login (if enabled)
@@ -565,6 +548,9 @@ void LoginHandler::handleHostMessage(const protocol::ServerCommand &cmd)
 	send(reply);
 
 	m_complete = true;
+	if(m_compress)
+		m_client->setCompression(true);
+	ServerMetrics::instance().loginDuration.observe(m_loginTime.elapsed() / 1000.0);
 	session->joinUser(m_client, true);
 
 	deleteLater();
@@ -641,6 +627,9 @@ void LoginHandler::handleJoinMessage(const protocol::ServerCommand &cmd)
 	send(reply);
 
 	m_complete = true;
+	if(m_compress)
+		m_client->setCompression(true);
+	ServerMetrics::instance().loginDuration.observe(m_loginTime.elapsed() / 1000.0);
 
 	session->joinUser(m_client, false);
 
@@ -24,6 +24,7 @@
 #include <QObject>
 #include <QStringList>
 #include <QByteArray>
+#include <QElapsedTimer>
 
 namespace protocol {
 	struct ServerCommand;
@@ -93,8 +94,7 @@ public:
 private slots:
 	void handleLoginMessage(protocol::MessagePtr message);
 
-	void announceSession(const QJsonObject &session);
-	void announceSessionEnd(const QString &id);
+	void announceSessionList(const protocol::MessageList &messages);
 
 private:
 	enum State {
@@ -123,6 +123,9 @@ private:
 	quint64 m_extauth_nonce;
 	bool m_hostPrivilege;
 	bool m_complete;
+	bool m_compress;
+
+	QElapsedTimer m_loginTime;
 };
 
 }
@@ -0,0 +1,100 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "metrics.h"
+
+namespace server {
+
+Histogram::Histogram(const QVector<double> &bounds)
+	: m_bounds(bounds), m_counts(bounds.size() + 1, 0), m_sum(0), m_count(0)
+{
+}
+
+void Histogram::observe(double value)
+{
+	int i=0;
+	while(i<m_bounds.size() && value > m_bounds.at(i))
+		++i;
+	++m_counts[i];
+	m_sum += value;
+	++m_count;
+}
+
+ServerMetrics::ServerMetrics()
+	: historyBlockLoadTime({0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5}),
+	  loginDuration({0.1, 0.5, 1, 2.5, 5, 10, 30, 60}),
+	  eventLoopLag({0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1})
+{
+}
+
+ServerMetrics &ServerMetrics::instance()
+{
+	static ServerMetrics metrics;
+	return metrics;
+}
+
+void MetricsWriter::header(const char *name, const char *type, const char *help)
+{
+	m_data.append("# HELP ").append(name).append(' ').append(help).append('\n');
+	m_data.append("# TYPE ").append(name).append(' ').append(type).append('\n');
+}
+
+void MetricsWriter::sample(const char *name, double value, const QString &labels)
+{
+	m_data.append(name);
+	if(!labels.isEmpty())
+		m_data.append('{').append(labels.toUtf8()).append('}');
+	m_data.append(' ').append(QByteArray::number(value, 'g', 15)).append('\n');
+}
+
+void MetricsWriter::gauge(const char *name, const char *help, double value)
+{
+	header(name, "gauge", help);
+	sample(name, value);
+}
+
+void MetricsWriter::counter(const char *name, const char *help, double value)
+{
+	header(name, "counter", help);
+	sample(name, value);
+}
+
+void MetricsWriter::histogram(const char *name, const char *help, const Histogram &histogram)
+{
+	header(name, "histogram", help);
+
+	const QByteArray bucket = QByteArray(name) + "_bucket";
+	quint64 cumulative = 0;
+	for(int i=0;i<histogram.bounds().size();++i) {
+		cumulative += histogram.counts().at(i);
+		sample(bucket.constData(), cumulative, label("le", QString::number(histogram.bounds().at(i))));
+	}
+	sample(bucket.constData(), histogram.count(), label("le", "+Inf"));
+	sample((QByteArray(name) + "_sum").constData(), histogram.sum());
+	sample((QByteArray(name) + "_count").constData(), histogram.count());
+}
+
+QString MetricsWriter::label(const char *name, const QString &value)
+{
+	QString escaped = value;
+	escaped.replace('\\', "\\\\").replace('"', "\\\"").replace('\n', "\\n");
+	return QStringLiteral("%1=\"%2\"").arg(QString::fromLatin1(name), escaped);
+}
+
+}
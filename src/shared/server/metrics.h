@@ -0,0 +1,114 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_SERVER_METRICS_H
+#define DP_SERVER_METRICS_H
+
+#include <QVector>
+#include <QByteArray>
+#include <QString>
+
+namespace server {
+
+/**
+ * @brief A histogram with fixed bucket boundaries
+ */
+class Histogram
+{
+public:
+	/**
+	 * @param bounds upper bounds of the buckets, in ascending order
+	 */
+	explicit Histogram(const QVector<double> &bounds);
+
+	//! Record an observation
+	void observe(double value);
+
+	const QVector<double> &bounds() const { return m_bounds; }
+
+	//! Get the number of observations per bucket. The last one is the overflow bucket.
+	const QVector<quint64> &counts() const { return m_counts; }
+
+	double sum() const { return m_sum; }
+	quint64 count() const { return m_count; }
+
+private:
+	QVector<double> m_bounds;
+	QVector<quint64> m_counts;
+	double m_sum;
+	quint64 m_count;
+};
+
+/**
+ * @brief Server wide metrics that don't belong to any single object
+ *
+ * These are updated and read only in the main thread.
+ */
+struct ServerMetrics
+{
+	//! Time taken to load a history block from disk (seconds)
+	Histogram historyBlockLoadTime;
+
+	//! Time from connection to joining a session (seconds)
+	Histogram loginDuration;
+
+	//! How late the event loop runs a periodic timer (seconds)
+	Histogram eventLoopLag;
+
+	static ServerMetrics &instance();
+
+private:
+	ServerMetrics();
+};
+
+/**
+ * @brief Writer for the Prometheus text exposition format
+ *
+ * All samples of a metric must be written right after its header.
+ */
+class MetricsWriter
+{
+public:
+	//! Write the HELP and TYPE lines of a metric
+	void header(const char *name, const char *type, const char *help);
+
+	/**
+	 * @brief Write a sample
+	 * @param labels label list made with label()
+	 */
+	void sample(const char *name, double value, const QString &labels=QString());
+
+	//! Write a metric with a single unlabeled sample
+	void gauge(const char *name, const char *help, double value);
+	void counter(const char *name, const char *help, double value);
+
+	//! Write a histogram metric
+	void histogram(const char *name, const char *help, const Histogram &histogram);
+
+	//! Format a label. Multiple labels can be joined with a comma.
+	static QString label(const char *name, const QString &value);
+
+	const QByteArray &data() const { return m_data; }
+
+private:
+	QByteArray m_data;
+};
+
+}
+
+#endif
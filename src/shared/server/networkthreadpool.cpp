@@ -0,0 +1,63 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "networkthreadpool.h"
+
+#include <QThread>
+
+namespace server {
+
+NetworkThreadPool::NetworkThreadPool(int count, QObject *parent)
+	: QObject(parent), m_next(0)
+{
+	for(int i=0;i<count;++i) {
+		QThread *thread = new QThread;
+		thread->setObjectName(QStringLiteral("network-%1").arg(i));
+		thread->start();
+		m_threads << thread;
+	}
+}
+
+NetworkThreadPool::~NetworkThreadPool()
+{
+	for(QThread *thread : m_threads) {
+		// Quitting right away would drop the deferred deletions of connection
+		// workers still queued in the thread. Events are processed in order,
+		// so quit only once a marker object posted after them is deleted.
+		QObject *marker = new QObject;
+		marker->moveToThread(thread);
+		connect(marker, &QObject::destroyed, thread, &QThread::quit, Qt::DirectConnection);
+		marker->deleteLater();
+
+		thread->wait();
+		delete thread;
+	}
+}
+
+QThread *NetworkThreadPool::nextThread()
+{
+	if(m_threads.isEmpty())
+		return nullptr;
+
+	QThread *thread = m_threads.at(m_next);
+	m_next = (m_next + 1) % m_threads.size();
+	return thread;
+}
+
+}
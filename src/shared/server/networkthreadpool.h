@@ -0,0 +1,58 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_SERVER_NETWORKTHREADPOOL_H
+#define DP_SERVER_NETWORKTHREADPOOL_H
+
+#include <QObject>
+#include <QVector>
+
+class QThread;
+
+namespace server {
+
+/**
+ * @brief A set of threads for client socket I/O
+ *
+ * Client connections are assigned to the threads in turn.
+ * See ClientConnection.
+ */
+class NetworkThreadPool : public QObject
+{
+	Q_OBJECT
+public:
+	/**
+	 * @brief Start the network threads
+	 * @param count number of threads. If zero, all I/O is done in the main thread
+	 */
+	explicit NetworkThreadPool(int count, QObject *parent=nullptr);
+	~NetworkThreadPool();
+
+	int threadCount() const { return m_threads.size(); }
+
+	//! Get the thread the next connection should use (null if there are no threads)
+	QThread *nextThread();
+
+private:
+	QVector<QThread*> m_threads;
+	int m_next;
+};
+
+}
+
+#endif
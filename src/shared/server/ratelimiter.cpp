@@ -0,0 +1,90 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "ratelimiter.h"
+
+#include <QJsonObject>
+#include <cmath>
+
+namespace server {
+
+RateLimiter::RateLimiter()
+	: m_lastRefill(0), m_totalMessages(0), m_totalBytes(0), m_throttleCount(0)
+{
+}
+
+void RateLimiter::setLimits(int messagesPerSecond, int bytesPerSecond)
+{
+	m_messages.rate = qMax(0, messagesPerSecond);
+	m_messages.tokens = m_messages.rate;
+	m_bytes.rate = qMax(0, bytesPerSecond);
+	m_bytes.tokens = m_bytes.rate;
+	m_lastRefill = 0;
+}
+
+void RateLimiter::Bucket::refill(qint64 elapsed)
+{
+	tokens = qMin(rate, tokens + rate * elapsed / 1000.0);
+}
+
+int RateLimiter::Bucket::take(double amount)
+{
+	if(rate <= 0)
+		return 0;
+
+	tokens -= amount;
+	if(tokens >= 0)
+		return 0;
+
+	return int(std::ceil(-tokens / rate * 1000.0));
+}
+
+int RateLimiter::take(int bytes, qint64 now)
+{
+	++m_totalMessages;
+	m_totalBytes += bytes;
+
+	if(!isEnabled())
+		return 0;
+
+	if(m_lastRefill > 0 && now > m_lastRefill) {
+		m_messages.refill(now - m_lastRefill);
+		m_bytes.refill(now - m_lastRefill);
+	}
+	m_lastRefill = now;
+
+	const int wait = qMax(m_messages.take(1), m_bytes.take(bytes));
+	if(wait > 0)
+		++m_throttleCount;
+
+	return wait;
+}
+
+QJsonObject RateLimiter::description() const
+{
+	return QJsonObject {
+		{"messageLimit", int(m_messages.rate)},
+		{"byteLimit", int(m_bytes.rate)},
+		{"messages", double(m_totalMessages)},
+		{"bytes", double(m_totalBytes)},
+		{"throttled", m_throttleCount}
+	};
+}
+
+}
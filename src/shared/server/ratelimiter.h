@@ -0,0 +1,95 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DP_SERVER_RATELIMITER_H
+#define DP_SERVER_RATELIMITER_H
+
+#include <QtGlobal>
+
+class QJsonObject;
+
+namespace server {
+
+/**
+ * @brief Token bucket rate limiter for incoming messages
+ *
+ * Two buckets are used: one for the message count and one for the byte count.
+ * A bucket holds at most one second's worth of tokens, which allows short bursts.
+ *
+ * Taking more tokens than are available puts the bucket into debt. The sender
+ * should then be made to wait until the debt has been paid off. This way a
+ * message never needs to be held back once it has been received.
+ */
+class RateLimiter
+{
+public:
+	RateLimiter();
+
+	/**
+	 * @brief Set the rate limits
+	 *
+	 * A limit of zero means unlimited. The buckets are refilled.
+	 */
+	void setLimits(int messagesPerSecond, int bytesPerSecond);
+
+	//! Is either limit enabled?
+	bool isEnabled() const { return m_messages.rate > 0 || m_bytes.rate > 0; }
+
+	/**
+	 * @brief Account for a received message
+	 *
+	 * @param bytes message length
+	 * @param now current time in milliseconds
+	 * @return how many milliseconds the sender should wait before sending more (0 if no need to wait)
+	 */
+	int take(int bytes, qint64 now);
+
+	//! Total number of messages accounted for
+	quint64 totalMessages() const { return m_totalMessages; }
+
+	//! Total number of bytes accounted for
+	quint64 totalBytes() const { return m_totalBytes; }
+
+	//! Number of times the limit was exceeded
+	int throttleCount() const { return m_throttleCount; }
+
+	//! Get a description of the limits and counters for the admin API
+	QJsonObject description() const;
+
+private:
+	struct Bucket {
+		double rate;
+		double tokens;
+
+		Bucket() : rate(0), tokens(0) { }
+		void refill(qint64 elapsed);
+		int take(double amount);
+	};
+
+	Bucket m_messages;
+	Bucket m_bytes;
+	qint64 m_lastRefill;
+
+	quint64 m_totalMessages;
+	quint64 m_totalBytes;
+	int m_throttleCount;
+};
+
+}
+
+#endif
@@ -74,7 +74,14 @@ namespace config {
 		LogPurgeDays(18, "logpurgedays", "0", ConfigKey::INT),               // Automatically purge log entries older than this many days (DB log only)
 		AutoresetThreshold(19, "autoResetThreshold", "15mb", ConfigKey::SIZE), // Default autoreset threshold in bytes
 		AllowCustomAvatars(20, "customAvatars", "true", ConfigKey::BOOL),      // Allow users to set a custom avatar when logging in
-		ExtAuthAvatars(21, "extAuthAvatars", "true", ConfigKey::BOOL)          // Use avatars received from ext-auth server (unless a custom avatar has been set)
+		ExtAuthAvatars(21, "extAuthAvatars", "true", ConfigKey::BOOL),         // Use avatars received from ext-auth server (unless a custom avatar has been set)
+		AutoCompact(22, "autoCompact", "true", ConfigKey::BOOL),               // Compact session history on the server if no operator performs the autoreset
+		ClientMessageRate(23, "clientMessageRate", "0", ConfigKey::INT),       // Maximum number of messages per second a single client may send (0 = unlimited)
+		ClientByteRate(24, "clientByteRate", "0", ConfigKey::SIZE),            // Maximum number of bytes per second a single client may send (0 = unlimited)
+		SessionMessageRate(25, "sessionMessageRate", "0", ConfigKey::INT),     // Maximum number of messages per second all clients in a session may send (0 = unlimited)
+		SessionByteRate(26, "sessionByteRate", "0", ConfigKey::SIZE),          // Maximum number of bytes per second all clients in a session may send (0 = unlimited)
+		HibernationTime(27, "hibernationTime", "10m", ConfigKey::TIME),        // Release cached data of persistent sessions that have been empty for this long (0 = never)
+		Compression(28, "compression", "true", ConfigKey::BOOL)                // Allow clients to negotiate stream compression
 		;
 }
 
@@ -183,6 +183,11 @@ public:
 	 */
 	virtual QList<Log> getLogEntries(const QUuid &session, const QDateTime &after, Log::Level atleast, int offset, int limit) const = 0;
 
+	/**
+	 * @brief Can getLogEntries() be called from a thread other than the main thread?
+	 */
+	virtual bool hasThreadSafeQueries() const { return false; }
+
 	/**
 	 * @brief Return a query builder
 	 * @return
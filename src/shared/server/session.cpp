@@ -22,6 +22,7 @@
 #include "serverconfig.h"
 #include "inmemoryhistory.h"
 #include "serverlog.h"
+#include "historycompactor.h"
 
 #include "../net/control.h"
 #include "../net/meta.h"
@@ -36,11 +37,16 @@
 #include <QTimer>
 #include <QNetworkRequest>
 #include <QNetworkReply>
+#include <QThreadPool>
+#include <QSignalBlocker>
 
 namespace server {
 
 using protocol::MessagePtr;
 
+// How long to wait for operators to respond to an autoreset request before compacting the history on the server
+static const int AUTORESET_RESPONSE_TIMEOUT = 30 * 1000;
+
 Session::Session(SessionHistory *history, ServerConfig *config, sessionlisting::Announcements *announcements, QObject *parent)
 	: QObject(parent),
 	m_config(config),
@@ -50,6 +56,13 @@ Session::Session(SessionHistory *history, ServerConfig *config, sessionlisting::
 	m_recorder(nullptr),
 	m_history(history),
 	m_resetstreamsize(0),
+	m_messagesOut(0),
+	m_bytesOut(0),
+	m_compactionFirstIndex(0),
+	m_compactionLastIndex(-1),
+	m_compactionFutile(false),
+	m_compacting(false),
+	m_hibernating(false),
 	m_closed(false),
 	m_authOnly(false),
 	m_autoResetRequestStatus(AutoResetState::NotSent)
@@ -57,6 +70,7 @@ Session::Session(SessionHistory *history, ServerConfig *config, sessionlisting::
 	m_history->setParent(this);
 	m_history->setSizeLimit(config->getConfigSize(config::SessionSizeLimit));
 	m_history->setAutoResetThreshold(config->getConfigSize(config::AutoresetThreshold));
+	m_rateLimiter.setLimits(config->getConfigInt(config::SessionMessageRate), config->getConfigSize(config::SessionByteRate));
 
 	m_lastEventTime.start();
 	m_lastStatusUpdate.start();
@@ -100,43 +114,11 @@ void Session::switchState(State newstate)
 		if(m_state==Reset && !m_resetstream.isEmpty()) {
 			// Reset buffer uploaded. Now perform the reset before returning to
 			// normal running state.
-
-			// Add list of currently logged in users to reset snapshot
-			QList<uint8_t> owners;
-			QList<uint8_t> trusted;
-			for(const Client *c : m_clients) {
-				m_resetstream.prepend(c->joinMessage());
-				if(c->isOperator())
-					owners << c->id();
-				if(c->isTrusted())
-					trusted << c->id();
-			}
-			if(!trusted.isEmpty())
-				m_resetstream.prepend(protocol::MessagePtr(new protocol::TrustedUsers(0, trusted)));
-			m_resetstream.prepend(protocol::MessagePtr(new protocol::SessionOwner(0, owners)));
-
-			// Send reset snapshot
-			if(!m_history->reset(m_resetstream)) {
+			if(!resetHistory(m_resetstream)) {
 				// This shouldn't normally happen, as the size limit should be caught while
 				// still uploading the reset.
 				messageAll("Session reset failed!", true);
 				success = false;
-
-			} else {
-				protocol::ServerReply resetcmd;
-				resetcmd.type = protocol::ServerReply::RESET;
-				resetcmd.reply["state"] = "reset";
-				resetcmd.message = "Session reset!";
-				directToAll(MessagePtr(new protocol::Command(0, resetcmd)));
-
-				protocol::ServerReply catchup;
-				catchup.type = protocol::ServerReply::CATCHUP;
-				catchup.reply["count"] = m_history->lastIndex() - m_history->firstIndex();
-				directToAll(MessagePtr(new protocol::Command(0, catchup)));
-
-				m_autoResetRequestStatus = AutoResetState::NotSent;
-
-				sendUpdatedSessionProperties();
 			}
 
 			m_resetstream.clear();
@@ -161,6 +143,57 @@ void Session::switchState(State newstate)
 	m_state = newstate;
 }
 
+bool Session::resetHistory(protocol::MessageList newHistory)
+{
+	// Add list of currently logged in users to reset snapshot
+	QList<uint8_t> owners;
+	QList<uint8_t> trusted;
+	for(const Client *c : m_clients) {
+		newHistory.prepend(c->joinMessage());
+		if(c->isOperator())
+			owners << c->id();
+		if(c->isTrusted())
+			trusted << c->id();
+	}
+	if(!trusted.isEmpty())
+		newHistory.prepend(protocol::MessagePtr(new protocol::TrustedUsers(0, trusted)));
+	newHistory.prepend(protocol::MessagePtr(new protocol::SessionOwner(0, owners)));
+
+	// Replace the history. Clients must be notified of the reset before
+	// they start receiving the new history, so the update signal is held back.
+	{
+		const QSignalBlocker blocker(m_history);
+		if(!m_history->reset(newHistory))
+			return false;
+	}
+
+	// Old history still waiting in the upload queues is now obsolete
+	for(Client *c : m_clients)
+		c->discardQueuedHistory();
+
+	protocol::ServerReply resetcmd;
+	resetcmd.type = protocol::ServerReply::RESET;
+	resetcmd.reply["state"] = "reset";
+	resetcmd.message = "Session reset!";
+	directToAll(MessagePtr(new protocol::Command(0, resetcmd)));
+
+	protocol::ServerReply catchup;
+	catchup.type = protocol::ServerReply::CATCHUP;
+	catchup.reply["count"] = m_history->lastIndex() - m_history->firstIndex();
+	directToAll(MessagePtr(new protocol::Command(0, catchup)));
+
+	m_autoResetRequestStatus = AutoResetState::NotSent;
+	m_compactionFutile = false;
+
+	sendUpdatedSessionProperties();
+
+	// Start sending the new history
+	for(Client *c : m_clients)
+		c->sendNextHistoryBatch();
+
+	return true;
+}
+
 void Session::assignId(Client *user)
 {
 	uint8_t id = m_history->idQueue().getIdForName(user->username());
@@ -176,12 +209,16 @@ void Session::assignId(Client *user)
 
 void Session::joinUser(Client *user, bool host)
 {
+	wakeUp();
+
 	user->setSession(this);
 	m_clients.append(user);
 
 	connect(user, &Client::loggedOff, this, &Session::removeUser);
 	connect(history(), &SessionHistory::newMessagesAvailable, user, &Client::sendNextHistoryBatch);
 
+	user->setRateLimits(m_config->getConfigInt(config::ClientMessageRate), m_config->getConfigSize(config::ClientByteRate));
+
 	m_pastClients.remove(user->id());
 
 	// Send session log history to the new client
@@ -656,11 +693,17 @@ void Session::addToHistory(const protocol::MessagePtr &msg)
 	if(m_state == Shutdown)
 		return;
 
+	wakeUp();
+
 	// Add message to history (if there is space)
 	if(!m_history->addMessage(msg)) {
 		const Client *shame = getClientById(msg->contextId());
 		messageAll("History size limit reached!", false);
 		messageAll((shame ? shame->username() : QString("user #%1").arg(msg->contextId())) + " broke the camel's back. Session must be reset to continue drawing.", false);
+
+		// Last chance: see if the history can be compacted enough to continue
+		if(m_config->getConfigBool(config::AutoCompact))
+			startHistoryCompaction();
 		return;
 	}
 
@@ -708,12 +751,30 @@ void Session::addToHistory(const protocol::MessagePtr &msg)
 		resetRequest.reply["query"] = true;
 		protocol::MessagePtr reqMsg { new protocol::Command(0, resetRequest )};
 
+		bool hasOp = false;
 		for(Client *c : m_clients) {
-			if(c->isOperator())
+			if(c->isOperator()) {
 				c->sendDirectMessage(reqMsg);
+				hasOp = true;
+			}
 		}
 
 		m_autoResetRequestStatus = AutoResetState::Queried;
+
+		// If there is nobody to perform the reset, the server must do it.
+		if(m_config->getConfigBool(config::AutoCompact)) {
+			if(!hasOp) {
+				startHistoryCompaction();
+
+			} else {
+				QTimer::singleShot(AUTORESET_RESPONSE_TIMEOUT, this, [this]() {
+					if(m_autoResetRequestStatus == AutoResetState::Queried && m_state == Running) {
+						log(Log().about(Log::Level::Info, Log::Topic::Status).message("No response to autoreset request."));
+						startHistoryCompaction();
+					}
+				});
+			}
+		}
 	}
 
 	// Regular history size status updates
@@ -726,6 +787,133 @@ void Session::addToHistory(const protocol::MessagePtr &msg)
 	}
 }
 
+void Session::startHistoryCompaction()
+{
+	if(m_compacting || m_compactionFutile || m_state != Running)
+		return;
+
+	log(Log().about(Log::Level::Info, Log::Topic::Status).message(
+		QString("Compacting session history (%1 MB)").arg(m_history->sizeInBytes()/(1024.0*1024.0), 0, 'f', 1)
+	));
+
+	m_compacting = true;
+	m_autoResetRequestStatus = AutoResetState::Compacting;
+	m_compactionFirstIndex = m_history->firstIndex();
+
+	// Collect the current history. The messages are kept until compaction
+	// is finished, and the serialized form is given to the compactor.
+	m_compactionSource.clear();
+	int lastBatchIndex = m_history->firstIndex() - 1;
+	do {
+		protocol::MessageList batch;
+		const int after = lastBatchIndex;
+		std::tie(batch, lastBatchIndex) = m_history->getBatch(lastBatchIndex);
+		if(lastBatchIndex == after) {
+			log(Log().about(Log::Level::Error, Log::Topic::Status).message(
+				QString("History is unreadable after index %1. Compaction cancelled.").arg(after)
+			));
+			m_compactionSource.clear();
+			m_compacting = false;
+			m_autoResetRequestStatus = AutoResetState::Queried;
+			return;
+		}
+		m_compactionSource << batch;
+	} while(lastBatchIndex<m_history->lastIndex());
+	m_compactionLastIndex = lastBatchIndex;
+
+	int serializedLength = 0;
+	for(const MessagePtr &m : m_compactionSource)
+		serializedLength += m->length();
+
+	QByteArray serialized(serializedLength, 0);
+	int pos = 0;
+	for(const MessagePtr &m : m_compactionSource)
+		pos += m->serialize(serialized.data() + pos);
+
+	auto *compactor = new HistoryCompactor(serialized);
+	connect(compactor, &HistoryCompactor::compacted, this, &Session::onHistoryCompacted);
+	QThreadPool::globalInstance()->start(compactor);
+}
+
+void Session::onHistoryCompacted(const QBitArray &keep)
+{
+	const protocol::MessageList source = m_compactionSource;
+	m_compactionSource.clear();
+	m_compacting = false;
+
+	// The session may have been reset (or shut down) while the compactor was running
+	if(m_state != Running || m_history->firstIndex() != m_compactionFirstIndex) {
+		log(Log().about(Log::Level::Debug, Log::Topic::Status).message("History changed during compaction. Result discarded."));
+		if(m_autoResetRequestStatus == AutoResetState::Compacting)
+			m_autoResetRequestStatus = AutoResetState::NotSent;
+		return;
+	}
+
+	// Let operators still perform a normal reset if compaction fails
+	m_autoResetRequestStatus = AutoResetState::Queried;
+
+	if(keep.size() != source.size()) {
+		log(Log().about(Log::Level::Warn, Log::Topic::Status).message("History compaction failed."));
+		return;
+	}
+
+	protocol::MessageList compacted;
+	uint compactedSize = 0;
+	for(int i=0;i<source.size();++i) {
+		if(keep.testBit(i)) {
+			compacted << source.at(i);
+			compactedSize += source.at(i)->length();
+		}
+	}
+
+	// Messages added while the compactor was running
+	int lastBatchIndex = m_compactionLastIndex;
+	while(lastBatchIndex < m_history->lastIndex()) {
+		protocol::MessageList batch;
+		const int after = lastBatchIndex;
+		std::tie(batch, lastBatchIndex) = m_history->getBatch(lastBatchIndex);
+		if(lastBatchIndex == after) {
+			log(Log().about(Log::Level::Error, Log::Topic::Status).message(
+				QString("History is unreadable after index %1. Compaction result discarded.").arg(after)
+			));
+			return;
+		}
+		for(const MessagePtr &m : batch)
+			compactedSize += m->length();
+		compacted << batch;
+	}
+
+	// Not worth it if the history didn't shrink noticeably.
+	// This is the case when the history is mostly plain drawing: the compactor
+	// can only drop messages, not merge them. Running it again won't help,
+	// so automatic compaction stays off until the session is reset.
+	if(compactedSize > m_history->sizeInBytes() * 0.9) {
+		m_compactionFutile = true;
+		log(Log().about(Log::Level::Warn, Log::Topic::Status).message(
+			QString("History compaction freed only %1 KB. Session must be reset by an operator.")
+				.arg((m_history->sizeInBytes() - qMin(compactedSize, m_history->sizeInBytes())) / 1024)
+		));
+		messageAll("The session history could not be compacted. An operator must reset the session.", false);
+		return;
+	}
+
+	const uint oldSize = m_history->sizeInBytes();
+	if(!resetHistory(compacted)) {
+		m_compactionFutile = true;
+		log(Log().about(Log::Level::Warn, Log::Topic::Status).message("Compacted history exceeds size limit!"));
+		return;
+	}
+
+	log(Log().about(Log::Level::Info, Log::Topic::Status).message(
+		QString("Session history compacted from %1 MB to %2 MB")
+			.arg(oldSize/(1024.0*1024.0), 0, 'f', 1)
+			.arg(m_history->sizeInBytes()/(1024.0*1024.0), 0, 'f', 1)
+	));
+
+	if(!m_recordingFile.isEmpty())
+		restartRecording();
+}
+
 void Session::addToInitStream(protocol::MessagePtr msg)
 {
 	Q_ASSERT(m_state == Initialization || m_state == Reset || m_state == Shutdown);
@@ -881,6 +1069,14 @@ void Session::killSession(bool terminate)
 	this->deleteLater();
 }
 
+qint64 Session::uploadQueueBytes() const
+{
+	qint64 total = 0;
+	for(const Client *c : m_clients)
+		total += c->uploadQueueBytes();
+	return total;
+}
+
 void Session::directToAll(protocol::MessagePtr msg)
 {
 	for(Client *c : m_clients) {
@@ -951,7 +1147,14 @@ void Session::restartRecording()
 	int lastBatchIndex=0;
 	do {
 		protocol::MessageList history;
+		const int after = lastBatchIndex;
 		std::tie(history, lastBatchIndex) = m_history->getBatch(lastBatchIndex);
+		if(lastBatchIndex == after) {
+			log(Log().about(Log::Level::Error, Log::Topic::Status).message(
+				QString("History is unreadable after index %1. Recording is incomplete.").arg(after)
+			));
+			break;
+		}
 		for(const MessagePtr &m : history)
 			m_recorder->recordMessage(m);
 
@@ -1048,6 +1251,31 @@ void Session::onAnnouncementsChanged(const sessionlisting::Announcable *session)
 		sendUpdatedAnnouncementList();
 }
 
+bool Session::hibernate()
+{
+	if(m_hibernating)
+		return true;
+
+	if(!m_clients.isEmpty() || m_compacting || m_state != Running)
+		return false;
+
+	m_history->hibernate();
+	m_resetstream = protocol::MessageList();
+	m_resetstreamsize = 0;
+	m_hibernating = true;
+
+	log(Log().about(Log::Level::Debug, Log::Topic::Status).message("Session hibernating."));
+	return true;
+}
+
+void Session::wakeUp()
+{
+	if(m_hibernating) {
+		m_hibernating = false;
+		log(Log().about(Log::Level::Debug, Log::Topic::Status).message("Session woke up from hibernation."));
+	}
+}
+
 void Session::historyCacheCleanup()
 {
 	int minIdx = m_history->lastIndex();
@@ -1137,6 +1365,8 @@ QJsonObject Session::getDescription(bool full) const
 		o["maxSize"] = int(m_history->sizeLimit());
 		o["resetThreshold"] = int(m_history->autoResetThreshold());
 		o["deputies"] = m_history->flags().testFlag(SessionHistory::Deputies);
+		o["rateLimit"] = m_rateLimiter.description();
+		o["hibernating"] = m_hibernating;
 
 		QJsonArray users;
 		for(const Client *user : m_clients) {
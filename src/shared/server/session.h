@@ -28,12 +28,14 @@
 #include <QElapsedTimer>
 #include <QUuid>
 #include <QJsonObject>
+#include <QBitArray>
 
 #include "../listings/announcable.h"
 #include "../util/passwordhash.h"
 #include "../net/message.h"
 #include "../net/protover.h"
 #include "sessionhistory.h"
+#include "ratelimiter.h"
 #include "jsonapi.h"
 
 class QTimer;
@@ -316,6 +318,26 @@ public:
 	 */
 	const SessionHistory *history() const { return m_history; }
 
+	/**
+	 * @brief Get the session wide rate limiter for incoming messages
+	 */
+	RateLimiter &rateLimiter() { return m_rateLimiter; }
+	const RateLimiter &rateLimiter() const { return m_rateLimiter; }
+
+	/**
+	 * @brief Account for messages queued for sending to a client
+	 */
+	void countOutgoing(int messages, int bytes) { m_messagesOut += messages; m_bytesOut += bytes; }
+
+	//! Total number of messages queued for sending to the clients
+	quint64 messagesOut() const { return m_messagesOut; }
+
+	//! Total number of bytes queued for sending to the clients
+	quint64 bytesOut() const { return m_bytesOut; }
+
+	//! Get the combined length of the clients' upload queues
+	qint64 uploadQueueBytes() const;
+
 	/**
 	 * @brief Add a message to the session history
 	 * @param msg
@@ -439,6 +461,32 @@ public:
 	//! Release caches that can be released
 	void historyCacheCleanup();
 
+	/**
+	 * @brief Compact the session history on the server
+	 *
+	 * This is used to keep the session going when no operator is available
+	 * to perform an autoreset. The history is compacted in a background thread
+	 * and the session is reset once the compaction is complete.
+	 */
+	void startHistoryCompaction();
+
+	//! Is a serverside history compaction in progress?
+	bool isCompacting() const { return m_compacting; }
+
+	/**
+	 * @brief Release cached data of an empty session
+	 *
+	 * This is used to reduce the memory footprint of persistent sessions
+	 * that nobody is using. The session wakes up automatically when
+	 * a user joins or a message is added to the history.
+	 *
+	 * @return false if the session cannot hibernate right now
+	 */
+	bool hibernate();
+
+	//! Is this session hibernating?
+	bool isHibernating() const { return m_hibernating; }
+
 	/**
 	 * @brief Send an abuse report
 	 *
@@ -504,6 +552,7 @@ signals:
 private slots:
 	void removeUser(Client *user);
 	void onAnnouncementsChanged(const Announcable *session);
+	void onHistoryCompacted(const QBitArray &keep);
 
 private:
 	void cleanupCommandStream();
@@ -511,6 +560,8 @@ private:
 	void restartRecording();
 	void stopRecording();
 	void abortReset();
+	void wakeUp();
+	bool resetHistory(protocol::MessageList newHistory);
 
 	void sendUpdatedSessionProperties();
 	void sendStatusUpdate();
@@ -539,9 +590,20 @@ private:
 	QElapsedTimer m_lastEventTime;
 	QElapsedTimer m_lastStatusUpdate;
 
+	RateLimiter m_rateLimiter;
+	quint64 m_messagesOut;
+	quint64 m_bytesOut;
+
+	protocol::MessageList m_compactionSource;
+	int m_compactionFirstIndex;
+	int m_compactionLastIndex;
+	bool m_compactionFutile; // compaction couldn't help: don't retry until the history is reset
+	bool m_compacting;
+	bool m_hibernating;
+
 	bool m_closed;
 	bool m_authOnly;
-	enum class AutoResetState { NotSent, Queried, Requested} m_autoResetRequestStatus;
+	enum class AutoResetState { NotSent, Queried, Requested, Compacting } m_autoResetRequestStatus;
 };
 
 }
@@ -69,6 +69,18 @@ bool SessionHistory::addMessage(const protocol::MessagePtr &msg)
 	return true;
 }
 
+bool SessionHistory::addSharedMessage(const protocol::MessagePtr &msg)
+{
+	if(isOutOfSpace())
+		return false;
+
+	m_sizeInBytes += msg->length();
+	++m_lastIndex;
+	historyAddShared(msg);
+	emit newMessagesAvailable();
+	return true;
+}
+
 bool SessionHistory::reset(const protocol::MessageList &newHistory)
 {
 	uint newSize = 0;
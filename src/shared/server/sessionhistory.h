@@ -129,6 +129,17 @@ public:
 	 */
 	bool addMessage(const protocol::MessagePtr &msg);
 
+	/**
+	 * @brief Add a message whose content is shared with someone else
+	 *
+	 * This works just like addMessage, but the backend may keep a reference
+	 * to the message rather than a copy of its content. This is used for
+	 * session template content, which is cached by the template loader.
+	 *
+	 * @return false if there was no space for this message
+	 */
+	bool addSharedMessage(const protocol::MessagePtr &msg);
+
 	/**
 	 * @brief Reset the session history
 	 *
@@ -149,7 +160,10 @@ public:
 	 * the given index.
 	 *
 	 * The second element of the tuple is the index of the last message
-	 * in the batch, or lastIndex() if there were no more available messages
+	 * in the batch, or lastIndex() if there were no more available messages.
+	 *
+	 * If a message can't be read, the batch ends before it. If it's the
+	 * first one, the batch is empty and the returned index is *after*.
 	 */
 	virtual std::tuple<protocol::MessageList, int> getBatch(int after) const = 0;
 
@@ -161,6 +175,14 @@ public:
 	 */
 	virtual void cleanupBatches(int before) = 0;
 
+	/**
+	 * @brief Release all cached data that can be reloaded when needed
+	 *
+	 * This is called when the session has been empty for a while.
+	 * The history must remain fully usable afterwards.
+	 */
+	virtual void hibernate() { }
+
 	/**
 	 * @brief End this session and delete any associated files (if any)
 	 */
@@ -293,6 +315,7 @@ signals:
 
 protected:
 	virtual void historyAdd(const protocol::MessagePtr &msg) = 0;
+	virtual void historyAddShared(const protocol::MessagePtr &msg) { historyAdd(msg); }
 	virtual void historyReset(const protocol::MessageList &newHistory) = 0;
 	virtual void historyAddBan(int id, const QString &username, const QHostAddress &ip, const QString &extAuthId, const QString &bannedBy) = 0;
 	virtual void historyRemoveBan(int id) = 0;
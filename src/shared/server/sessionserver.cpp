@@ -26,13 +26,18 @@
 #include "inmemoryhistory.h"
 #include "filedhistory.h"
 #include "templateloader.h"
+#include "metrics.h"
 
 #include "../listings/announcements.h"
+#include "../net/control.h"
 
 #include <QTimer>
 #include <QJsonArray>
 #include <QJsonDocument>
 
+#include <functional>
+#include <algorithm>
+
 namespace server {
 
 SessionServer::SessionServer(ServerConfig *config, QObject *parent)
@@ -49,6 +54,16 @@ SessionServer::SessionServer(ServerConfig *config, QObject *parent)
 	cleanupTimer->setInterval(15 * 1000);
 	cleanupTimer->start(cleanupTimer->interval());
 
+	// Session list changes are batched and sent to lobby clients in one go.
+	// The timer is not restarted by new changes, so a constant stream of
+	// joins and leaves cannot postpone the update indefinitely.
+	m_announceTimer = new QTimer(this);
+	m_announceTimer->setSingleShot(true);
+	m_announceTimer->setInterval(500);
+	connect(m_announceTimer, &QTimer::timeout, this, &SessionServer::announceSessionChanges);
+	connect(this, &SessionServer::sessionChanged, this, &SessionServer::queueSessionAnnouncement);
+	connect(this, &SessionServer::sessionEnded, this, &SessionServer::queueSessionRemoval);
+
 #ifndef NDEBUG
 	m_randomlag = 0;
 #endif
@@ -218,6 +233,38 @@ int SessionServer::totalUsers() const
 	return count;
 }
 
+void SessionServer::writeMetrics(MetricsWriter &writer) const
+{
+	writer.gauge("drawpile_sessions", "Number of active sessions", m_sessions.size());
+	writer.gauge("drawpile_users", "Number of connected users", totalUsers());
+	writer.gauge("drawpile_lobby_users", "Number of users who have not yet joined a session", m_lobby.size());
+	writer.gauge("drawpile_hibernating_sessions", "Number of sessions whose cached data has been released",
+		std::count_if(m_sessions.constBegin(), m_sessions.constEnd(), [](const Session *s) { return s->isHibernating(); }));
+
+	const auto perSession = [this, &writer](const char *name, const char *type, const char *help, std::function<double(const Session*)> value) {
+		writer.header(name, type, help);
+		for(const Session *s : m_sessions)
+			writer.sample(name, value(s), MetricsWriter::label("session", s->idString()));
+	};
+
+	perSession("drawpile_session_users", "gauge", "Number of users in the session",
+		[](const Session *s) { return s->userCount(); });
+	perSession("drawpile_session_history_bytes", "gauge", "Size of the session history",
+		[](const Session *s) { return s->history()->sizeInBytes(); });
+	perSession("drawpile_session_upload_queue_bytes", "gauge", "Combined length of the upload queues of the session's users",
+		[](const Session *s) { return s->uploadQueueBytes(); });
+	perSession("drawpile_session_messages_in_total", "counter", "Messages received from the session's users",
+		[](const Session *s) { return s->rateLimiter().totalMessages(); });
+	perSession("drawpile_session_bytes_in_total", "counter", "Bytes received from the session's users",
+		[](const Session *s) { return s->rateLimiter().totalBytes(); });
+	perSession("drawpile_session_messages_out_total", "counter", "Messages queued for sending to the session's users",
+		[](const Session *s) { return s->messagesOut(); });
+	perSession("drawpile_session_bytes_out_total", "counter", "Bytes queued for sending to the session's users",
+		[](const Session *s) { return s->bytesOut(); });
+	perSession("drawpile_session_throttled_total", "counter", "Number of times the session wide rate limit was exceeded",
+		[](const Session *s) { return s->rateLimiter().throttleCount(); });
+}
+
 void SessionServer::stopAll()
 {
 	for(Client *c : m_lobby)
@@ -309,6 +356,83 @@ void SessionServer::userDisconnectedEvent(Session *session)
 	emit userDisconnected(totalUsers());
 }
 
+void SessionServer::queueSessionAnnouncement(const QJsonObject &session)
+{
+	const QString id = session["id"].toString();
+	Q_ASSERT(!id.isEmpty());
+
+	m_changedSessions[id] = session;
+	m_removedSessions.removeAll(id);
+
+	if(!m_announceTimer->isActive())
+		m_announceTimer->start();
+}
+
+void SessionServer::queueSessionRemoval(const QString &id)
+{
+	m_changedSessions.remove(id);
+	if(!m_removedSessions.contains(id))
+		m_removedSessions << id;
+
+	if(!m_announceTimer->isActive())
+		m_announceTimer->start();
+}
+
+static void encodeSessionList(protocol::MessageList &out, const QJsonArray &sessions, const QJsonArray &removed)
+{
+	protocol::ServerReply reply;
+	reply.type = protocol::ServerReply::LOGIN;
+	reply.message = "Session list update";
+	if(!sessions.isEmpty())
+		reply.reply["sessions"] = sessions;
+	if(!removed.isEmpty())
+		reply.reply["remove"] = removed;
+
+	protocol::MessagePtr msg(new protocol::Command(0, reply));
+
+	if(!msg.cast<protocol::Command>().isOversize()) {
+		out << msg;
+
+	} else if(sessions.size() > 1) {
+		// Too big to fit in one message: split the session list in two
+		const int half = sessions.size() / 2;
+		QJsonArray first, second;
+		for(int i=0;i<sessions.size();++i)
+			(i < half ? first : second) << sessions.at(i);
+
+		encodeSessionList(out, first, removed);
+		encodeSessionList(out, second, QJsonArray());
+
+	} else {
+		qWarning("Oversize session list update!");
+	}
+}
+
+void SessionServer::announceSessionChanges()
+{
+	if(m_changedSessions.isEmpty() && m_removedSessions.isEmpty())
+		return;
+
+	QJsonArray sessions;
+	for(const QJsonObject &s : m_changedSessions)
+		sessions << s;
+
+	const QJsonArray removed = QJsonArray::fromStringList(m_removedSessions);
+
+	m_changedSessions.clear();
+	m_removedSessions.clear();
+
+	// Only bother encoding the update if someone is listening
+	if(m_lobby.isEmpty())
+		return;
+
+	protocol::MessageList messages;
+	encodeSessionList(messages, sessions, removed);
+
+	if(!messages.isEmpty())
+		emit sessionListUpdated(messages);
+}
+
 void SessionServer::cleanupSessions()
 {
 	const qint64 expirationTime = m_config->getConfigTime(config::IdleTimeLimit) * 1000;
@@ -321,6 +445,15 @@ void SessionServer::cleanupSessions()
 			}
 		}
 	}
+
+	const qint64 hibernationTime = m_config->getConfigTime(config::HibernationTime) * 1000;
+
+	if(hibernationTime>0) {
+		for(Session *s : m_sessions) {
+			if(!s->isHibernating() && s->userCount()==0 && s->lastEventTime() > hibernationTime)
+				s->hibernate();
+		}
+	}
 }
 
 JsonApiResult SessionServer::callSessionJsonApi(JsonApiMethod method, const QStringList &path, const QJsonObject &request)
@@ -18,10 +18,15 @@
 */
 
 #include "../net/protover.h"
+#include "../net/message.h"
 #include "jsonapi.h"
 
 #include <QObject>
 #include <QDir>
+#include <QHash>
+#include <QJsonObject>
+
+class QTimer;
 
 namespace sessionlisting {
 	class Announcements;
@@ -34,6 +39,7 @@ class SessionHistory;
 class Client;
 class ServerConfig;
 class TemplateLoader;
+class MetricsWriter;
 
 /**
  * @brief Session manager
@@ -135,6 +141,11 @@ public:
 	 */
 	int sessionCount() const { return m_sessions.size(); }
 
+	/**
+	 * @brief Write session and user metrics
+	 */
+	void writeMetrics(MetricsWriter &writer) const;
+
 	/**
 	 * @brief Stop all running sessions
 	 */
@@ -199,13 +210,27 @@ signals:
 	 */
 	void sessionEnded(const QString &id);
 
+	/**
+	 * @brief Session list update for clients waiting in the lobby
+	 *
+	 * Session changes and removals are collected for a short while and
+	 * then encoded just once into login Command messages that can be shared
+	 * by every LoginHandler. The list is split into more than one message
+	 * only if it would not fit otherwise.
+	 */
+	void sessionListUpdated(const protocol::MessageList &messages);
+
 private slots:
 	void moveFromLobby(Session *session, Client *client);
 	void lobbyDisconnectedEvent(Client *client);
 	void userDisconnectedEvent(Session *session);
 	void cleanupSessions();
+	void announceSessionChanges();
 
 private:
+	void queueSessionAnnouncement(const QJsonObject &session);
+	void queueSessionRemoval(const QString &id);
+
 	SessionHistory *initHistory(const QUuid &id, const QString alias, const protocol::ProtocolVersion &protocolVersion, const QString &founder);
 	void initSession(Session *session);
 
@@ -220,6 +245,10 @@ private:
 
 	bool m_mustSecure;
 
+	QTimer *m_announceTimer;
+	QHash<QString, QJsonObject> m_changedSessions;
+	QStringList m_removedSessions;
+
 #ifndef NDEBUG
 	uint m_randomlag;
 #endif
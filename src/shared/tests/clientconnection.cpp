@@ -0,0 +1,155 @@
+#include "../server/clientconnection.h"
+#include "../net/meta.h"
+
+#include <QtTest/QtTest>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QThread>
+
+using namespace protocol;
+using server::ClientConnection;
+
+class TestClientConnection : public QObject
+{
+	Q_OBJECT
+private slots:
+	void initTestCase()
+	{
+		// Echo server running in the main thread
+		QVERIFY(m_server.listen(QHostAddress::LocalHost));
+		connect(&m_server, &QTcpServer::newConnection, [this]() {
+			QTcpSocket *s;
+			while((s=m_server.nextPendingConnection())) {
+				connect(s, &QTcpSocket::readyRead, [s]() {
+					s->write(s->readAll());
+				});
+			}
+		});
+
+		m_thread.start();
+	}
+
+	void cleanupTestCase()
+	{
+		m_thread.quit();
+		m_thread.wait();
+	}
+
+	void testRoundTrip()
+	{
+		QTcpSocket *socket = new QTcpSocket;
+		socket->connectToHost(QHostAddress::LocalHost, m_server.serverPort());
+		QVERIFY(socket->waitForConnected());
+
+		ClientConnection conn(socket, &m_thread);
+
+		const int sendCount = 1000;
+		int countReceived = 0;
+		bool allReceived = false;
+
+		connect(&conn, &ClientConnection::messageAvailable, [&]() {
+			while(conn.isPending()) {
+				MessagePtr got = conn.getPending();
+				QCOMPARE(got->type(), MSG_CHAT);
+				QCOMPARE(got.cast<Chat>().message(), QString::number(countReceived));
+				if(++countReceived == sendCount)
+					allReceived = true;
+			}
+		});
+
+		MessageList batch;
+		int totalLen = 0;
+		for(int i=0;i<sendCount;++i) {
+			batch << MessagePtr(new Chat(0, 0, 0, QByteArray::number(i)));
+			totalLen += batch.last()->length();
+		}
+		conn.send(batch.mid(0, sendCount/2), MessageQueue::CatchUp);
+		conn.send(batch.mid(sendCount/2), MessageQueue::CatchUp);
+
+		loopUntil(allReceived);
+
+		// The echo can't arrive before the network thread has taken the messages
+		QCOMPARE(conn.queuedMessages(MessageQueue::CatchUp), 0);
+		QCOMPARE(conn.traffic().rawOut, qint64(totalLen));
+	}
+
+	void testClearMidCatchUp()
+	{
+		QTcpSocket *socket = new QTcpSocket;
+		socket->connectToHost(QHostAddress::LocalHost, m_server.serverPort());
+		QVERIFY(socket->waitForConnected());
+
+		// No network thread: nothing is sent until the event loop runs
+		ClientConnection conn(socket, nullptr);
+
+		MessageList oldBatch;
+		for(int i=0;i<100;++i)
+			oldBatch << MessagePtr(new Chat(0, 0, 0, QByteArray("old")));
+		conn.send(oldBatch, MessageQueue::CatchUp);
+		QCOMPARE(conn.queuedMessages(MessageQueue::CatchUp), 100);
+
+		// Session reset: the old catch-up batch is dropped and a new one started
+		conn.clearQueue(MessageQueue::CatchUp);
+		QCOMPARE(conn.queuedMessages(MessageQueue::CatchUp), 0);
+		QCOMPARE(conn.queuedBytes(MessageQueue::CatchUp), 0);
+
+		const int sendCount = 10;
+		MessageList newBatch;
+		for(int i=0;i<sendCount;++i)
+			newBatch << MessagePtr(new Chat(0, 0, 0, QByteArray::number(i)));
+		conn.send(newBatch, MessageQueue::CatchUp);
+		QCOMPARE(conn.queuedMessages(MessageQueue::CatchUp), sendCount);
+
+		int countReceived = 0;
+		bool allReceived = false;
+		connect(&conn, &ClientConnection::messageAvailable, [&]() {
+			while(conn.isPending()) {
+				MessagePtr got = conn.getPending();
+				// The network queue may have started writing the old batch already
+				if(got.cast<Chat>().message() == "old")
+					continue;
+				QCOMPARE(got.cast<Chat>().message(), QString::number(countReceived));
+				if(++countReceived == sendCount)
+					allReceived = true;
+			}
+		});
+
+		loopUntil(allReceived);
+		QCOMPARE(conn.queuedMessages(MessageQueue::CatchUp), 0);
+	}
+
+	void testDisconnect()
+	{
+		QTcpSocket *socket = new QTcpSocket;
+		socket->connectToHost(QHostAddress::LocalHost, m_server.serverPort());
+		QVERIFY(socket->waitForConnected());
+
+		ClientConnection conn(socket, &m_thread);
+
+		bool disconnected = false;
+		connect(&conn, &ClientConnection::disconnected, [&disconnected]() {
+			disconnected = true;
+		});
+
+		conn.sendDisconnect(0, "test");
+		loopUntil(disconnected);
+	}
+
+private:
+	void loopUntil(bool &condition) {
+		const int timeout = 3000;
+		QElapsedTimer t;
+		t.start();
+		while(!condition && t.elapsed() < timeout) {
+			QCoreApplication::processEvents();
+		}
+		QVERIFY(t.elapsed() < timeout);
+	}
+
+	QTcpServer m_server;
+	QThread m_thread;
+};
+
+
+QTEST_MAIN(TestClientConnection)
+#include "clientconnection.moc"
@@ -0,0 +1,116 @@
+#include "../server/client.h"
+#include "../net/textmode.h"
+
+#include <QtTest/QtTest>
+
+using namespace protocol;
+using server::Client;
+
+class TestCoalesce: public QObject
+{
+	Q_OBJECT
+private slots:
+	void testSupersededRemoved()
+	{
+		MessageList batch {
+			msg("1 movepointer x=1 y=1"),
+			msg("2 movepointer x=2 y=2"),
+			msg("1 laser color=#ff0000 persistence=1"),
+			msg("1 movepointer x=3 y=3"),
+			msg("1 laser color=#00ff00 persistence=1"),
+		};
+		const MessageList original = batch;
+
+		QVERIFY(Client::coalesceEphemeral(batch, 0, false));
+
+		// Only the latest of each type per user is left, in the original order
+		QCOMPARE(batch.size(), 3);
+		QVERIFY(same(batch.at(0), original.at(1)));
+		QVERIFY(same(batch.at(1), original.at(3)));
+		QVERIFY(same(batch.at(2), original.at(4)));
+	}
+
+	void testOrderPreserved()
+	{
+		MessageList batch {
+			msg("1 undopoint"),
+			msg("1 movepointer x=1 y=1"),
+			msg("1 fillrect layer=0x0101 x=0 y=0 w=10 h=10 color=#ff0000"),
+			msg("1 movepointer x=2 y=2"),
+			msg("2 fillrect layer=0x0101 x=0 y=0 w=10 h=10 color=#00ff00"),
+			msg("1 movepointer x=3 y=3"),
+		};
+		const MessageList original = batch;
+
+		QVERIFY(Client::coalesceEphemeral(batch, 0, false));
+
+		QCOMPARE(batch.size(), 4);
+		QVERIFY(same(batch.at(0), original.at(0)));
+		QVERIFY(same(batch.at(1), original.at(2)));
+		QVERIFY(same(batch.at(2), original.at(4)));
+		QVERIFY(same(batch.at(3), original.at(5)));
+	}
+
+	void testNothingToCoalesce()
+	{
+		MessageList batch {
+			msg("1 movepointer x=1 y=1"),
+			msg("2 movepointer x=2 y=2"),
+			msg("1 undopoint"),
+		};
+
+		QVERIFY(!Client::coalesceEphemeral(batch, 0, false));
+		QCOMPARE(batch.size(), 3);
+	}
+
+	void testOffset()
+	{
+		MessageList batch {
+			msg("1 movepointer x=1 y=1"),
+			msg("1 movepointer x=2 y=2"),
+			msg("1 movepointer x=3 y=3"),
+			msg("1 movepointer x=4 y=4"),
+		};
+		const MessageList original = batch;
+
+		// Messages before the offset are left alone
+		QVERIFY(Client::coalesceEphemeral(batch, 2, false));
+		QCOMPARE(batch.size(), 3);
+		QVERIFY(same(batch.at(0), original.at(0)));
+		QVERIFY(same(batch.at(1), original.at(1)));
+		QVERIFY(same(batch.at(2), original.at(3)));
+	}
+
+	void testDropAll()
+	{
+		MessageList batch {
+			msg("1 movepointer x=1 y=1"),
+			msg("1 undopoint"),
+			msg("2 laser color=#ff0000 persistence=1"),
+		};
+		const MessageList original = batch;
+
+		QVERIFY(Client::coalesceEphemeral(batch, 0, true));
+		QCOMPARE(batch.size(), 1);
+		QVERIFY(same(batch.at(0), original.at(1)));
+	}
+
+private:
+	static bool same(const MessagePtr &a, const MessagePtr &b)
+	{
+		return &*a == &*b;
+	}
+
+	MessagePtr msg(const QString &line)
+	{
+		text::Parser p;
+		text::Parser::Result r = p.parseLine(line);
+		if(r.status != text::Parser::Result::Ok || r.msg.isNull())
+			qFatal("invalid message: %s", qPrintable(line));
+		return protocol::MessagePtr::fromNullable(r.msg);
+	}
+};
+
+
+QTEST_MAIN(TestCoalesce)
+#include "coalesce.moc"
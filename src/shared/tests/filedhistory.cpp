@@ -274,6 +274,27 @@ private slots:
 		QCOMPARE(lastIdx, 5);
 	}
 
+	void testHibernate()
+	{
+		QString file = makeTestRecording();
+		std::unique_ptr<FiledHistory> fh { FiledHistory::load(m_dir.absoluteFilePath(file)) };
+
+		protocol::MessageList msgs;
+		int lastIdx;
+		std::tie(msgs, lastIdx) = fh->getBatch(-1);
+		QCOMPARE(msgs.size(), 3);
+
+		// Cached blocks are released, but the history is still usable
+		fh->hibernate();
+		fh->addMessage(protocol::MessagePtr(new protocol::Chat(1, 0, 0, QByteArray("test4"))));
+
+		std::tie(msgs, lastIdx) = fh->getBatch(-1);
+		QCOMPARE(msgs.size(), 4);
+		QCOMPARE(lastIdx, 3);
+		QCOMPARE(msgs.first().cast<protocol::Chat>().message(), QString("test1"));
+		QCOMPARE(msgs.last().cast<protocol::Chat>().message(), QString("test4"));
+	}
+
 	void testUserLeave()
 	{
 		QUuid id = QUuid::createUuid();
@@ -0,0 +1,127 @@
+#include "../server/historycompactor.h"
+#include "../net/textmode.h"
+#include "../net/meta.h"
+
+#include <QtTest/QtTest>
+
+using namespace protocol;
+using server::HistoryCompactor;
+
+class TestHistoryCompactor: public QObject
+{
+	Q_OBJECT
+private slots:
+	void testUndoneRemoved()
+	{
+		const MessageList history {
+			msg("1 join name=user1"),
+			msg("1 newlayer id=0x0101"),
+			msg("1 undopoint"),
+			msg("1 fillrect layer=0x0101 x=0 y=0 w=10 h=10 color=#ff0000"),
+			msg("1 undopoint"),
+			msg("1 fillrect layer=0x0101 x=10 y=0 w=10 h=10 color=#00ff00"),
+			msg("1 undo"),
+		};
+
+		const QBitArray keep = HistoryCompactor::compact(history);
+		QCOMPARE(keep.size(), history.size());
+		QCOMPARE(keep.testBit(0), true);  // join
+		QCOMPARE(keep.testBit(1), true);  // newlayer
+		QCOMPARE(keep.testBit(2), false); // undo points are never kept
+		QCOMPARE(keep.testBit(3), true);  // first fill
+		QCOMPARE(keep.testBit(4), false);
+		QCOMPARE(keep.testBit(5), false); // undone fill
+		QCOMPARE(keep.testBit(6), false); // undo command
+	}
+
+	void testRedo()
+	{
+		const MessageList history {
+			msg("1 undopoint"),
+			msg("1 fillrect layer=0x0101 x=0 y=0 w=10 h=10 color=#ff0000"),
+			msg("1 undo"),
+			msg("1 redo"),
+			msg("2 undopoint"),
+			msg("2 fillrect layer=0x0101 x=0 y=0 w=10 h=10 color=#00ff00"),
+			msg("2 undo"),
+			msg("2 undopoint"), // undone action is now gone for good
+			msg("2 redo"),
+		};
+
+		const QBitArray keep = HistoryCompactor::compact(history);
+		QCOMPARE(keep.testBit(1), true);  // redone
+		QCOMPARE(keep.testBit(5), false); // undone and not redoable
+	}
+
+	void testDeletedLayer()
+	{
+		const MessageList history {
+			msg("1 newlayer id=0x0101"),
+			msg("1 newlayer id=0x0102"),
+			msg("1 fillrect layer=0x0101 x=0 y=0 w=10 h=10 color=#ff0000"),
+			msg("1 fillrect layer=0x0102 x=0 y=0 w=10 h=10 color=#ff0000"),
+			msg("1 newlayer id=0x0103 source=0x0102 flags=copy"),
+			msg("1 deletelayer id=0x0101"),
+			msg("1 deletelayer id=0x0102"),
+			msg("1 newlayer id=0x0101"),
+			msg("1 fillrect layer=0x0101 x=0 y=0 w=10 h=10 color=#ff0000"),
+		};
+
+		const QBitArray keep = HistoryCompactor::compact(history);
+		QCOMPARE(keep.count(false), 1);
+		QCOMPARE(keep.testBit(2), false); // content of deleted layer
+		QCOMPARE(keep.testBit(3), true);  // copied before deletion
+		QCOMPARE(keep.testBit(8), true);  // ID was reused
+	}
+
+	void testTransientMessages()
+	{
+		const MessageList history {
+			msg("1 join name=user1"),
+			msg("2 join name=user2"),
+			Chat::regular(1, "hello", false),
+			Chat::pin(1, "first pin"),
+			msg("1 undopoint"),
+			Chat::pin(1, "second pin"),
+			msg("2 leave"),
+		};
+
+		const QBitArray keep = HistoryCompactor::compact(history);
+		QCOMPARE(keep.testBit(0), true);
+		QCOMPARE(keep.testBit(1), false); // user 2 didn't do anything
+		QCOMPARE(keep.testBit(2), false);
+		QCOMPARE(keep.testBit(3), false);
+		QCOMPARE(keep.testBit(5), true);
+		QCOMPARE(keep.testBit(6), false);
+	}
+
+	void testSessionPermissions()
+	{
+		const MessageList history {
+			msg("1 join name=user1"),
+			msg("0 owner users=1"),
+			msg("0 trusted users=1"),
+			msg("1 newlayer id=0x0101"),
+		};
+
+		const QBitArray keep = HistoryCompactor::compact(history);
+		QCOMPARE(keep.testBit(0), true);
+		QCOMPARE(keep.testBit(1), false); // replaced by the reset
+		QCOMPARE(keep.testBit(2), false);
+		QCOMPARE(keep.testBit(3), true);
+	}
+
+private:
+	MessagePtr msg(const QString &line)
+	{
+		text::Parser p;
+		text::Parser::Result r = p.parseLine(line);
+		if(r.status != text::Parser::Result::Ok || r.msg.isNull())
+			qFatal("invalid message: %s", qPrintable(line));
+		return protocol::MessagePtr::fromNullable(r.msg);
+	}
+};
+
+
+QTEST_MAIN(TestHistoryCompactor)
+#include "historycompactor.moc"
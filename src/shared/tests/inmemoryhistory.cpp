@@ -0,0 +1,122 @@
+#include "../server/inmemoryhistory.h"
+#include "../net/meta.h"
+
+#include <QtTest/QtTest>
+
+using namespace server;
+
+class TestInMemoryHistory: public QObject
+{
+	Q_OBJECT
+private slots:
+	// Messages older than the tail cache are decoded from the arena
+	void testArena()
+	{
+		InMemoryHistory history(QUuid::createUuid(), QString(), protocol::ProtocolVersion::current(), "test");
+
+		const int count = 1000;
+		for(int i=0;i<count;++i)
+			QVERIFY(history.addMessage(chat(QString::number(i))));
+
+		QCOMPARE(history.lastIndex(), count - 1);
+
+		protocol::MessageList all;
+		int last = -1;
+		do {
+			protocol::MessageList batch;
+			std::tie(batch, last) = history.getBatch(last);
+			QVERIFY(!batch.isEmpty());
+			all << batch;
+			QCOMPARE(all.size(), last + 1);
+		} while(last < history.lastIndex());
+
+		QCOMPARE(all.size(), count);
+		for(int i=0;i<count;++i) {
+			QCOMPARE(all.at(i)->type(), protocol::MSG_CHAT);
+			QCOMPARE(all.at(i).cast<protocol::Chat>().message(), QString::number(i));
+		}
+	}
+
+	// The most recent messages are shared rather than decoded again
+	void testTail()
+	{
+		InMemoryHistory history(QUuid::createUuid(), QString(), protocol::ProtocolVersion::current(), "test");
+
+		const protocol::MessagePtr msg = chat("hello");
+		history.addMessage(chat("first"));
+		history.addMessage(msg);
+
+		protocol::MessageList batch;
+		int last;
+		std::tie(batch, last) = history.getBatch(0);
+		QCOMPARE(batch.size(), 1);
+		QCOMPARE(last, 1);
+		QCOMPARE(&(*batch.at(0)), &(*msg));
+	}
+
+	// Shared messages at the start of the history are not copied into the arena
+	void testShared()
+	{
+		InMemoryHistory history(QUuid::createUuid(), QString(), protocol::ProtocolVersion::current(), "test");
+
+		protocol::MessageList shared;
+		for(int i=0;i<10;++i) {
+			shared << chat(QString("shared %1").arg(i));
+			QVERIFY(history.addSharedMessage(shared.last()));
+		}
+
+		// Push the shared messages out of the tail cache
+		const int count = 1000;
+		for(int i=0;i<count;++i)
+			QVERIFY(history.addMessage(chat(QString::number(i))));
+
+		protocol::MessageList all;
+		int last = -1;
+		do {
+			protocol::MessageList batch;
+			std::tie(batch, last) = history.getBatch(last);
+			all << batch;
+			QCOMPARE(all.size(), last + 1);
+		} while(last < history.lastIndex());
+
+		QCOMPARE(all.size(), shared.size() + count);
+		for(int i=0;i<shared.size();++i)
+			QCOMPARE(&(*all.at(i)), &(*shared.at(i)));
+		for(int i=0;i<count;++i)
+			QCOMPARE(all.at(shared.size() + i).cast<protocol::Chat>().message(), QString::number(i));
+
+		// A batch may also start in the middle of the shared messages
+		protocol::MessageList batch;
+		std::tie(batch, last) = history.getBatch(4);
+		QCOMPARE(&(*batch.at(0)), &(*shared.at(5)));
+		QCOMPARE(batch.at(5).cast<protocol::Chat>().message(), QString("0"));
+	}
+
+	void testReset()
+	{
+		InMemoryHistory history(QUuid::createUuid(), QString(), protocol::ProtocolVersion::current(), "test");
+		for(int i=0;i<10;++i)
+			history.addMessage(chat(QString::number(i)));
+
+		const int firstIndex = history.lastIndex() + 1;
+		QVERIFY(history.reset(protocol::MessageList() << chat("a") << chat("b")));
+		QCOMPARE(history.firstIndex(), firstIndex);
+
+		protocol::MessageList batch;
+		int last;
+		std::tie(batch, last) = history.getBatch(-1);
+		QCOMPARE(batch.size(), 2);
+		QCOMPARE(last, history.lastIndex());
+		QCOMPARE(batch.at(1).cast<protocol::Chat>().message(), QString("b"));
+	}
+
+private:
+	protocol::MessagePtr chat(const QString &text)
+	{
+		return protocol::MessagePtr(new protocol::Chat(1, 0, 0, text.toUtf8()));
+	}
+};
+
+
+QTEST_MAIN(TestInMemoryHistory)
+#include "inmemoryhistory.moc"
@@ -9,6 +9,7 @@
 #include <QThread>
 #include <QTcpServer>
 #include <QDebug>
+#include <QtEndian>
 
 using namespace protocol;
 
@@ -171,6 +172,135 @@ private slots:
 		loopUntil(allReceived);
 	}
 
+	void testPriority()
+	{
+		auto mq = getMsgQueue();
+
+		// Enough bulk data so that not all of it fits in a single write batch
+		const int bulkCount = 100;
+		const QByteArray padding(1000, 'x');
+
+		int bulkReceived = 0;
+		int controlReceivedAt = -1;
+		int liveReceivedAt = -1;
+		bool allReceived = false;
+
+		connect(mq.get(), &MessageQueue::messageAvailable, [&]() {
+			while(mq->isPending()) {
+				MessagePtr got = mq->getPending();
+				QCOMPARE(got->type(), MSG_CHAT);
+				if(got.cast<Chat>().message() == "control")
+					controlReceivedAt = bulkReceived;
+				else if(got.cast<Chat>().message() == "live")
+					liveReceivedAt = bulkReceived;
+				else
+					++bulkReceived;
+				if(bulkReceived == bulkCount && controlReceivedAt >= 0 && liveReceivedAt >= 0)
+					allReceived = true;
+			}
+		});
+
+		MessageList bulk;
+		for(int i=0;i<bulkCount;++i)
+			bulk << MessagePtr(new Chat(0, 0, 0, padding));
+		mq->send(bulk, MessageQueue::CatchUp);
+		QVERIFY(mq->queuedMessages(MessageQueue::CatchUp) > 0);
+		QCOMPARE(mq->queuedBytes(MessageQueue::CatchUp), mq->queuedMessages(MessageQueue::CatchUp) * bulk.first()->length());
+
+		mq->send(MessagePtr(new Chat(0, 0, 0, QByteArray("live"))), MessageQueue::Live);
+		mq->send(MessagePtr(new Chat(0, 0, 0, QByteArray("control"))), MessageQueue::Control);
+
+		loopUntil(allReceived);
+
+		// The control and live messages should have jumped ahead of the queued bulk data
+		QVERIFY(controlReceivedAt < bulkCount);
+		QVERIFY(liveReceivedAt < bulkCount);
+		QVERIFY(controlReceivedAt <= liveReceivedAt);
+	}
+
+	void testCompression()
+	{
+		auto mq = getMsgQueue();
+		mq->setCompression(true);
+
+		// Enough data to span several compressed batches
+		const int sendCount = 200;
+		const QByteArray padding(1000, 'x');
+
+		int countReceived = 0;
+		bool allReceived = false;
+
+		connect(mq.get(), &MessageQueue::messageAvailable, [&]() {
+			while(mq->isPending()) {
+				MessagePtr got = mq->getPending();
+				QCOMPARE(got->type(), MSG_CHAT);
+				QCOMPARE(got.cast<Chat>().message(), QString::number(countReceived) + QString::fromLatin1(padding));
+				if(++countReceived == sendCount)
+					allReceived = true;
+			}
+		});
+
+		for(int i=0;i<sendCount;++i)
+			mq->send(MessagePtr(new Chat(0, 0, 0, QByteArray::number(i) + padding)));
+
+		loopUntil(allReceived);
+
+		// The echo server sends back exactly what it got
+		QCOMPARE(mq->rawBytesReceived(), mq->rawBytesSent());
+		QCOMPARE(mq->wireBytesReceived(), mq->wireBytesSent());
+		QVERIFY(mq->wireBytesSent() < mq->rawBytesSent() / 10);
+	}
+
+	void testCompressionNotNegotiated()
+	{
+		auto mq = getMsgQueue();
+		mq->setCompression(true);
+		mq->setAcceptCompressed(false);
+
+		bool gotBadData = false;
+		bool gotMessage = false;
+		connect(mq.get(), &MessageQueue::badData, [&gotBadData](int, int type, int) {
+			QCOMPARE(type, int(MSG_COMPRESSED));
+			gotBadData = true;
+		});
+		connect(mq.get(), &MessageQueue::messageAvailable, [&gotMessage]() {
+			gotMessage = true;
+		});
+
+		mq->send(MessagePtr(new Chat(0, 0, 0, QByteArray("hello"))));
+
+		loopUntil(gotBadData);
+		QVERIFY(!gotMessage);
+	}
+
+	void testCompressionBomb()
+	{
+		auto s = getConnection();
+		MessageQueue mq(s.get());
+		mq.setAcceptCompressed(true);
+
+		bool gotBadData = false;
+		connect(&mq, &MessageQueue::badData, [&gotBadData](int, int type, int) {
+			if(type == MSG_COMPRESSED)
+				gotBadData = true;
+		});
+
+		// A megabyte of zeros fits in a single small frame.
+		// (qCompress output is a zlib stream with a 4 byte length prefix)
+		const QByteArray payload = qCompress(QByteArray(1024 * 1024, 0), 9).mid(4);
+		QVERIFY(payload.length() < 0xffff);
+
+		QByteArray frame(Message::HEADER_LEN, 0);
+		qToBigEndian(quint16(payload.length()), reinterpret_cast<uchar*>(frame.data()));
+		frame[2] = char(MSG_COMPRESSED);
+		frame.append(payload);
+
+		// Echoed straight back to the message queue
+		s->write(frame);
+
+		loopUntil(gotBadData);
+	}
+
 	void testSendDisconnect()
 	{
 		auto s = getConnection();
@@ -0,0 +1,57 @@
+#include "../server/metrics.h"
+
+#include <QtTest/QtTest>
+
+using server::Histogram;
+using server::MetricsWriter;
+
+class TestMetrics: public QObject
+{
+	Q_OBJECT
+private slots:
+	void testHistogram()
+	{
+		Histogram h({1, 10});
+		h.observe(0.5);
+		h.observe(1);
+		h.observe(5);
+		h.observe(100);
+
+		QCOMPARE(h.count(), quint64(4));
+		QCOMPARE(h.sum(), 106.5);
+		QCOMPARE(h.counts(), (QVector<quint64> { 2, 1, 1 }));
+	}
+
+	void testWriter()
+	{
+		Histogram h({1});
+		h.observe(0.5);
+		h.observe(2);
+
+		MetricsWriter w;
+		w.counter("test_total", "A counter", 3);
+		w.histogram("test_hist", "A histogram", h);
+		w.header("test_labeled", "gauge", "With labels");
+		w.sample("test_labeled", 1, MetricsWriter::label("name", "a \"quoted\" value"));
+
+		const QByteArray expected =
+			"# HELP test_total A counter\n"
+			"# TYPE test_total counter\n"
+			"test_total 3\n"
+			"# HELP test_hist A histogram\n"
+			"# TYPE test_hist histogram\n"
+			"test_hist_bucket{le=\"1\"} 1\n"
+			"test_hist_bucket{le=\"+Inf\"} 2\n"
+			"test_hist_sum 2.5\n"
+			"test_hist_count 2\n"
+			"# HELP test_labeled With labels\n"
+			"# TYPE test_labeled gauge\n"
+			"test_labeled{name=\"a \\\"quoted\\\" value\"} 1\n";
+
+		QCOMPARE(w.data(), expected);
+	}
+};
+
+
+QTEST_MAIN(TestMetrics)
+#include "metrics.moc"
@@ -0,0 +1,55 @@
+#include "../server/ratelimiter.h"
+
+#include <QtTest/QtTest>
+
+using server::RateLimiter;
+
+class TestRateLimiter: public QObject
+{
+	Q_OBJECT
+private slots:
+	void testUnlimited()
+	{
+		RateLimiter rl;
+		QVERIFY(!rl.isEnabled());
+		for(int i=0;i<1000;++i)
+			QCOMPARE(rl.take(1000, 1), 0);
+		QCOMPARE(rl.totalMessages(), quint64(1000));
+		QCOMPARE(rl.totalBytes(), quint64(1000 * 1000));
+		QCOMPARE(rl.throttleCount(), 0);
+	}
+
+	void testMessageRate()
+	{
+		RateLimiter rl;
+		rl.setLimits(10, 0);
+
+		// One second's worth of burst is allowed
+		for(int i=0;i<10;++i)
+			QCOMPARE(rl.take(1, 1000), 0);
+
+		// Next one goes into debt: 1 message at 10 msg/s = 100ms
+		QCOMPARE(rl.take(1, 1000), 100);
+		QCOMPARE(rl.throttleCount(), 1);
+
+		// After waiting, the debt is paid off and one more message fits
+		QCOMPARE(rl.take(1, 1200), 0);
+	}
+
+	void testByteRate()
+	{
+		RateLimiter rl;
+		rl.setLimits(0, 1000);
+
+		QCOMPARE(rl.take(1000, 1000), 0);
+		QCOMPARE(rl.take(500, 1000), 500);
+
+		// Refill is capped at one second's worth
+		QCOMPARE(rl.take(1000, 10000), 0);
+		QVERIFY(rl.take(1, 10000) > 0);
+	}
+};
+
+
+QTEST_MAIN(TestRateLimiter)
+#include "ratelimiter.moc"
@@ -0,0 +1,225 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "loadclient.h"
+
+#include "../shared/net/messagequeue.h"
+#include "../shared/net/control.h"
+#include "../shared/net/protover.h"
+
+#include <QTcpSocket>
+#include <QTimer>
+
+// Don't queue more if the server isn't keeping up with us
+static const int MAX_UPLOAD_QUEUE = 64 * 1024;
+
+// Messages are sent in bursts at this interval
+static const int SEND_INTERVAL = 10;
+
+LoadClient::LoadClient(const QString &username, const QString &session, bool host, const protocol::MessageList &script, int rate, QObject *parent)
+	: QObject(parent),
+	  m_username(username),
+	  m_session(session),
+	  m_host(host),
+	  m_script(script),
+	  m_scriptPos(0),
+	  m_rate(rate),
+	  m_runStart(0),
+	  m_totalSent(0),
+	  m_state(Connecting),
+	  m_userId(0)
+{
+	m_socket = new QTcpSocket(this);
+	m_msgqueue = new protocol::MessageQueue(m_socket, this);
+
+	m_sendTimer = new QTimer(this);
+	m_sendTimer->setInterval(SEND_INTERVAL);
+	m_sendTimer->setTimerType(Qt::PreciseTimer);
+
+	connect(m_msgqueue, &protocol::MessageQueue::messageAvailable, this, &LoadClient::receiveMessages);
+	connect(m_socket, &QTcpSocket::disconnected, this, &LoadClient::onDisconnected);
+	connect(m_sendTimer, &QTimer::timeout, this, &LoadClient::sendScript);
+
+	m_clock.start();
+}
+
+void LoadClient::connectToServer(const QString &host, quint16 port)
+{
+	m_state = WaitForGreeting;
+	m_socket->connectToHost(host, port);
+}
+
+LoadClient::Stats LoadClient::takeStats()
+{
+	Stats s = m_stats;
+	m_stats = Stats();
+	return s;
+}
+
+void LoadClient::fail(const QString &reason)
+{
+	if(m_state == Failed)
+		return;
+
+	m_state = Failed;
+	m_sendTimer->stop();
+	m_socket->abort();
+	emit failed(reason);
+}
+
+void LoadClient::onDisconnected()
+{
+	fail("disconnected");
+}
+
+void LoadClient::sendCommand(const QString &cmd, const QJsonArray &args, const QJsonObject &kwargs)
+{
+	protocol::ServerCommand c { cmd, args, kwargs };
+	m_msgqueue->send(protocol::MessagePtr(new protocol::Command(m_userId, c)));
+}
+
+void LoadClient::receiveMessages()
+{
+	while(m_msgqueue->isPending()) {
+		protocol::MessagePtr msg = m_msgqueue->getPending();
+
+		if(m_state == Running) {
+			++m_stats.receivedMessages;
+			m_stats.receivedBytes += msg->length();
+
+			if(msg->contextId() == m_userId && msg->isCommand())
+				checkEcho(msg);
+
+		} else if(msg->type() == protocol::MSG_COMMAND) {
+			handleLoginReply(msg.cast<protocol::Command>().reply());
+		}
+	}
+}
+
+void LoadClient::handleLoginReply(const protocol::ServerReply &reply)
+{
+	if(reply.type == protocol::ServerReply::ERROR) {
+		fail(reply.message);
+		return;
+	}
+
+	switch(m_state) {
+	case WaitForGreeting:
+		if(reply.type != protocol::ServerReply::LOGIN)
+			return;
+		if(reply.reply["flags"].toArray().contains("SECURE")) {
+			fail("server requires TLS");
+			return;
+		}
+		m_state = WaitForIdent;
+		sendCommand("ident", QJsonArray() << m_username);
+		break;
+
+	case WaitForIdent:
+		if(reply.type != protocol::ServerReply::RESULT)
+			return;
+		if(reply.reply["state"] != "identOk") {
+			fail("login failed: " + reply.message);
+			return;
+		}
+		m_state = WaitForJoin;
+		if(m_host) {
+			sendCommand("host", QJsonArray(), QJsonObject {
+				{"protocol", protocol::ProtocolVersion::current().asString()},
+				{"user_id", 1},
+				{"alias", m_session}
+			});
+		} else {
+			sendCommand("join", QJsonArray() << m_session);
+		}
+		break;
+
+	case WaitForJoin: {
+		// Session list updates may still arrive while waiting
+		if(reply.type != protocol::ServerReply::RESULT)
+			return;
+
+		const QString state = reply.reply["state"].toString();
+		if(state != "host" && state != "join") {
+			fail("unexpected reply: " + reply.message);
+			return;
+		}
+
+		m_userId = reply.reply["join"].toObject()["user"].toInt();
+
+		// Hosting: the session starts out empty
+		if(m_host)
+			sendCommand("init-complete", QJsonArray());
+
+		m_state = Running;
+		m_runStart = m_clock.elapsed();
+		m_msgqueue->setPingInterval(15 * 1000);
+		m_sendTimer->start();
+		emit loggedIn();
+		break;
+	}
+
+	default: break;
+	}
+}
+
+void LoadClient::sendScript()
+{
+	if(m_script.isEmpty() || m_rate <= 0)
+		return;
+
+	const qint64 now = m_clock.elapsed();
+	const qint64 due = (now - m_runStart) * m_rate / 1000;
+
+	if(due <= m_totalSent)
+		return;
+
+	if(m_msgqueue->uploadQueueBytes() > MAX_UPLOAD_QUEUE) {
+		// Skip this round rather than letting the backlog grow
+		++m_stats.stalls;
+		m_totalSent = due;
+		return;
+	}
+
+	const qint64 nowUs = m_clock.nsecsElapsed() / 1000;
+
+	for(;m_totalSent<due;++m_totalSent) {
+		const protocol::MessagePtr &msg = m_script.at(m_scriptPos);
+		m_scriptPos = (m_scriptPos + 1) % m_script.size();
+
+		// The server rewrites the context ID, so the message can be sent as is
+		m_msgqueue->send(msg);
+		m_inflight.enqueue(Sent { msg->type(), msg->length(), nowUs });
+
+		++m_stats.sentMessages;
+		m_stats.sentBytes += msg->length();
+	}
+}
+
+void LoadClient::checkEcho(const protocol::MessagePtr &msg)
+{
+	// Messages the server chose not to relay are simply skipped
+	while(!m_inflight.isEmpty()) {
+		const Sent s = m_inflight.dequeue();
+		if(s.type == msg->type() && s.length == msg->length()) {
+			m_stats.latencies << (m_clock.nsecsElapsed() / 1000 - s.time);
+			return;
+		}
+	}
+}
@@ -0,0 +1,125 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef LOADCLIENT_H
+#define LOADCLIENT_H
+
+#include "../shared/net/message.h"
+
+#include <QObject>
+#include <QQueue>
+#include <QVector>
+#include <QElapsedTimer>
+#include <QJsonArray>
+#include <QJsonObject>
+
+class QTcpSocket;
+class QTimer;
+
+namespace protocol {
+	class MessageQueue;
+	struct ServerReply;
+}
+
+/**
+ * @brief A headless protocol level client for load testing the server
+ *
+ * The client logs in as a guest, hosts or joins a session and then
+ * sends the messages of its script in a loop at a fixed rate.
+ *
+ * The server relays every message back to its sender too, so relay
+ * latency is measured by matching our own messages when they come back.
+ */
+class LoadClient : public QObject
+{
+	Q_OBJECT
+public:
+	struct Stats {
+		int sentMessages = 0;
+		int receivedMessages = 0;
+		qint64 sentBytes = 0;
+		qint64 receivedBytes = 0;
+		int stalls = 0;
+
+		// Relay latencies in microseconds
+		QVector<qint64> latencies;
+	};
+
+	/**
+	 * @brief Construct a load test client
+	 * @param username the guest username to log in with
+	 * @param session the alias of the session to host or join
+	 * @param host host the session instead of joining it
+	 * @param script the messages to send
+	 * @param rate number of messages to send per second
+	 */
+	LoadClient(const QString &username, const QString &session, bool host, const protocol::MessageList &script, int rate, QObject *parent=nullptr);
+
+	void connectToServer(const QString &host, quint16 port);
+
+	//! Has the client logged in and joined its session?
+	bool isRunning() const { return m_state == Running; }
+
+	//! Get the statistics accumulated since the last call
+	Stats takeStats();
+
+signals:
+	void loggedIn();
+	void failed(const QString &reason);
+
+private slots:
+	void receiveMessages();
+	void sendScript();
+	void onDisconnected();
+
+private:
+	enum State { Connecting, WaitForGreeting, WaitForIdent, WaitForJoin, Running, Failed };
+
+	struct Sent {
+		int type;
+		int length;
+		qint64 time;
+	};
+
+	void handleLoginReply(const protocol::ServerReply &reply);
+	void sendCommand(const QString &cmd, const QJsonArray &args, const QJsonObject &kwargs=QJsonObject());
+	void fail(const QString &reason);
+	void checkEcho(const protocol::MessagePtr &msg);
+
+	QString m_username;
+	QString m_session;
+	bool m_host;
+	protocol::MessageList m_script;
+	int m_scriptPos;
+	int m_rate;
+
+	QTcpSocket *m_socket;
+	protocol::MessageQueue *m_msgqueue;
+	QTimer *m_sendTimer;
+	QElapsedTimer m_clock;
+	qint64 m_runStart;
+	qint64 m_totalSent;
+
+	State m_state;
+	uint8_t m_userId;
+
+	QQueue<Sent> m_inflight;
+	Stats m_stats;
+};
+
+#endif
@@ -0,0 +1,434 @@
+/*
+   Drawpile - a collaborative drawing program.
+
+   Copyright (C) 2019 Calle Laakkonen
+
+   Drawpile is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   Drawpile is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with Drawpile.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "config.h"
+#include "loadclient.h"
+
+#include "../shared/record/reader.h"
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QStringList>
+#include <QTemporaryDir>
+#include <QTcpSocket>
+#include <QProcess>
+#include <QElapsedTimer>
+#include <QTimer>
+#include <QThread>
+#include <QFile>
+#include <QDir>
+
+#include <algorithm>
+
+#ifdef Q_OS_LINUX
+#include <unistd.h>
+#endif
+
+using namespace recording;
+
+void printVersion()
+{
+	printf("drawpile-loadtest " DRAWPILE_VERSION "\n");
+	printf("Protocol version: %s\n", qPrintable(protocol::ProtocolVersion::current().asString()));
+	printf("Qt version: %s (compiled against %s)\n", qVersion(), QT_VERSION_STR);
+}
+
+/**
+ * Load the drawing commands from the given recordings.
+ *
+ * Only drawing commands are replayed: meta messages (joins, chat, etc.) would
+ * either be rejected by the server or have side effects on the session.
+ */
+bool loadScript(const QStringList &filenames, protocol::MessageList &script)
+{
+	for(const QString &filename : filenames) {
+		Reader reader(filename);
+		const Compatibility compat = reader.open();
+		if(compat != COMPATIBLE && compat != MINOR_INCOMPATIBILITY && compat != UNKNOWN_COMPATIBILITY) {
+			fprintf(stderr, "%s: cannot read recording: %s\n", qPrintable(filename), qPrintable(reader.errorString()));
+			return false;
+		}
+
+		bool keepReading=true;
+		do {
+			MessageRecord r = reader.readNext();
+			switch(r.status) {
+			case MessageRecord::OK: {
+				protocol::MessagePtr msg = protocol::MessagePtr::fromNullable(r.message);
+				if(msg->isCommand())
+					script << msg;
+				break;
+			}
+			case MessageRecord::INVALID:
+				break;
+			case MessageRecord::END_OF_RECORDING:
+				keepReading = false;
+				break;
+			}
+		} while(keepReading);
+	}
+
+	return true;
+}
+
+/**
+ * Get the consumed CPU time (user+system) of the given process in seconds
+ */
+double processCpuTime(qint64 pid)
+{
+#ifdef Q_OS_LINUX
+	QFile f(QStringLiteral("/proc/%1/stat").arg(pid));
+	if(!f.open(QFile::ReadOnly))
+		return -1;
+
+	// The process name may contain spaces, so skip past it first
+	const QByteArray stat = f.readAll();
+	const QList<QByteArray> fields = stat.mid(stat.lastIndexOf(')') + 2).split(' ');
+	if(fields.size() < 13)
+		return -1;
+
+	// utime and stime (fields 14 and 15 in proc(5))
+	const qint64 ticks = fields.at(11).toLongLong() + fields.at(12).toLongLong();
+	return ticks / double(sysconf(_SC_CLK_TCK));
+#else
+	Q_UNUSED(pid);
+	return -1;
+#endif
+}
+
+bool waitForServer(const QString &host, quint16 port, int timeout)
+{
+	QElapsedTimer t;
+	t.start();
+	while(t.elapsed() < timeout) {
+		QTcpSocket socket;
+		socket.connectToHost(host, port);
+		if(socket.waitForConnected(500)) {
+			socket.disconnectFromHost();
+			return true;
+		}
+		QThread::msleep(100);
+	}
+	return false;
+}
+
+class LoadTest : public QObject
+{
+public:
+	struct Options {
+		QString host;
+		quint16 port;
+		qint64 serverPid;
+		int clients;
+		int sessions;
+		int rate;
+		int duration;
+		int interval;
+	};
+
+	LoadTest(const Options &opts, const protocol::MessageList &script, QObject *parent=nullptr)
+		: QObject(parent), m_opts(opts), m_script(script), m_failed(0),
+		  m_lastCpuTime(0), m_lastReportTime(0)
+	{
+		QTimer *reportTimer = new QTimer(this);
+		reportTimer->setInterval(m_opts.interval * 1000);
+		connect(reportTimer, &QTimer::timeout, this, [this]() { report(false); });
+		reportTimer->start();
+
+		QTimer::singleShot(m_opts.duration * 1000, this, [this]() {
+			report(true);
+			QCoreApplication::exit(0);
+		});
+	}
+
+	void start()
+	{
+		m_clock.start();
+		m_lastCpuTime = m_opts.serverPid>0 ? processCpuTime(m_opts.serverPid) : -1;
+
+		// The session hosts log in first. The rest join once their session exists.
+		for(int s=0;s<m_opts.sessions;++s) {
+			LoadClient *host = addClient(s, true);
+			connect(host, &LoadClient::loggedIn, this, [this, s]() {
+				for(int i=m_opts.sessions+s;i<m_opts.clients;i+=m_opts.sessions)
+					addClient(s, false);
+			});
+		}
+	}
+
+private:
+	LoadClient *addClient(int session, bool host)
+	{
+		const QString name = QStringLiteral("loadtest%1").arg(m_clients.size() + 1);
+		LoadClient *c = new LoadClient(name, QStringLiteral("loadtest-%1").arg(session + 1), host, m_script, m_opts.rate, this);
+		connect(c, &LoadClient::failed, this, [this, name](const QString &reason) {
+			fprintf(stderr, "%s: %s\n", qPrintable(name), qPrintable(reason));
+			++m_failed;
+		});
+		m_clients << c;
+		c->connectToServer(m_opts.host, m_opts.port);
+		return c;
+	}
+
+	static qint64 percentile(const QVector<qint64> &sorted, double p)
+	{
+		if(sorted.isEmpty())
+			return 0;
+		return sorted.at(qMin(sorted.size()-1, int(sorted.size() * p)));
+	}
+
+	void report(bool final)
+	{
+		int running = 0;
+		LoadClient::Stats total;
+		for(LoadClient *c : m_clients) {
+			if(c->isRunning())
+				++running;
+			const LoadClient::Stats s = c->takeStats();
+			total.sentMessages += s.sentMessages;
+			total.sentBytes += s.sentBytes;
+			total.receivedMessages += s.receivedMessages;
+			total.receivedBytes += s.receivedBytes;
+			total.stalls += s.stalls;
+			total.latencies << s.latencies;
+		}
+
+		m_totalLatencies << total.latencies;
+		m_totalSent += total.sentMessages;
+		m_totalReceived += total.receivedMessages;
+		m_totalReceivedBytes += total.receivedBytes;
+		m_totalStalls += total.stalls;
+
+		const qint64 now = m_clock.elapsed();
+		const double secs = qMax(1ll, now - m_lastReportTime) / 1000.0;
+		m_lastReportTime = now;
+
+		QString cpu;
+		if(m_opts.serverPid > 0 && m_lastCpuTime >= 0) {
+			const double cpuTime = processCpuTime(m_opts.serverPid);
+			const double usage = (cpuTime - m_lastCpuTime) / secs * 100;
+			m_lastCpuTime = cpuTime;
+			cpu = QStringLiteral(" server cpu %1% (%2% per session)")
+				.arg(usage, 0, 'f', 1)
+				.arg(usage / m_opts.sessions, 0, 'f', 2);
+		}
+
+		std::sort(total.latencies.begin(), total.latencies.end());
+
+		printf("%5llds clients %d/%d failed %d | sent %.0f msg/s | relayed %.0f msg/s %.2f MB/s | latency ms p50 %.1f p90 %.1f p99 %.1f max %.1f | stalls %d%s\n",
+			now / 1000,
+			running, m_opts.clients, m_failed,
+			total.sentMessages / secs,
+			total.receivedMessages / secs,
+			total.receivedBytes / secs / (1024.0 * 1024.0),
+			percentile(total.latencies, 0.5) / 1000.0,
+			percentile(total.latencies, 0.9) / 1000.0,
+			percentile(total.latencies, 0.99) / 1000.0,
+			(total.latencies.isEmpty() ? 0 : total.latencies.last()) / 1000.0,
+			total.stalls,
+			qPrintable(cpu)
+			);
+
+		if(final) {
+			std::sort(m_totalLatencies.begin(), m_totalLatencies.end());
+			const double runSecs = now / 1000.0;
+			printf("\nSummary (%d sessions, %d clients, %d msg/s per client, %.0f seconds)\n", m_opts.sessions, m_opts.clients, m_opts.rate, runSecs);
+			printf("  messages sent:     %lld (%.0f/s)\n", m_totalSent, m_totalSent / runSecs);
+			printf("  messages relayed:  %lld (%.0f/s, %.2f MB/s)\n", m_totalReceived, m_totalReceived / runSecs, m_totalReceivedBytes / runSecs / (1024.0 * 1024.0));
+			printf("  latency samples:   %d\n", m_totalLatencies.size());
+			printf("  latency p50:       %.2f ms\n", percentile(m_totalLatencies, 0.5) / 1000.0);
+			printf("  latency p90:       %.2f ms\n", percentile(m_totalLatencies, 0.9) / 1000.0);
+			printf("  latency p99:       %.2f ms\n", percentile(m_totalLatencies, 0.99) / 1000.0);
+			printf("  latency p99.9:     %.2f ms\n", percentile(m_totalLatencies, 0.999) / 1000.0);
+			printf("  upload stalls:     %lld\n", m_totalStalls);
+			printf("  failed clients:    %d\n", m_failed);
+		}
+		fflush(stdout);
+	}
+
+	Options m_opts;
+	protocol::MessageList m_script;
+	QList<LoadClient*> m_clients;
+	int m_failed;
+
+	QElapsedTimer m_clock;
+	double m_lastCpuTime;
+	qint64 m_lastReportTime;
+
+	QVector<qint64> m_totalLatencies;
+	qint64 m_totalSent = 0;
+	qint64 m_totalReceived = 0;
+	qint64 m_totalReceivedBytes = 0;
+	qint64 m_totalStalls = 0;
+};
+
+int main(int argc, char *argv[]) {
+	QCoreApplication app(argc, argv);
+
+	QCoreApplication::setOrganizationName("drawpile");
+	QCoreApplication::setOrganizationDomain("drawpile.net");
+	QCoreApplication::setApplicationName("drawpile-loadtest");
+	QCoreApplication::setApplicationVersion(DRAWPILE_VERSION);
+
+	// Set up command line arguments
+	QCommandLineParser parser;
+
+	parser.setApplicationDescription("Drawpile server load tester");
+	parser.addHelpOption();
+
+	// --version, -v
+	QCommandLineOption versionOption(QStringList() << "v" << "version", "Displays version information.");
+	parser.addOption(versionOption);
+
+	// --clients, -n
+	QCommandLineOption clientsOption(QStringList() << "n" << "clients", "Number of clients", "count", "10");
+	parser.addOption(clientsOption);
+
+	// --sessions, -s
+	QCommandLineOption sessionsOption(QStringList() << "s" << "sessions", "Number of sessions to spread the clients over", "count", "1");
+	parser.addOption(sessionsOption);
+
+	// --rate, -r
+	QCommandLineOption rateOption(QStringList() << "r" << "rate", "Messages sent per second by each client", "rate", "20");
+	parser.addOption(rateOption);
+
+	// --duration, -d
+	QCommandLineOption durationOption(QStringList() << "d" << "duration", "Test duration in seconds", "seconds", "60");
+	parser.addOption(durationOption);
+
+	// --interval, -i
+	QCommandLineOption intervalOption(QStringList() << "i" << "interval", "Reporting interval in seconds", "seconds", "5");
+	parser.addOption(intervalOption);
+
+	// --server
+	QCommandLineOption serverOption(QStringList() << "server", "Use an already running server instead of starting one", "host:port");
+	parser.addOption(serverOption);
+
+	// --server-pid
+	QCommandLineOption serverPidOption(QStringList() << "server-pid", "Process ID of the already running server (for CPU usage statistics)", "pid");
+	parser.addOption(serverPidOption);
+
+	// --server-exe
+	QCommandLineOption serverExeOption(QStringList() << "server-exe", "Server executable to start", "path", "drawpile-srv");
+	parser.addOption(serverExeOption);
+
+	// --port, -p
+	QCommandLineOption portOption(QStringList() << "p" << "port", "Port for the started server", "port", "27760");
+	parser.addOption(portOption);
+
+	// recordings to replay
+	parser.addPositionalArgument("input", "recordings to replay", "<input.dprec...>");
+
+	// Parse
+	parser.process(app);
+
+	if(parser.isSet(versionOption)) {
+		printVersion();
+		return 0;
+	}
+
+	const QStringList inputfiles = parser.positionalArguments();
+	if(inputfiles.isEmpty()) {
+		parser.showHelp(1);
+		return 1;
+	}
+
+	protocol::MessageList script;
+	if(!loadScript(inputfiles, script))
+		return 1;
+
+	if(script.isEmpty()) {
+		fprintf(stderr, "No drawing commands found in input!\n");
+		return 1;
+	}
+
+	LoadTest::Options opts;
+	opts.clients = qMax(1, parser.value(clientsOption).toInt());
+	opts.sessions = qBound(1, parser.value(sessionsOption).toInt(), opts.clients);
+	opts.rate = parser.value(rateOption).toInt();
+	opts.duration = qMax(1, parser.value(durationOption).toInt());
+	opts.interval = qMax(1, parser.value(intervalOption).toInt());
+	opts.serverPid = parser.value(serverPidOption).toLongLong();
+
+	if(opts.clients / opts.sessions > 254) {
+		fprintf(stderr, "Too many clients per session!\n");
+		return 1;
+	}
+
+	QTemporaryDir tempDir;
+	QProcess server;
+
+	if(parser.isSet(serverOption)) {
+		const QStringList hostport = parser.value(serverOption).split(':');
+		opts.host = hostport.at(0);
+		opts.port = hostport.size() > 1 ? hostport.at(1).toUShort() : DRAWPILE_PROTO_DEFAULT_PORT;
+
+	} else {
+		// Start a private server on the loopback interface
+		opts.host = "127.0.0.1";
+		opts.port = parser.value(portOption).toUShort();
+
+		const QString configFile = tempDir.filePath("loadtest.cfg");
+		{
+			QFile f(configFile);
+			if(!tempDir.isValid() || !f.open(QFile::WriteOnly)) {
+				fprintf(stderr, "Couldn't write server configuration file\n");
+				return 1;
+			}
+			f.write("[config]\n");
+			f.write(QStringLiteral("sessionCountLimit = %1\n").arg(opts.sessions).toUtf8());
+			f.write("sessionSizeLimit = 0\n");
+			f.write("autoResetThreshold = 0\n");
+		}
+
+		server.setProcessChannelMode(QProcess::ForwardedErrorChannel);
+		server.setStandardOutputFile(QProcess::nullDevice());
+		server.start(parser.value(serverExeOption), QStringList()
+			<< "--listen" << opts.host
+			<< "--port" << QString::number(opts.port)
+			<< "--config" << configFile
+			);
+
+		if(!server.waitForStarted()) {
+			fprintf(stderr, "Couldn't start server: %s\n", qPrintable(server.errorString()));
+			return 1;
+		}
+		opts.serverPid = server.processId();
+	}
+
+	if(!waitForServer(opts.host, opts.port, 10 * 1000)) {
+		fprintf(stderr, "Couldn't connect to %s:%d\n", qPrintable(opts.host), opts.port);
+		return 1;
+	}
+
+	printf("Replaying %d messages with %d clients in %d sessions\n", script.size(), opts.clients, opts.sessions);
+
+	LoadTest test(opts, script);
+	test.start();
+
+	const int result = app.exec();
+
+	if(server.state() != QProcess::NotRunning) {
+		server.terminate();
+		if(!server.waitForFinished(5000))
+			server.kill();
+	}
+
+	return result;
+}
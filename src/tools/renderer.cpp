@@ -23,6 +23,7 @@
 #include "../client/canvas/layerlist.h"
 #include "../client/canvas/aclfilter.h"
 #include "../client/core/layerstack.h"
+#include "../client/core/tilepool.h"
 #include "../client/ora/orawriter.h"
 #include "../shared/record/reader.h"
 
@@ -217,6 +218,9 @@ bool renderDrawpileRecording(const DrawpileCmdSettings &settings)
 	fprintf(stderr, "[I] Total processing time: %s\n", qPrintable(prettyDuration(totalTime.nsecsElapsed())));
 	fprintf(stderr, "[I] Cumulative render time: %s\n", qPrintable(prettyDuration(totalRenderTime)));
 
+	const paintcore::TilePool::Stats tileStats = paintcore::TilePool::stats();
+	fprintf(stderr, "[I] Peak tile memory: %.1f MB (%d tiles)\n", tileStats.peakMegabytes(), tileStats.peakTiles);
+
 	// Save the final result
 	saveTime.start();
 	if(!saveImage(settings, image, exportState))